@@ -0,0 +1,473 @@
+#include "../src/config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../src/message.h"
+#include "../src/queue.h"
+#include "../src/sockaddr_cmp.h"
+#include "../src/session.h"
+#include "../src/clients.h"
+
+/*
+ * Microbenchmarks of per-message primitives. Every case runs once to warm up, then `repeats` times;
+ * each result is one JSON object per line:
+ *   {"bench":..., "params":{...}, "ops":..., "repeats":..., "ns_per_op":{"min":..,"median":..,"max":..}}
+ * Inputs are generated from a fixed seed, so runs are comparable.
+ */
+
+#define BENCH_SEED 12345
+#define ADDRESSES 1024
+
+int repeats = 5;
+char **only = NULL; /* names of benchmarks to run, NULL - all */
+int only_count = 0;
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+bool selected(const char *name) {
+    if (only == NULL) {
+        return true;
+    }
+    for (int i = 0; i < only_count; i++) {
+        if (strcmp(only[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* runs case: body(arg, ops) performs ops operations */
+void run(const char *name, const char *params, long ops, void (*body)(void *arg, long ops), void *arg) {
+    double *samples = malloc(sizeof(double)*repeats);
+
+    body(arg, ops);
+    for (int r = 0; r < repeats; r++) {
+        long start = now_ns();
+        body(arg, ops);
+        samples[r] = (double)(now_ns() - start)/ops;
+    }
+
+    qsort(samples, repeats, sizeof(double), compare_doubles);
+    printf("{\"bench\":\"%s\",\"params\":{%s},\"ops\":%ld,\"repeats\":%d,"
+           "\"ns_per_op\":{\"min\":%.2f,\"median\":%.2f,\"max\":%.2f}}\n",
+           name, params, ops, repeats, samples[0], samples[repeats/2], samples[repeats - 1]);
+    fflush(stdout);
+    free(samples);
+}
+
+/* -------------------------------------- */
+
+struct sockaddr *make_address(int family, int n) {
+    if (family == AF_INET) {
+        struct sockaddr_in *in = calloc(sizeof(struct sockaddr_in), 1);
+        in->sin_family = AF_INET;
+        in->sin_addr.s_addr = htonl(0x7f000001 + (n >> 16));
+        in->sin_port = htons((in_port_t)(1024 + (n & 0xffff)));
+        return (struct sockaddr *)in;
+    }
+    if (family == AF_INET6) {
+        struct sockaddr_in6 *in6 = calloc(sizeof(struct sockaddr_in6), 1);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_addr.s6_addr[0] = 0x20;
+        in6->sin6_addr.s6_addr[1] = 0x01;
+        in6->sin6_addr.s6_addr[13] = (uint8_t)(n >> 16);
+        in6->sin6_addr.s6_addr[15] = 1;
+        in6->sin6_port = htons((in_port_t)(1024 + (n & 0xffff)));
+        return (struct sockaddr *)in6;
+    }
+
+    /* autobound clients have abstract names: '\0' and 5 hex digits */
+    struct sockaddr_un *un = calloc(sizeof(struct sockaddr_un), 1);
+    un->sun_family = AF_UNIX;
+    snprintf(un->sun_path + 1, sizeof(un->sun_path) - 1, "%05x", n);
+    return (struct sockaddr *)un;
+}
+
+/* as recvfrom() reports it for make_address() ones */
+socklen_t make_size(int family) {
+    if (family == AF_INET) {
+        return sizeof(struct sockaddr_in);
+    }
+    if (family == AF_INET6) {
+        return sizeof(struct sockaddr_in6);
+    }
+    return offsetof(struct sockaddr_un, sun_path) + 6;
+}
+
+const char *family_name(int family) {
+    return (family == AF_INET) ? "inet" : (family == AF_INET6) ? "inet6" : "unix";
+}
+
+typedef struct {
+    struct sockaddr *a[ADDRESSES];
+    struct sockaddr *b[ADDRESSES];
+} address_pairs;
+
+volatile int sink; /* keeps results alive */
+
+void body_sockaddr_cmp(void *arg, long ops) {
+    address_pairs *pairs = arg;
+    int acc = 0;
+    for (long i = 0; i < ops; i++) {
+        int k = i & (ADDRESSES - 1);
+        acc += sockaddr_cmp(pairs->a[k], pairs->b[k]);
+    }
+    sink = acc;
+}
+
+void bench_sockaddr_cmp() {
+    int families[] = {AF_INET, AF_INET6, AF_UNIX};
+    for (int f = 0; f < 3; f++) {
+        for (int equal = 1; equal >= 0; equal--) {
+            address_pairs pairs;
+            for (int i = 0; i < ADDRESSES; i++) {
+                pairs.a[i] = make_address(families[f], i);
+                /* differing ones differ in the last compared field */
+                pairs.b[i] = make_address(families[f], equal ? i : i + 1);
+            }
+
+            char params[128];
+            snprintf(params, sizeof(params), "\"family\":\"%s\",\"match\":\"%s\"",
+                     family_name(families[f]), equal ? "equal" : "differ");
+            run("sockaddr_cmp", params, 4000000, body_sockaddr_cmp, &pairs);
+
+            for (int i = 0; i < ADDRESSES; i++) {
+                free(pairs.a[i]);
+                free(pairs.b[i]);
+            }
+        }
+    }
+}
+
+/* -------------------------------------- */
+
+typedef struct {
+    struct sockaddr **probes;
+    socklen_t size;
+    int count;
+} lookup_arg;
+
+void body_client_lookup(void *arg, long ops) {
+    lookup_arg *lookup = arg;
+    int acc = 0;
+    for (long i = 0; i < ops; i++) {
+        acc += clientPresent(lookup->probes[i % lookup->count], lookup->size);
+    }
+    sink = acc;
+}
+
+/* sender lookup in server registry, registry grows between cases and is emptied between families */
+void bench_client_lookup() {
+    int families[] = {AF_INET, AF_INET6, AF_UNIX};
+    int sizes[] = {16, 256, 4096};
+    srand(BENCH_SEED);
+
+    for (int f = 0; f < 3; f++) {
+        int registered = 0;
+        for (int s = 0; s < 3; s++) {
+            for (; registered < sizes[s]; registered++) {
+                struct sockaddr *address = make_address(families[f], registered);
+                addClient(address, make_size(families[f]), -1);
+                free(address);
+            }
+
+            lookup_arg lookup;
+            lookup.count = ADDRESSES;
+            lookup.size = make_size(families[f]);
+            lookup.probes = malloc(sizeof(struct sockaddr*)*lookup.count);
+            for (int i = 0; i < lookup.count; i++) {
+                /* every 8th one is a new client */
+                int n = (i % 8 == 0) ? registered + i : rand() % registered;
+                lookup.probes[i] = make_address(families[f], n);
+            }
+
+            char params[128];
+            snprintf(params, sizeof(params), "\"family\":\"%s\",\"clients\":%d", family_name(families[f]), sizes[s]);
+            run("client_lookup", params, 2000000, body_client_lookup, &lookup);
+
+            for (int i = 0; i < lookup.count; i++) {
+                free(lookup.probes[i]);
+            }
+            free(lookup.probes);
+        }
+
+        for (int cid = 0; cid < clientIterator; cid++) {
+            if (CLIENT_LIVE(cid)) {
+                removeClient(cid);
+            }
+        }
+    }
+}
+
+/* -------------------------------------- */
+
+void *queue_buffer[MSG_QUEUES_CAPACITY];
+queue_t queue = QUEUE_INITIALIZER(queue_buffer);
+
+void body_queue_single(void *arg, long ops) {
+    for (long i = 0; i < ops; i++) {
+        queue_enqueue(&queue, arg);
+        sink = queue_dequeue(&queue) != NULL;
+    }
+}
+
+typedef struct {
+    int producers;
+    long per_producer;
+} contention_arg;
+
+void *producer(void *arg) {
+    long count = *(long *)arg;
+    for (long i = 0; i < count; i++) {
+        queue_enqueue(&queue, &queue);
+    }
+    return NULL;
+}
+
+/* producers block on full queue, consumer (like client's IO threads) polls */
+void body_queue_contended(void *arg, long ops) {
+    contention_arg *contention = arg;
+    pthread_t threads[contention->producers];
+    contention->per_producer = ops / contention->producers;
+
+    for (int p = 0; p < contention->producers; p++) {
+        pthread_create(&threads[p], NULL, producer, &(contention->per_producer));
+    }
+
+    long consumed = 0;
+    long total = contention->per_producer * contention->producers;
+    while (consumed < total) {
+        if (queue_dequeue(&queue) != NULL) {
+            consumed++;
+        }
+    }
+
+    for (int p = 0; p < contention->producers; p++) {
+        pthread_join(threads[p], NULL);
+    }
+}
+
+void bench_queue() {
+    run("queue", "\"producers\":0", 2000000, body_queue_single, &queue);
+
+    int producers[] = {1, 2, 4};
+    for (int p = 0; p < 3; p++) {
+        contention_arg contention;
+        contention.producers = producers[p];
+
+        char params[128];
+        snprintf(params, sizeof(params), "\"producers\":%d", producers[p]);
+        run("queue", params, 100000, body_queue_contended, &contention);
+    }
+}
+
+/* -------------------------------------- */
+
+void body_pack_message(void *arg, long ops) {
+    char *content = arg;
+    for (long i = 0; i < ops; i++) {
+        message *msg = pack_message("benchmark", content);
+        sink = msg->msg[0];
+        free(msg);
+    }
+}
+
+void bench_pack_message() {
+    int sizes[] = {1, 16, 64, MSG_LEN_MAX};
+    for (int s = 0; s < 4; s++) {
+        char content[MSG_LEN_MAX + 1];
+        memset(content, 'x', sizes[s]);
+        content[sizes[s]] = '\0';
+
+        char params[128];
+        snprintf(params, sizeof(params), "\"length\":%d", sizes[s]);
+        run("pack_message", params, 2000000, body_pack_message, content);
+    }
+}
+
+/* -------------------------------------- */
+
+void body_broadcast(void *arg, long ops) {
+    message *msg = arg;
+    /* nobody answers heartbeats here, don't let them time out */
+    long now = curr_time();
+    for (int cid = 0; cid < clientIterator; cid++) {
+        clientLastHeardOf[cid] = now;
+    }
+
+    for (long i = 0; i < ops; i++) {
+        broadcast(msg);
+    }
+}
+
+/* real datagrams to local sockets which never read - kernel drops what doesn't fit */
+void bench_broadcast() {
+    int sizes[] = {1, 16, 256, 1024};
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    int *receivers = malloc(sizeof(int)*sizes[3]);
+    int opened = 0;
+
+    message msg;
+    memset(&msg, 0, sizeof(msg));
+    strcpy(msg.from, "benchmark");
+    memset(msg.msg, 'x', MSG_LEN_MAX);
+
+    for (int s = 0; s < 4; s++) {
+        for (; opened < sizes[s]; opened++) {
+            receivers[opened] = socket(AF_INET, SOCK_DGRAM, 0);
+            struct sockaddr_in address;
+            memset(&address, 0, sizeof(address));
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t size = sizeof(struct sockaddr_in);
+            if (receivers[opened] == -1 || bind(receivers[opened], (struct sockaddr *)&address, size) == -1 ||
+                getsockname(receivers[opened], (struct sockaddr *)&address, &size) == -1) {
+                perror("Cannot open receiver");
+                exit(1);
+            }
+            addClient((struct sockaddr *)&address, size, sender);
+        }
+
+        char params[128];
+        snprintf(params, sizeof(params), "\"clients\":%d", sizes[s]);
+        run("broadcast", params, 20000/sizes[s] + 20, body_broadcast, &msg);
+    }
+
+    for (int cid = 0; cid < clientIterator; cid++) {
+        if (CLIENT_LIVE(cid)) {
+            removeClient(cid);
+        }
+    }
+    for (int i = 0; i < opened; i++) {
+        close(receivers[i]);
+    }
+    free(receivers);
+    close(sender);
+}
+
+/* -------------------------------------- */
+
+void body_expire(void *arg, long ops) {
+    long now = *(long *)arg;
+    int acc = 0;
+    for (long i = 0; i < ops; i++) {
+        acc += expireClients(now);
+    }
+    sink = acc;
+}
+
+/* periodic liveness sweep over a registry where nobody is due - the common case */
+void bench_expire() {
+    int sizes[] = {1024, 16384, 131072};
+    const char *sweeps[] = {"scalar", "sse2", "avx2"};
+    int registered = 0;
+
+    for (int s = 0; s < 3; s++) {
+        for (; registered < sizes[s]; registered++) {
+            struct sockaddr *address = make_address(AF_INET, registered);
+            addClient(address, sizeof(struct sockaddr_in), -1);
+            free(address);
+        }
+
+        long now = curr_time();
+        for (int v = 0; v < 3; v++) {
+            sweepSelect(sweeps[v]);
+            if (strcmp(sweepName, sweeps[v]) != 0) {
+                continue; /* not supported here */
+            }
+
+            char params[128];
+            snprintf(params, sizeof(params), "\"clients\":%d,\"sweep\":\"%s\"", sizes[s], sweepName);
+            run("expire", params, 20000000/sizes[s] + 10, body_expire, &now);
+        }
+    }
+    sweepSelect(NULL);
+
+    for (int cid = 0; cid < clientIterator; cid++) {
+        if (CLIENT_LIVE(cid)) {
+            removeClient(cid);
+        }
+    }
+    expireClients(curr_time());
+}
+
+/* -------------------------------------- */
+
+void print_usage() {
+    printf("Usage: bench [options] [benchmark...]\n"
+           "  -r, --repeats <n>  timed runs per case (default 5)\n"
+           "benchmarks: sockaddr_cmp client_lookup queue pack_message broadcast expire\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"repeats", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                repeats = (int)strtol(optarg, NULL, 10);
+                if (repeats <= 0) {
+                    printf("Number of repeats must be positive\n");
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        only = argv + optind;
+        only_count = argc - optind;
+    }
+
+    /* broadcast runs before lookups, which leave tombstones in the registry */
+    if (selected("sockaddr_cmp")) {
+        bench_sockaddr_cmp();
+    }
+    if (selected("broadcast")) {
+        bench_broadcast();
+    }
+    if (selected("client_lookup")) {
+        bench_client_lookup();
+    }
+    if (selected("expire")) {
+        bench_expire();
+    }
+    if (selected("queue")) {
+        bench_queue();
+    }
+    if (selected("pack_message")) {
+        bench_pack_message();
+    }
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "address.h"
+
+static const struct sockaddr *heap_copy(const compact_address *a) {
+    const struct sockaddr *copy;
+    memcpy(&copy, a->at.bytes, sizeof(copy));
+    return copy;
+}
+
+bool address_store(compact_address *a, const struct sockaddr *address, socklen_t size) {
+    memset(a, 0, sizeof(compact_address));
+    if (size == 0 || size > sizeof(struct sockaddr_un)) {
+        return false;
+    }
+    if (size <= ADDRESS_INLINE) {
+        memcpy(a->at.bytes, address, size);
+    } else {
+        /* one zero more, so pathnames are terminated even when the peer's weren't */
+        struct sockaddr *copy = calloc(size + 1, 1);
+        memcpy(copy, address, size);
+        memcpy(a->at.bytes, &copy, sizeof(copy));
+    }
+    a->size = (uint8_t)size;
+    return true;
+}
+
+void address_release(compact_address *a) {
+    if (a->size > ADDRESS_INLINE) {
+        free((void *)heap_copy(a));
+    }
+    memset(a, 0, sizeof(compact_address));
+}
+
+const struct sockaddr *address_sockaddr(const compact_address *a) {
+    return (a->size > ADDRESS_INLINE) ? heap_copy(a) : (const struct sockaddr *)&(a->at);
+}
+
+socklen_t address_size(const compact_address *a) {
+    return a->size;
+}
+
+bool address_equal(const compact_address *a, const struct sockaddr *address, socklen_t size) {
+    return a->size == size && memcmp(address_sockaddr(a), address, size) == 0;
+}
+
+static uint32_t rotl(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+unsigned int address_hash(const struct sockaddr *address, socklen_t size) {
+    /* MurmurHash3 (x86, 32 bit): 4 bytes a step, so an IPv6 address is 7 steps */
+    const unsigned char *p = (const unsigned char *)address;
+    uint32_t h = 0;
+    socklen_t k = 0;
+    for (; k + 4 <= size; k += 4) {
+        uint32_t w;
+        memcpy(&w, p + k, sizeof(w));
+        w = rotl(w*0xcc9e2d51u, 15)*0x1b873593u;
+        h = rotl(h ^ w, 13)*5 + 0xe6546b64u;
+    }
+    uint32_t tail = 0;
+    for (socklen_t t = size; t > k; t--) {
+        tail = (tail << 8) | p[t - 1];
+    }
+    h ^= rotl(tail*0xcc9e2d51u, 15)*0x1b873593u;
+
+    h ^= size;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+size_t address_heap(const compact_address *a) {
+    return (a->size > ADDRESS_INLINE) ? (size_t)a->size + 1 : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef MAKEFILE_ADDRESS_H
+#define MAKEFILE_ADDRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+/*
+ * Client address as the registry and fan-out workers keep it, inline in their tables.
+ * The key is the address exactly as recvfrom() gave it, its size and bytes, whatever the family:
+ * the kernel fills them the same way for the same peer, so IPv4, IPv6 and unix addresses are
+ * all compared and hashed by those bytes. Up to ADDRESS_INLINE bytes (every inet address, short
+ * unix paths) are there whole; longer unix ones (up to 110 bytes, mostly unused) are copied to
+ * the heap, exactly as long as the address, and the copy's pointer is kept in place of the bytes.
+ */
+#define ADDRESS_INLINE sizeof(struct sockaddr_in6)
+
+typedef struct {
+    union {
+        struct sockaddr_in6 in6;    /* alignment for any inline sockaddr */
+        unsigned char bytes[ADDRESS_INLINE];
+    } at;
+    uint8_t size;                   /* 0 - empty */
+} compact_address;
+
+#define ADDRESS_PRESENT(a) ((a)->size != 0)
+
+/* false (a left empty) for empty or longer than struct sockaddr_un addresses */
+bool address_store(compact_address *a, const struct sockaddr *address, socklen_t size);
+
+/* a is empty afterwards */
+void address_release(compact_address *a);
+
+/* for sendto() */
+const struct sockaddr *address_sockaddr(const compact_address *a);
+socklen_t address_size(const compact_address *a);
+
+bool address_equal(const compact_address *a, const struct sockaddr *address, socklen_t size);
+
+/* equal addresses (by address_equal()) give equal hashes */
+unsigned int address_hash(const struct sockaddr *address, socklen_t size);
+
+/* heap bytes a holds beyond itself */
+size_t address_heap(const compact_address *a);
+
+#endif //MAKEFILE_ADDRESS_H
@@ -1,6 +1,7 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,6 +12,9 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <poll.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include <pthread.h>
 #include <signal.h>
@@ -18,6 +22,10 @@
 
 #include "message.h"
 #include "queue.h"
+#include "presence.h"
+#include "fragment.h"
+#include "reliable.h"
+#include "session.h"
 
 #define EXIT() exit(1);
 
@@ -32,16 +40,97 @@ typedef struct {
 	char mode;
 	struct sockaddr *address;
 	size_t address_size;
+	session_address resolved;
 	int sock_type;
+	bool reliable;
+	long linger_us;
+	bool headless;
+	char *input_path; /* headless mode reads from it instead of stdin */
+	int overflow; /* OVERFLOW_*, what happens to received messages UI has no room for */
 } program_arguments;
 
+enum {
+	OVERFLOW_GROW,
+	OVERFLOW_DROP,
+	OVERFLOW_COALESCE
+};
+
 program_arguments program_args;
 int sd = -1;
 volatile short should_exit = 0;
+volatile short input_finished = 0; /* headless mode reached end of input */
+
+void print_usage() {
+	printf("Usage: client [options] <username> <l|r> <unix_socket_path|ip> [port]\n"
+		   "  -R, --reliable       reliable, in-order delivery\n"
+		   "  -L, --linger-us <us> wait for more messages before sending a batch\n"
+		   "  -b, --headless       no prompts: one message per input line, received ones written as lines\n"
+		   "  -f, --input <file>   headless input (default stdin)\n"
+		   "  -O, --overflow <grow|drop|coalesce>  received messages the display can't keep up with are\n"
+		   "                       kept aside (default), dropped oldest first, or shown as one bulk\n"
+		   "                       of the last %d\n", INBOUND_BULK_MAX);
+}
 
 void process_arguments(int argc, char **argv, program_arguments *args) {
-	if(argc < 3) {
+	static struct option long_options[] = {
+		{"reliable", no_argument, NULL, 'R'},
+		{"linger-us", required_argument, NULL, 'L'},
+		{"headless", no_argument, NULL, 'b'},
+		{"input", required_argument, NULL, 'f'},
+		{"overflow", required_argument, NULL, 'O'},
+		{NULL, 0, NULL, 0}
+	};
+
+	args->reliable = false;
+	args->linger_us = 0;
+	args->headless = false;
+	args->input_path = NULL;
+	args->overflow = OVERFLOW_GROW;
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "+RL:bf:O:", long_options, NULL)) != -1) {
+		switch(opt) {
+			case 'b':
+				args->headless = true;
+				break;
+			case 'f':
+				args->input_path = optarg;
+				break;
+			case 'O':
+				if(strcmp(optarg, "grow") == 0) {
+					args->overflow = OVERFLOW_GROW;
+				} else if(strcmp(optarg, "drop") == 0) {
+					args->overflow = OVERFLOW_DROP;
+				} else if(strcmp(optarg, "coalesce") == 0) {
+					args->overflow = OVERFLOW_COALESCE;
+				} else {
+					printf("Overflow policy must be grow, drop or coalesce\n");
+					EXIT();
+				}
+				break;
+			case 'R':
+				args->reliable = true;
+				break;
+			case 'L':
+				args->linger_us = strtol(optarg, NULL, 10);
+				if(args->linger_us < 0 || args->linger_us >= 1000000) {
+					printf("Linger must be within [0, 1000000) us\n");
+					EXIT();
+				}
+				break;
+			default:
+				print_usage();
+				EXIT();
+		}
+	}
+
+	/* positional arguments keep their indexes */
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if(argc < 4) {
 		printf("Too few arguments\n");
+		print_usage();
 		EXIT();
 	}
 
@@ -51,57 +140,16 @@ void process_arguments(int argc, char **argv, program_arguments *args) {
 	}
 	args->username = argv[1];
 
-	char mode_tmp = argv[2][0];
-	if(mode_tmp != MODE_LOCAL && mode_tmp != MODE_REMOTE) {
-		printf("Mode unrecognized\n");
+	args->mode = argv[2][0];
+	const char *error = session_resolve(args->mode, argv[3], (argc > 4) ? argv[4] : NULL, &(args->resolved));
+	if(error != NULL) {
+		printf("%s\n", error);
 		EXIT();
 	}
-	args->mode = mode_tmp;
 
-	if(args->mode == MODE_LOCAL) {
-		char *unix_socket_path = argv[3];
-		int path_len = strlen(unix_socket_path);
-
-		if(path_len > UNIX_SOCKET_PATH_MAX) {
-			printf("Socket path too long\n");
-			EXIT();
-		}
-
-		/*
-		 * @todo: free this memory
-		 */
-		struct sockaddr_un *unix_address = calloc(sizeof(struct sockaddr_un), 1);
-		unix_address->sun_family = AF_UNIX;
-		strcpy(unix_address->sun_path, unix_socket_path);
-
-		args->address = unix_address;
-		args->address_size = sizeof(struct sockaddr_un);
-		args->sock_type = AF_UNIX;
-	} else {
-		if(argc < 4) {
-			printf("Too few arguments!\n");
-			EXIT();
-		}
-
-		struct sockaddr_in *inet_address = calloc(sizeof(struct sockaddr_in), 1);
-		inet_address->sin_family = AF_INET;
-		int ret = inet_pton(AF_INET, argv[3], &(inet_address->sin_addr));
-		if(ret != 1) {
-			printf("Wrong IP format\n");
-			EXIT();
-		}
-
-		long unvalidated_port = strtol(argv[4], NULL, 10);
-		if(unvalidated_port < MIN_PORT || unvalidated_port > MAX_PORT) {
-			printf("Wrong port\n");
-			EXIT();
-		}
-		inet_address->sin_port = htons((in_port_t)unvalidated_port);
-
-		args->address = inet_address;
-		args->address_size = sizeof(struct sockaddr_in);
-		args->sock_type = AF_INET;
-	}
+	args->address = (struct sockaddr *)&(args->resolved.storage);
+	args->address_size = args->resolved.size;
+	args->sock_type = args->resolved.storage.ss_family;
 }
 
 /* ------------------------------- */
@@ -147,29 +195,67 @@ void print_recipient_query() {
 	fflush(stdout);
 }
 
-void print_all_pending_msgs(queue_t *q_out) {
+/*
+ * Received messages on their way to UI (q_out). Networking thread never waits for UI: whatever
+ * doesn't fit into q_out is handled by overflow policy (see deliver()). Entries are single
+ * messages, or with -O coalesce a bulk of the newest ones - a ring of capacity messages.
+ */
+typedef struct {
+	int count;
+	int capacity;
+	int first;
+	unsigned long skipped; /* older messages bulk had no room for */
+	message msgs[];
+} inbound;
+
+/* set by networking thread while it holds messages back; UI kicks it once it made room */
+volatile short inbound_waiting = 0;
+
+/* long texts put back together; UI thread's, or networking thread's in headless mode */
+fragment_reader incoming;
+
+/* what to show for received msg, NULL while it's a piece of a longer text still coming */
+const char *shown_text(message *msg) {
+	const char *text;
+	switch(fragment_accept(&incoming, msg, &text)) {
+		case FRAGMENT_PLAIN:
+			return msg->msg;
+		case FRAGMENT_DONE:
+			return text;
+		case FRAGMENT_LOST:
+			return "[part of a long message was lost]";
+		default:
+			return NULL;
+	}
+}
+
+void print_all_pending_msgs(queue_t *q_out, pthread_t networking_thread) {
 
 	short at_least_one_printed = 0;
-	message *msg = NULL;
-	while(msg = queue_dequeue(q_out), msg != NULL) {
+	inbound *entry = NULL;
+	while(entry = queue_dequeue(q_out), entry != NULL) {
 		at_least_one_printed = 1;
-		printf("\n! [%s] %s\n", msg->from, msg->msg);
-		free(msg);
+		if(entry->skipped > 0) {
+			printf("\n! ... %lu earlier messages skipped, display was busy\n", entry->skipped);
+		}
+		for(int i = 0; i < entry->count; i++) {
+			message *msg = &(entry->msgs[(entry->first + i) % entry->capacity]);
+			const char *text = shown_text(msg);
+			if(text != NULL) {
+				printf("\n! [%s] %s\n", msg->from, text);
+			}
+		}
+		free(entry);
 	}
 
 	if(at_least_one_printed != 0) {
 		print_command_prompt();
+		if(inbound_waiting) {
+			pthread_kill(networking_thread, SIGUSR2);
+		}
 	}
 }
 
-message *pack_message(char *from, char *content) {
-	message *msg = calloc(sizeof(message), 1);
-	strcpy(msg->from, from);
-	strcpy(msg->msg, content);
-
-	return msg;
-}
-
 /* ------------------------------- */
 
 typedef struct {
@@ -179,6 +265,18 @@ typedef struct {
 	pthread_t networking_thread;
 } thread_data;
 
+/* text goes as one message, or as several when it doesn't fit */
+void enqueue_text(thread_data *data, const char *text, size_t length) {
+	fragment_writer w;
+	fragment_begin(&w, data->program_args->username, text, length);
+
+	message *msg;
+	while((msg = fragment_next(&w)) != NULL) {
+		queue_enqueue(data->q_in, msg);
+		pthread_kill(data->networking_thread, SIGUSR2);
+	}
+}
+
 void *thread_io(void *_data) {
 	thread_data *data = _data;
 
@@ -192,7 +290,7 @@ void *thread_io(void *_data) {
 			GET_LINE();
 
 			if(strcmp(buffer_for_user_input, USR_CMD_EXIT) == 0) {
-				print_all_pending_msgs(data->q_out);
+				print_all_pending_msgs(data->q_out, data->networking_thread);
 				should_exit = 1;
 				pthread_kill(data->networking_thread, SIGUSR2);
 			} else if(strcmp(buffer_for_user_input, USR_CMD_TYPE) == 0) {
@@ -203,16 +301,14 @@ void *thread_io(void *_data) {
 					buffer_for_user_input[read-1] = '\0';
 				}
 
-				message *packed_msg = pack_message(data->program_args->username, buffer_for_user_input);
-				queue_enqueue(data->q_in, packed_msg);
-				pthread_kill(data->networking_thread, SIGUSR2);
+				enqueue_text(data, buffer_for_user_input, strlen(buffer_for_user_input));
 
 				print_command_prompt();
 			} else {
 				print_command_prompt();
 			}
 		} else {
-			print_all_pending_msgs(data->q_out);
+			print_all_pending_msgs(data->q_out, data->networking_thread);
 		}
 	}
 
@@ -220,63 +316,468 @@ void *thread_io(void *_data) {
 }
 
 /*
- * 0 - dana avaliable to write
- * 1 - alarm has arrived
+ * Headless input: every line is a message. Blocks on full q_in, which throttles the reader
+ * to what the network can take. At the end of input networking thread finishes sending and exits.
  */
-volatile sig_atomic_t interrput_cause;
+void *thread_headless_input(void *_data) {
+	thread_data *data = _data;
+
+	FILE *input = stdin;
+	if(data->program_args->input_path != NULL) {
+		input = fopen(data->program_args->input_path, "r");
+		if(input == NULL) {
+			perror("fopen(...) failed");
+			input_finished = 1;
+			pthread_kill(data->networking_thread, SIGUSR2);
+			return NULL;
+		}
+	}
+
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t read;
+	while(should_exit != 1 && (read = getline(&line, &line_capacity, input)) != -1) {
+		if(read > 0 && line[read-1] == '\n') {
+			line[--read] = '\0';
+		}
+
+		enqueue_text(data, line, read);
+	}
+
+	free(line);
+	if(input != stdin) {
+		fclose(input);
+	}
+
+	input_finished = 1;
+	pthread_kill(data->networking_thread, SIGUSR2);
+	return NULL;
+}
+
+/*
+ * Set by signal handlers. Networking thread keeps SIGUSR2 and SIGALRM blocked except
+ * inside ppoll(), so a signal can't slip in between checking these and going to sleep.
+ */
+volatile sig_atomic_t data_signalled = 0;
+volatile sig_atomic_t alarm_signalled = 0;
+
+/* state of reliable delivery to/from server, used only with --reliable */
+rel_peer server_peer;
+message *held_back = NULL; /* waiting for free room in retransmit window */
+
+/* server may advertise its own */
+int heartbeat_ms = HB_DEFAULT_MS;
 
 void heartbeat(program_arguments *args) {
-	int buff = -11;
-	sendto(sd, &buff, sizeof(int), 0, args->address, args->address_size);
+	hb_packet hb;
+	hb.type = PKT_HEARTBEAT;
+	hb.interval_ms = heartbeat_ms;
+	hb.flags = args->reliable ? HB_FLAG_RELIABLE : 0;
+	sendto(sd, &hb, sizeof(hb), 0, args->address, args->address_size);
 }
 
+/*
+ * Heartbeat is due heartbeat_ms after the last packet we sent - any traffic keeps us alive.
+ * Jitter spreads heartbeats of clients which (re)connected at the same moment.
+ */
 void reset_alarm() {
-	alarm( ((TIMEOUT_SEC/5) > 0) ? (TIMEOUT_SEC/5) : 1 );
+	long jitter_pct = 100 - HB_JITTER_PCT + rand() % (2*HB_JITTER_PCT + 1);
+	long delay_us = heartbeat_ms * jitter_pct * 10;
+
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = delay_us / 1000000;
+	timer.it_value.tv_usec = delay_us % 1000000;
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/* outgoing traffic - messages per syscall shows how well batching works */
+unsigned long sent_messages = 0;
+unsigned long send_syscalls = 0;
+
+/* sends count datagrams of the same size to server, as few syscalls as possible */
+void send_datagrams(program_arguments *args, void **datagrams, size_t size, int count) {
+	struct mmsghdr headers[SEND_BATCH_MAX];
+	struct iovec iovs[SEND_BATCH_MAX];
+
+	memset(headers, 0, sizeof(struct mmsghdr)*count);
+	for(int i = 0; i < count; i++) {
+		iovs[i].iov_base = datagrams[i];
+		iovs[i].iov_len = size;
+		headers[i].msg_hdr.msg_name = args->address;
+		headers[i].msg_hdr.msg_namelen = args->address_size;
+		headers[i].msg_hdr.msg_iov = &iovs[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int done = 0;
+	while(done < count) {
+		int sent = sendmmsg(sd, headers + done, count - done, 0);
+		send_syscalls++;
+		if(sent == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			/* datagrams are fire and forget - just don't loop forever */
+			break;
+		}
+		done += sent;
+	}
+
+	sent_messages += count;
+	reset_alarm();
+}
+
+void send_outgoing(thread_data *data) {
+	program_arguments *args = data->program_args;
+	void *batch[SEND_BATCH_MAX];
+	message *sent[SEND_BATCH_MAX];
+
+	/* give producer a moment to add more, unless there is already enough for full batch */
+	if(args->linger_us > 0 && queue_size(data->q_in) < SEND_BATCH_MAX) {
+		struct timespec linger = {0, args->linger_us*1000};
+		nanosleep(&linger, NULL);
+	}
+
+	bool window_full = false;
+	while(!window_full) {
+		int count = 0;
+		message *msg;
+		while(count < SEND_BATCH_MAX && (msg = (held_back != NULL) ? held_back : queue_dequeue(data->q_in), msg != NULL)) {
+			held_back = NULL;
+			if(args->reliable) {
+				rel_packet *pkt = rel_send(&server_peer, msg, rel_now_ms());
+				if(pkt == NULL) {
+					held_back = msg;
+					window_full = true;
+					break;
+				}
+				batch[count] = pkt;
+			} else {
+				batch[count] = msg;
+			}
+			sent[count++] = msg;
+		}
+
+		if(count == 0) {
+			break;
+		}
+
+		send_datagrams(args, batch, args->reliable ? sizeof(rel_packet) : sizeof(message), count);
+		for(int i = 0; i < count; i++) {
+			free(sent[i]);
+		}
+	}
+}
+
+/* -------------------------------------- */
+
+/* messages q_out had no room for, oldest first; networking thread's only */
+inbound **inbound_held = NULL;
+int inbound_held_head = 0;
+int inbound_held_count = 0;
+int inbound_held_capacity = 0;
+unsigned long inbound_held_peak = 0;
+unsigned long inbound_dropped = 0;
+
+inbound *new_inbound(int capacity) {
+	inbound *entry = malloc(sizeof(inbound) + sizeof(message)*capacity);
+	entry->count = 0;
+	entry->capacity = capacity;
+	entry->first = 0;
+	entry->skipped = 0;
+	return entry;
+}
+
+void hold_back_inbound(inbound *entry) {
+	if(inbound_held_head + inbound_held_count == inbound_held_capacity) {
+		if(inbound_held_head > 0) {
+			memmove(inbound_held, inbound_held + inbound_held_head, sizeof(inbound*)*inbound_held_count);
+			inbound_held_head = 0;
+		} else {
+			inbound_held_capacity = (inbound_held_capacity > 0) ? 2*inbound_held_capacity : MSG_QUEUES_CAPACITY;
+			inbound_held = realloc(inbound_held, sizeof(inbound*)*inbound_held_capacity);
+		}
+	}
+	inbound_held[inbound_held_head + inbound_held_count++] = entry;
+	if((unsigned long)inbound_held_count > inbound_held_peak) {
+		inbound_held_peak = inbound_held_count;
+	}
+}
+
+/* moves whatever UI made room for to q_out */
+void flush_held_back_inbound(thread_data *data) {
+	while(inbound_held_count > 0 && queue_try_enqueue(data->q_out, inbound_held[inbound_held_head]) == 0) {
+		inbound_held_head++;
+		inbound_held_count--;
+	}
+	if(inbound_held_count == 0) {
+		inbound_held_head = 0;
+		inbound_waiting = 0;
+	}
+}
+
+void presence_update(thread_data *data, message *msg);
+
+/* hands received message to user - UI thread, or straight to (buffered) stdout in headless mode */
+void deliver(thread_data *data, message *msg) {
+	if(presence_record(msg)) {
+		/* headless output carries only messages, it never asks for roster either */
+		if(!data->program_args->headless) {
+			presence_update(data, msg);
+		}
+		return;
+	}
+
+	if(data->program_args->headless) {
+		const char *text = shown_text(msg);
+		if(text != NULL) {
+			printf("%s\t%s\n", msg->from, text);
+		}
+		return;
+	}
+
+	flush_held_back_inbound(data);
+	if(inbound_held_count == 0) {
+		inbound *entry = new_inbound(1);
+		memcpy(&(entry->msgs[0]), msg, sizeof(message));
+		entry->count = 1;
+		if(queue_try_enqueue(data->q_out, entry) == 0) {
+			return;
+		}
+
+		if(data->program_args->overflow == OVERFLOW_DROP) {
+			/* UI may be dequeuing meanwhile - the swap happens under q_out's own lock */
+			inbound *oldest = queue_enqueue_displace(data->q_out, entry);
+			if(oldest != NULL) {
+				inbound_dropped += oldest->count;
+				free(oldest);
+			}
+			return;
+		}
+
+		if(data->program_args->overflow == OVERFLOW_COALESCE) {
+			inbound *bulk = new_inbound(INBOUND_BULK_MAX);
+			memcpy(&(bulk->msgs[0]), msg, sizeof(message));
+			bulk->count = 1;
+			free(entry);
+			entry = bulk;
+		}
+		hold_back_inbound(entry);
+	} else if(data->program_args->overflow == OVERFLOW_COALESCE) {
+		/* the one bulk waiting keeps the newest */
+		inbound *bulk = inbound_held[inbound_held_head];
+		if(bulk->count < bulk->capacity) {
+			memcpy(&(bulk->msgs[bulk->count++]), msg, sizeof(message));
+		} else {
+			memcpy(&(bulk->msgs[bulk->first]), msg, sizeof(message));
+			bulk->first = (bulk->first + 1) % bulk->capacity;
+			bulk->skipped++;
+			inbound_dropped++;
+		}
+	} else {
+		inbound *entry = new_inbound(1);
+		memcpy(&(entry->msgs[0]), msg, sizeof(message));
+		entry->count = 1;
+		hold_back_inbound(entry);
+	}
+	inbound_waiting = 1;
+}
+
+/* roster as server last described it; networking thread's only */
+presence_view roster_view;
+
+/* next send_outgoing() takes it along */
+void request_roster(thread_data *data) {
+	message *request = pack_message(data->program_args->username, PRESENCE_REQUEST);
+	if(queue_try_enqueue(data->q_in, request) == -1) {
+		/* next delta finds view out of date again */
+		free(request);
+		return;
+	}
+	data_signalled = 1;
+}
+
+/* applies roster record, user sees changes as messages from "*" */
+void presence_update(thread_data *data, message *msg) {
+	message shown;
+	memset(&shown, 0, sizeof(message));
+	strcpy(shown.from, "*");
+
+	switch(presence_apply(&roster_view, msg)) {
+		case PRESENCE_RESYNC:
+			request_roster(data);
+			return;
+		case PRESENCE_UPDATED:
+			/* "+bob -carol ~dave" */
+			strcpy(shown.msg, roster_view.changes);
+			break;
+		case PRESENCE_COMPLETE: {
+			const char *names[PRESENCE_SHOWN_MAX];
+			int count = presence_names(&roster_view, names, PRESENCE_SHOWN_MAX);
+			size_t length = snprintf(shown.msg, sizeof(shown.msg), "%u online:", roster_view.roster.used);
+			for(int i = 0; i < count && length < sizeof(shown.msg); i++) {
+				length += snprintf(shown.msg + length, sizeof(shown.msg) - length, " %s", names[i]);
+			}
+			break;
+		}
+		default:
+			return;
+	}
+
+	deliver(data, &shown);
+}
+
+ssize_t receive_packet(thread_data *data, int flags) {
+	program_arguments *args = data->program_args;
+	packet buf;
+	message delivered[RLY_WINDOW];
+	ack_packet ack;
+
+	ssize_t recv_len = recvfrom(sd, &buf, sizeof(buf), flags, NULL, NULL);
+	if(recv_len == sizeof(message)) {
+		deliver(data, &buf.msg);
+	} else if(BATCH_COUNT(&buf, recv_len) > 0) {
+		for(int i = 0; i < buf.batch.count; i++) {
+			deliver(data, &buf.batch.msgs[i]);
+		}
+	} else if(recv_len == sizeof(rel_packet) && buf.type == PKT_RELIABLE) {
+		int count = rel_receive(&server_peer, &buf.rel, delivered, &ack);
+		sendto(sd, &ack, sizeof(ack), 0, args->address, args->address_size);
+		reset_alarm();
+
+		for(int i = 0; i < count; i++) {
+			deliver(data, &delivered[i]);
+		}
+	} else if(recv_len == sizeof(ack_packet) && buf.type == PKT_ACK) {
+		rel_ack(&server_peer, &buf.ack, rel_now_ms());
+		if(held_back != NULL) {
+			/* window might have opened */
+			send_outgoing(data);
+		}
+	} else if(recv_len == sizeof(hb_packet) && buf.type == PKT_HB_INTERVAL) {
+		if(buf.hb.interval_ms >= HB_MIN_MS && buf.hb.interval_ms <= HB_MAX_MS) {
+			heartbeat_ms = buf.hb.interval_ms;
+			reset_alarm();
+		}
+	}
+
+	return recv_len;
+}
+
+/* headless session ends once whole input is sent (and acknowledged) */
+bool headless_done(thread_data *data) {
+	if(input_finished != 1 || queue_size(data->q_in) > 0) {
+		return false;
+	}
+
+	return !data->program_args->reliable || (held_back == NULL && rel_in_flight(&server_peer) == 0);
+}
+
+void retransmit_due(thread_data *data) {
+	program_arguments *args = data->program_args;
+	rel_packet *due[RLY_WINDOW];
+
+	int count = rel_retransmit(&server_peer, rel_now_ms(), due);
+	if(count == -1) {
+		fprintf(args->headless ? stderr : stdout, "\n***\nServer not responding\n");
+		should_exit = 1;
+		return;
+	}
+
+	if(count > 0) {
+		send_datagrams(args, (void **)due, sizeof(rel_packet), count);
+	}
 }
 
 void thread_networking(thread_data *data) {
 	open_socket(&program_args);
+	if(data->program_args->reliable) {
+		rel_init(&server_peer);
+	}
 	heartbeat(data->program_args);
 	reset_alarm();
 
+	/* snapshot of who is online, deltas follow by themselves */
+	if(!data->program_args->headless) {
+		request_roster(data);
+		data_signalled = 0;
+		send_outgoing(data);
+	}
+
 	struct pollfd poll_receiving[1];
 	poll_receiving[0].fd = sd;
 	poll_receiving[0].events = POLLIN;
 	poll_receiving[0].revents = 0;
 
+	sigset_t wait_mask;
+	pthread_sigmask(SIG_SETMASK, NULL, &wait_mask);
+	sigdelset(&wait_mask, SIGUSR2);
+	sigdelset(&wait_mask, SIGALRM);
+
 	int ret = 0;
 	while(should_exit != 1) {
-		ret = poll(poll_receiving, 1, -1);
+		long timeout = -1;
+		if(data->program_args->reliable) {
+			timeout = rel_next_timeout(&server_peer, rel_now_ms());
+		}
+		struct timespec timeout_ts = {timeout / 1000, (timeout % 1000) * 1000000};
+
+		ret = ppoll(poll_receiving, 1, (timeout >= 0) ? &timeout_ts : NULL, &wait_mask);
 		if(ret > 0 && (poll_receiving[0].revents & POLLIN) != 0) {
-			message *incoming_msg = malloc(sizeof(message));
-			recvfrom(sd, incoming_msg, sizeof(message), 0, NULL, NULL);
-			queue_enqueue(data->q_out, incoming_msg);
+			receive_packet(data, 0);
+			if(data->program_args->headless) {
+				/* drain socket, then flush output in bulk */
+				while(receive_packet(data, MSG_DONTWAIT) > 0);
+				fflush(stdout);
+			}
 
 			poll_receiving[0].revents = 0;
-		} else if (ret == -1 && errno == EINTR) {
-			if(interrput_cause == 0) {
-				message *msg;
-				while (msg = queue_dequeue(data->q_in), msg != NULL) {
-					sendto(sd, msg, sizeof(message), 0, data->program_args->address, data->program_args->address_size);
-					reset_alarm();
-					free(msg);
-				}
-			} else if(interrput_cause == 1) {
-				heartbeat(data->program_args);
-				reset_alarm();
-			}
 		}
+
+		if(data_signalled) {
+			data_signalled = 0;
+			flush_held_back_inbound(data);
+			send_outgoing(data);
+		}
+		if(alarm_signalled) {
+			alarm_signalled = 0;
+			heartbeat(data->program_args);
+			reset_alarm();
+		}
+
+		if(data->program_args->reliable) {
+			retransmit_due(data);
+		}
+
+		if(data->program_args->headless && headless_done(data)) {
+			should_exit = 1;
+		}
+	}
+
+	/* in headless mode stdout carries only messages */
+	FILE *report = data->program_args->headless ? stderr : stdout;
+	fflush(stdout);
+	fprintf(report, "Sent %lu messages in %lu syscalls (%.2f per syscall)\n", sent_messages, send_syscalls,
+		   (send_syscalls > 0) ? (double)sent_messages/send_syscalls : 0.0);
+	if(inbound_held_peak > 0 || inbound_dropped > 0) {
+		fprintf(report, "Display fell behind: %lu entries held back at most, %lu messages dropped\n",
+			   inbound_held_peak, inbound_dropped);
+	}
+	if(data->program_args->reliable) {
+		fprintf(report, "Retransmitted: %lu, duplicates received: %lu, stale dropped: %lu\n", server_peer.retransmits,
+				server_peer.duplicates, server_peer.stale);
 	}
 }
 
 /* ------------------------------- */
 
 void datainterrupt(int sig) {
-	interrput_cause = 0;
+	data_signalled = 1;
 }
 
 void sigalarm(int sig) {
-	interrput_cause = 1;
+	alarm_signalled = 1;
 }
 
 int main(int argc, char **argv) {
@@ -287,6 +788,7 @@ int main(int argc, char **argv) {
 	pthread_sigmask(SIG_SETMASK, &all, NULL);
 
 	process_arguments(argc, argv, &program_args);
+	srand(time(NULL) ^ getpid());
 
 	// create and initialize bounded queues
 	void* in_buffer[MSG_QUEUES_CAPACITY];
@@ -301,14 +803,14 @@ int main(int argc, char **argv) {
 	data.networking_thread = pthread_self();
 
 	pthread_t io_thread;
-	pthread_create(&io_thread, NULL, &thread_io, &data);
-
-	/* for networking thread we want SIGUSR2 unlocked */
-	sigset_t usr2;
-	sigemptyset(&usr2);
-	sigaddset(&usr2, SIGUSR2);
-	sigaddset(&usr2, SIGALRM);
-	pthread_sigmask(SIG_UNBLOCK, &usr2, NULL);
+	if(program_args.headless) {
+		setvbuf(stdout, NULL, _IOFBF, HEADLESS_OUTPUT_BUFFER);
+		pthread_create(&io_thread, NULL, &thread_headless_input, &data);
+	} else {
+		pthread_create(&io_thread, NULL, &thread_io, &data);
+	}
+
+	/* networking thread unblocks SIGUSR2 and SIGALRM only for the duration of ppoll() */
 	/* I don't want SIGUSR2 to kill my application but to interrupt poll */
 	struct sigaction data_sigh;
 	data_sigh.sa_handler = &datainterrupt;
@@ -324,8 +826,11 @@ int main(int argc, char **argv) {
 
 	thread_networking(&data);
 
+	/* headless reader may still be blocked on input if we are leaving because of server */
 	void *dummy = NULL;
-	pthread_join(io_thread, &dummy);
+	if(!program_args.headless || input_finished == 1) {
+		pthread_join(io_thread, &dummy);
+	}
 
 	close_socket();
 	return 0;
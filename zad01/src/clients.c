@@ -0,0 +1,756 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWEEP_X86
+#endif
+
+#include "clients.h"
+#include "stages.h"
+#include "topics.h"
+#include "presence.h"
+#include "mailbox.h"
+
+#define INIT_CLIENTS 2
+
+/*
+ * Make it a struct!
+ */
+int clientCapacity = 0;
+compact_address *clientAddr = NULL; /* empty in removed slots */
+int *clientDesc = NULL;
+int32_t *clientLastHeardOf = NULL; /* curr_time() seconds, 32 bit so SIMD sweep packs 4/8 per compare */
+rel_peer **clientRel = NULL; /* NULL unless client uses reliable delivery */
+char (*clientName)[USERNAME_MAX + 1] = NULL; /* empty until client sends something */
+rate_bucket *clientBucket = NULL; /* ingress limit (server's -r) */
+int *clientStage = NULL; /* slot at fan-out worker (stages.h), -1 when main thread sends to client */
+int clientIterator = 0;
+int unstagedClients = 0; /* live clients with clientStage -1, broadcasts skip the loop when 0 */
+
+/*
+ * Open addressing index: address_hash() -> position in client arrays,
+ * so looking up the sender doesn't scan the whole registry on every datagram.
+ */
+#define INDEX_EMPTY -1
+#define INDEX_REMOVED -2
+int *clientIndex = NULL;
+unsigned int clientIndexSize = 0; /* power of 2, at least 2*clientCapacity */
+
+/* expireClients() scratch: bit per registry slot */
+uint64_t *expiredBitmap = NULL;
+int expiredBitmapWords = 0;
+
+/* set by retransmitTick() - when something is in flight we have to wake up often */
+bool reliableInFlight = false;
+long nextRetransmitCheck = 0;
+
+/* monotonic - wall clock jumps must not expire everyone; fits int32 for decades of uptime */
+long curr_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+static unsigned int clientHash(int cid) {
+    return address_hash(address_sockaddr(&clientAddr[cid]), address_size(&clientAddr[cid]));
+}
+
+void indexInsert(int cid) {
+    unsigned int mask = clientIndexSize - 1;
+    unsigned int pos = clientHash(cid) & mask;
+    while (clientIndex[pos] >= 0) {
+        pos = (pos + 1) & mask;
+    }
+    clientIndex[pos] = cid;
+}
+
+void indexRebuild() {
+    while (clientIndexSize < 2*(unsigned int)clientCapacity) {
+        clientIndexSize = (clientIndexSize > 0) ? 2*clientIndexSize : 2*INIT_CLIENTS;
+    }
+
+    clientIndex = realloc(clientIndex, sizeof(int)*clientIndexSize);
+    for (unsigned int pos = 0; pos < clientIndexSize; pos++) {
+        clientIndex[pos] = INDEX_EMPTY;
+    }
+
+    for (int cid = 0; cid < clientIterator; cid++) {
+        if (CLIENT_LIVE(cid)) {
+            indexInsert(cid);
+        }
+    }
+}
+
+/* removed entries stay as tombstones, there is at most one per registry slot */
+void indexRemove(int cid) {
+    unsigned int mask = clientIndexSize - 1;
+    unsigned int pos = clientHash(cid) & mask;
+    while (clientIndex[pos] != INDEX_EMPTY) {
+        if (clientIndex[pos] == cid) {
+            clientIndex[pos] = INDEX_REMOVED;
+            return;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+int addClient(const struct sockaddr *cli_addr, socklen_t size, int desc) {
+    if(clientIterator >= clientCapacity) {
+        clientCapacity = (clientCapacity > 0) ? 2*clientCapacity : INIT_CLIENTS;
+        clientAddr = realloc(clientAddr, sizeof(compact_address)*clientCapacity);
+        clientDesc = realloc(clientDesc, sizeof(int)*clientCapacity);
+        clientLastHeardOf = realloc(clientLastHeardOf, sizeof(int32_t)*clientCapacity);
+        clientRel = realloc(clientRel, sizeof(rel_peer*)*clientCapacity);
+        clientStage = realloc(clientStage, sizeof(int)*clientCapacity);
+        clientBucket = realloc(clientBucket, sizeof(rate_bucket)*clientCapacity);
+        clientName = realloc(clientName, sizeof(*clientName)*clientCapacity);
+    }
+
+    if (!address_store(&clientAddr[clientIterator], cli_addr, size)) {
+        return -1;
+    }
+    clientDesc[clientIterator] = desc;
+    clientLastHeardOf[clientIterator] = curr_time();
+    clientRel[clientIterator] = NULL;
+    /* never refilled bucket fills up on first use */
+    clientBucket[clientIterator].tokens = 0;
+    clientBucket[clientIterator].last_ms = 0;
+    clientName[clientIterator][0] = '\0';
+    if (stagesRunning) {
+        clientStage[clientIterator] = stages_join(cli_addr, size, desc);
+    } else {
+        clientStage[clientIterator] = -1;
+        unstagedClients++;
+    }
+
+    clientIterator++;
+
+    if (clientIndexSize < 2*(unsigned int)clientCapacity) {
+        indexRebuild();
+    } else {
+        indexInsert(clientIterator - 1);
+    }
+    return clientIterator - 1;
+}
+
+void removeClient(int cid) {
+    indexRemove(cid);
+    address_release(&clientAddr[cid]);
+    clientLastHeardOf[cid] = CLIENT_REMOVED_STAMP;
+    topics_forget(cid);
+    if (clientName[cid][0] != '\0' && presence_leave(clientName[cid], false)) {
+        mailbox_offline(clientName[cid]);
+    }
+    if(clientStage[cid] >= 0) {
+        stages_leave(clientStage[cid]);
+    } else {
+        unstagedClients--;
+    }
+    if(clientRel[cid] != NULL) {
+        rel_destroy(clientRel[cid]);
+        free(clientRel[cid]);
+        clientRel[cid] = NULL;
+    }
+}
+
+/* reliable clients need acks and retransmits of the main thread, workers only do plain sends */
+static void unstageClient(int cid) {
+    if (clientStage[cid] >= 0) {
+        stages_leave(clientStage[cid]);
+        clientStage[cid] = -1;
+        unstagedClients++;
+    }
+}
+
+void nameClient(int cid, const char *name) {
+    if (clientName[cid][0] == '\0' && name[0] != '\0') {
+        size_t length = strnlen(name, USERNAME_MAX);
+        memcpy(clientName[cid], name, length);
+        clientName[cid][length] = '\0';
+        if (presence_join(clientName[cid])) {
+            mailbox_online(clientName[cid]);
+        }
+    }
+}
+
+int clientNamed(const char *name) {
+    for (int cid = 0; cid < clientIterator; cid++) {
+        if (CLIENT_LIVE(cid) && strncmp(clientName[cid], name, USERNAME_MAX) == 0) {
+            return cid;
+        }
+    }
+    return -1;
+}
+
+rel_peer *reliablePeer(int cid) {
+    if(clientRel[cid] == NULL) {
+        unstageClient(cid);
+        clientRel[cid] = malloc(sizeof(rel_peer));
+        rel_init(clientRel[cid]);
+    }
+
+    return clientRel[cid];
+}
+
+int clientPresent(const struct sockaddr *cli_addr, socklen_t size) {
+    if (clientIndexSize == 0) {
+        return -1;
+    }
+
+    unsigned int mask = clientIndexSize - 1;
+    unsigned int pos = address_hash(cli_addr, size) & mask;
+    while (clientIndex[pos] != INDEX_EMPTY) {
+        int cid = clientIndex[pos];
+        if (cid >= 0 && address_equal(&clientAddr[cid], cli_addr, size)) {
+            return cid;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    return -1;
+}
+
+/* returns false when client is gone (its unix socket was closed) and got removed */
+bool sendToClient(int cid, void *data, size_t length) {
+    if (sendto(clientDesc[cid], data, length, 0, address_sockaddr(&clientAddr[cid]), address_size(&clientAddr[cid])) == -1) {
+        if (errno == ECONNREFUSED || errno == ENOENT) {
+            removeClient(cid);
+            printf("Client vanished\n");
+            return false;
+        }
+        perror("sendto(...) failed");
+        exit(1);
+    }
+
+    return true;
+}
+
+/* sends whatever fits into client's retransmit window */
+void flushReliable(int cid, long now) {
+    rel_packet *ready[RLY_WINDOW];
+
+    int count = rel_flush(clientRel[cid], now, ready);
+    for (int k = 0; k < count; k++) {
+        if (!sendToClient(cid, ready[k], sizeof(rel_packet))) {
+            return;
+        }
+    }
+    if (rel_in_flight(clientRel[cid]) > 0) {
+        reliableInFlight = true;
+    }
+}
+
+/* through client's window if it's a reliable one; false when client is gone */
+static bool sendMessage(int cid, message *msg, long now) {
+    if(clientRel[cid] != NULL) {
+        if(rel_queue(clientRel[cid], msg) == -1) {
+            /* window and backlog full - client is not keeping up */
+            removeClient(cid);
+            printf("Client stalled, dropping\n");
+            return false;
+        }
+        flushReliable(cid, now);
+        return true;
+    }
+
+    return sendToClient(cid, msg, sizeof(message));
+}
+
+/* returns number of clients message went to; silent ones are left to expireClients() */
+int broadcast(message *msg) {
+    long now = rel_now_ms();
+    int recipients = stages_broadcast(msg, sizeof(message));
+
+    for (int j = 0; j < clientIterator && unstagedClients > 0; j++) {
+        if(!CLIENT_LIVE(j) || clientStage[j] >= 0) {
+            continue;
+        }
+
+        if (sendMessage(j, msg, now)) {
+            recipients++;
+        }
+    }
+
+    return recipients;
+}
+
+/* message for a topic's subscribers; staged clients get it from this thread too */
+int multicast(message *msg, const int *cids, int count) {
+    long now = rel_now_ms();
+    int recipients = 0;
+
+    for (int k = 0; k < count; k++) {
+        if (CLIENT_LIVE(cids[k]) && sendMessage(cids[k], msg, now)) {
+            recipients++;
+        }
+    }
+
+    return recipients;
+}
+
+/*
+ * Whole batch in one datagram per client; reliable clients get each message through their
+ * window, as broadcast() does. Returns number of clients messages went to.
+ */
+int broadcastBatch(batch_packet *batch) {
+    if (batch->count == 1) {
+        /* nothing to coalesce, bare message is shorter */
+        return broadcast(&(batch->msgs[0]));
+    }
+
+    long now = rel_now_ms();
+    batch->type = PKT_BATCH;
+    int recipients = stages_broadcast(batch, BATCH_LENGTH(batch->count));
+
+    for (int j = 0; j < clientIterator && unstagedClients > 0; j++) {
+        if(!CLIENT_LIVE(j) || clientStage[j] >= 0) {
+            continue;
+        }
+
+        if(clientRel[j] != NULL) {
+            int k = 0;
+            while (k < batch->count && rel_queue(clientRel[j], &(batch->msgs[k])) != -1) {
+                k++;
+            }
+            if (k < batch->count) {
+                removeClient(j);
+                printf("Client stalled, dropping\n");
+            } else {
+                flushReliable(j, now);
+                recipients++;
+            }
+        } else if (sendToClient(j, batch, BATCH_LENGTH(batch->count))) {
+            recipients++;
+        }
+    }
+
+    return recipients;
+}
+
+/* resends whatever reliable clients haven't acknowledged in time */
+void retransmitTick(long now) {
+    rel_packet *due[RLY_WINDOW];
+
+    reliableInFlight = false;
+    for (int j = 0; j < clientIterator; j++) {
+        if(!CLIENT_LIVE(j) || clientRel[j] == NULL) {
+            continue;
+        }
+
+        int count = rel_retransmit(clientRel[j], now, due);
+        if(count == -1) {
+            removeClient(j);
+            printf("Client not acknowledging, dropping\n");
+            continue;
+        }
+
+        for (int k = 0; k < count && clientRel[j] != NULL; k++) {
+            sendToClient(j, due[k], sizeof(rel_packet));
+        }
+
+        if(clientRel[j] != NULL && rel_in_flight(clientRel[j]) > 0) {
+            reliableInFlight = true;
+        }
+    }
+
+    nextRetransmitCheck = now + RLY_TICK_MS;
+}
+
+/* -------------------------------------- */
+
+/* one row of the registry arrays - what a client costs while it only sends heartbeats */
+static size_t slotBytes() {
+    return sizeof(compact_address) + sizeof(int) + sizeof(int32_t) + sizeof(rel_peer*) + sizeof(int) +
+           sizeof(rate_bucket) + sizeof(*clientName);
+}
+
+void memoryReport(FILE *out) {
+    int live = 0, heapAddresses = 0, peers = 0, windows = 0, reorders = 0, backlogs = 0;
+    size_t addressHeap = 0, reliability = 0;
+    for (int cid = 0; cid < clientIterator; cid++) {
+        if (!CLIENT_LIVE(cid)) {
+            continue;
+        }
+        live++;
+        if (address_heap(&clientAddr[cid]) > 0) {
+            heapAddresses++;
+            addressHeap += address_heap(&clientAddr[cid]);
+        }
+        rel_peer *p = clientRel[cid];
+        if (p != NULL) {
+            peers++;
+            windows += (p->snd != NULL);
+            reorders += (p->rcv != NULL);
+            backlogs += (p->backlog != NULL);
+            reliability += sizeof(rel_peer) + rel_memory(p);
+        }
+    }
+
+    size_t index = sizeof(int)*clientIndexSize + sizeof(uint64_t)*expiredBitmapWords;
+    fprintf(out, "Memory: registry %zu B (%d of %d slots live, %zu B each, index %zu B), "
+            "addresses %zu B (%d long unix paths), reliability %zu B (%d peers, %d windows, %d reorder buffers, "
+            "%d backlogs), fan-out %zu B; idle client %zu B\n", slotBytes()*clientCapacity + index, live,
+            clientCapacity, slotBytes(), index, addressHeap, heapAddresses, reliability, peers, windows, reorders,
+            backlogs, stages_memory(), slotBytes() + 2*sizeof(int));
+    fflush(out);
+}
+
+/* -------------------------------------- */
+
+/*
+ * Registry as handed to a restarted server. Descriptors are stored as indexes into sockets[],
+ * reliability state is carried only when its structures have the same layout on both sides.
+ *   header: uint32 count, uint32 sizeof(rel_peer), uint32 window bytes, uint32 sizeof(rel_reorder)
+ *   client: int32 last heard, uint8 socket, uint8 REL_* flags, uint16 address length, address,
+ *           name, topics, [uint32 backlog length, rel_peer, backlog messages in order,
+ *           [window], [reorder buffer]]
+ */
+#define REL_STATE 1
+#define REL_WINDOW 2
+#define REL_REORDER 4
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} registry_buffer;
+
+static void put(registry_buffer *b, const void *data, size_t length) {
+    if (b->length + length > b->capacity) {
+        while (b->length + length > b->capacity) {
+            b->capacity = (b->capacity > 0) ? 2*b->capacity : 4096;
+        }
+        b->data = realloc(b->data, b->capacity);
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+}
+
+void *saveClients(const int *sockets, int socketCount, size_t *length) {
+    registry_buffer b = {NULL, 0, 0};
+
+    uint32_t header[4] = {0, sizeof(rel_peer), sizeof(rel_slot)*RLY_WINDOW, sizeof(rel_reorder)};
+    put(&b, header, sizeof(header));
+
+    for (int cid = 0; cid < clientIterator; cid++) {
+        if (!CLIENT_LIVE(cid)) {
+            continue;
+        }
+
+        uint8_t socket = 0;
+        while (socket < socketCount && sockets[socket] != clientDesc[cid]) {
+            socket++;
+        }
+        rel_peer *p = clientRel[cid];
+        uint8_t hasRel = (p == NULL) ? 0 : REL_STATE | ((p->snd != NULL) ? REL_WINDOW : 0) |
+                                           ((p->rcv != NULL) ? REL_REORDER : 0);
+        uint16_t addressLength = (uint16_t)address_size(&clientAddr[cid]);
+
+        put(&b, &(clientLastHeardOf[cid]), sizeof(int32_t));
+        put(&b, &socket, sizeof(socket));
+        put(&b, &hasRel, sizeof(hasRel));
+        put(&b, &addressLength, sizeof(addressLength));
+        put(&b, address_sockaddr(&clientAddr[cid]), addressLength);
+
+        uint8_t nameLength = (uint8_t)strlen(clientName[cid]);
+        put(&b, &nameLength, sizeof(nameLength));
+        put(&b, clientName[cid], nameLength);
+
+        uint16_t topicCount = (uint16_t)topics_count(cid);
+        put(&b, &topicCount, sizeof(topicCount));
+        for (int k = 0; k < topicCount; k++) {
+            uint16_t patternLength = (uint16_t)strlen(topics_pattern(cid, k));
+            put(&b, &patternLength, sizeof(patternLength));
+            put(&b, topics_pattern(cid, k), patternLength);
+        }
+
+        if (hasRel) {
+            uint32_t backlogCount = (uint32_t)p->backlog_count;
+            put(&b, &backlogCount, sizeof(backlogCount));
+            put(&b, p, sizeof(rel_peer));
+            for (int k = 0; k < p->backlog_count; k++) {
+                put(&b, &(p->backlog[(p->backlog_head + k) % RLY_BACKLOG]), sizeof(message));
+            }
+            if (p->snd != NULL) {
+                put(&b, p->snd, sizeof(rel_slot)*RLY_WINDOW);
+            }
+            if (p->rcv != NULL) {
+                put(&b, p->rcv, sizeof(rel_reorder));
+            }
+        }
+        header[0]++;
+    }
+
+    memcpy(b.data, header, sizeof(header));
+    *length = b.length;
+    return b.data;
+}
+
+/* reads length bytes from data at *offset; false when there's not enough */
+static bool take(const char *data, size_t length, size_t *offset, void *out, size_t count) {
+    if (*offset + count > length) {
+        return false;
+    }
+    if (out != NULL) {
+        memcpy(out, data + *offset, count);
+    }
+    *offset += count;
+    return true;
+}
+
+int loadClients(const void *state, size_t length, const int *sockets, int socketCount) {
+    const char *data = state;
+    size_t offset = 0;
+
+    uint32_t header[4];
+    if (!take(data, length, &offset, header, sizeof(header))) {
+        return -1;
+    }
+    bool relCompatible = (header[1] == sizeof(rel_peer) && header[2] == sizeof(rel_slot)*RLY_WINDOW &&
+                          header[3] == sizeof(rel_reorder));
+
+    for (uint32_t k = 0; k < header[0]; k++) {
+        int32_t lastHeard;
+        uint8_t socket, hasRel;
+        uint16_t addressLength;
+        if (!take(data, length, &offset, &lastHeard, sizeof(lastHeard)) ||
+            !take(data, length, &offset, &socket, sizeof(socket)) ||
+            !take(data, length, &offset, &hasRel, sizeof(hasRel)) ||
+            !take(data, length, &offset, &addressLength, sizeof(addressLength)) ||
+            socket >= socketCount || addressLength > sizeof(struct sockaddr_storage)) {
+            return -1;
+        }
+
+        struct sockaddr_storage address;
+        if (!take(data, length, &offset, &address, addressLength)) {
+            return -1;
+        }
+        int cid = addClient((struct sockaddr *)&address, addressLength, sockets[socket]);
+        if (cid == -1) {
+            return -1;
+        }
+        clientLastHeardOf[cid] = lastHeard;
+
+        uint8_t nameLength;
+        char name[USERNAME_MAX + 1];
+        if (!take(data, length, &offset, &nameLength, sizeof(nameLength)) || nameLength > USERNAME_MAX ||
+            !take(data, length, &offset, name, nameLength)) {
+            return -1;
+        }
+        name[nameLength] = '\0';
+        nameClient(cid, name);
+
+        uint16_t topicCount;
+        if (!take(data, length, &offset, &topicCount, sizeof(topicCount))) {
+            return -1;
+        }
+        for (int t = 0; t < topicCount; t++) {
+            uint16_t patternLength;
+            char pattern[MSG_LEN_MAX + 1];
+            if (!take(data, length, &offset, &patternLength, sizeof(patternLength)) || patternLength > MSG_LEN_MAX ||
+                !take(data, length, &offset, pattern, patternLength)) {
+                return -1;
+            }
+            pattern[patternLength] = '\0';
+            topics_subscribe(cid, pattern);
+        }
+
+        if (hasRel) {
+            uint32_t backlogCount;
+            if (!take(data, length, &offset, &backlogCount, sizeof(backlogCount)) || backlogCount > RLY_BACKLOG) {
+                return -1;
+            }
+            if (!relCompatible) {
+                /* without state client's reliability layer resynchronizes on new session id */
+                size_t skipped = header[1] + sizeof(message)*backlogCount + ((hasRel & REL_WINDOW) ? header[2] : 0) +
+                                 ((hasRel & REL_REORDER) ? header[3] : 0);
+                if (!take(data, length, &offset, NULL, skipped)) {
+                    return -1;
+                }
+                continue;
+            }
+
+            rel_peer *peer = malloc(sizeof(rel_peer));
+            message *backlog = (backlogCount > 0) ? malloc(sizeof(message)*RLY_BACKLOG) : NULL;
+            rel_slot *window = (hasRel & REL_WINDOW) ? malloc(sizeof(rel_slot)*RLY_WINDOW) : NULL;
+            rel_reorder *reorder = (hasRel & REL_REORDER) ? malloc(sizeof(rel_reorder)) : NULL;
+            if (!take(data, length, &offset, peer, sizeof(rel_peer)) ||
+                !take(data, length, &offset, backlog, sizeof(message)*backlogCount) ||
+                !take(data, length, &offset, window, (window != NULL) ? sizeof(rel_slot)*RLY_WINDOW : 0) ||
+                !take(data, length, &offset, reorder, (reorder != NULL) ? sizeof(rel_reorder) : 0)) {
+                free(peer);
+                free(backlog);
+                free(window);
+                free(reorder);
+                return -1;
+            }
+            /* pointers came from the old process, only whether they were set matters */
+            peer->backlog = backlog;
+            peer->backlog_head = 0;
+            peer->backlog_count = (int)backlogCount;
+            peer->snd = window;
+            peer->rcv = reorder;
+            unstageClient(cid);
+            clientRel[cid] = peer;
+        }
+    }
+
+    return (int)header[0];
+}
+
+/* -------------------------------------- */
+
+/*
+ * Sweep: sets bit of every slot with last-heard stamp below deadline (removed slots carry
+ * CLIENT_REMOVED_STAMP, so they are caught too), returns number of set bits.
+ * Bitmap has to be zeroed; vector versions leave the tail (count % width) to the scalar one.
+ */
+typedef int (*sweep_fn)(const int32_t *last, int from, int count, int32_t deadline, uint64_t *bitmap);
+
+static int sweepScalar(const int32_t *last, int from, int count, int32_t deadline, uint64_t *bitmap) {
+    int found = 0;
+    for (int j = from; j < count; j++) {
+        if (last[j] < deadline) {
+            bitmap[j >> 6] |= 1ULL << (j & 63);
+            found++;
+        }
+    }
+    return found;
+}
+
+#ifdef SWEEP_X86
+__attribute__((target("sse2")))
+static int sweepSse2(const int32_t *last, int from, int count, int32_t deadline, uint64_t *bitmap) {
+    __m128i limit = _mm_set1_epi32(deadline);
+    int found = 0;
+    int j = from;
+    for (; j + 4 <= count; j += 4) {
+        __m128i stamps = _mm_loadu_si128((const __m128i *)(last + j));
+        unsigned int mask = (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(stamps, limit)));
+        if (mask != 0) {
+            /* j is a multiple of 4, so 4 bits never straddle a word */
+            bitmap[j >> 6] |= (uint64_t)mask << (j & 63);
+            found += __builtin_popcount(mask);
+        }
+    }
+    return found + sweepScalar(last, j, count, deadline, bitmap);
+}
+
+__attribute__((target("avx2")))
+static int sweepAvx2(const int32_t *last, int from, int count, int32_t deadline, uint64_t *bitmap) {
+    __m256i limit = _mm256_set1_epi32(deadline);
+    int found = 0;
+    int j = from;
+    for (; j + 8 <= count; j += 8) {
+        __m256i stamps = _mm256_loadu_si256((const __m256i *)(last + j));
+        unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, stamps)));
+        if (mask != 0) {
+            bitmap[j >> 6] |= (uint64_t)mask << (j & 63);
+            found += __builtin_popcount(mask);
+        }
+    }
+    return found + sweepScalar(last, j, count, deadline, bitmap);
+}
+#endif
+
+static sweep_fn sweep = NULL;
+const char *sweepName = NULL;
+
+void sweepSelect(const char *name) {
+#ifdef SWEEP_X86
+    __builtin_cpu_init();
+    if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        sweep = sweepAvx2;
+        sweepName = "avx2";
+        return;
+    }
+    if ((name == NULL || strcmp(name, "sse2") == 0) && __builtin_cpu_supports("sse2")) {
+        sweep = sweepSse2;
+        sweepName = "sse2";
+        return;
+    }
+#endif
+    (void)name;
+    sweep = sweepScalar;
+    sweepName = "scalar";
+}
+
+/*
+ * Drops every client not heard of for more than TIMEOUT_SEC together with slots left by
+ * removeClient(), then closes the gaps in all registry arrays in one pass. Client ids change -
+ * call it only where no cid is held (top of the server loop). Returns number of timed out clients.
+ */
+int expireClients(long now) {
+    if (sweep == NULL) {
+        sweepSelect(NULL);
+    }
+
+    int words = (clientIterator + 63) / 64;
+    if (words > expiredBitmapWords) {
+        expiredBitmapWords = (clientCapacity + 63) / 64;
+        expiredBitmap = realloc(expiredBitmap, sizeof(uint64_t)*expiredBitmapWords);
+    }
+    memset(expiredBitmap, 0, sizeof(uint64_t)*words);
+
+    if (sweep(clientLastHeardOf, 0, clientIterator, (int32_t)(now - TIMEOUT_SEC), expiredBitmap) == 0) {
+        return 0;
+    }
+
+    int timedOut = 0;
+    int kept = 0;
+    for (int w = 0; w < words; w++) {
+        uint64_t bits = expiredBitmap[w];
+        int end = (64*(w + 1) < clientIterator) ? 64*(w + 1) : clientIterator;
+        for (int j = 64*w; j < end; j++, bits >>= 1) {
+            if (bits & 1) {
+                topics_forget(j);
+                if (CLIENT_LIVE(j)) {
+                    if (clientName[j][0] != '\0' && presence_leave(clientName[j], true)) {
+                        mailbox_offline(clientName[j]);
+                    }
+                    address_release(&clientAddr[j]);
+                    if (clientStage[j] >= 0) {
+                        stages_leave(clientStage[j]);
+                    } else {
+                        unstagedClients--;
+                    }
+                    if (clientRel[j] != NULL) {
+                        rel_destroy(clientRel[j]);
+                        free(clientRel[j]);
+                    }
+                    timedOut++;
+                }
+                continue;
+            }
+            if (kept != j) {
+                clientAddr[kept] = clientAddr[j];
+                clientDesc[kept] = clientDesc[j];
+                clientLastHeardOf[kept] = clientLastHeardOf[j];
+                clientRel[kept] = clientRel[j];
+                clientStage[kept] = clientStage[j];
+                clientBucket[kept] = clientBucket[j];
+                memcpy(clientName[kept], clientName[j], sizeof(*clientName));
+                topics_renumber(j, kept);
+            }
+            kept++;
+        }
+    }
+    clientIterator = kept;
+
+    /* positions moved, tombstones are gone with them */
+    indexRebuild();
+
+    if (timedOut > 0) {
+        printf("Clients timed out: %d\n", timedOut);
+    }
+    return timedOut;
+}
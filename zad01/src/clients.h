@@ -0,0 +1,84 @@
+#ifndef MAKEFILE_CLIENTS_H
+#define MAKEFILE_CLIENTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "message.h"
+#include "reliable.h"
+#include "ratelimit.h"
+#include "address.h"
+
+/*
+ * Registry of known clients (parallel arrays indexed by client id, removed slots are empty in
+ * clientAddr) and everything that sends to them. Kept apart from the server loop so benchmarks
+ * can drive broadcast() directly.
+ */
+
+extern int clientCapacity;
+extern compact_address *clientAddr;
+extern int *clientDesc;
+extern int32_t *clientLastHeardOf;
+extern rel_peer **clientRel;
+extern int *clientStage;
+extern rate_bucket *clientBucket;
+extern char (*clientName)[USERNAME_MAX + 1];
+extern int clientIterator;
+extern int unstagedClients;
+
+extern bool reliableInFlight;
+extern long nextRetransmitCheck;
+
+#define CLIENT_LIVE(cid) ADDRESS_PRESENT(&clientAddr[cid])
+#define CLIENT_REMOVED_STAMP INT32_MIN /* last-heard of removed slots, always expired */
+
+/* name of sweep expireClients() uses: "avx2", "sse2" or "scalar" */
+extern const char *sweepName;
+
+long curr_time();
+
+/* address is copied; returns new client's id, -1 for an address family registry can't keep */
+int addClient(const struct sockaddr *cli_addr, socklen_t size, int desc);
+void removeClient(int cid);
+
+/* -1 when address is unknown */
+int clientPresent(const struct sockaddr *cli_addr, socklen_t size);
+
+/* first name client uses is the one it's on the roster (presence.h) with */
+void nameClient(int cid, const char *name);
+
+/* some client with that name, -1 - none */
+int clientNamed(const char *name);
+
+/* creates reliability state on first use */
+rel_peer *reliablePeer(int cid);
+
+bool sendToClient(int cid, void *data, size_t length);
+void flushReliable(int cid, long now);
+int broadcast(message *msg);
+int multicast(message *msg, const int *cids, int count);
+int broadcastBatch(batch_packet *batch);
+void retransmitTick(long now);
+
+/*
+ * Registry for a restarted server (see handoff.h). Descriptors are saved as indexes into sockets,
+ * so the new process maps them to its own numbers. loadClients() returns number of clients, -1
+ * when state is malformed.
+ */
+void *saveClients(const int *sockets, int socketCount, size_t *length);
+int loadClients(const void *state, size_t length, const int *sockets, int socketCount);
+
+/* bytes held per subsystem: registry, addresses, reliability buffers, fan-out queues and tables */
+void memoryReport(FILE *out);
+
+/* picks sweep by name (NULL - best the CPU supports), falls back to scalar */
+void sweepSelect(const char *name);
+
+/* removes timed out clients and compacts registry, client ids change; returns timed out count */
+int expireClients(long now);
+
+#endif //MAKEFILE_CLIENTS_H
@@ -5,6 +5,7 @@
 #ifndef MAKEFILE_CONFIG_H
 #define MAKEFILE_CONFIG_H
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE
 
@@ -16,11 +17,89 @@
 #define MIN_PORT 1024
 #define MAX_PORT 65535
 #define MSG_QUEUES_CAPACITY 64
+#define SEND_BATCH_MAX MSG_QUEUES_CAPACITY /* messages sent by client with one syscall */
 #define TIMEOUT_SEC 10
 
+/* Heartbeats (UDP) - server may advertise different interval, clients add +-HB_JITTER_PCT */
+#define HB_DEFAULT_MS (TIMEOUT_SEC*1000/5)
+#define HB_MIN_MS 100
+#define HB_MAX_MS (TIMEOUT_SEC*1000/2)
+#define HB_JITTER_PCT 20
+
+/* Coalescing fan-out (server's -W) */
+#define COALESCE_MAX 8 /* messages per datagram: 8 + 8*146 bytes still fit an ethernet MTU */
+#define COALESCE_WINDOW_MAX_MS 100
+
+/* Staged fan-out (server's -P) */
+#define STAGE_WORKERS_MAX 16
+#define STAGE_QUEUE_CAPACITY 1024 /* jobs waiting per worker, receive stage blocks beyond that */
+
+/* Session library */
+#define SESSION_QUEUE_MAX 64 /* messages waiting for a writable socket, per session */
+#define SESSION_EVENTS_MAX 256 /* events handled per epoll_wait() */
+
+/* Reliable delivery (UDP) */
+#define RLY_WINDOW 32 /* max unacked messages per peer, must be <= 32 (sack bitmap) */
+#define RLY_BACKLOG 256 /* messages waiting for room in the window, allocated only when needed */
+#define RLY_RTO_INIT_MS 200
+#define RLY_RTO_MIN_MS 40
+#define RLY_RTO_MAX_MS 3000
+#define RLY_MAX_RETRIES 8
+#define RLY_TICK_MS 10
+#define RLY_RETIRED 4 /* sender sessions remembered after they were replaced, their late packets are dropped */
+
+/* Socket buffers (server's -R, -Q) */
+#define SOCKBUF_BYTES_MAX (256*1024*1024)
+#define SOCKBUF_PRESSURE_TICKS 2 /* seconds in a row with kernel drops before receive buffer grows */
+#define SOCKBUF_GROWTH 2
+
+/* Rate limiting (server's -r, -u) */
+#define RATE_USERS_INIT 256
+#define RATE_USERS_MAX (64*1024) /* usernames with own bucket; beyond that idle ones are forgotten */
+
+/* Topics (pub/sub) */
+#define TOPIC_DEPTH_MAX 16 /* levels of a topic or pattern */
+#define TOPICS_CACHE_SIZE 256 /* recipient sets of recently published topics, power of 2 */
+
+/* Long messages, sent in fragments */
+#define FRAGMENT_TEXT_MAX (64*1024) /* longer input is cut */
+#define FRAGMENT_PARTIALS_MAX 16 /* texts receiver puts together at once */
+
+/* Presence */
+#define PRESENCE_BATCH_MS 250 /* deltas go out at most this often */
+#define PRESENCE_SHOWN_MAX 32 /* names client shows with a snapshot */
+
+/* Offline mailboxes (server's -M) */
+#define MAILBOX_CHUNK (64*1024) /* mailbox files grow by doubling from that */
+#define MAILBOX_BYTES_MAX (1024*1024) /* beyond that newer messages for the user are dropped */
+#define MAILBOX_MAPPED_MAX 64 /* mailboxes mapped at once, least recently used is unmapped first */
+#define MAILBOX_QUEUE_CAPACITY 4096 /* jobs for the writer; full - new posts are dropped */
+#define MAILBOX_BATCH_MAX 256 /* posts written in one pass over mailboxes */
+#define MAILBOX_POLL_MS 10 /* how often event loop looks for finished deliveries while some are due */
+
+/* History and search (server's -L) */
+#define SEARCH_TERM_MAX 32 /* longer terms are cut */
+#define SEARCH_RESULTS_MAX 20 /* newest hits sent back for a query */
+#define SEARCH_QUEUE_CAPACITY 4096 /* messages and queries for the search thread; full - messages aren't kept */
+#define SEARCH_POLL_MS 10 /* how often event loop looks for answers while some are due */
+
+/* Hot restart */
+#define HANDOFF_VERSION 5 /* bump whenever the handed off state changes */
+#define HANDOFF_TIMEOUT_SEC 5
+#define HANDOFF_FDS_PER_MESSAGE 250 /* kernel takes at most 253 per SCM_RIGHTS */
+#define HANDOFF_CHUNK (32*1024)
+
+/* Tracing */
+#define TRACE_SAMPLE_DEFAULT 100 /* every n-th message goes to trace file */
+
+/* Replay of captured traffic */
+#define REPLAY_INFLIGHT_MAX 4096 /* sent messages per sender waiting to be seen back, for latency */
+
 /* Interface */
 #define USR_CMD_EXIT "e\n"
 #define USR_CMD_TYPE "t\n"
+#define HEADLESS_OUTPUT_BUFFER (64*1024)
+#define INBOUND_BULK_MAX 256 /* client's -O coalesce: newest messages one bulk keeps for display */
 
 
 #endif //MAKEFILE_CONFIG_H
@@ -0,0 +1,356 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "session.h"
+
+#define EXIT() exit(1)
+#define PROBE_GAP_MS 2 /* pause between latency probes, lets the server go idle */
+#define PROBE_TIMEOUT_MS 1000
+
+/*
+ * Load generator built on the session library: keeps many sessions connected from one
+ * thread and sends lines read from stdin round-robin through them.
+ * In latency mode first session sends probes one by one instead and times their echo.
+ */
+
+typedef struct {
+    int sessions;
+    char *prefix;
+    int sock_type;
+    long wait_ms;
+    int probes;
+    session_address address;
+} fanout_arguments;
+
+fanout_arguments args;
+session **sessions;
+int next_session = 0;
+
+unsigned long connected = 0;
+unsigned long lost = 0;
+unsigned long lines = 0;
+unsigned long dropped = 0;
+
+bool input_finished = false;
+char line_buffer[MSG_LEN_MAX + 1];
+size_t line_size = 0;
+
+long *probe_rtt;
+int probes_done = 0;
+int probes_lost = 0;
+long probe_sent_at = -1; /* -1 - no probe in flight */
+
+volatile sig_atomic_t should_exit = 0;
+
+void print_usage() {
+    printf("Usage: fanout [options] <l|r> <unix_socket_path|ip> [port]\n"
+           "  -n, --sessions <n>  number of sessions (default 100)\n"
+           "  -p, --prefix <name> username prefix, session number is appended (default bot)\n"
+           "  -t, --tcp           connect to TCP server (zad02) instead of UDP\n"
+           "  -w, --wait-ms <ms>  how long to keep receiving after end of input (default 1000)\n"
+           "  -l, --latency <n>   instead of reading stdin, measure round trip of n probes\n");
+}
+
+void process_arguments(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"sessions", required_argument, NULL, 'n'},
+        {"prefix", required_argument, NULL, 'p'},
+        {"tcp", no_argument, NULL, 't'},
+        {"wait-ms", required_argument, NULL, 'w'},
+        {"latency", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+
+    args.sessions = 100;
+    args.prefix = "bot";
+    args.sock_type = SOCK_DGRAM;
+    args.wait_ms = 1000;
+    args.probes = 0;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "+n:p:tw:l:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'n':
+                args.sessions = (int)strtol(optarg, NULL, 10);
+                if(args.sessions <= 0) {
+                    printf("Number of sessions must be positive\n");
+                    EXIT();
+                }
+                break;
+            case 'p':
+                /* room for up to 6 digits of session number */
+                if(strlen(optarg) > USERNAME_MAX - 6) {
+                    printf("Prefix too long; max: %i\n", USERNAME_MAX - 6);
+                    EXIT();
+                }
+                args.prefix = optarg;
+                break;
+            case 't':
+                args.sock_type = SOCK_STREAM;
+                break;
+            case 'w':
+                args.wait_ms = strtol(optarg, NULL, 10);
+                if(args.wait_ms < 0) {
+                    printf("Wait must not be negative\n");
+                    EXIT();
+                }
+                break;
+            case 'l':
+                args.probes = (int)strtol(optarg, NULL, 10);
+                if(args.probes <= 0) {
+                    printf("Number of probes must be positive\n");
+                    EXIT();
+                }
+                break;
+            default:
+                print_usage();
+                EXIT();
+        }
+    }
+
+    /* positional arguments keep their indexes */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if(argc < 3) {
+        printf("Too few arguments\n");
+        print_usage();
+        EXIT();
+    }
+
+    const char *error = session_resolve(argv[1][0], argv[2], (argc > 3) ? argv[3] : NULL, &(args.address));
+    if(error != NULL) {
+        printf("%s\n", error);
+        EXIT();
+    }
+}
+
+/* every session needs a descriptor */
+void raise_fd_limit() {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    rlim_t needed = (rlim_t)args.sessions + 16;
+    if(limit.rlim_cur < needed) {
+        limit.rlim_cur = (limit.rlim_max < needed) ? limit.rlim_max : needed;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* ------------------------------- */
+
+void on_connect(session *s, void *user) {
+    (void)s;
+    (void)user;
+    connected++;
+}
+
+void on_message(session *s, const message *msg, void *user) {
+    (void)s;
+    /* everything is counted by the loop, only probe echoes are of interest */
+    if(probe_sent_at == -1 || (long)user != 0 || strncmp(msg->msg, "probe ", 6) != 0) {
+        return;
+    }
+
+    char expected[USERNAME_MAX + 1];
+    snprintf(expected, sizeof(expected), "%s0", args.prefix);
+    if(strcmp(msg->from, expected) == 0 && strtol(msg->msg + 6, NULL, 10) == probes_done + probes_lost) {
+        probe_rtt[probes_done++] = now_us() - probe_sent_at;
+        probe_sent_at = -1;
+    }
+}
+
+void on_close(session *s, void *user) {
+    (void)s;
+    long idx = (long)user;
+    sessions[idx] = NULL;
+    lost++;
+}
+
+/* tries every session once, starting after the last used one */
+void send_line(const char *text) {
+    lines++;
+    for(int tries = 0; tries < args.sessions; tries++) {
+        session *s = sessions[next_session];
+        next_session = (next_session + 1) % args.sessions;
+        if(s != NULL && session_send(s, text) == 0) {
+            return;
+        }
+    }
+    dropped++;
+}
+
+void read_input(int fd, void *user) {
+    char chunk[4096];
+    ssize_t size = read(fd, chunk, sizeof(chunk));
+    if(size <= 0) {
+        if(size == -1 && errno == EINTR) {
+            return;
+        }
+        if(line_size > 0) {
+            line_buffer[line_size] = '\0';
+            send_line(line_buffer);
+        }
+        session_loop_unwatch(user, fd);
+        input_finished = true;
+        return;
+    }
+
+    for(ssize_t i = 0; i < size; i++) {
+        if(chunk[i] == '\n') {
+            line_buffer[line_size] = '\0';
+            send_line(line_buffer);
+            line_size = 0;
+        } else if(line_size < MSG_LEN_MAX) {
+            /* rest of too long line is cut off, as in headless client */
+            line_buffer[line_size++] = chunk[i];
+        }
+    }
+}
+
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+void run_probes(session_loop *loop) {
+    probe_rtt = malloc(sizeof(long)*args.probes);
+    long next_probe = now_us();
+
+    while(!should_exit && sessions[0] != NULL && probes_done + probes_lost < args.probes) {
+        long now = now_us();
+        if(probe_sent_at == -1 && now >= next_probe) {
+            char text[MSG_LEN_MAX + 1];
+            snprintf(text, sizeof(text), "probe %d", probes_done + probes_lost);
+            probe_sent_at = now_us();
+            session_send(sessions[0], text);
+        } else if(probe_sent_at != -1 && now - probe_sent_at > PROBE_TIMEOUT_MS*1000L) {
+            probes_lost++;
+            probe_sent_at = -1;
+        }
+
+        bool waiting = probe_sent_at != -1;
+        session_loop_run(loop, waiting ? PROBE_TIMEOUT_MS : PROBE_GAP_MS);
+        if(waiting && probe_sent_at == -1) {
+            next_probe = now_us() + PROBE_GAP_MS*1000L;
+        }
+    }
+
+    qsort(probe_rtt, probes_done, sizeof(long), compare_longs);
+    fprintf(stderr, "Probes: %d, lost: %d\n", probes_done, probes_lost);
+    if(probes_done > 0) {
+        fprintf(stderr, "Round trip us: min %ld, p50 %ld, p90 %ld, p99 %ld, max %ld\n", probe_rtt[0],
+                probe_rtt[probes_done/2], probe_rtt[probes_done*9/10], probe_rtt[probes_done*99/100],
+                probe_rtt[probes_done - 1]);
+    }
+    free(probe_rtt);
+}
+
+void interrupt(int sig) {
+    (void)sig;
+    should_exit = 1;
+}
+
+/* ------------------------------- */
+
+int main(int argc, char **argv) {
+    process_arguments(argc, argv);
+    raise_fd_limit();
+    srand(time(NULL) ^ getpid());
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    session_loop *loop = session_loop_create();
+    if(loop == NULL) {
+        perror("Cannot create event loop");
+        EXIT();
+    }
+
+    session_callbacks callbacks = {on_connect, on_message, on_close};
+    sessions = calloc(sizeof(session*), args.sessions);
+    for(long i = 0; i < args.sessions; i++) {
+        char username[USERNAME_MAX + 1];
+        snprintf(username, sizeof(username), "%s%ld", args.prefix, i);
+        sessions[i] = session_open(loop, &(args.address), args.sock_type, username, &callbacks, (void*)i);
+        for(int retries = 0; sessions[i] == NULL && errno == EAGAIN && retries < 100; retries++) {
+            /* server hasn't accepted earlier connections yet */
+            session_loop_run(loop, 10);
+            sessions[i] = session_open(loop, &(args.address), args.sock_type, username, &callbacks, (void*)i);
+        }
+        if(sessions[i] == NULL) {
+            perror("Cannot open session");
+            EXIT();
+        }
+    }
+
+    /* lines are sent only once every session is up, so nobody misses the beginning */
+    while(!should_exit && connected + lost < (unsigned long)args.sessions) {
+        session_loop_run(loop, 1000);
+    }
+    if(args.probes > 0) {
+        run_probes(loop);
+        session_loop_destroy(loop);
+        free(sessions);
+        return 0;
+    }
+
+    long start = now_us()/1000;
+
+    /* epoll refuses regular files - those are always readable, so just read between loop runs */
+    bool polled_input = session_loop_watch(loop, STDIN_FILENO, read_input, loop) == 0;
+
+    long quiet_since = -1;
+    unsigned long last_received = 0;
+    while(!should_exit && session_loop_count(loop) > 0) {
+        if(!polled_input && !input_finished) {
+            read_input(STDIN_FILENO, loop);
+            session_loop_run(loop, 0);
+        } else {
+            session_loop_run(loop, 100);
+        }
+
+        if(input_finished) {
+            long now = now_us()/1000;
+            unsigned long received = session_loop_stats(loop).received;
+            if(quiet_since == -1 || received != last_received) {
+                quiet_since = now;
+                last_received = received;
+            } else if(now - quiet_since >= args.wait_ms) {
+                break;
+            }
+        }
+    }
+
+    /* waiting for stragglers doesn't count */
+    long elapsed = ((quiet_since != -1) ? quiet_since : now_us()/1000) - start;
+    session_stats stats = session_loop_stats(loop);
+    fprintf(stderr, "Sessions: %i, connected: %lu, lost: %lu\n", args.sessions, connected, lost);
+    fprintf(stderr, "Lines: %lu, sent: %lu, dropped (queues full): %lu\n", lines, stats.sent, dropped);
+    fprintf(stderr, "Received: %lu in %ld ms (%.0f msg/s), heartbeats: %lu\n", stats.received, elapsed,
+            (elapsed > 0) ? stats.received * 1000.0 / elapsed : 0.0, stats.heartbeats);
+
+    session_loop_destroy(loop);
+    free(sessions);
+
+    return 0;
+}
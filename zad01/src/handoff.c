@@ -0,0 +1,229 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+#define HANDOFF_MAGIC 0x484f4646 /* "HOFF" */
+#define HANDOFF_CONFIRM 'K'
+
+/*
+ * Wire format, one seqpacket per item: header, fds in groups (1 byte of data each, descriptors
+ * in SCM_RIGHTS), state in chunks of HANDOFF_CHUNK. Confirmation is a single byte back.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t fd_count;
+    uint32_t reserved;
+    uint64_t state_length;
+} handoff_header;
+
+/* a stuck peer must not freeze the server that is still serving */
+static void set_timeout(int conn) {
+    struct timeval tv;
+    tv.tv_sec = HANDOFF_TIMEOUT_SEC;
+    tv.tv_usec = 0;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int set_address(struct sockaddr_un *address, const char *path) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un address;
+    if (set_address(&address, path) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int handoff_connect(const char *path) {
+    struct sockaddr_un address;
+    if (set_address(&address, path) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    set_timeout(fd);
+    return fd;
+}
+
+static int send_fds(int conn, const int *fds, int count) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int)*HANDOFF_FDS_PER_MESSAGE)];
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int)*count);
+    memset(control, 0, sizeof(control));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int)*count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int)*count);
+
+    return (sendmsg(conn, &hdr, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+int handoff_send(int conn, const int *fds, int fd_count, const void *state, size_t length) {
+    set_timeout(conn);
+
+    handoff_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.fd_count = (uint32_t)fd_count;
+    header.state_length = length;
+    if (send(conn, &header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
+        return -1;
+    }
+
+    for (int sent = 0; sent < fd_count; sent += HANDOFF_FDS_PER_MESSAGE) {
+        int count = (fd_count - sent < HANDOFF_FDS_PER_MESSAGE) ? fd_count - sent : HANDOFF_FDS_PER_MESSAGE;
+        if (send_fds(conn, fds + sent, count) == -1) {
+            return -1;
+        }
+    }
+
+    for (size_t sent = 0; sent < length; sent += HANDOFF_CHUNK) {
+        size_t count = (length - sent < HANDOFF_CHUNK) ? length - sent : HANDOFF_CHUNK;
+        if (send(conn, (const char *)state + sent, count, MSG_NOSIGNAL) != (ssize_t)count) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* returns number of descriptors stored at fds, -1 on error */
+static int receive_fds(int conn, int *fds, int room) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int)*HANDOFF_FDS_PER_MESSAGE)];
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    if (recvmsg(conn, &hdr, MSG_CMSG_CLOEXEC) != 1 || (hdr.msg_flags & MSG_CTRUNC)) {
+        return -1;
+    }
+
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (count + n > room) {
+                return -1;
+            }
+            memcpy(fds + count, CMSG_DATA(cmsg), sizeof(int)*n);
+            count += n;
+        }
+    }
+
+    return count;
+}
+
+int handoff_receive(int conn, handoff_state *st) {
+    memset(st, 0, sizeof(handoff_state));
+
+    handoff_header header;
+    if (recv(conn, &header, sizeof(header), 0) != sizeof(header) || header.magic != HANDOFF_MAGIC) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (header.version != HANDOFF_VERSION) {
+        errno = EPROTONOSUPPORT;
+        return -1;
+    }
+
+    st->fds = malloc(sizeof(int)*(header.fd_count + 1));
+    while (st->fd_count < (int)header.fd_count) {
+        int count = receive_fds(conn, st->fds + st->fd_count, header.fd_count - st->fd_count);
+        if (count <= 0) {
+            handoff_free(st);
+            errno = EPROTO;
+            return -1;
+        }
+        st->fd_count += count;
+    }
+
+    st->state = malloc(header.state_length + 1);
+    while (st->state_length < header.state_length) {
+        size_t left = header.state_length - st->state_length;
+        ssize_t count = recv(conn, st->state + st->state_length, (left < HANDOFF_CHUNK) ? left : HANDOFF_CHUNK, 0);
+        if (count <= 0) {
+            handoff_free(st);
+            errno = EPROTO;
+            return -1;
+        }
+        st->state_length += count;
+    }
+
+    return 0;
+}
+
+void handoff_free(handoff_state *st) {
+    free(st->fds);
+    free(st->state);
+    memset(st, 0, sizeof(handoff_state));
+}
+
+int handoff_confirm(int conn) {
+    char byte = HANDOFF_CONFIRM;
+    return (send(conn, &byte, 1, MSG_NOSIGNAL) == 1) ? 0 : -1;
+}
+
+int handoff_wait_confirm(int conn) {
+    char byte;
+    return (recv(conn, &byte, 1, 0) == 1 && byte == HANDOFF_CONFIRM) ? 0 : -1;
+}
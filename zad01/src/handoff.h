@@ -0,0 +1,40 @@
+#ifndef MAKEFILE_HANDOFF_H
+#define MAKEFILE_HANDOFF_H
+
+#include <stddef.h>
+
+/*
+ * Hot restart: running server listens on a unix seqpacket socket; a new process started with the
+ * same path connects to it and gets its descriptors (SCM_RIGHTS) and serialized state, binds the
+ * path itself and confirms - only then the old process exits. Until the confirmation the old one
+ * keeps serving, so a successor that dies halfway changes nothing. Data arriving meanwhile waits
+ * in the (shared) sockets.
+ */
+
+typedef struct {
+    int *fds;
+    int fd_count;
+    char *state;
+    size_t state_length;
+} handoff_state;
+
+/* replaces whatever is at path; -1 on error */
+int handoff_listen(const char *path);
+
+/* -1 when nobody listens at path (errno ENOENT or ECONNREFUSED) or on error */
+int handoff_connect(const char *path);
+
+/* old server: sends everything over accepted connection */
+int handoff_send(int conn, const int *fds, int fd_count, const void *state, size_t length);
+
+/* new server: st is filled in (release with handoff_free()); -1 on error or version mismatch */
+int handoff_receive(int conn, handoff_state *st);
+void handoff_free(handoff_state *st);
+
+/* new server, once it's ready to serve */
+int handoff_confirm(int conn);
+
+/* old server: 0 when successor confirmed, -1 when it went away (or timed out) */
+int handoff_wait_confirm(int conn);
+
+#endif //MAKEFILE_HANDOFF_H
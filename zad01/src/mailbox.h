@@ -0,0 +1,58 @@
+#ifndef MAKEFILE_MAILBOX_H
+#define MAKEFILE_MAILBOX_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "message.h"
+
+/*
+ * Offline mailboxes (server's -M). Every user the server has seen (or found a mailbox of) gets
+ * plain messages sent while it was offline appended to "<dir>/<name>.box", a file mapped only
+ * while it's being used: a small header, which is the index (record count and end of data),
+ * then records of 1-byte lengths and bytes of sender and text. When user is back, the whole
+ * mailbox is read in one go and truncated.
+ *
+ * Files are touched only by a writer thread: event loop queues online/offline/post jobs (in order,
+ * so every post goes exactly to users offline at that moment) and collects finished deliveries.
+ * At most MAILBOX_MAPPED_MAX mailboxes stay mapped, each is at most MAILBOX_BYTES_MAX.
+ */
+
+#define MAILBOX_SUFFIX ".box"
+
+extern bool mailboxRunning;
+
+/* creates dir if needed, starts writer; -1 (errno set) on failure */
+int mailbox_start(const char *dir);
+
+/* looks for mailboxes already in dir; separate, so it can go after a hot restart took state over */
+void mailbox_scan();
+
+/* waits until everything queued so far is written */
+void mailbox_drain();
+
+/* writes everything queued and stops the writer */
+void mailbox_stop();
+
+/* user's mailbox is read for mailbox_collect(), from now on it gets no mail */
+void mailbox_online(const char *name);
+void mailbox_offline(const char *name);
+
+/* appends msg to mailbox of every offline user; false when writer is too far behind (dropped) */
+bool mailbox_post(const message *msg);
+
+/* deliveries asked for with mailbox_online() which weren't collected yet */
+int mailbox_waiting();
+
+/*
+ * Takes one finished delivery: name is set (USERNAME_MAX + 1 bytes), messages (malloc'ed, caller
+ * frees, NULL if mailbox was empty) are returned in *msgs. Returns their number, -1 - none ready.
+ */
+int mailbox_collect(char *name, message **msgs);
+
+/* delivery nobody took (user is gone again) goes back in front of mailbox; takes msgs */
+void mailbox_return(const char *name, message *msgs, int count);
+
+void mailbox_report(FILE *out);
+
+#endif //MAKEFILE_MAILBOX_H
@@ -7,9 +7,82 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 typedef struct {
     char from[USERNAME_MAX+1];
     char msg[MSG_LEN_MAX+1];
 } message;
 
+/*
+ * Datagrams which are not a bare message start with one of these tags.
+ * Anything shorter than a message with an unknown tag is treated as heartbeat.
+ */
+#define PKT_HEARTBEAT -11
+#define PKT_RELIABLE -12
+#define PKT_ACK -13
+#define PKT_HB_INTERVAL -14
+#define PKT_BATCH -15
+
+#define HB_FLAG_RELIABLE 1
+
+/*
+ * Sent by clients as PKT_HEARTBEAT with interval they currently use (and HB_FLAG_RELIABLE
+ * to register for reliable delivery). Server answers with PKT_HB_INTERVAL when interval differs.
+ * Bare 4-byte PKT_HEARTBEAT is still accepted.
+ */
+typedef struct {
+    int32_t type;
+    int32_t interval_ms;
+    int32_t flags;
+} hb_packet;
+
+/* message sent through the reliability layer */
+typedef struct {
+    int32_t type;
+    uint32_t session;
+    uint32_t seq;
+    message msg;
+} rel_packet;
+
+/*
+ * cum_ack - next sequence number expected by the receiver
+ * sack - bit i set means cum_ack+1+i has already been received
+ */
+typedef struct {
+    int32_t type;
+    uint32_t session;
+    uint32_t cum_ack;
+    uint32_t sack;
+} ack_packet;
+
+/*
+ * Several messages in one datagram - what server sends when it coalesces fan-out.
+ * Only first count entries travel, see BATCH_LENGTH().
+ */
+typedef struct {
+    int32_t type;
+    int32_t count;
+    message msgs[COALESCE_MAX];
+} batch_packet;
+
+#define BATCH_LENGTH(count) (offsetof(batch_packet, msgs) + (count)*sizeof(message))
+
+/* receive buffer big enough for any datagram */
+typedef union {
+    int32_t type;
+    message msg;
+    hb_packet hb;
+    rel_packet rel;
+    ack_packet ack;
+    batch_packet batch;
+} packet;
+
+/* number of messages in received datagram if it's a well formed batch, 0 otherwise */
+#define BATCH_COUNT(p, length) \
+    (((length) > (ssize_t)offsetof(batch_packet, msgs) && (p)->type == PKT_BATCH && (p)->batch.count > 0 && \
+      (p)->batch.count <= COALESCE_MAX && (length) == (ssize_t)BATCH_LENGTH((p)->batch.count)) ? (p)->batch.count : 0)
+
 #endif //MAKEFILE_MESSAGE_H
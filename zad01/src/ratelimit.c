@@ -0,0 +1,161 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ratelimit.h"
+
+typedef struct {
+    char name[USERNAME_MAX+1];    /* empty - free slot */
+    rate_bucket bucket;
+} rate_user_entry;
+
+unsigned long rate_decisions[RATE_DECISIONS] = {0};
+
+static rate_user_entry *users = NULL;
+static unsigned int users_size = 0; /* power of 2 */
+static unsigned int users_count = 0;
+static unsigned long users_forgotten = 0;
+static unsigned long users_overflow = 0;
+
+int rate_parse(const char *arg, rate_limit *limit) {
+    char *end;
+    long rate = strtol(arg, &end, 10);
+    long burst = (rate > 0) ? rate : 1;
+    if (*end == ':') {
+        burst = strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' || rate <= 0 || rate > 1000000 || burst <= 0 || burst > 1000000) {
+        return -1;
+    }
+
+    limit->rate = (int)rate;
+    limit->burst = (int)burst;
+    return 0;
+}
+
+void rate_bucket_init(rate_bucket *b, const rate_limit *limit, long now_ms) {
+    b->tokens = limit->burst*1000L;
+    b->last_ms = now_ms;
+}
+
+static void refill(rate_bucket *b, const rate_limit *limit, long now_ms) {
+    if (now_ms > b->last_ms) {
+        /* rate tokens a second are rate thousandths a millisecond */
+        b->tokens += (now_ms - b->last_ms)*limit->rate;
+        if (b->tokens > limit->burst*1000L) {
+            b->tokens = limit->burst*1000L;
+        }
+        b->last_ms = now_ms;
+    }
+}
+
+bool rate_take(rate_bucket *b, const rate_limit *limit, long now_ms) {
+    refill(b, limit, now_ms);
+    if (b->tokens < 1000) {
+        return false;
+    }
+
+    b->tokens -= 1000;
+    return true;
+}
+
+void rate_give_back(rate_bucket *b) {
+    b->tokens += 1000;
+}
+
+long rate_wait_ms(const rate_bucket *b, const rate_limit *limit) {
+    if (b->tokens >= 1000) {
+        return 0;
+    }
+    return (1000 - b->tokens + limit->rate - 1)/limit->rate;
+}
+
+static uint32_t name_hash(const char *name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int k = 0; k < USERNAME_MAX && name[k] != '\0'; k++) {
+        hash = (hash ^ (unsigned char)name[k])*16777619u;
+    }
+    return hash;
+}
+
+/* moves entries to a table of given size, dropping idle ones if asked to */
+static void users_rehash(unsigned int size, const rate_limit *limit, long now_ms, bool forget_idle) {
+    rate_user_entry *old = users;
+    unsigned int old_size = users_size;
+
+    users = calloc(sizeof(rate_user_entry), size);
+    users_size = size;
+    users_count = 0;
+
+    for (unsigned int k = 0; k < old_size; k++) {
+        if (old[k].name[0] == '\0') {
+            continue;
+        }
+        if (forget_idle) {
+            /* full bucket is what a new user gets anyway */
+            refill(&(old[k].bucket), limit, now_ms);
+            if (old[k].bucket.tokens == limit->burst*1000L) {
+                users_forgotten++;
+                continue;
+            }
+        }
+
+        unsigned int pos = name_hash(old[k].name) & (size - 1);
+        while (users[pos].name[0] != '\0') {
+            pos = (pos + 1) & (size - 1);
+        }
+        users[pos] = old[k];
+        users_count++;
+    }
+
+    free(old);
+}
+
+rate_bucket *rate_user(const char *name, const rate_limit *limit, long now_ms) {
+    static rate_bucket overflow; /* last_ms 0 - full on first refill */
+
+    /* unnamed clients still get a slot of their own */
+    if (name[0] == '\0') {
+        name = " ";
+    }
+
+    /* at most half full - probes stay short */
+    if (2*(users_count + 1) > users_size) {
+        if (users_size < RATE_USERS_MAX) {
+            users_rehash((users_size > 0) ? 2*users_size : RATE_USERS_INIT, limit, now_ms, false);
+        } else {
+            users_rehash(users_size, limit, now_ms, true);
+        }
+    }
+
+    unsigned int mask = users_size - 1;
+    unsigned int pos = name_hash(name) & mask;
+    while (users[pos].name[0] != '\0') {
+        if (strncmp(users[pos].name, name, USERNAME_MAX) == 0) {
+            return &(users[pos].bucket);
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    if (2*(users_count + 1) > users_size) {
+        /* everybody is active - they share one bucket until somebody goes idle */
+        users_overflow++;
+        return &overflow;
+    }
+
+    strncpy(users[pos].name, name, USERNAME_MAX);
+    rate_bucket_init(&(users[pos].bucket), limit, now_ms);
+    users_count++;
+    return &(users[pos].bucket);
+}
+
+void rate_report(FILE *out, const char *excess) {
+    fprintf(out, "Rate limit: %lu passed, %lu %s by connection limit, %lu %s by username limit, "
+            "%u users tracked (%lu forgotten while idle, %lu over table limit)\n",
+            rate_decisions[RATE_PASSED], rate_decisions[RATE_CONNECTION], excess, rate_decisions[RATE_USER],
+            excess, users_count, users_forgotten, users_overflow);
+    fflush(out);
+}
@@ -0,0 +1,58 @@
+#ifndef MAKEFILE_RATELIMIT_H
+#define MAKEFILE_RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Token buckets for the server's ingress (-r per connection, -u per username): every message takes
+ * one token, tokens come back at rate per second up to burst. Server checks them before it
+ * decodes and fans message out; what it does with the excess is up to it (UDP one drops, TCP one
+ * stops reading the connection until a token is back, so the sender's socket fills up instead).
+ * Buckets count in thousandths of a token, so rates below 1/s work too.
+ */
+
+typedef struct {
+    int rate;                     /* tokens per second, 0 - no limit */
+    int burst;
+} rate_limit;
+
+typedef struct {
+    long tokens;                  /* 1/1000 token */
+    long last_ms;
+} rate_bucket;
+
+enum {
+    RATE_PASSED,
+    RATE_CONNECTION,              /* limited by connection's bucket */
+    RATE_USER,                    /* limited by username's bucket */
+    RATE_DECISIONS
+};
+
+extern unsigned long rate_decisions[RATE_DECISIONS];
+
+/* "rate[:burst]", burst defaults to rate (at least 1); -1 when malformed */
+int rate_parse(const char *arg, rate_limit *limit);
+
+/* full bucket */
+void rate_bucket_init(rate_bucket *b, const rate_limit *limit, long now_ms);
+
+/* true when token was taken */
+bool rate_take(rate_bucket *b, const rate_limit *limit, long now_ms);
+
+/* returns token taken by rate_take(), when the message it was taken for is put off anyway */
+void rate_give_back(rate_bucket *b);
+
+/* ms until next token */
+long rate_wait_ms(const rate_bucket *b, const rate_limit *limit);
+
+/*
+ * Bucket of username (up to USERNAME_MAX characters are significant); valid until the next call.
+ * Idle users (full buckets) are forgotten once the table reaches RATE_USERS_MAX.
+ */
+rate_bucket *rate_user(const char *name, const rate_limit *limit, long now_ms);
+
+/* decision counters; what stands for dropped is the caller's verb */
+void rate_report(FILE *out, const char *excess);
+
+#endif //MAKEFILE_RATELIMIT_H
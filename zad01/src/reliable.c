@@ -0,0 +1,306 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "reliable.h"
+
+/* sequence numbers wrap around, so they are compared by signed distance */
+#define SEQ_DIFF(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)))
+
+long rel_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+void rel_init(rel_peer *p) {
+    memset(p, 0, sizeof(rel_peer));
+
+    while(p->session == 0) {
+        p->session = ((uint32_t)rand() << 16) ^ (uint32_t)rand() ^ (uint32_t)rel_now_ms();
+    }
+    p->srtt = -1;
+    p->rto = RLY_RTO_INIT_MS;
+}
+
+static void update_rtt(rel_peer *p, long sample) {
+    if(p->srtt < 0) {
+        p->srtt = sample;
+        p->rttvar = sample/2;
+    } else {
+        long delta = (p->srtt > sample) ? p->srtt - sample : sample - p->srtt;
+        p->rttvar = (3*p->rttvar + delta)/4;
+        p->srtt = (7*p->srtt + sample)/8;
+    }
+
+    long var = 4*p->rttvar;
+    p->rto = p->srtt + ((var > RLY_TICK_MS) ? var : RLY_TICK_MS);
+    if(p->rto < RLY_RTO_MIN_MS) {
+        p->rto = RLY_RTO_MIN_MS;
+    } else if(p->rto > RLY_RTO_MAX_MS) {
+        p->rto = RLY_RTO_MAX_MS;
+    }
+}
+
+rel_packet *rel_send(rel_peer *p, const message *msg, long now) {
+    if(rel_in_flight(p) >= RLY_WINDOW) {
+        return NULL;
+    }
+    if(p->snd == NULL) {
+        p->snd = calloc(RLY_WINDOW, sizeof(rel_slot));
+    }
+
+    rel_slot *slot = &(p->snd[p->snd_next % RLY_WINDOW]);
+    slot->pkt.type = PKT_RELIABLE;
+    slot->pkt.session = p->session;
+    slot->pkt.seq = p->snd_next;
+    memcpy(&(slot->pkt.msg), msg, sizeof(message));
+    slot->sent_at = now;
+    slot->deadline = now + p->rto;
+    slot->retries = 0;
+    slot->in_use = true;
+
+    p->snd_next++;
+    return &(slot->pkt);
+}
+
+int rel_queue(rel_peer *p, const message *msg) {
+    if(p->backlog_count >= RLY_BACKLOG) {
+        return -1;
+    }
+
+    if(p->backlog == NULL) {
+        p->backlog = malloc(sizeof(message)*RLY_BACKLOG);
+        p->backlog_head = 0;
+    }
+
+    int idx = (p->backlog_head + p->backlog_count) % RLY_BACKLOG;
+    memcpy(&(p->backlog[idx]), msg, sizeof(message));
+    p->backlog_count++;
+    return 0;
+}
+
+int rel_flush(rel_peer *p, long now, rel_packet **out) {
+    int count = 0;
+    while(p->backlog_count > 0) {
+        rel_packet *pkt = rel_send(p, &(p->backlog[p->backlog_head]), now);
+        if(pkt == NULL) {
+            break;
+        }
+
+        out[count++] = pkt;
+        p->backlog_head = (p->backlog_head + 1) % RLY_BACKLOG;
+        p->backlog_count--;
+    }
+
+    if(p->backlog_count == 0 && p->backlog != NULL) {
+        free(p->backlog);
+        p->backlog = NULL;
+    }
+
+    return count;
+}
+
+void rel_destroy(rel_peer *p) {
+    free(p->backlog);
+    p->backlog = NULL;
+    p->backlog_count = 0;
+    free(p->snd);
+    p->snd = NULL;
+    free(p->rcv);
+    p->rcv = NULL;
+    p->rcv_held = 0;
+}
+
+size_t rel_memory(const rel_peer *p) {
+    return ((p->backlog != NULL) ? sizeof(message)*RLY_BACKLOG : 0) +
+           ((p->snd != NULL) ? sizeof(rel_slot)*RLY_WINDOW : 0) + ((p->rcv != NULL) ? sizeof(rel_reorder) : 0);
+}
+
+static void ack_slot(rel_peer *p, uint32_t seq, long now) {
+    rel_slot *slot = &(p->snd[seq % RLY_WINDOW]);
+    if(slot->in_use && slot->pkt.seq == seq) {
+        /* Karn's algorithm - retransmitted packets give ambiguous samples */
+        if(slot->retries == 0) {
+            update_rtt(p, now - slot->sent_at);
+        }
+        slot->in_use = false;
+    }
+}
+
+void rel_ack(rel_peer *p, const ack_packet *ack, long now) {
+    if(ack->session != p->session || p->snd == NULL) {
+        /* nothing in flight, nothing to acknowledge */
+        return;
+    }
+
+    uint32_t cum = ack->cum_ack;
+    if(SEQ_DIFF(cum, p->snd_una) < 0 || SEQ_DIFF(cum, p->snd_next) > 0) {
+        /* stale or bogus */
+        return;
+    }
+
+    for(uint32_t seq = p->snd_una; seq != cum; seq++) {
+        ack_slot(p, seq, now);
+    }
+    p->snd_una = cum;
+
+    for(int i = 0; i < 32 && i+1 < RLY_WINDOW; i++) {
+        uint32_t seq = cum + 1 + i;
+        if(SEQ_DIFF(seq, p->snd_next) >= 0) {
+            break;
+        }
+        if(ack->sack & (1u << i)) {
+            ack_slot(p, seq, now);
+        }
+    }
+
+    while(p->snd_una != p->snd_next && !p->snd[p->snd_una % RLY_WINDOW].in_use) {
+        p->snd_una++;
+    }
+
+    /* receiver has later packets, so the hole was most likely lost - don't wait for full rto */
+    if(ack->sack != 0 && p->snd_una != p->snd_next) {
+        rel_slot *hole = &(p->snd[p->snd_una % RLY_WINDOW]);
+        long early = hole->sent_at + ((p->srtt > 0) ? p->srtt : 0) + RLY_TICK_MS;
+        if(early < hole->deadline) {
+            hole->deadline = early;
+        }
+    }
+
+    if(p->snd_una == p->snd_next) {
+        free(p->snd);
+        p->snd = NULL;
+    }
+}
+
+/* late packet of an earlier session must not throw away the current one */
+static bool new_session(const rel_peer *p, const rel_packet *pkt) {
+    if(p->rcv_session == 0) {
+        return true;
+    }
+    if(pkt->seq >= RLY_WINDOW) {
+        return false;
+    }
+    for(int k = 0; k < RLY_RETIRED; k++) {
+        if(p->rcv_retired[k] == pkt->session) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int rel_receive(rel_peer *p, const rel_packet *pkt, message *deliver, ack_packet *ack) {
+    bool stale = false;
+    if(pkt->session != p->rcv_session) {
+        if(new_session(p, pkt)) {
+            /* sender (re)started - its sequence numbers start from zero */
+            if(p->rcv_session != 0) {
+                memmove(p->rcv_retired, p->rcv_retired + 1, sizeof(uint32_t)*(RLY_RETIRED - 1));
+                p->rcv_retired[RLY_RETIRED - 1] = p->rcv_session;
+            }
+            p->rcv_session = pkt->session;
+            p->rcv_next = 0;
+            free(p->rcv);
+            p->rcv = NULL;
+            p->rcv_held = 0;
+        } else {
+            p->stale++;
+            stale = true;
+        }
+    }
+
+    int delivered = 0;
+    int32_t distance = SEQ_DIFF(pkt->seq, p->rcv_next);
+    if(stale) {
+        /* only the ack of the current session goes back, the old sender ignores it */
+    } else if(distance < 0) {
+        p->duplicates++;
+    } else if(distance == 0) {
+        /* in order, the common case - goes out without being buffered */
+        memcpy(&(deliver[delivered++]), &(pkt->msg), sizeof(message));
+        p->rcv_next++;
+    } else if(distance < RLY_WINDOW) {
+        if(p->rcv == NULL) {
+            p->rcv = calloc(1, sizeof(rel_reorder));
+        }
+        int idx = pkt->seq % RLY_WINDOW;
+        if(p->rcv->have[idx]) {
+            p->duplicates++;
+        } else {
+            p->rcv->have[idx] = true;
+            memcpy(&(p->rcv->buf[idx]), &(pkt->msg), sizeof(message));
+            p->rcv_held++;
+        }
+    }
+    /* else: beyond window, sender will retransmit it */
+
+    while(p->rcv != NULL && p->rcv->have[p->rcv_next % RLY_WINDOW]) {
+        int idx = p->rcv_next % RLY_WINDOW;
+        memcpy(&(deliver[delivered++]), &(p->rcv->buf[idx]), sizeof(message));
+        p->rcv->have[idx] = false;
+        p->rcv_held--;
+        p->rcv_next++;
+    }
+
+    ack->type = PKT_ACK;
+    ack->session = p->rcv_session;
+    ack->cum_ack = p->rcv_next;
+    ack->sack = 0;
+    for(int i = 0; i < 32 && i+1 < RLY_WINDOW && p->rcv != NULL; i++) {
+        if(p->rcv->have[(p->rcv_next + 1 + i) % RLY_WINDOW]) {
+            ack->sack |= (1u << i);
+        }
+    }
+
+    if(p->rcv != NULL && p->rcv_held == 0) {
+        free(p->rcv);
+        p->rcv = NULL;
+    }
+    return delivered;
+}
+
+int rel_in_flight(rel_peer *p) {
+    return (int)(p->snd_next - p->snd_una);
+}
+
+long rel_next_timeout(rel_peer *p, long now) {
+    long earliest = -1;
+    for(uint32_t seq = p->snd_una; seq != p->snd_next; seq++) {
+        rel_slot *slot = &(p->snd[seq % RLY_WINDOW]);
+        if(slot->in_use && (earliest == -1 || slot->deadline < earliest)) {
+            earliest = slot->deadline;
+        }
+    }
+
+    if(earliest == -1) {
+        return -1;
+    }
+    return (earliest > now) ? earliest - now : 0;
+}
+
+int rel_retransmit(rel_peer *p, long now, rel_packet **out) {
+    int count = 0;
+    for(uint32_t seq = p->snd_una; seq != p->snd_next; seq++) {
+        rel_slot *slot = &(p->snd[seq % RLY_WINDOW]);
+        if(!slot->in_use || slot->deadline > now) {
+            continue;
+        }
+
+        if(slot->retries >= RLY_MAX_RETRIES) {
+            return -1;
+        }
+
+        slot->retries++;
+        long backoff = p->rto << slot->retries;
+        slot->deadline = now + ((backoff < RLY_RTO_MAX_MS) ? backoff : RLY_RTO_MAX_MS);
+        slot->sent_at = now;
+        p->retransmits++;
+        out[count++] = &(slot->pkt);
+    }
+
+    return count;
+}
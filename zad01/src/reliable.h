@@ -0,0 +1,102 @@
+#ifndef MAKEFILE_RELIABLE_H
+#define MAKEFILE_RELIABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "message.h"
+
+/*
+ * Optional reliability layer on top of datagram sockets.
+ * Every peer keeps a sending half (sequence numbers, bounded retransmit window, rtt estimate)
+ * and a receiving half (cumulative + selective ack state, reorder buffer), so messages are
+ * delivered in order and at least once. Times are in milliseconds (see rel_now_ms()).
+ * Window, backlog and reorder buffer are allocated only while they hold something, so an idle
+ * peer is little more than its sequence numbers.
+ */
+
+typedef struct {
+    rel_packet pkt;
+    long sent_at;
+    long deadline;
+    int retries;
+    bool in_use;
+} rel_slot;
+
+typedef struct {
+    bool have[RLY_WINDOW];
+    message buf[RLY_WINDOW];
+} rel_reorder;
+
+typedef struct {
+    /* sending half */
+    uint32_t session;
+    uint32_t snd_una;
+    uint32_t snd_next;
+    rel_slot *snd;  /* RLY_WINDOW of them, NULL while nothing is in flight */
+    long srtt;      /* < 0 until first sample */
+    long rttvar;
+    long rto;
+    message *backlog; /* ring of RLY_BACKLOG, NULL while empty */
+    int backlog_head;
+    int backlog_count;
+
+    /* receiving half */
+    uint32_t rcv_session;
+    uint32_t rcv_next;
+    rel_reorder *rcv; /* NULL while nothing waits for an earlier packet */
+    int rcv_held;
+    uint32_t rcv_retired[RLY_RETIRED]; /* sessions rcv_session replaced, latest last */
+
+    unsigned long retransmits;
+    unsigned long duplicates;
+    unsigned long stale;            /* dropped packets of other sessions */
+} rel_peer;
+
+long rel_now_ms();
+
+void rel_init(rel_peer *p);
+
+/* stores message in retransmit window; returns packet to transmit or NULL when window is full */
+rel_packet *rel_send(rel_peer *p, const message *msg, long now);
+
+/*
+ * Alternative to rel_send() for senders which can't hold messages back themselves:
+ * rel_queue() puts message in the backlog (-1 when it's full, peer should be dropped),
+ * rel_flush() moves backlog into free window slots and returns packets to transmit
+ * (out needs room for RLY_WINDOW entries). Call rel_flush() after every rel_ack() too.
+ */
+int rel_queue(rel_peer *p, const message *msg);
+int rel_flush(rel_peer *p, long now, rel_packet **out);
+
+void rel_destroy(rel_peer *p);
+
+/* heap bytes p holds beyond itself */
+size_t rel_memory(const rel_peer *p);
+
+/*
+ * Processes incoming data packet. Messages which became deliverable (in order) are copied to
+ * deliver (which must have room for RLY_WINDOW entries); returns their count.
+ * Ack which should be sent back is stored in ack. A packet of another session starts it over
+ * only when it can be the start of a restarted sender's stream (seq within the first window)
+ * and its session wasn't replaced before; other ones are late and dropped.
+ */
+int rel_receive(rel_peer *p, const rel_packet *pkt, message *deliver, ack_packet *ack);
+
+void rel_ack(rel_peer *p, const ack_packet *ack, long now);
+
+/* number of messages waiting for ack */
+int rel_in_flight(rel_peer *p);
+
+/* ms until earliest retransmission is due, -1 if nothing is in flight */
+long rel_next_timeout(rel_peer *p, long now);
+
+/*
+ * Collects packets whose retransmission timer expired into out (room for RLY_WINDOW entries).
+ * Returns their count or -1 when some packet exceeded RLY_MAX_RETRIES (peer should be dropped).
+ */
+int rel_retransmit(rel_peer *p, long now, rel_packet **out);
+
+#endif //MAKEFILE_RELIABLE_H
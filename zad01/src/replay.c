@@ -0,0 +1,427 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "session.h"
+#include "capture.h"
+
+#define EXIT() exit(1)
+#define SEND_RETRIES 100 /* loop runs a full session queue gets before its message counts as dropped */
+
+/*
+ * Plays a capture (server's -C) back against a server: one session per captured source, named
+ * after the first sender it had, sending the captured texts at captured times scaled by speed
+ * (or as fast as it can). First session also times delivery: every message it sees from a sender
+ * is matched with the oldest one that sender still waits for with the same text.
+ */
+
+typedef struct {
+    double speed;                 /* 0 - as fast as possible */
+    int sock_type;                /* -1 - transport of the capture */
+    long wait_ms;
+    char *path;
+    session_address address;
+} replay_arguments;
+
+/* sent by one username and not seen back yet */
+typedef struct {
+    char name[USERNAME_MAX + 1];
+    long *sent_us;
+    uint32_t *hashes;
+    int head;
+    int count;
+} replay_sender;
+
+replay_arguments args;
+capture_reader reader;
+session_loop *loop;
+
+session **sessions;
+int *source_sender;              /* source -> its sender */
+int source_count = 0;
+replay_sender *senders;
+int sender_count = 0;
+
+unsigned long connected = 0;
+unsigned long lost = 0;
+unsigned long replayed = 0;
+unsigned long dropped = 0;
+unsigned long matched = 0;
+unsigned long unmatched = 0;
+unsigned long skipped = 0;       /* sent, but never seen back */
+
+long *latency;
+unsigned long latency_capacity = 0;
+
+volatile sig_atomic_t should_exit = 0;
+
+void print_usage() {
+    printf("Usage: replay [options] <capture> <l|r> <unix_socket_path|ip> [port]\n"
+           "  -s, --speed <x>     1 - as captured (default), 10 - ten times faster, 0 - as fast as possible\n"
+           "  -t, --tcp           connect to TCP server (zad02), default: transport of the capture\n"
+           "  -u, --udp           connect to UDP server (zad01)\n"
+           "  -w, --wait-ms <ms>  how long to keep receiving after the last message (default 1000)\n");
+}
+
+void process_arguments(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"speed", required_argument, NULL, 's'},
+        {"tcp", no_argument, NULL, 't'},
+        {"udp", no_argument, NULL, 'u'},
+        {"wait-ms", required_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0}
+    };
+
+    args.speed = 1.0;
+    args.sock_type = -1;
+    args.wait_ms = 1000;
+
+    int opt;
+    while((opt = getopt_long(argc, argv, "+s:tuw:", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 's':
+                args.speed = strtod(optarg, NULL);
+                if(args.speed < 0) {
+                    printf("Speed must not be negative\n");
+                    EXIT();
+                }
+                break;
+            case 't':
+                args.sock_type = SOCK_STREAM;
+                break;
+            case 'u':
+                args.sock_type = SOCK_DGRAM;
+                break;
+            case 'w':
+                args.wait_ms = strtol(optarg, NULL, 10);
+                if(args.wait_ms < 0) {
+                    printf("Wait must not be negative\n");
+                    EXIT();
+                }
+                break;
+            default:
+                print_usage();
+                EXIT();
+        }
+    }
+
+    /* positional arguments keep their indexes */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if(argc < 4) {
+        printf("Too few arguments\n");
+        print_usage();
+        EXIT();
+    }
+
+    args.path = argv[1];
+    const char *error = session_resolve(argv[2][0], argv[3], (argc > 4) ? argv[4] : NULL, &(args.address));
+    if(error != NULL) {
+        printf("%s\n", error);
+        EXIT();
+    }
+}
+
+/* every session needs a descriptor */
+void raise_fd_limit(int sessions) {
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    rlim_t needed = (rlim_t)sessions + 16;
+    if(limit.rlim_cur < needed) {
+        limit.rlim_cur = (limit.rlim_max < needed) ? limit.rlim_max : needed;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+uint32_t text_hash(const char *text) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for(int k = 0; k < MSG_LEN_MAX && text[k] != '\0'; k++) {
+        hash = (hash ^ (unsigned char)text[k])*16777619u;
+    }
+    return hash;
+}
+
+/* -1 when name isn't known */
+int find_sender(const char *name) {
+    for(int k = 0; k < sender_count; k++) {
+        if(strncmp(senders[k].name, name, USERNAME_MAX) == 0) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/* first pass: sources and the name each will send as */
+void read_sources() {
+    long at_us;
+    int source;
+    message msg;
+    int result;
+    int capacity = 0;
+    while((result = capture_read(&reader, &at_us, &source, &msg)) == 1) {
+        if(source < source_count) {
+            continue;
+        }
+        if(reader.sources > capacity) {
+            capacity = 2*reader.sources;
+            source_sender = realloc(source_sender, sizeof(int)*capacity);
+            senders = realloc(senders, sizeof(replay_sender)*capacity);
+        }
+        /* sources which never sent anything get no session */
+        while(source_count < source) {
+            source_sender[source_count++] = -1;
+        }
+        int sender = find_sender(msg.from);
+        if(sender == -1) {
+            replay_sender *s = &(senders[sender_count]);
+            memset(s, 0, sizeof(replay_sender));
+            strcpy(s->name, msg.from);
+            s->sent_us = malloc(sizeof(long)*REPLAY_INFLIGHT_MAX);
+            s->hashes = malloc(sizeof(uint32_t)*REPLAY_INFLIGHT_MAX);
+            sender = sender_count++;
+        }
+        source_sender[source_count++] = sender;
+    }
+    if(result == -1) {
+        fprintf(stderr, "Capture is cut short or malformed, replaying what's before\n");
+    }
+}
+
+/* ------------------------------- */
+
+void on_connect(session *s, void *user) {
+    (void)s;
+    (void)user;
+    connected++;
+}
+
+void on_message(session *s, const message *msg, void *user) {
+    (void)s;
+    /* everybody gets the same fan-out, first session's view is enough */
+    if((long)user != 0) {
+        return;
+    }
+
+    long now = now_us();
+    int sender = find_sender(msg->from);
+    if(sender == -1 || senders[sender].count == 0) {
+        unmatched++;
+        return;
+    }
+
+    /* the ones before it were lost or filtered out by server */
+    replay_sender *r = &(senders[sender]);
+    uint32_t hash = text_hash(msg->msg);
+    for(int k = 0; k < r->count; k++) {
+        int pos = (r->head + k) % REPLAY_INFLIGHT_MAX;
+        if(r->hashes[pos] == hash) {
+            if(matched == latency_capacity) {
+                latency_capacity = (latency_capacity == 0) ? 1024 : 2*latency_capacity;
+                latency = realloc(latency, sizeof(long)*latency_capacity);
+            }
+            latency[matched++] = now - r->sent_us[pos];
+            skipped += k;
+            r->head = (pos + 1) % REPLAY_INFLIGHT_MAX;
+            r->count -= k + 1;
+            return;
+        }
+    }
+    unmatched++;
+}
+
+void on_close(session *s, void *user) {
+    (void)s;
+    long idx = (long)user;
+    sessions[idx] = NULL;
+    lost++;
+}
+
+void remember_sent(int sender, const char *text, long sent_us) {
+    replay_sender *r = &(senders[sender]);
+    if(r->count == REPLAY_INFLIGHT_MAX) {
+        /* the oldest one isn't coming any more */
+        r->head = (r->head + 1) % REPLAY_INFLIGHT_MAX;
+        r->count--;
+        skipped++;
+    }
+    int pos = (r->head + r->count) % REPLAY_INFLIGHT_MAX;
+    r->sent_us[pos] = sent_us;
+    r->hashes[pos] = text_hash(text);
+    r->count++;
+}
+
+void send_captured(int source, const message *msg) {
+    if(source >= source_count || source_sender[source] == -1) {
+        dropped++;
+        return;
+    }
+
+    /* a lost session is gone after the loop runs */
+    long sent_us;
+    for(int tries = 0; ; tries++) {
+        if(sessions[source] == NULL || tries > SEND_RETRIES) {
+            dropped++;
+            return;
+        }
+        sent_us = now_us();
+        if(session_send(sessions[source], msg->msg) == 0) {
+            break;
+        }
+        session_loop_run(loop, 0);
+    }
+    remember_sent(source_sender[source], msg->msg, sent_us);
+    replayed++;
+}
+
+int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+void interrupt(int sig) {
+    (void)sig;
+    should_exit = 1;
+}
+
+/* ------------------------------- */
+
+int main(int argc, char **argv) {
+    process_arguments(argc, argv);
+
+    if(capture_read_open(&reader, args.path) == -1) {
+        printf("Cannot read capture %s\n", args.path);
+        EXIT();
+    }
+    read_sources();
+    capture_read_close(&reader);
+    if(sender_count == 0) {
+        printf("No messages in capture\n");
+        EXIT();
+    }
+    int sock_type = (args.sock_type != -1) ? args.sock_type :
+                    ((reader.transport == CAPTURE_TCP) ? SOCK_STREAM : SOCK_DGRAM);
+    raise_fd_limit(source_count);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    loop = session_loop_create();
+    if(loop == NULL) {
+        perror("Cannot create event loop");
+        EXIT();
+    }
+
+    /* session 0 is the one timing delivery, so it must exist */
+    session_callbacks callbacks = {on_connect, on_message, on_close};
+    sessions = calloc(sizeof(session*), source_count);
+    int opened = 0;
+    for(long i = 0; i < source_count; i++) {
+        if(source_sender[i] == -1 && i > 0) {
+            continue;
+        }
+        const char *username = (source_sender[i] != -1) ? senders[source_sender[i]].name : "replay";
+        sessions[i] = session_open(loop, &(args.address), sock_type, username, &callbacks, (void*)i);
+        for(int retries = 0; sessions[i] == NULL && errno == EAGAIN && retries < 100; retries++) {
+            /* server hasn't accepted earlier connections yet */
+            session_loop_run(loop, 10);
+            sessions[i] = session_open(loop, &(args.address), sock_type, username, &callbacks, (void*)i);
+        }
+        if(sessions[i] == NULL) {
+            perror("Cannot open session");
+            EXIT();
+        }
+        opened++;
+    }
+
+    /* messages are sent only once every session is up, so nobody misses the beginning */
+    while(!should_exit && connected + lost < (unsigned long)opened) {
+        session_loop_run(loop, 1000);
+    }
+
+    if(capture_read_open(&reader, args.path) == -1) {
+        printf("Cannot read capture %s\n", args.path);
+        EXIT();
+    }
+
+    long start = now_us();
+    long captured_us = 0;
+    long at_us;
+    int source;
+    message msg;
+    while(!should_exit && capture_read(&reader, &at_us, &source, &msg) == 1) {
+        captured_us = at_us;
+        if(args.speed > 0) {
+            long due = start + (long)(at_us/args.speed);
+            long now;
+            while(!should_exit && (now = now_us()) < due) {
+                long left_ms = (due - now)/1000;
+                session_loop_run(loop, (left_ms > 0) ? (int)left_ms : 0);
+            }
+        } else {
+            session_loop_run(loop, 0);
+        }
+        send_captured(source, &msg);
+    }
+    capture_read_close(&reader);
+    long replayed_us = now_us() - start;
+
+    long quiet_since = now_us();
+    unsigned long last_received = session_loop_stats(loop).received;
+    while(!should_exit && session_loop_count(loop) > 0 && now_us() - quiet_since < args.wait_ms*1000L) {
+        session_loop_run(loop, 100);
+        unsigned long received = session_loop_stats(loop).received;
+        if(received != last_received) {
+            quiet_since = now_us();
+            last_received = received;
+        }
+    }
+    for(int k = 0; k < sender_count; k++) {
+        skipped += senders[k].count;
+    }
+
+    /* waiting for stragglers doesn't count */
+    long elapsed_us = quiet_since - start;
+    session_stats stats = session_loop_stats(loop);
+    fprintf(stderr, "Capture: %d sources (%d senders), %.3f s; replayed at %s in %.3f s\n",
+            source_count, sender_count, captured_us/1e6,
+            (args.speed > 0) ? "given speed" : "full speed", replayed_us/1e6);
+    fprintf(stderr, "Sessions: %d, connected: %lu, lost: %lu\n", opened, connected, lost);
+    fprintf(stderr, "Messages: %lu sent (%.0f msg/s), dropped (queues full or session gone): %lu\n",
+            replayed, (replayed_us > 0) ? replayed*1e6/replayed_us : 0.0, dropped);
+    fprintf(stderr, "Received: %lu in %.3f s (%.0f msg/s), heartbeats: %lu\n", stats.received, elapsed_us/1e6,
+            (elapsed_us > 0) ? stats.received*1e6/elapsed_us : 0.0, stats.heartbeats);
+    fprintf(stderr, "Delivery to first session: %lu timed, %lu never seen, %lu not matched\n",
+            matched, skipped, unmatched);
+    if(matched > 0) {
+        qsort(latency, matched, sizeof(long), compare_longs);
+        fprintf(stderr, "Delivery latency us: min %ld, p50 %ld, p90 %ld, p99 %ld, max %ld\n", latency[0],
+                latency[matched/2], latency[matched*9/10], latency[matched*99/100], latency[matched - 1]);
+    }
+
+    session_loop_destroy(loop);
+    free(sessions);
+
+    return 0;
+}
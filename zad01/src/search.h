@@ -0,0 +1,53 @@
+#ifndef MAKEFILE_SEARCH_H
+#define MAKEFILE_SEARCH_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "message.h"
+
+/*
+ * Message history and full-text search over it (server's -L). Plain messages go to
+ * "<dir>/history.log" (records of 1-byte lengths plus sender and text bytes; n-th record is
+ * message n) and to an inverted index: every term (lowercased run of letters and digits) has
+ * a posting list of message numbers, kept as varint deltas. On start the index is rebuilt from
+ * the log.
+ *
+ * Everything happens on a search thread: event loop only queues accepted messages and queries,
+ * and collects results. A query "/search word word ..." finds messages with all the words; the
+ * one who asked gets "<hits> hits for: <query>" from SEARCH_SENDER, then the newest
+ * SEARCH_RESULTS_MAX of them (oldest first) as "#<number> <text>" from their senders.
+ */
+
+#define SEARCH_REQUEST "/search "
+#define SEARCH_SENDER "?"
+
+extern bool searchRunning;
+
+/* opens (and indexes) history in dir, creating it if needed; -1 (errno set) on failure */
+int search_start(const char *dir);
+
+/* waits until everything queued so far is in history */
+void search_drain();
+
+/* indexes everything queued and stops */
+void search_stop();
+
+/* false when search thread is too far behind (message isn't in history) */
+bool search_add(const message *msg);
+
+/* query is what follows SEARCH_REQUEST; answer goes to name */
+void search_query(const char *name, const char *query);
+
+/* queries which weren't collected yet */
+int search_waiting();
+
+/*
+ * Takes one answered query: name is set (USERNAME_MAX + 1 bytes), messages (malloc'ed, caller
+ * frees) are returned in *msgs. Returns their number, -1 - none ready.
+ */
+int search_collect(char *name, message **msgs);
+
+void search_report(FILE *out);
+
+#endif //MAKEFILE_SEARCH_H
@@ -10,6 +10,8 @@
 #include <ctype.h>
 #include <limits.h>
 #include <sys/time.h>
+#include <time.h>
+#include <getopt.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -19,34 +21,230 @@
 #include <sys/un.h>
 
 #include "message.h"
-#include "sockaddr_cmp.h"
+#include "reliable.h"
+#include "clients.h"
+#include "tuning.h"
+#include "trace.h"
+#include "handoff.h"
+#include "stages.h"
+#include "ratelimit.h"
+#include "topics.h"
+#include "presence.h"
+#include "mailbox.h"
+#include "search.h"
+#include "capture.h"
+#include "sockbuf.h"
 
 //#define IP_ADDR htonl(INADDR_ANY)
 //#define PORT 2507
 
 /*#define SS_BACKLOG 16*/
 /*#define UNIX_ADDR "./unix_socket"*/
-#define INIT_CLIENTS 2
 
 typedef struct {
     struct sockaddr_un unix_socket_addr;
-    struct sockaddr_in inet_socket_addr;
+    struct sockaddr_storage inet_socket_addr;   /* IPv4 or IPv6 */
+    socklen_t inet_socket_size;
     char *hr_up;
     char *hr_ip;
     char *hr_p;
+    int heartbeat_ms;
+    tuning_options tuning;
+    sockbuf_options buffers;
+    bool trace;
+    char *trace_path;
+    int trace_sample;
+    char *handoff_path;
+    int coalesce_ms;
+    int fanout_threads;
+    rate_limit conn_limit;
+    rate_limit user_limit;
+    char *mailbox_dir;
+    char *history_dir;
+    char *capture_path;
 } application_arguments;
 
 application_arguments prog_args;
 
+void print_usage() {
+    printf("Usage: server [options] <unix_socket_path> <ip> <port>\n"
+           "  -H, --heartbeat-ms <ms>  heartbeat interval advertised to clients (default %d)\n"
+           "  -c, --cpus <list>        pin event loop to cpus, e.g. 2 or 0,2-3\n"
+           "  -B, --busy-poll-us <us>  SO_BUSY_POLL on the inet socket\n"
+           "  -S, --spin-us <us>       spin that long before sleeping in poll()\n"
+           "  -R, --rcvbuf <bytes>[:max]  receive buffer of both sockets (k, m suffixes); with max it\n"
+           "                           doubles up to max while the kernel keeps dropping datagrams\n"
+           "  -Q, --sndbuf <bytes>     send buffer of both sockets\n"
+           "  -T, --trace              per-stage latency histograms (printed on SIGUSR1 and at exit)\n"
+           "  -F, --trace-file <path>  also write sampled message traces (Chrome trace format), implies -T\n"
+           "  -N, --trace-sample <n>   trace every n-th message to the file (default %d)\n"
+           "  -X, --handoff <path>     hot restart: take over from server listening at path, if any,\n"
+           "                           then listen there for a successor\n"
+           "  -W, --coalesce-ms <ms>   hold messages up to that long and send them to each client\n"
+           "                           in one datagram (up to %d per datagram, default 0 - off)\n"
+           "  -P, --fanout-threads <n> send to plain clients from n worker threads, main thread only\n"
+           "                           receives (up to %d, default 0 - main thread sends too)\n"
+           "  -r, --rate <n>[:burst]   messages a second one client may send, excess is dropped\n"
+           "                           (burst defaults to n; reliable clients resend it later)\n"
+           "  -u, --user-rate <n>[:burst]  the same per username, whichever address it comes from\n"
+           "  -M, --mailbox <dir>      keep messages for users who are offline in dir, deliver them\n"
+           "                           when user is back\n"
+           "  -L, --history <dir>      keep history of messages in dir, searchable with\n"
+           "                           \"/search <words>\"\n"
+           "  -C, --capture <path>     record every received message with its time and address to path,\n"
+           "                           for replay (see replay)\n"
+           "<ip> may be IPv4 or IPv6; an IPv6 one (:: for any) takes IPv4 clients as well.\n"
+           "Messages \"@<topic> <text>\" go only to clients which sent \"/sub <pattern>\" with a matching\n"
+           "pattern (levels split by dots, * - one level, # at the end - any number of them).\n",
+           HB_DEFAULT_MS, TRACE_SAMPLE_DEFAULT, COALESCE_MAX, STAGE_WORKERS_MAX);
+}
+
 /*
- * Order of arguments:
+ * Options go first, then in order:
  * - unix port name
  * - ip
  * - port
  */
 void process_application_arguments(int argc, char **argv, application_arguments *args) {
-    if(argc < 3) {
+    static struct option long_options[] = {
+        {"heartbeat-ms", required_argument, NULL, 'H'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"busy-poll-us", required_argument, NULL, 'B'},
+        {"spin-us", required_argument, NULL, 'S'},
+        {"rcvbuf", required_argument, NULL, 'R'},
+        {"sndbuf", required_argument, NULL, 'Q'},
+        {"trace", no_argument, NULL, 'T'},
+        {"trace-file", required_argument, NULL, 'F'},
+        {"trace-sample", required_argument, NULL, 'N'},
+        {"handoff", required_argument, NULL, 'X'},
+        {"coalesce-ms", required_argument, NULL, 'W'},
+        {"fanout-threads", required_argument, NULL, 'P'},
+        {"rate", required_argument, NULL, 'r'},
+        {"user-rate", required_argument, NULL, 'u'},
+        {"mailbox", required_argument, NULL, 'M'},
+        {"history", required_argument, NULL, 'L'},
+        {"capture", required_argument, NULL, 'C'},
+        {NULL, 0, NULL, 0}
+    };
+
+    args->heartbeat_ms = HB_DEFAULT_MS;
+    tuning_defaults(&(args->tuning));
+    memset(&(args->buffers), 0, sizeof(sockbuf_options));
+    args->trace = false;
+    args->trace_path = NULL;
+    args->trace_sample = TRACE_SAMPLE_DEFAULT;
+    args->handoff_path = NULL;
+    args->coalesce_ms = 0;
+    args->fanout_threads = 0;
+    args->conn_limit.rate = 0;
+    args->user_limit.rate = 0;
+    args->mailbox_dir = NULL;
+    args->history_dir = NULL;
+    args->capture_path = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+H:c:B:S:R:Q:TF:N:X:W:P:r:u:M:L:C:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                args->heartbeat_ms = (int)strtol(optarg, NULL, 10);
+                if (args->heartbeat_ms < HB_MIN_MS || args->heartbeat_ms > HB_MAX_MS) {
+                    printf("Heartbeat interval must be within [%d, %d] ms\n", HB_MIN_MS, HB_MAX_MS);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                if (tuning_parse_cpus(optarg, &(args->tuning.cpus)) == -1) {
+                    printf("Wrong cpu list\n");
+                    exit(1);
+                }
+                args->tuning.pin = true;
+                break;
+            case 'B':
+                args->tuning.busy_poll_us = (int)strtol(optarg, NULL, 10);
+                if (args->tuning.busy_poll_us < 0) {
+                    printf("Busy poll time must not be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'S':
+                args->tuning.spin_us = strtol(optarg, NULL, 10);
+                if (args->tuning.spin_us < 0 || args->tuning.spin_us >= 1000000) {
+                    printf("Spin time must be within [0, 1000000) us\n");
+                    exit(1);
+                }
+                break;
+            case 'R':
+                if (sockbuf_parse(optarg, &(args->buffers.rcvbuf), &(args->buffers.rcvbuf_max)) == -1) {
+                    printf("Receive buffer must be <bytes>[:max], max not below bytes\n");
+                    exit(1);
+                }
+                break;
+            case 'Q':
+                if (sockbuf_parse(optarg, &(args->buffers.sndbuf), NULL) == -1) {
+                    printf("Send buffer must be <bytes>\n");
+                    exit(1);
+                }
+                break;
+            case 'T':
+                args->trace = true;
+                break;
+            case 'F':
+                args->trace = true;
+                args->trace_path = optarg;
+                break;
+            case 'N':
+                args->trace_sample = (int)strtol(optarg, NULL, 10);
+                if (args->trace_sample <= 0) {
+                    printf("Trace sampling must be positive\n");
+                    exit(1);
+                }
+                break;
+            case 'X':
+                args->handoff_path = optarg;
+                break;
+            case 'W':
+                args->coalesce_ms = (int)strtol(optarg, NULL, 10);
+                if (args->coalesce_ms < 0 || args->coalesce_ms > COALESCE_WINDOW_MAX_MS) {
+                    printf("Coalescing window must be within [0, %d] ms\n", COALESCE_WINDOW_MAX_MS);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                args->fanout_threads = (int)strtol(optarg, NULL, 10);
+                if (args->fanout_threads < 0 || args->fanout_threads > STAGE_WORKERS_MAX) {
+                    printf("Number of fan-out threads must be within [0, %d]\n", STAGE_WORKERS_MAX);
+                    exit(1);
+                }
+                break;
+            case 'r':
+            case 'u':
+                if (rate_parse(optarg, (opt == 'r') ? &(args->conn_limit) : &(args->user_limit)) == -1) {
+                    printf("Rate must be <n>[:burst], both positive\n");
+                    exit(1);
+                }
+                break;
+            case 'M':
+                args->mailbox_dir = optarg;
+                break;
+            case 'L':
+                args->history_dir = optarg;
+                break;
+            case 'C':
+                args->capture_path = optarg;
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
+    /* positional arguments keep their indexes */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if(argc < 4) {
         printf("Too few argument, 3 required: <unix_socket_path> <ip> <port>\n");
+        print_usage();
         exit(1);
     }
 
@@ -68,9 +266,15 @@ void process_application_arguments(int argc, char **argv, application_arguments
     strcpy(args->unix_socket_addr.sun_path, unix_socket_path);
 
     /* internet domain socket */
-    args->inet_socket_addr.sin_family = AF_INET;
-    int ret = inet_pton(AF_INET, argv[2], &(args->inet_socket_addr.sin_addr));
-    if(ret != 1) {
+    struct sockaddr_in *inet_addr = (struct sockaddr_in *)&(args->inet_socket_addr);
+    struct sockaddr_in6 *inet6_addr = (struct sockaddr_in6 *)&(args->inet_socket_addr);
+    if(inet_pton(AF_INET, argv[2], &(inet_addr->sin_addr)) == 1) {
+        inet_addr->sin_family = AF_INET;
+        args->inet_socket_size = sizeof(struct sockaddr_in);
+    } else if(inet_pton(AF_INET6, argv[2], &(inet6_addr->sin6_addr)) == 1) {
+        inet6_addr->sin6_family = AF_INET6;
+        args->inet_socket_size = sizeof(struct sockaddr_in6);
+    } else {
         printf("Wrong IP format\n");
         exit(1);
     }
@@ -80,12 +284,14 @@ void process_application_arguments(int argc, char **argv, application_arguments
         printf("Wrong port\n");
         exit(1);
     }
-    args->inet_socket_addr.sin_port = htons((in_port_t)unvalidated_port);
+    /* port is at the same place in both */
+    inet_addr->sin_port = htons((in_port_t)unvalidated_port);
 }
 
 /* -------------------------------------- */
 
 volatile bool loop = true;
+volatile sig_atomic_t reportRequested = 0;
 
 void sigint_handler(int signo) {
     char msg[] = "\nSIGINT received...\n";
@@ -93,85 +299,234 @@ void sigint_handler(int signo) {
     loop = false;
 }
 
+void sigusr1_handler(int signo) {
+    (void)signo;
+    reportRequested = 1;
+}
+
+/* -------------------------------------- */
+
 /*
- * Make it a struct!
+ * Coalescing window: first message opens it, it closes after coalesce_ms or when it's full, and
+ * then every client gets everything in one datagram. Messages' trace "log" stage includes the wait.
  */
-int clientCapacity = 0;
-struct sockaddr **clientTab = NULL;
-socklen_t *clientSizes = NULL;
-int *clientDesc = NULL;
-long *clientLastHeardOf = NULL;
-int clientIterator = 0;
-
-long curr_time() {
-    struct timeval tm;
-    gettimeofday(&tm, NULL);
-
-    return tm.tv_sec;
+batch_packet pending;
+trace_record pendingTrace[COALESCE_MAX];
+long pendingDeadline = 0;
+unsigned long coalescedMessages = 0;
+unsigned long coalescedDatagrams = 0;
+
+void flushPending() {
+    if (pending.count == 0) {
+        return;
+    }
+
+    for (int k = 0; k < pending.count; k++) {
+        TRACE_STAMP(&pendingTrace[k], TRACE_FANOUT);
+    }
+    int recipients = broadcastBatch(&pending);
+    for (int k = 0; k < pending.count; k++) {
+        pendingTrace[k].recipients = recipients;
+        TRACE_STAMP(&pendingTrace[k], TRACE_SENT);
+        TRACE_END(&pendingTrace[k], pending.msgs[k].from);
+    }
+
+    coalescedMessages += pending.count;
+    coalescedDatagrams++;
+    pending.count = 0;
+}
+
+/* sends message to everybody right away, or parks it in the coalescing window */
+void fanOut(message *msg, trace_record *trace) {
+    if (prog_args.coalesce_ms == 0) {
+        TRACE_STAMP(trace, TRACE_FANOUT);
+        trace->recipients = broadcast(msg);
+        TRACE_STAMP(trace, TRACE_SENT);
+        TRACE_END(trace, msg->from);
+        return;
+    }
+
+    if (pending.count == 0) {
+        pendingDeadline = rel_now_ms() + prog_args.coalesce_ms;
+    }
+    memcpy(&(pending.msgs[pending.count]), msg, sizeof(message));
+    memcpy(&pendingTrace[pending.count], trace, sizeof(trace_record));
+    pending.count++;
+
+    if (pending.count == COALESCE_MAX) {
+        flushPending();
+    }
 }
 
-void addClient(struct sockaddr *cli_addr, socklen_t size, int desc) {
-    if(clientIterator >= clientCapacity) {
-        clientCapacity = (clientCapacity > 0) ? 2*clientCapacity : INIT_CLIENTS;
-        clientTab = realloc(clientTab, sizeof(struct sockaddr*)*clientCapacity);
-        clientSizes = realloc(clientSizes, sizeof(socklen_t)*clientCapacity);
-        clientDesc = realloc(clientDesc, sizeof(int)*clientCapacity);
-        clientLastHeardOf = realloc(clientLastHeardOf, sizeof(long)*clientCapacity);
+void coalesceReport() {
+    if (prog_args.coalesce_ms > 0) {
+        printf("Coalesced %lu messages into %lu datagrams per client\n", coalescedMessages, coalescedDatagrams);
     }
+}
+
+/* snapshot to client which asked, from now on it gets deltas too */
+void sendRoster(int cid) {
+    topics_subscribe(cid, PRESENCE_TOPIC);
 
-    clientTab[clientIterator] = cli_addr;
-    clientSizes[clientIterator] = size;
-    clientDesc[clientIterator] = desc;
-    clientLastHeardOf[clientIterator] = curr_time();
+    message *records;
+    int count = presence_snapshot(&records);
+    for (int k = 0; k < count; k++) {
+        multicast(&records[k], &cid, 1);
+    }
+    free(records);
+}
 
-    clientIterator++;
+/* joins and leaves since the last batch, to everybody who asked for roster */
+void flushPresence() {
+    message *records;
+    int count = presence_deltas(&records);
+    int watchers;
+    const int *cids = topics_match(PRESENCE_TOPIC, &watchers);
+    for (int k = 0; k < count; k++) {
+        multicast(&records[k], cids, watchers);
+    }
+    free(records);
 }
 
-int clientPresent(struct sockaddr *cli_addr) {
-    for(int i = 0; i < clientIterator; i++) {
-        if(clientTab[i] != NULL && sockaddr_cmp(cli_addr, clientTab[i]) == 0) {
-            return i;
+/* mailboxes read for users who came back go to them, or back if they're gone again */
+void collectMail() {
+    char name[USERNAME_MAX + 1];
+    message *msgs;
+    int count;
+    while ((count = mailbox_collect(name, &msgs)) != -1) {
+        int cid = clientNamed(name);
+        if (cid == -1) {
+            mailbox_return(name, msgs, count);
+            continue;
+        }
+        for (int k = 0; k < count; k++) {
+            multicast(&msgs[k], &cid, 1);
         }
+        if (count > 0) {
+            printf("Delivered %d messages kept for %s\n", count, name);
+        }
+        free(msgs);
     }
+}
 
-    return -1;
+/* answers to searches, for whoever asked (if still there) */
+void collectAnswers() {
+    char name[USERNAME_MAX + 1];
+    message *msgs;
+    int count;
+    while ((count = search_collect(name, &msgs)) != -1) {
+        int cid = clientNamed(name);
+        for (int k = 0; k < count && cid != -1; k++) {
+            multicast(&msgs[k], &cid, 1);
+        }
+        free(msgs);
+    }
 }
 
-int main(int argc, char **argv) {
-    process_application_arguments(argc, argv, &prog_args);
+/* roster requests, searches, topic commands are handled here (see topics.h), everything else fans out */
+void route(int cid, message *msg, trace_record *trace) {
+    /* sender may have been dropped by an earlier fan-out */
+    bool present = CLIENT_LIVE(cid);
+    if (presence_record(msg)) {
+        /* only server sends with empty name */
+        printf("Message without sender, dropping\n");
+        return;
+    }
+    if (present) {
+        nameClient(cid, msg->from);
+    }
 
-    int recv_len, i, events, optval;
+    if (strncmp(msg->msg, PRESENCE_REQUEST, sizeof(PRESENCE_REQUEST)) == 0) {
+        if (present) {
+            sendRoster(cid);
+        }
+        return;
+    }
 
-    socklen_t how_much_for_address = 0;
-    {
-        socklen_t inet_sizeof = sizeof(struct sockaddr_in);
-        socklen_t un_sizeof = sizeof(struct sockaddr_un);
-        if (inet_sizeof > un_sizeof) {
-            how_much_for_address = inet_sizeof;
+    if (strncmp(msg->msg, SEARCH_REQUEST, strlen(SEARCH_REQUEST)) == 0) {
+        if (searchRunning) {
+            search_query(msg->from, msg->msg + strlen(SEARCH_REQUEST));
         } else {
-            how_much_for_address = un_sizeof;
+            printf("No history to search for: %s\n", msg->from);
         }
+        return;
     }
 
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = sigint_handler;
-    sigaction(SIGINT, &act, NULL);
+    char name[MSG_LEN_MAX + 1];
+    switch (topics_command(msg->msg, name)) {
+        case TOPIC_NONE:
+            mailbox_post(msg);
+            search_add(msg);
+            fanOut(msg, trace);
+            break;
+        case TOPIC_PUBLISH: {
+            /* whatever waits in the window was sent earlier */
+            flushPending();
+            int count;
+            const int *cids = topics_match(name, &count);
+            TRACE_STAMP(trace, TRACE_FANOUT);
+            trace->recipients = multicast(msg, cids, count);
+            TRACE_STAMP(trace, TRACE_SENT);
+            TRACE_END(trace, msg->from);
+            break;
+        }
+        case TOPIC_SUBSCRIBE:
+            if (present && topics_subscribe(cid, name) == 0) {
+                printf("%s subscribed to %s\n", msg->from, name);
+            }
+            break;
+        case TOPIC_UNSUBSCRIBE:
+            if (present && topics_unsubscribe(cid, name) == 0) {
+                printf("%s unsubscribed from %s\n", msg->from, name);
+            }
+            break;
+        default:
+            printf("Malformed topic from: %s\n", msg->from);
+    }
+}
 
-    message buf;
-    struct pollfd ufds[2];
-    memset(&ufds, 0, sizeof(ufds));
+/* ingress limits, checked before message is decoded or fanned out; false - drop it */
+bool admit(int cid, const message *msg, long now) {
+    if (prog_args.conn_limit.rate > 0 && !rate_take(&(clientBucket[cid]), &(prog_args.conn_limit), now)) {
+        rate_decisions[RATE_CONNECTION]++;
+        return false;
+    }
+    if (prog_args.user_limit.rate > 0 &&
+        !rate_take(rate_user(msg->from, &(prog_args.user_limit), now), &(prog_args.user_limit), now)) {
+        rate_decisions[RATE_USER]++;
+        return false;
+    }
 
-    /* create UNIX and INET sockets */
+    rate_decisions[RATE_PASSED]++;
+    return true;
+}
+
+void rateReport() {
+    if (prog_args.conn_limit.rate > 0 || prog_args.user_limit.rate > 0) {
+        rate_report(stdout, "dropped");
+    }
+}
+
+/* creates UNIX and INET sockets: sockets[0] - inet, sockets[1] - unix */
+void openSockets(int *sockets) {
     int inet_socket;
     int unix_socket;
+    int optval;
 
-    if ((inet_socket = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    if ((inet_socket = socket(prog_args.inet_socket_addr.ss_family, SOCK_DGRAM, 0)) == -1) {
         perror("socket(...) failed");
         exit(1);
     }
 
-    if (bind(inet_socket, (struct sockaddr *) &(prog_args.inet_socket_addr), sizeof(prog_args.inet_socket_addr)) == -1) {
+    /* dual stack: IPv4 clients come as IPv4-mapped IPv6 addresses */
+    optval = 0;
+    if (prog_args.inet_socket_addr.ss_family == AF_INET6 &&
+        setsockopt(inet_socket, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval)) == -1) {
+        perror("setsockopt(..., IPV6_V6ONLY, ...) failed");
+        exit(1);
+    }
+
+    if (bind(inet_socket, (struct sockaddr *) &(prog_args.inet_socket_addr), prog_args.inet_socket_size) == -1) {
         perror("bind(...) failed");
         exit(1);
     }
@@ -189,11 +544,147 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (bind(unix_socket, (struct sockaddr *) &(prog_args.unix_socket_addr), sizeof(prog_args.inet_socket_addr)) == -1) {
+    if (bind(unix_socket, (struct sockaddr *) &(prog_args.unix_socket_addr), sizeof(prog_args.unix_socket_addr)) == -1) {
         perror("bind2(...) failed");
         exit(1);
     }
 
+    sockets[0] = inet_socket;
+    sockets[1] = unix_socket;
+}
+
+/* hot restart, new process: sockets and registry of the previous one */
+void takeOver(int conn, int *sockets) {
+    handoff_state st;
+    if (handoff_receive(conn, &st) == -1) {
+        perror("handoff_receive(...) failed");
+        exit(1);
+    }
+    if (st.fd_count != 2) {
+        printf("Previous server handed over %d sockets, 2 expected\n", st.fd_count);
+        exit(1);
+    }
+
+    sockets[0] = st.fds[0];
+    sockets[1] = st.fds[1];
+    int count = loadClients(st.state, st.state_length, sockets, 2);
+    if (count == -1) {
+        printf("Malformed client registry from previous server\n");
+        exit(1);
+    }
+    printf("Took over %d clients from previous server\n", count);
+    handoff_free(&st);
+}
+
+/* hot restart, old process: true when successor has everything and we should quit */
+bool handOver(int handoffListen, int *sockets) {
+    int conn = accept4(handoffListen, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        perror("accept4(...) failed");
+        return false;
+    }
+
+    /* nothing may stay behind in the window */
+    flushPending();
+    stages_drain();
+    /* successor reads mailboxes and history as they are now */
+    mailbox_drain();
+    search_drain();
+
+    size_t length;
+    void *state = saveClients(sockets, 2, &length);
+    bool done = handoff_send(conn, sockets, 2, state, length) == 0 && handoff_wait_confirm(conn) == 0;
+    if (done) {
+        printf("Handed %d clients over to successor\n", clientIterator);
+    } else {
+        printf("Successor went away, carrying on\n");
+    }
+
+    free(state);
+    close(conn);
+    return done;
+}
+
+int main(int argc, char **argv) {
+    process_application_arguments(argc, argv, &prog_args);
+    srand(time(NULL) ^ getpid());
+
+    int recv_len, i, events;
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sigint_handler;
+    sigaction(SIGINT, &act, NULL);
+    act.sa_handler = sigusr1_handler;
+    sigaction(SIGUSR1, &act, NULL);
+
+    if (prog_args.trace && trace_init(prog_args.trace_path, prog_args.trace_sample) == -1) {
+        perror("trace_init(...) failed");
+        exit(1);
+    }
+    if (prog_args.capture_path != NULL && capture_open(prog_args.capture_path, CAPTURE_UDP) == -1) {
+        perror("capture_open(...) failed");
+        exit(1);
+    }
+
+    packet buf;
+    message delivered[RLY_WINDOW];
+    ack_packet ack;
+    struct pollfd ufds[3];
+    memset(&ufds, 0, sizeof(ufds));
+
+    /* sockets and registry come either from the previous server, or we start from scratch */
+    int sockets[2];
+    int handoffConn = -1;
+    if (prog_args.handoff_path != NULL) {
+        handoffConn = handoff_connect(prog_args.handoff_path);
+        if (handoffConn == -1 && errno != ENOENT && errno != ECONNREFUSED) {
+            perror("handoff_connect(...) failed");
+            exit(1);
+        }
+    }
+
+    /* before the registry is filled, so taken over clients get staged too */
+    if (prog_args.fanout_threads > 0 && stages_start(prog_args.fanout_threads) == -1) {
+        perror("stages_start(...) failed");
+        exit(1);
+    }
+
+    if (prog_args.mailbox_dir != NULL && mailbox_start(prog_args.mailbox_dir) == -1) {
+        perror("mailbox_start(...) failed");
+        exit(1);
+    }
+
+    if (handoffConn != -1) {
+        takeOver(handoffConn, sockets);
+    } else {
+        openSockets(sockets);
+    }
+    /* predecessor, if any, has written all its mail and history by now */
+    mailbox_scan();
+    if (prog_args.history_dir != NULL && search_start(prog_args.history_dir) == -1) {
+        perror("search_start(...) failed");
+        exit(1);
+    }
+    int inet_socket = sockets[0];
+    int unix_socket = sockets[1];
+
+    if (tuning_apply_affinity(&(prog_args.tuning)) == -1) {
+        perror("tuning_apply_affinity(...) failed");
+        exit(1);
+    }
+
+    if (tuning_apply_busy_poll(&(prog_args.tuning), inet_socket) == -1) {
+        perror("tuning_apply_busy_poll(...) failed");
+        exit(1);
+    }
+
+    const char *socketNames[2] = {"inet", "unix"};
+    if (sockbuf_setup(&(prog_args.buffers), sockets, socketNames, 2) == -1) {
+        perror("sockbuf_setup(...) failed");
+        exit(1);
+    }
+
     /* add sockets to polling queue */
     ufds[0].fd = inet_socket;
     ufds[0].events = POLLIN;
@@ -203,12 +694,100 @@ int main(int argc, char **argv) {
     ufds[1].events = POLLIN;
     ufds[1].revents = 0;
 
-    printf("Waiting for connections at %s:[%s] and %s\n", prog_args.hr_ip, prog_args.hr_p, prog_args.hr_up);
+    /* successor connects here; -1 (ignored by poll) without hot restart */
+    ufds[2].fd = -1;
+    ufds[2].events = POLLIN;
+    ufds[2].revents = 0;
+    if (prog_args.handoff_path != NULL && (ufds[2].fd = handoff_listen(prog_args.handoff_path)) == -1) {
+        perror("handoff_listen(...) failed");
+        exit(1);
+    }
 
-    struct sockaddr *cli_addr = NULL;
+    /* only now the previous server may go */
+    if (handoffConn != -1) {
+        if (handoff_confirm(handoffConn) == -1) {
+            perror("handoff_confirm(...) failed");
+            exit(1);
+        }
+        close(handoffConn);
+    }
+
+    sweepSelect(NULL);
+    printf("Waiting for connections at %s:[%s] and %s (liveness sweep: %s)\n", prog_args.hr_ip, prog_args.hr_p,
+           prog_args.hr_up, sweepName);
+
+    /* sender of the datagram being handled, registry keeps its own compact copy */
+    struct sockaddr_storage cli_storage;
+    struct sockaddr *cli_addr = (struct sockaddr *)&cli_storage;
+    trace_record trace;
+    long lastSweep = 0;
+    long nextPresence = 0;
+    bool handedOver = false;
     while (loop) {
-        if ((events = poll(ufds, 2, 2500)) == 0) {
-            printf("Timeout, but no events!\n");
+        int timeout = reliableInFlight ? RLY_TICK_MS : 2500;
+        if (pending.count > 0) {
+            long left = pendingDeadline - rel_now_ms();
+            timeout = (left < 0) ? 0 : ((left < timeout) ? (int)left : timeout);
+        }
+        if (presence_pending()) {
+            long left = nextPresence - rel_now_ms();
+            timeout = (left < 0) ? 0 : ((left < timeout) ? (int)left : timeout);
+        }
+        bool mailDue = mailbox_waiting() > 0;
+        if (mailDue && timeout > MAILBOX_POLL_MS) {
+            timeout = MAILBOX_POLL_MS;
+        }
+        bool answerDue = search_waiting() > 0;
+        if (answerDue && timeout > SEARCH_POLL_MS) {
+            timeout = SEARCH_POLL_MS;
+        }
+        events = tuning_poll(&(prog_args.tuning), ufds, 3, timeout);
+
+        if (reportRequested) {
+            reportRequested = 0;
+            trace_report(stdout);
+            coalesceReport();
+            rateReport();
+            topics_report(stdout);
+            presence_report(stdout);
+            mailbox_report(stdout);
+            search_report(stdout);
+            capture_report(stdout);
+            sockbuf_report(stdout);
+            stages_report(stdout, sockets, 2);
+            memoryReport(stdout);
+        }
+
+        long now = rel_now_ms();
+        if (now >= nextRetransmitCheck) {
+            retransmitTick(now);
+        }
+
+        bool windowClosed = pending.count > 0 && now >= pendingDeadline;
+        if (windowClosed) {
+            flushPending();
+        }
+
+        /* stamps have 1 s resolution, more frequent sweeps wouldn't find anything new */
+        if (curr_time() != lastSweep) {
+            lastSweep = curr_time();
+            expireClients(lastSweep);
+            sockbuf_tick();
+        }
+
+        /* first change goes out right away, the ones following it in batches */
+        bool presenceSent = presence_pending() && now >= nextPresence;
+        if (presenceSent) {
+            flushPresence();
+            nextPresence = now + PRESENCE_BATCH_MS;
+        }
+        collectMail();
+        collectAnswers();
+
+        if (events == 0) {
+            if (!reliableInFlight && !windowClosed && !presenceSent && !mailDue && !answerDue) {
+                printf("Timeout, but no events!\n");
+            }
             continue;
         }
         else if (events == -1) {
@@ -219,21 +798,33 @@ int main(int argc, char **argv) {
             exit(1);
         }
         else {
+            /* successor takes it from here - nothing more may be read */
+            if (ufds[2].revents & POLLIN) {
+                events--;
+                if (handOver(ufds[2].fd, sockets)) {
+                    handedOver = true;
+                    break;
+                }
+            }
+
             for (i = 0; events > 0 && i < 2; i++) {
                 if (ufds[i].revents & POLLIN) {
-                    cli_addr = calloc(how_much_for_address, 1);
-                    socklen_t actual_length = how_much_for_address;
-                    if ((recv_len = recvfrom(ufds[i].fd, &buf, sizeof(buf), 0, cli_addr, &actual_length)) == -1) {
+                    socklen_t actual_length = sizeof(cli_storage);
+                    if ((recv_len = sockbuf_recvfrom(i, &buf, sizeof(buf), cli_addr, &actual_length)) == -1) {
                         if (errno == EINTR) {
                             continue;
                         }
-                        perror("recvfrom(...) failed");
+                        perror("recvmsg(...) failed");
                         exit(1);
                     }
+                    TRACE_STAMP(&trace, TRACE_RECEIVED);
                     //      IF MESSAGE IS CLIENT REGISTERING, THEN
-                    int cid = clientPresent(cli_addr);
+                    int cid = clientPresent(cli_addr, actual_length);
                     if(cid == -1) {
-                        addClient(cli_addr, actual_length, ufds[i].fd);
+                        if ((cid = addClient(cli_addr, actual_length, ufds[i].fd)) == -1) {
+                            events--;
+                            continue;
+                        }
                     } else {
                         /* update timestamp */
                         clientLastHeardOf[cid] = curr_time();
@@ -241,30 +832,53 @@ int main(int argc, char **argv) {
 
                     /* now we have to check whether it was just a keepalive or a legitimate message, which should be forwarded */
                     if(recv_len == sizeof(message)) {
+                        /* as it came, whether admitted or not - replay should meet the same limits */
+                        CAPTURE(cli_addr, actual_length, &buf.msg);
+                        if (!admit(cid, &buf.msg, now)) {
+                            events--;
+                            continue;
+                        }
                         /* this is legit message! */
-                        printf("Received: %s from: %s\n", buf.msg, buf.from);
-                        int j;
-
-                        long reference_time = curr_time();
-                        for (j = 0; j < clientIterator; j++) {
-                            cli_addr = clientTab[j];
-                            actual_length = clientSizes[j];
-
-                            if(reference_time - clientLastHeardOf[j] > TIMEOUT_SEC) {
-                                /* kick this guy out */
-                                free(clientTab[j]);
-                                clientTab[j] = NULL;
-                                printf("Client timed out\n");
-                            } else {
-                                if (sendto(clientDesc[j], &buf, recv_len, 0, cli_addr, actual_length) == -1) {
-                                    perror("sendto(...) failed");
-                                    exit(1);
-                                }
-                            }
+                        TRACE_STAMP(&trace, TRACE_DECODED);
+                        printf("Received: %s from: %s\n", buf.msg.msg, buf.msg.from);
+                        route(cid, &buf.msg, &trace);
+                    } else if(recv_len == sizeof(rel_packet) && buf.type == PKT_RELIABLE) {
+                        /* without an ack client sends it again after its RTO */
+                        if (!admit(cid, &buf.rel.msg, now)) {
+                            events--;
+                            continue;
+                        }
+                        int count = rel_receive(reliablePeer(cid), &buf.rel, delivered, &ack);
+                        sendToClient(cid, &ack, sizeof(ack));
+
+                        /* retransmissions are captured once, in order */
+                        for (int k = 0; k < count; k++) {
+                            CAPTURE(cli_addr, actual_length, &delivered[k]);
+                        }
+                        /* broadcast() may drop clients, cid must not be used below */
+                        for (int k = 0; k < count; k++) {
+                            /* messages released together share the receive time */
+                            TRACE_STAMP(&trace, TRACE_DECODED);
+                            printf("Received: %s from: %s\n", delivered[k].msg, delivered[k].from);
+                            route(cid, &delivered[k], &trace);
+                        }
+                    } else if(recv_len == sizeof(ack_packet) && buf.type == PKT_ACK) {
+                        rel_ack(reliablePeer(cid), &buf.ack, now);
+                        flushReliable(cid, now);
+                    } else if(recv_len == sizeof(hb_packet) && buf.type == PKT_HEARTBEAT) {
+                        if (buf.hb.flags & HB_FLAG_RELIABLE) {
+                            reliablePeer(cid);
+                        }
+
+                        if (buf.hb.interval_ms != prog_args.heartbeat_ms) {
+                            hb_packet advert;
+                            advert.type = PKT_HB_INTERVAL;
+                            advert.interval_ms = prog_args.heartbeat_ms;
+                            advert.flags = 0;
+                            sendToClient(cid, &advert, sizeof(advert));
                         }
-                    } else {
-                        printf("Heartbeat!\n");
                     }
+                    /* anything else is a bare heartbeat - timestamp is already updated */
 
                     events--;
                 }
@@ -272,7 +886,33 @@ int main(int argc, char **argv) {
         }
     }
 
+    flushPending();
+    stages_stop();
+    mailbox_stop();
+    search_stop();
+
     printf("Shutting down...\n");
+    trace_report(stdout);
+    coalesceReport();
+    rateReport();
+    topics_report(stdout);
+    presence_report(stdout);
+    mailbox_report(stdout);
+    search_report(stdout);
+    capture_report(stdout);
+    sockbuf_report(stdout);
+    stages_report(stdout, sockets, 2);
+    memoryReport(stdout);
+    trace_close();
+    capture_close();
+
+    if (ufds[2].fd >= 0) {
+        close(ufds[2].fd);
+        /* path belongs to the successor now */
+        if (!handedOver) {
+            unlink(prog_args.handoff_path);
+        }
+    }
 
     /* two sockets to close - 0 and 1 */
     for (int i = 1; i >= 0; i--) {
@@ -0,0 +1,606 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "session.h"
+
+/* epoll user data points to one of these, kind tells which */
+#define KIND_SESSION 1
+#define KIND_WATCH 2
+
+struct session {
+    int kind;
+    session_loop *loop;
+    int fd;
+    int sock_type;
+    char username[USERNAME_MAX+1];
+    session_callbacks callbacks;
+    void *user;
+
+    bool connected;
+    bool closed;
+    bool want_write;
+
+    /* messages waiting for writable socket, ring of SESSION_QUEUE_MAX allocated only when needed */
+    message *out;
+    int out_head;
+    int out_count;
+    size_t out_offset; /* TCP - how much of the first one is already written */
+
+    /* TCP - beginning of a message split between reads */
+    char partial[sizeof(message)];
+    size_t partial_size;
+
+    /* UDP heartbeats: heap is keyed by heap_deadline, next_heartbeat may only move later */
+    int heartbeat_ms;
+    long next_heartbeat;
+    long heap_deadline;
+    int heap_pos;
+
+    /* list of open sessions, closed ones are chained by next until freed */
+    session *prev;
+    session *next;
+};
+
+typedef struct watch {
+    int kind;
+    int fd;
+    void (*on_readable)(int fd, void *user);
+    void *user;
+    bool dead;
+    struct watch *next;
+} watch;
+
+struct session_loop {
+    int epfd;
+    int count;
+
+    /* binary min-heap of UDP sessions by heap_deadline */
+    session **heap;
+    int heap_size;
+    int heap_capacity;
+
+    session *open;
+    session *closed;
+    watch *watches;
+    session_stats stats;
+};
+
+/* TCP reads land here first - one buffer for all sessions */
+static char read_buffer[SESSION_QUEUE_MAX*sizeof(message)];
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* -------------------------------------- */
+
+const char *session_resolve(char mode, const char *where, const char *port, session_address *out) {
+    memset(out, 0, sizeof(session_address));
+
+    if(mode == MODE_LOCAL) {
+        if(strlen(where) > UNIX_SOCKET_PATH_MAX - 1) {
+            return "Socket path too long";
+        }
+
+        struct sockaddr_un *unix_address = (struct sockaddr_un *)&(out->storage);
+        unix_address->sun_family = AF_UNIX;
+        strcpy(unix_address->sun_path, where);
+        out->size = sizeof(struct sockaddr_un);
+    } else if(mode == MODE_REMOTE) {
+        if(port == NULL) {
+            return "Too few arguments!";
+        }
+
+        struct sockaddr_in *inet_address = (struct sockaddr_in *)&(out->storage);
+        struct sockaddr_in6 *inet6_address = (struct sockaddr_in6 *)&(out->storage);
+        if(inet_pton(AF_INET, where, &(inet_address->sin_addr)) == 1) {
+            inet_address->sin_family = AF_INET;
+            out->size = sizeof(struct sockaddr_in);
+        } else if(inet_pton(AF_INET6, where, &(inet6_address->sin6_addr)) == 1) {
+            inet6_address->sin6_family = AF_INET6;
+            out->size = sizeof(struct sockaddr_in6);
+        } else {
+            return "Wrong IP format";
+        }
+
+        long unvalidated_port = strtol(port, NULL, 10);
+        if(unvalidated_port < MIN_PORT || unvalidated_port > MAX_PORT) {
+            return "Wrong port";
+        }
+        /* port is at the same place in both */
+        inet_address->sin_port = htons((in_port_t)unvalidated_port);
+    } else {
+        return "Mode unrecognized";
+    }
+
+    return NULL;
+}
+
+message *pack_message(char *from, char *content) {
+    message *msg = calloc(sizeof(message), 1);
+    /* calloc'ed, so cut ones stay terminated */
+    strncpy(msg->from, from, USERNAME_MAX);
+    strncpy(msg->msg, content, MSG_LEN_MAX);
+
+    return msg;
+}
+
+/* -------------------------------------- */
+
+static void heap_swap(session_loop *loop, int a, int b) {
+    session *tmp = loop->heap[a];
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = tmp;
+    loop->heap[a]->heap_pos = a;
+    loop->heap[b]->heap_pos = b;
+}
+
+static void heap_up(session_loop *loop, int pos) {
+    while(pos > 0 && loop->heap[(pos-1)/2]->heap_deadline > loop->heap[pos]->heap_deadline) {
+        heap_swap(loop, pos, (pos-1)/2);
+        pos = (pos-1)/2;
+    }
+}
+
+static void heap_down(session_loop *loop, int pos) {
+    while(true) {
+        int smallest = pos;
+        int left = 2*pos + 1, right = 2*pos + 2;
+        if(left < loop->heap_size && loop->heap[left]->heap_deadline < loop->heap[smallest]->heap_deadline) {
+            smallest = left;
+        }
+        if(right < loop->heap_size && loop->heap[right]->heap_deadline < loop->heap[smallest]->heap_deadline) {
+            smallest = right;
+        }
+        if(smallest == pos) {
+            return;
+        }
+        heap_swap(loop, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void heap_push(session_loop *loop, session *s) {
+    if(loop->heap_size == loop->heap_capacity) {
+        loop->heap_capacity = (loop->heap_capacity > 0) ? 2*loop->heap_capacity : 16;
+        loop->heap = realloc(loop->heap, sizeof(session*)*loop->heap_capacity);
+    }
+
+    s->heap_deadline = s->next_heartbeat;
+    s->heap_pos = loop->heap_size++;
+    loop->heap[s->heap_pos] = s;
+    heap_up(loop, s->heap_pos);
+}
+
+static void heap_remove(session_loop *loop, session *s) {
+    int pos = s->heap_pos;
+    if(pos < 0) {
+        return;
+    }
+
+    heap_swap(loop, pos, --loop->heap_size);
+    s->heap_pos = -1;
+    if(pos < loop->heap_size) {
+        heap_up(loop, pos);
+        heap_down(loop, pos);
+    }
+}
+
+/* any packet sent counts as liveness, so it postpones the heartbeat */
+static void postpone_heartbeat(session *s) {
+    long jitter_pct = 100 - HB_JITTER_PCT + rand() % (2*HB_JITTER_PCT + 1);
+    s->next_heartbeat = now_ms() + s->heartbeat_ms * jitter_pct / 100;
+}
+
+/* -------------------------------------- */
+
+static void update_events(session *s) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (s->want_write ? EPOLLOUT : 0);
+    ev.data.ptr = s;
+    epoll_ctl(s->loop->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static void want_write(session *s, bool want) {
+    if(s->want_write != want) {
+        s->want_write = want;
+        update_events(s);
+    }
+}
+
+static void lose(session *s) {
+    if(s->closed) {
+        return;
+    }
+    if(s->callbacks.on_close != NULL) {
+        s->callbacks.on_close(s, s->user);
+    }
+    session_close(s);
+}
+
+/* writes as much of the queue as socket takes; false when session broke */
+static bool flush_queue(session *s) {
+    while(s->out_count > 0) {
+        message *msg = &(s->out[s->out_head]);
+        ssize_t written = send(s->fd, (char *)msg + s->out_offset, sizeof(message) - s->out_offset, MSG_NOSIGNAL);
+        if(written == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                want_write(s, true);
+                return true;
+            }
+            return false;
+        }
+
+        s->out_offset += written;
+        if(s->sock_type == SOCK_DGRAM || s->out_offset == sizeof(message)) {
+            s->out_head = (s->out_head + 1) % SESSION_QUEUE_MAX;
+            s->out_count--;
+            s->out_offset = 0;
+            s->loop->stats.sent++;
+        }
+    }
+
+    free(s->out);
+    s->out = NULL;
+    want_write(s, false);
+    if(s->sock_type == SOCK_DGRAM) {
+        postpone_heartbeat(s);
+    }
+    return true;
+}
+
+static void send_heartbeat(session *s) {
+    hb_packet hb;
+    hb.type = PKT_HEARTBEAT;
+    hb.interval_ms = s->heartbeat_ms;
+    hb.flags = 0;
+
+    /* if socket buffer is full there is traffic anyway, no need to retry */
+    send(s->fd, &hb, sizeof(hb), MSG_NOSIGNAL);
+    s->loop->stats.heartbeats++;
+    postpone_heartbeat(s);
+}
+
+static void receive_datagrams(session *s) {
+    packet buf;
+    ssize_t recv_len;
+    while(!s->closed && (recv_len = recv(s->fd, &buf, sizeof(buf), 0)) >= 0) {
+        if(recv_len == sizeof(message)) {
+            s->loop->stats.received++;
+            s->callbacks.on_message(s, &buf.msg, s->user);
+        } else if(BATCH_COUNT(&buf, recv_len) > 0) {
+            for(int k = 0; k < buf.batch.count && !s->closed; k++) {
+                s->loop->stats.received++;
+                s->callbacks.on_message(s, &buf.batch.msgs[k], s->user);
+            }
+        } else if(recv_len == sizeof(hb_packet) && buf.type == PKT_HB_INTERVAL) {
+            if(buf.hb.interval_ms >= HB_MIN_MS && buf.hb.interval_ms <= HB_MAX_MS) {
+                s->heartbeat_ms = buf.hb.interval_ms;
+            }
+        }
+        /* reliable delivery packets are not supported by sessions - ignore */
+    }
+
+    if(!s->closed && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        lose(s);
+    }
+}
+
+static void receive_stream(session *s) {
+    while(!s->closed) {
+        memcpy(read_buffer, s->partial, s->partial_size);
+        ssize_t read = recv(s->fd, read_buffer + s->partial_size, sizeof(read_buffer) - s->partial_size, 0);
+        if(read == 0) {
+            lose(s);
+            return;
+        } else if(read == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                lose(s);
+            }
+            return;
+        }
+
+        size_t available = s->partial_size + read;
+        size_t offset = 0;
+        while(!s->closed && available - offset >= sizeof(message)) {
+            message msg;
+            memcpy(&msg, read_buffer + offset, sizeof(message));
+            offset += sizeof(message);
+            s->loop->stats.received++;
+            s->callbacks.on_message(s, &msg, s->user);
+        }
+
+        s->partial_size = available - offset;
+        memcpy(s->partial, read_buffer + offset, s->partial_size);
+    }
+}
+
+static void handle_session(session *s, uint32_t events) {
+    if(!s->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int error = 0;
+        socklen_t error_size = sizeof(error);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &error_size);
+        if(error != 0) {
+            lose(s);
+            return;
+        }
+
+        s->connected = true;
+        if(s->sock_type == SOCK_DGRAM) {
+            /* first heartbeat registers us with the server */
+            send_heartbeat(s);
+            heap_push(s->loop, s);
+        }
+        if(s->callbacks.on_connect != NULL) {
+            s->callbacks.on_connect(s, s->user);
+        }
+        if(!s->closed && !flush_queue(s)) {
+            lose(s);
+            return;
+        }
+    }
+
+    if(!s->closed && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        if(s->sock_type == SOCK_DGRAM) {
+            receive_datagrams(s);
+        } else {
+            receive_stream(s);
+        }
+    }
+
+    if(!s->closed && s->connected && (events & EPOLLOUT) && !flush_queue(s)) {
+        lose(s);
+    }
+}
+
+static void run_heartbeats(session_loop *loop, long now) {
+    while(loop->heap_size > 0 && loop->heap[0]->heap_deadline <= now) {
+        session *s = loop->heap[0];
+        if(s->next_heartbeat <= now) {
+            send_heartbeat(s);
+        }
+
+        /* postponed by traffic since it was queued - just move it */
+        s->heap_deadline = s->next_heartbeat;
+        heap_down(loop, 0);
+    }
+}
+
+/* -------------------------------------- */
+
+session_loop *session_loop_create() {
+    session_loop *loop = calloc(sizeof(session_loop), 1);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd == -1) {
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+static void free_closed(session_loop *loop) {
+    while(loop->closed != NULL) {
+        session *s = loop->closed;
+        loop->closed = s->next;
+        free(s->out);
+        free(s);
+    }
+
+    watch **link = &(loop->watches);
+    while(*link != NULL) {
+        watch *w = *link;
+        if(w->dead) {
+            *link = w->next;
+            free(w);
+        } else {
+            link = &(w->next);
+        }
+    }
+}
+
+void session_loop_destroy(session_loop *loop) {
+    while(loop->open != NULL) {
+        session_close(loop->open);
+    }
+    free_closed(loop);
+    close(loop->epfd);
+    free(loop->heap);
+    free(loop);
+}
+
+session *session_open(session_loop *loop, const session_address *address, int sock_type, const char *username,
+                      const session_callbacks *callbacks, void *user) {
+    int family = address->storage.ss_family;
+    int fd = socket(family, sock_type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        return NULL;
+    }
+
+    if(family == AF_UNIX && sock_type == SOCK_DGRAM) {
+        /* autobind, otherwise server has no address to answer to */
+        struct sockaddr_un me;
+        me.sun_family = AF_UNIX;
+        bind(fd, (struct sockaddr *)&me, sizeof(sa_family_t));
+    }
+
+    if(connect(fd, (struct sockaddr *)&(address->storage), address->size) == -1 && errno != EINPROGRESS) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    session *s = calloc(sizeof(session), 1);
+    s->kind = KIND_SESSION;
+    s->loop = loop;
+    s->fd = fd;
+    s->sock_type = sock_type;
+    strncpy(s->username, username, USERNAME_MAX);
+    s->callbacks = *callbacks;
+    s->user = user;
+    s->heartbeat_ms = HB_DEFAULT_MS;
+    s->heap_pos = -1;
+
+    /* connection is confirmed by first EPOLLOUT */
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = s;
+    s->want_write = true;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        close(fd);
+        free(s);
+        return NULL;
+    }
+
+    s->next = loop->open;
+    if(loop->open != NULL) {
+        loop->open->prev = s;
+    }
+    loop->open = s;
+    loop->count++;
+    return s;
+}
+
+int session_send(session *s, const char *text) {
+    if(s->closed) {
+        return -1;
+    }
+    if(s->out_count >= SESSION_QUEUE_MAX) {
+        s->loop->stats.queue_full++;
+        return -1;
+    }
+
+    if(s->out == NULL) {
+        s->out = malloc(sizeof(message)*SESSION_QUEUE_MAX);
+        s->out_head = 0;
+    }
+
+    message *msg = &(s->out[(s->out_head + s->out_count) % SESSION_QUEUE_MAX]);
+    memset(msg, 0, sizeof(message));
+    memcpy(msg->from, s->username, sizeof(msg->from)); /* same size, zero padded */
+    strncpy(msg->msg, text, MSG_LEN_MAX);
+    s->out_count++;
+
+    /* try right away unless earlier messages are still waiting */
+    if(s->connected && !s->want_write && !flush_queue(s)) {
+        lose(s);
+    }
+    return 0;
+}
+
+void session_close(session *s) {
+    if(s->closed) {
+        return;
+    }
+
+    s->closed = true;
+    heap_remove(s->loop, s);
+    epoll_ctl(s->loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->loop->count--;
+
+    if(s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        s->loop->open = s->next;
+    }
+    if(s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+
+    /* epoll events already fetched may still point to it */
+    s->next = s->loop->closed;
+    s->loop->closed = s;
+}
+
+int session_loop_count(session_loop *loop) {
+    return loop->count;
+}
+
+int session_loop_watch(session_loop *loop, int fd, void (*on_readable)(int fd, void *user), void *user) {
+    watch *w = calloc(sizeof(watch), 1);
+    w->kind = KIND_WATCH;
+    w->fd = fd;
+    w->on_readable = on_readable;
+    w->user = user;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = w;
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        free(w);
+        return -1;
+    }
+
+    w->next = loop->watches;
+    loop->watches = w;
+    return 0;
+}
+
+void session_loop_unwatch(session_loop *loop, int fd) {
+    for(watch *w = loop->watches; w != NULL; w = w->next) {
+        if(!w->dead && w->fd == fd) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+            w->dead = true;
+        }
+    }
+}
+
+int session_loop_run(session_loop *loop, int timeout_ms) {
+    struct epoll_event events[SESSION_EVENTS_MAX];
+
+    if(loop->heap_size > 0) {
+        long until_heartbeat = loop->heap[0]->heap_deadline - now_ms();
+        if(until_heartbeat < 0) {
+            until_heartbeat = 0;
+        }
+        if(timeout_ms < 0 || until_heartbeat < timeout_ms) {
+            timeout_ms = (int)until_heartbeat;
+        }
+    }
+
+    int count = epoll_wait(loop->epfd, events, SESSION_EVENTS_MAX, timeout_ms);
+    if(count == -1) {
+        if(errno != EINTR) {
+            return -1;
+        }
+        count = 0;
+    }
+
+    for(int i = 0; i < count; i++) {
+        int kind = *(int *)events[i].data.ptr;
+        if(kind == KIND_SESSION) {
+            session *s = events[i].data.ptr;
+            if(!s->closed) {
+                handle_session(s, events[i].events);
+            }
+        } else {
+            watch *w = events[i].data.ptr;
+            if(!w->dead) {
+                w->on_readable(w->fd, w->user);
+            }
+        }
+    }
+
+    run_heartbeats(loop, now_ms());
+    free_closed(loop);
+    return count;
+}
+
+session_stats session_loop_stats(session_loop *loop) {
+    return loop->stats;
+}
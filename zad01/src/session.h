@@ -0,0 +1,79 @@
+#ifndef MAKEFILE_SESSION_H
+#define MAKEFILE_SESSION_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "message.h"
+
+/*
+ * Client side of the chat as a library: non-blocking sessions driven by one event loop,
+ * so a single thread can keep thousands of them connected (over UDP or TCP).
+ * Nothing blocks - sends are queued per session and written when the socket is ready.
+ */
+
+typedef struct session session;
+typedef struct session_loop session_loop;
+
+typedef struct {
+    /* TCP - connection established, UDP - right after the session is opened; may be NULL */
+    void (*on_connect)(session *s, void *user);
+    void (*on_message)(session *s, const message *msg, void *user);
+    /* session is gone (error or hangup) and will be freed after this returns; may be NULL */
+    void (*on_close)(session *s, void *user);
+} session_callbacks;
+
+typedef struct {
+    struct sockaddr_storage storage;
+    socklen_t size;
+} session_address;
+
+/*
+ * mode is MODE_LOCAL (where = unix socket path, port unused) or MODE_REMOTE (where = ip).
+ * Returns NULL on success, otherwise description of what's wrong.
+ */
+const char *session_resolve(char mode, const char *where, const char *port, session_address *out);
+
+message *pack_message(char *from, char *content);
+
+session_loop *session_loop_create();
+void session_loop_destroy(session_loop *loop);
+
+/*
+ * sock_type is SOCK_DGRAM (zad01 server) or SOCK_STREAM (zad02 server).
+ * NULL on failure with errno set; EAGAIN means server's (unix) listen backlog is full - run the loop and retry.
+ */
+session *session_open(session_loop *loop, const session_address *address, int sock_type, const char *username,
+                      const session_callbacks *callbacks, void *user);
+
+/* queues text as a message from session's user; -1 when session's output queue is full */
+int session_send(session *s, const char *text);
+
+/* closes immediately (no on_close), safe to call from callbacks */
+void session_close(session *s);
+
+int session_loop_count(session_loop *loop);
+
+/* watches additional descriptor for input, e.g. stdin of a bridge; callback is removed with fd */
+int session_loop_watch(session_loop *loop, int fd, void (*on_readable)(int fd, void *user), void *user);
+void session_loop_unwatch(session_loop *loop, int fd);
+
+/*
+ * Waits at most timeout_ms (-1 forever) for events, dispatches callbacks and sends due heartbeats.
+ * Returns number of handled events or -1 on error (EINTR is not an error).
+ */
+int session_loop_run(session_loop *loop, int timeout_ms);
+
+/* totals over all sessions ever opened in this loop */
+typedef struct {
+    unsigned long sent;
+    unsigned long received;
+    unsigned long heartbeats;
+    unsigned long queue_full;
+} session_stats;
+
+session_stats session_loop_stats(session_loop *loop);
+
+#endif //MAKEFILE_SESSION_H
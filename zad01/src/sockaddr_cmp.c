@@ -31,7 +31,10 @@ int sockaddr_cmp(struct sockaddr *x, struct sockaddr *y)
 
     if (x->sa_family == AF_UNIX) {
         struct sockaddr_un *xun = (void*)x, *yun = (void*)y;
-        int r = strcmp(xun->sun_path, yun->sun_path);
+        /* abstract (autobound) names start with '\0' - compare whole, zero-padded buffer */
+        int r = (xun->sun_path[0] == '\0' && yun->sun_path[0] == '\0')
+            ? memcmp(xun->sun_path, yun->sun_path, sizeof(xun->sun_path))
+            : strcmp(xun->sun_path, yun->sun_path);
         if (r != 0)
             return r;
     } else if (x->sa_family == AF_INET) {
@@ -52,4 +55,39 @@ int sockaddr_cmp(struct sockaddr *x, struct sockaddr *y)
 
 #undef CMP
     return 0;
-}
\ No newline at end of file
+}
+
+static unsigned int fnv1a(unsigned int h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+unsigned int sockaddr_hash(struct sockaddr *x)
+{
+    unsigned int h = fnv1a(2166136261u, &x->sa_family, sizeof(x->sa_family));
+
+    if (x->sa_family == AF_UNIX) {
+        struct sockaddr_un *xun = (void*)x;
+        if (xun->sun_path[0] == '\0')
+            h = fnv1a(h, xun->sun_path, sizeof(xun->sun_path));
+        else
+            h = fnv1a(h, xun->sun_path, strlen(xun->sun_path));
+    } else if (x->sa_family == AF_INET) {
+        struct sockaddr_in *xin = (void*)x;
+        h = fnv1a(h, &xin->sin_addr.s_addr, sizeof(xin->sin_addr.s_addr));
+        h = fnv1a(h, &xin->sin_port, sizeof(xin->sin_port));
+    } else if (x->sa_family == AF_INET6) {
+        struct sockaddr_in6 *xin6 = (void*)x;
+        h = fnv1a(h, xin6->sin6_addr.s6_addr, sizeof(xin6->sin6_addr.s6_addr));
+        h = fnv1a(h, &xin6->sin6_port, sizeof(xin6->sin6_port));
+    } else {
+        assert(!"unknown sa_family");
+    }
+
+    return h;
+}
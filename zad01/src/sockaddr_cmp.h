@@ -8,6 +8,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+/* unix addresses must be zero-padded - abstract ones are compared as whole buffers */
 int sockaddr_cmp(struct sockaddr *x, struct sockaddr *y);
 
+/* hash consistent with sockaddr_cmp() - equal addresses give equal hashes */
+unsigned int sockaddr_hash(struct sockaddr *x);
+
 #endif //MAKEFILE_SOCKADDR_CMP_H
@@ -0,0 +1,199 @@
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+
+#include "sockbuf.h"
+
+typedef struct {
+    int fd;
+    const char *name;
+    int requested;                /* receive buffer asked for, kernel doubles it */
+    int rcvbuf;                   /* as kernel reports them */
+    int sndbuf;
+    int grown;
+    bool capped;                  /* kernel didn't give more, net.core.rmem_max is in the way */
+    unsigned long received;
+    uint32_t drops_base;          /* kernel's counter is per socket, not per process */
+    uint32_t drops_seen;
+    uint32_t drops_at_tick;
+    int pressure_ticks;
+} sockbuf_socket;
+
+static sockbuf_socket sockets[SOCKBUF_SOCKETS_MAX];
+static int socket_count = 0;
+static int rcvbuf_max = 0;
+
+/* -------------------------------------- */
+
+static int get_size(int fd, int option) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    getsockopt(fd, SOL_SOCKET, option, &size, &length);
+    return size;
+}
+
+/* privileged variant goes past net.core.[rw]mem_max, without privileges it's clamped there */
+static int set_size(int fd, int option, int force_option, int size) {
+    if (setsockopt(fd, SOL_SOCKET, force_option, &size, sizeof(size)) == 0) {
+        return 0;
+    }
+    return setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size));
+}
+
+static uint32_t kernel_drops(int fd) {
+#ifdef SO_MEMINFO
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t size = sizeof(meminfo);
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &size) == 0) {
+        return meminfo[SK_MEMINFO_DROPS];
+    }
+#endif
+    (void)fd;
+    return 0;
+}
+
+static long parse_bytes(const char *arg, char **end) {
+    long bytes = strtol(arg, end, 10);
+    if (**end == 'k' || **end == 'K') {
+        bytes *= 1024;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        bytes *= 1024*1024;
+        (*end)++;
+    }
+    return bytes;
+}
+
+/* -------------------------------------- */
+
+int sockbuf_parse(const char *arg, int *bytes, int *max) {
+    char *end;
+    long size = parse_bytes(arg, &end);
+    long limit = 0;
+    if (*end == ':') {
+        limit = parse_bytes(end + 1, &end);
+        if (limit < size || limit <= 0) {
+            return -1;
+        }
+    }
+    if (*end != '\0' || size < 0 || size > SOCKBUF_BYTES_MAX || limit > SOCKBUF_BYTES_MAX) {
+        return -1;
+    }
+
+    *bytes = (int)size;
+    if (max != NULL) {
+        *max = (int)limit;
+    } else if (limit != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int sockbuf_setup(const sockbuf_options *o, const int *fds, const char **names, int count) {
+    rcvbuf_max = o->rcvbuf_max;
+    socket_count = count;
+    for (int k = 0; k < count; k++) {
+        sockbuf_socket *s = &(sockets[k]);
+        memset(s, 0, sizeof(sockbuf_socket));
+        s->fd = fds[k];
+        s->name = names[k];
+
+        if (o->rcvbuf > 0 && set_size(s->fd, SO_RCVBUF, SO_RCVBUFFORCE, o->rcvbuf) == -1) {
+            return -1;
+        }
+        if (o->sndbuf > 0 && set_size(s->fd, SO_SNDBUF, SO_SNDBUFFORCE, o->sndbuf) == -1) {
+            return -1;
+        }
+        int on = 1;
+        if (setsockopt(s->fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) == -1) {
+            return -1;
+        }
+
+        s->rcvbuf = get_size(s->fd, SO_RCVBUF);
+        s->sndbuf = get_size(s->fd, SO_SNDBUF);
+        s->requested = (o->rcvbuf > 0) ? o->rcvbuf : s->rcvbuf/2;
+        s->drops_base = kernel_drops(s->fd);
+        s->drops_seen = s->drops_base;
+        s->drops_at_tick = s->drops_base;
+    }
+    return 0;
+}
+
+ssize_t sockbuf_recvfrom(int k, void *buf, size_t length, struct sockaddr *address, socklen_t *address_length) {
+    sockbuf_socket *s = &(sockets[k]);
+    struct iovec iov = {buf, length};
+    /* unix socket passes credentials too */
+    char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct ucred))];
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = address;
+    hdr.msg_namelen = *address_length;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(s->fd, &hdr, 0);
+    if (received == -1) {
+        return -1;
+    }
+    *address_length = hdr.msg_namelen;
+    s->received++;
+
+    /* comes only once there were drops; it's the total so far, wrapping at 2^32 */
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            if ((int32_t)(drops - s->drops_seen) > 0) {
+                s->drops_seen = drops;
+            }
+        }
+    }
+    return received;
+}
+
+void sockbuf_tick() {
+    for (int k = 0; k < socket_count; k++) {
+        sockbuf_socket *s = &(sockets[k]);
+        bool dropped = s->drops_seen != s->drops_at_tick;
+        s->drops_at_tick = s->drops_seen;
+        s->pressure_ticks = dropped ? s->pressure_ticks + 1 : 0;
+
+        if (s->pressure_ticks < SOCKBUF_PRESSURE_TICKS || s->capped || s->requested >= rcvbuf_max) {
+            continue;
+        }
+        s->pressure_ticks = 0;
+
+        int size = (s->requested > rcvbuf_max/SOCKBUF_GROWTH) ? rcvbuf_max : s->requested*SOCKBUF_GROWTH;
+        int before = s->rcvbuf;
+        if (set_size(s->fd, SO_RCVBUF, SO_RCVBUFFORCE, size) == -1) {
+            s->capped = true;
+            continue;
+        }
+        s->requested = size;
+        s->rcvbuf = get_size(s->fd, SO_RCVBUF);
+        if (s->rcvbuf <= before) {
+            s->capped = true;
+        } else {
+            s->grown++;
+            printf("Kernel keeps dropping on %s socket, receive buffer grown to %d bytes\n", s->name, s->rcvbuf);
+        }
+    }
+}
+
+void sockbuf_report(FILE *out) {
+    for (int k = 0; k < socket_count; k++) {
+        sockbuf_socket *s = &(sockets[k]);
+        fprintf(out, "Socket %s: received %lu datagrams, kernel dropped %u, receive buffer %d bytes (grown %d times%s), "
+                "send buffer %d bytes\n", s->name, s->received, s->drops_seen - s->drops_base, s->rcvbuf, s->grown,
+                s->capped ? ", capped by net.core.rmem_max" : "", s->sndbuf);
+    }
+    fflush(out);
+}
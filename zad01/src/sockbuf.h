@@ -0,0 +1,38 @@
+#ifndef MAKEFILE_SOCKBUF_H
+#define MAKEFILE_SOCKBUF_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Socket buffers of the server's sockets (-R, -Q) and datagrams the kernel dropped on them.
+ * Drops come with received datagrams (SO_RXQ_OVFL), so they're known as soon as the socket is
+ * read again after a burst - that's loss which never reached the server, unlike what rate
+ * limiting or full queues drop later. With a growth limit, receive buffer doubles (up to it)
+ * whenever the kernel kept dropping for SOCKBUF_PRESSURE_TICKS ticks in a row.
+ */
+
+#define SOCKBUF_SOCKETS_MAX 2
+
+typedef struct {
+    int rcvbuf;        /* bytes, 0 - system default */
+    int rcvbuf_max;    /* receive buffer may grow up to that, 0 - it doesn't */
+    int sndbuf;        /* bytes, 0 - system default */
+} sockbuf_options;
+
+/* "<bytes>[:max]", k and m suffixes; -1 when malformed (max is 0 when not given) */
+int sockbuf_parse(const char *arg, int *bytes, int *max);
+
+/* sets buffers and turns drop counting on, names are for the report; -1 (errno set) on failure */
+int sockbuf_setup(const sockbuf_options *o, const int *sockets, const char **names, int count);
+
+/* recvfrom() on k-th socket, also picks up kernel's drop counter */
+ssize_t sockbuf_recvfrom(int k, void *buf, size_t length, struct sockaddr *address, socklen_t *address_length);
+
+/* once a second: grows receive buffers under sustained drops */
+void sockbuf_tick();
+
+void sockbuf_report(FILE *out);
+
+#endif //MAKEFILE_SOCKBUF_H
@@ -0,0 +1,333 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+
+#include "stages.h"
+#include "queue.h"
+#include "address.h"
+
+enum {
+    JOB_SEND,
+    JOB_JOIN,
+    JOB_LEAVE,
+    JOB_BARRIER,
+    JOB_STOP
+};
+
+typedef struct {
+    int kind;
+    int refs;                     /* SEND jobs are shared by all workers, last one frees */
+    int slot;                     /* JOIN, LEAVE: slot in worker's table */
+    socklen_t size;               /* JOIN */
+    int desc;                     /* JOIN */
+    struct sockaddr_storage address; /* JOIN */
+    size_t length;                /* SEND */
+    char data[];                  /* SEND */
+} stage_job;
+
+typedef struct {
+    compact_address address;
+    int desc;
+    bool live;
+} stage_recipient;
+
+typedef struct {
+    pthread_t thread;
+    queue_t queue;
+    void **buffer;
+
+    /* owned by the worker */
+    stage_recipient *table;
+    int capacity;
+    int used;                     /* high water mark of slots */
+
+    /* written by the worker, read by reports */
+    unsigned long messages;
+    unsigned long sends;
+    unsigned long vanished;       /* unix clients gone, left for the registry to expire */
+    unsigned long errors;
+    size_t heap;                  /* behind table's addresses */
+
+    /* written by the receive stage */
+    int peak;
+    unsigned long stalls;         /* enqueues which found queue full */
+    long stall_ns;
+} stage_worker;
+
+bool stagesRunning = false;
+
+static stage_worker *workers = NULL;
+static int worker_count = 0;
+
+/* slots are handed out by receive stage: slot % worker_count picks worker, slot / worker_count is index there */
+static int *free_slots = NULL;
+static int free_count = 0;
+static int free_capacity = 0;
+static int next_slot = 0;
+static int staged = 0;
+
+static pthread_mutex_t barrier_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
+static int barrier_reached = 0;
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static void release(stage_job *job) {
+    if (__atomic_sub_fetch(&(job->refs), 1, __ATOMIC_ACQ_REL) == 0) {
+        free(job);
+    }
+}
+
+static void fan_out(stage_worker *w, stage_job *job) {
+    w->messages++;
+    for (int k = 0; k < w->used; k++) {
+        stage_recipient *r = &(w->table[k]);
+        if (!r->live) {
+            continue;
+        }
+
+        if (sendto(r->desc, job->data, job->length, 0, address_sockaddr(&(r->address)), address_size(&(r->address))) == -1) {
+            if (errno == ECONNREFUSED || errno == ENOENT) {
+                r->live = false;
+                w->vanished++;
+            } else {
+                w->errors++;
+            }
+        } else {
+            w->sends++;
+        }
+    }
+}
+
+static void *worker_main(void *arg) {
+    stage_worker *w = arg;
+
+    while (true) {
+        stage_job *job = queue_dequeue_wait(&(w->queue));
+        switch (job->kind) {
+            case JOB_SEND:
+                fan_out(w, job);
+                release(job);
+                break;
+            case JOB_JOIN:
+                if (job->slot >= w->capacity) {
+                    int capacity = (w->capacity > 0) ? 2*w->capacity : 64;
+                    while (capacity <= job->slot) {
+                        capacity *= 2;
+                    }
+                    w->table = realloc(w->table, sizeof(stage_recipient)*capacity);
+                    memset(w->table + w->capacity, 0, sizeof(stage_recipient)*(capacity - w->capacity));
+                    w->capacity = capacity;
+                }
+                address_store(&(w->table[job->slot].address), (struct sockaddr *)&(job->address), job->size);
+                w->heap += address_heap(&(w->table[job->slot].address));
+                w->table[job->slot].desc = job->desc;
+                w->table[job->slot].live = true;
+                if (job->slot >= w->used) {
+                    w->used = job->slot + 1;
+                }
+                free(job);
+                break;
+            case JOB_LEAVE:
+                if (job->slot < w->used) {
+                    w->table[job->slot].live = false;
+                    w->heap -= address_heap(&(w->table[job->slot].address));
+                    address_release(&(w->table[job->slot].address));
+                }
+                free(job);
+                break;
+            case JOB_BARRIER:
+                free(job);
+                pthread_mutex_lock(&barrier_mutex);
+                barrier_reached++;
+                pthread_cond_signal(&barrier_cond);
+                pthread_mutex_unlock(&barrier_mutex);
+                break;
+            case JOB_STOP:
+                free(job);
+                return NULL;
+        }
+    }
+}
+
+/* blocks while worker's queue is full - that's what slows the receive stage down */
+static void push(stage_worker *w, stage_job *job) {
+    int depth = queue_size(&(w->queue));
+    if (depth >= w->queue.capacity) {
+        long start = now_ns();
+        w->stalls++;
+        queue_enqueue(&(w->queue), job);
+        w->stall_ns += now_ns() - start;
+    } else {
+        queue_enqueue(&(w->queue), job);
+    }
+    if (depth + 1 > w->peak) {
+        w->peak = depth + 1;
+    }
+}
+
+static stage_job *new_job(int kind, size_t length) {
+    stage_job *job = malloc(sizeof(stage_job) + length);
+    job->kind = kind;
+    job->refs = 1;
+    job->length = length;
+    return job;
+}
+
+int stages_start(int count) {
+    workers = calloc(sizeof(stage_worker), count);
+    worker_count = count;
+
+    for (int k = 0; k < count; k++) {
+        stage_worker *w = &workers[k];
+        w->buffer = malloc(sizeof(void*)*STAGE_QUEUE_CAPACITY);
+        queue_t queue = {w->buffer, STAGE_QUEUE_CAPACITY, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+                         PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+        memcpy(&(w->queue), &queue, sizeof(queue_t));
+
+        if (pthread_create(&(w->thread), NULL, worker_main, w) != 0) {
+            return -1;
+        }
+    }
+
+    stagesRunning = true;
+    return 0;
+}
+
+void stages_drain() {
+    if (!stagesRunning) {
+        return;
+    }
+
+    pthread_mutex_lock(&barrier_mutex);
+    barrier_reached = 0;
+    pthread_mutex_unlock(&barrier_mutex);
+
+    for (int k = 0; k < worker_count; k++) {
+        push(&workers[k], new_job(JOB_BARRIER, 0));
+    }
+
+    pthread_mutex_lock(&barrier_mutex);
+    while (barrier_reached < worker_count) {
+        pthread_cond_wait(&barrier_cond, &barrier_mutex);
+    }
+    pthread_mutex_unlock(&barrier_mutex);
+}
+
+void stages_stop() {
+    if (!stagesRunning) {
+        return;
+    }
+
+    for (int k = 0; k < worker_count; k++) {
+        push(&workers[k], new_job(JOB_STOP, 0));
+    }
+    for (int k = 0; k < worker_count; k++) {
+        pthread_join(workers[k].thread, NULL);
+        for (int j = 0; j < workers[k].used; j++) {
+            address_release(&(workers[k].table[j].address));
+        }
+        free(workers[k].table);
+        free(workers[k].buffer);
+    }
+    stagesRunning = false;
+}
+
+int stages_join(const struct sockaddr *address, socklen_t size, int desc) {
+    int slot;
+    if (free_count > 0) {
+        slot = free_slots[--free_count];
+    } else {
+        slot = next_slot++;
+    }
+
+    stage_job *job = new_job(JOB_JOIN, 0);
+    job->slot = slot / worker_count;
+    job->size = (size <= sizeof(struct sockaddr_storage)) ? size : sizeof(struct sockaddr_storage);
+    job->desc = desc;
+    memcpy(&(job->address), address, job->size);
+    push(&workers[slot % worker_count], job);
+
+    staged++;
+    return slot;
+}
+
+void stages_leave(int slot) {
+    stage_job *job = new_job(JOB_LEAVE, 0);
+    job->slot = slot / worker_count;
+    push(&workers[slot % worker_count], job);
+
+    if (free_count == free_capacity) {
+        free_capacity = (free_capacity > 0) ? 2*free_capacity : 64;
+        free_slots = realloc(free_slots, sizeof(int)*free_capacity);
+    }
+    free_slots[free_count++] = slot;
+    staged--;
+}
+
+int stages_broadcast(const void *data, size_t length) {
+    if (staged == 0) {
+        return 0;
+    }
+
+    stage_job *job = new_job(JOB_SEND, length);
+    job->refs = worker_count;
+    memcpy(job->data, data, length);
+    for (int k = 0; k < worker_count; k++) {
+        push(&workers[k], job);
+    }
+
+    return staged;
+}
+
+/* bytes waiting in socket's receive queue, -1 if kernel can't tell */
+static long receive_backlog(int fd) {
+#ifdef SO_MEMINFO
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t size = sizeof(meminfo);
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &size) == 0) {
+        return meminfo[SK_MEMINFO_RMEM_ALLOC];
+    }
+#endif
+    (void)fd;
+    return -1;
+}
+
+size_t stages_memory() {
+    size_t bytes = sizeof(int)*free_capacity;
+    for (int k = 0; k < worker_count; k++) {
+        bytes += sizeof(void*)*STAGE_QUEUE_CAPACITY + sizeof(stage_recipient)*workers[k].capacity + workers[k].heap;
+    }
+    return bytes;
+}
+
+void stages_report(FILE *out, const int *sockets, int count) {
+    if (worker_count == 0) {
+        return;
+    }
+
+    fprintf(out, "Receive stage:");
+    for (int k = 0; k < count; k++) {
+        fprintf(out, " socket %d queue %ld bytes%s", k, receive_backlog(sockets[k]), (k + 1 < count) ? "," : "\n");
+    }
+    for (int k = 0; k < worker_count; k++) {
+        stage_worker *w = &workers[k];
+        fprintf(out, "Fan-out %d: queue %d (peak %d of %d), stalled receive %lu times for %.2f ms, "
+                "%lu messages, %lu sends, %lu vanished, %lu errors\n", k, queue_size(&(w->queue)), w->peak,
+                STAGE_QUEUE_CAPACITY, w->stalls, w->stall_ns/1e6, w->messages, w->sends, w->vanished, w->errors);
+    }
+    fflush(out);
+}
@@ -0,0 +1,44 @@
+#ifndef MAKEFILE_STAGES_H
+#define MAKEFILE_STAGES_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Staged fan-out (server's -P). The main loop stays the receive stage - it reads, decodes and
+ * keeps the registry - while sends to plain (non reliable) clients move to worker threads.
+ * Every worker owns a slice of recipients: its own table, changed by join/leave jobs which
+ * travel through the same bounded queue as messages, so they're applied in order.
+ * A full queue blocks the receive stage (kernel buffer takes the burst) - nothing is dropped.
+ */
+
+extern bool stagesRunning;
+
+/* -1 when threads can't be started */
+int stages_start(int workers);
+
+/* finishes everything queued and stops workers */
+void stages_stop();
+
+/* waits until workers have sent everything queued so far */
+void stages_drain();
+
+/*
+ * Hands client over to a worker, returns slot which identifies it there.
+ * Address is copied, desc is the server socket to send from.
+ */
+int stages_join(const struct sockaddr *address, socklen_t size, int desc);
+void stages_leave(int slot);
+
+/* queues data (message or batch) for every staged client; returns their number */
+int stages_broadcast(const void *data, size_t length);
+
+/* bytes in queues and recipient tables (read while workers run, so approximate) */
+size_t stages_memory();
+
+/* queue depths and counters of every stage (also after stages_stop()); sockets are receive stage's */
+void stages_report(FILE *out, const int *sockets, int count);
+
+#endif //MAKEFILE_STAGES_H
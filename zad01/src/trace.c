@@ -0,0 +1,154 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define TRACE_BUCKETS 40 /* bucket k holds [2^(k-1), 2^k) ns, last one everything above */
+#define TRACE_FILE_BUFFER (64*1024)
+
+typedef struct {
+    const char *name;
+    int from;
+    int to;
+    unsigned long buckets[TRACE_BUCKETS];
+    unsigned long count;
+    long sum;
+    long max;
+} trace_histogram;
+
+bool trace_on = false;
+
+static trace_histogram histograms[] = {
+    {"decode", TRACE_RECEIVED, TRACE_DECODED, {0}, 0, 0, 0},
+    {"log", TRACE_DECODED, TRACE_FANOUT, {0}, 0, 0, 0},
+    {"fanout", TRACE_FANOUT, TRACE_SENT, {0}, 0, 0, 0},
+    {"total", TRACE_RECEIVED, TRACE_SENT, {0}, 0, 0, 0}
+};
+#define TRACE_HISTOGRAMS ((int)(sizeof(histograms)/sizeof(histograms[0])))
+
+static FILE *trace_file = NULL;
+static int trace_sample_every = 1;
+static unsigned long traced = 0;
+static bool first_event = true;
+
+int trace_init(const char *path, int sample_every) {
+    trace_on = true;
+    trace_sample_every = sample_every;
+
+    if (path != NULL) {
+        trace_file = fopen(path, "w");
+        if (trace_file == NULL) {
+            return -1;
+        }
+        setvbuf(trace_file, NULL, _IOFBF, TRACE_FILE_BUFFER);
+        fprintf(trace_file, "[\n");
+    }
+
+    return 0;
+}
+
+void trace_stamp(trace_record *r, int stamp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    r->ns[stamp] = ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+static int bucket_of(long ns) {
+    int bucket = 0;
+    while (ns > 0 && bucket < TRACE_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+static void write_event(const char *name, long from_ns, long to_ns, unsigned long id, const trace_record *r,
+                        const char *from) {
+    fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"msg\":%lu,\"from\":\"", first_event ? "" : ",\n", name, (int)getpid(),
+            from_ns/1000.0, (to_ns - from_ns)/1000.0, id);
+    first_event = false;
+
+    /* usernames come from the network - keep the JSON valid whatever they contain */
+    for (const char *c = from; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', trace_file);
+            fputc(*c, trace_file);
+        } else if ((unsigned char)*c >= 0x20) {
+            fputc(*c, trace_file);
+        }
+    }
+    fprintf(trace_file, "\",\"recipients\":%d}}", r->recipients);
+}
+
+void trace_end(trace_record *r, const char *from) {
+    for (int h = 0; h < TRACE_HISTOGRAMS; h++) {
+        trace_histogram *hist = &(histograms[h]);
+        long ns = r->ns[hist->to] - r->ns[hist->from];
+        hist->buckets[bucket_of(ns)]++;
+        hist->count++;
+        hist->sum += ns;
+        if (ns > hist->max) {
+            hist->max = ns;
+        }
+    }
+
+    if (trace_file != NULL && traced % trace_sample_every == 0) {
+        /* whole message, stages nest inside it */
+        write_event("message", r->ns[TRACE_RECEIVED], r->ns[TRACE_SENT], traced, r, from);
+        for (int h = 0; h < TRACE_HISTOGRAMS - 1; h++) {
+            write_event(histograms[h].name, r->ns[histograms[h].from], r->ns[histograms[h].to], traced, r, from);
+        }
+    }
+    traced++;
+}
+
+/* upper bound of the bucket in which given fraction of samples is reached */
+static long percentile(const trace_histogram *hist, double fraction) {
+    unsigned long needed = (unsigned long)(hist->count * fraction);
+    unsigned long seen = 0;
+    for (int b = 0; b < TRACE_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen > needed) {
+            return ((1L << b) < hist->max) ? (1L << b) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void trace_report(FILE *out) {
+    if (!trace_on) {
+        return;
+    }
+
+    fprintf(out, "Traced messages: %lu\n", traced);
+    for (int h = 0; h < TRACE_HISTOGRAMS; h++) {
+        const trace_histogram *hist = &(histograms[h]);
+        if (hist->count == 0) {
+            continue;
+        }
+
+        fprintf(out, "%-7s mean %.2f us, p50 < %.2f us, p99 < %.2f us, max %.2f us\n", hist->name,
+                hist->sum/1000.0/hist->count, percentile(hist, 0.5)/1000.0, percentile(hist, 0.99)/1000.0,
+                hist->max/1000.0);
+        for (int b = 0; b < TRACE_BUCKETS; b++) {
+            if (hist->buckets[b] > 0) {
+                fprintf(out, "    < %10.3f us: %lu\n", (1L << b)/1000.0, hist->buckets[b]);
+            }
+        }
+    }
+    fflush(out);
+}
+
+void trace_close() {
+    if (trace_file != NULL) {
+        fprintf(trace_file, "\n]\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef MAKEFILE_TRACE_H
+#define MAKEFILE_TRACE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Opt-in per-message tracing of the server pipeline. Every message is stamped (CLOCK_MONOTONIC, ns)
+ * when recv returns, when it's decoded, when fan-out starts and after the last send; time between
+ * stamps goes to per-stage log2 histograms. Every n-th message can also be written to a file in
+ * Chrome trace event format (load it in chrome://tracing or Perfetto).
+ * When tracing is off, TRACE_* macros cost one branch.
+ */
+
+enum {
+    TRACE_RECEIVED,
+    TRACE_DECODED,
+    TRACE_FANOUT,
+    TRACE_SENT,
+    TRACE_STAMPS
+};
+
+typedef struct {
+    long ns[TRACE_STAMPS];
+    int recipients;
+} trace_record;
+
+extern bool trace_on;
+
+#define TRACE_STAMP(r, stamp) do { if (trace_on) trace_stamp((r), (stamp)); } while (0)
+#define TRACE_END(r, from) do { if (trace_on) trace_end((r), (from)); } while (0)
+
+/* path may be NULL (histograms only); sample_every > 0. -1 when file can't be opened */
+int trace_init(const char *path, int sample_every);
+
+void trace_stamp(trace_record *r, int stamp);
+
+/* accounts finished message; r->recipients should be set by then */
+void trace_end(trace_record *r, const char *from);
+
+void trace_report(FILE *out);
+
+/* finishes trace file */
+void trace_close();
+
+#endif //MAKEFILE_TRACE_H
@@ -0,0 +1,114 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "tuning.h"
+
+void tuning_defaults(tuning_options *t) {
+    memset(t, 0, sizeof(tuning_options));
+    CPU_ZERO(&(t->cpus));
+}
+
+int tuning_parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+
+    const char *p = list;
+    while(*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+
+        long last = first;
+        p = end;
+        if(*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+            p = end;
+        }
+
+        for(long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+
+        if(*p == ',') {
+            p++;
+        } else if(*p != '\0') {
+            return -1;
+        }
+    }
+
+    return (CPU_COUNT(set) > 0) ? 0 : -1;
+}
+
+int tuning_apply_affinity(const tuning_options *t) {
+    if(!t->pin) {
+        return 0;
+    }
+
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &(t->cpus));
+    if(result != 0) {
+        errno = result;
+        return -1;
+    }
+    return 0;
+}
+
+int tuning_apply_busy_poll(const tuning_options *t, int fd) {
+    if(t->busy_poll_us <= 0) {
+        return 0;
+    }
+
+    int usec = t->busy_poll_us;
+    if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == -1) {
+        return -1;
+    }
+
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1) {
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+int tuning_poll(const tuning_options *t, struct pollfd *fds, nfds_t nfds, int timeout_ms) {
+    if(t->spin_us <= 0 || timeout_ms == 0) {
+        return poll(fds, nfds, timeout_ms);
+    }
+
+    long start = now_us();
+    long spun;
+    do {
+        int events = poll(fds, nfds, 0);
+        if(events != 0) {
+            return events;
+        }
+        spun = now_us() - start;
+    } while(spun < t->spin_us);
+
+    if(timeout_ms < 0) {
+        return poll(fds, nfds, -1);
+    }
+
+    long left = timeout_ms - spun/1000;
+    return poll(fds, nfds, (left > 0) ? (int)left : 0);
+}
@@ -0,0 +1,179 @@
+#include "../src/config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+
+#include "../src/message.h"
+#include "../src/clients.h"
+
+/*
+ * Microbenchmarks of per-message primitives of the TCP server (the shared ones - queue,
+ * sockaddr_cmp, pack_message - are covered by zad01 bench). Output format is the same:
+ *   {"bench":..., "params":{...}, "ops":..., "repeats":..., "ns_per_op":{"min":..,"median":..,"max":..}}
+ */
+
+#define BENCH_DRAIN_EVERY 64 /* broadcasts between drains, must fit into socket buffers */
+
+int repeats = 5;
+char **only = NULL; /* names of benchmarks to run, NULL - all */
+int only_count = 0;
+
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000000L + ts.tv_nsec;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+bool selected(const char *name) {
+    if (only == NULL) {
+        return true;
+    }
+    for (int i = 0; i < only_count; i++) {
+        if (strcmp(only[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* runs case: body(arg, ops) performs ops operations and returns time spent on them (ns) */
+void run(const char *name, const char *params, long ops, long (*body)(void *arg, long ops), void *arg) {
+    double *samples = malloc(sizeof(double)*repeats);
+
+    body(arg, ops);
+    for (int r = 0; r < repeats; r++) {
+        samples[r] = (double)body(arg, ops)/ops;
+    }
+
+    qsort(samples, repeats, sizeof(double), compare_doubles);
+    printf("{\"bench\":\"%s\",\"params\":{%s},\"ops\":%ld,\"repeats\":%d,"
+           "\"ns_per_op\":{\"min\":%.2f,\"median\":%.2f,\"max\":%.2f}}\n",
+           name, params, ops, repeats, samples[0], samples[repeats/2], samples[repeats - 1]);
+    fflush(stdout);
+    free(samples);
+}
+
+/* -------------------------------------- */
+
+typedef struct {
+    message msg;
+    int *peers; /* other ends of client sockets */
+    int count;
+} broadcast_arg;
+
+void drain(broadcast_arg *b) {
+    char sink[64*1024];
+    for (int i = 0; i < b->count; i++) {
+        while (read(b->peers[i], sink, sizeof(sink)) > 0);
+    }
+}
+
+/* draining is not timed - server's sends must never block here */
+long body_broadcast(void *arg, long ops) {
+    broadcast_arg *b = arg;
+    long spent = 0;
+
+    for (long done = 0; done < ops; ) {
+        long start = now_ns();
+        for (int k = 0; k < BENCH_DRAIN_EVERY && done < ops; k++, done++) {
+            broadcast(&(b->msg), sizeof(message));
+        }
+        spent += now_ns() - start;
+        drain(b);
+    }
+
+    return spent;
+}
+
+void bench_broadcast() {
+    int sizes[] = {1, 16, 256, 1024};
+    broadcast_arg b;
+    memset(&(b.msg), 0, sizeof(message));
+    strcpy(b.msg.from, "benchmark");
+    memset(b.msg.msg, 'x', MSG_LEN_MAX);
+    b.peers = malloc(sizeof(int)*sizes[3]);
+    b.count = 0;
+
+    for (int s = 0; s < 4; s++) {
+        for (; b.count < sizes[s]; b.count++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+                perror("socketpair(...) failed");
+                exit(1);
+            }
+            fcntl(pair[1], F_SETFL, O_NONBLOCK);
+            addClient(pair[0]);
+            b.peers[b.count] = pair[1];
+        }
+
+        char params[128];
+        snprintf(params, sizeof(params), "\"clients\":%d", sizes[s]);
+        run("broadcast", params, 20000/sizes[s] + 64, body_broadcast, &b);
+    }
+
+    for (int i = CLIENTS_FIRST; i < clientIterator; i++) {
+        if (ufds[i].fd >= 0) {
+            close(ufds[i].fd);
+        }
+    }
+    for (int i = 0; i < b.count; i++) {
+        close(b.peers[i]);
+    }
+    free(b.peers);
+}
+
+/* -------------------------------------- */
+
+void print_usage() {
+    printf("Usage: bench [options] [benchmark...]\n"
+           "  -r, --repeats <n>  timed runs per case (default 5)\n"
+           "benchmarks: broadcast\n");
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"repeats", required_argument, NULL, 'r'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'r':
+                repeats = (int)strtol(optarg, NULL, 10);
+                if (repeats <= 0) {
+                    printf("Number of repeats must be positive\n");
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
+    if (optind < argc) {
+        only = argv + optind;
+        only_count = argc - optind;
+    }
+
+    if (selected("broadcast")) {
+        bench_broadcast();
+    }
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attach.h"
+
+void attach_format(message *msg, const char *from, const attach_header *h) {
+    memset(msg, 0, sizeof(message));
+    strncpy(msg->from, from, USERNAME_MAX);
+    snprintf(msg->msg, sizeof(msg->msg), "%c%c %u %lu %lu %lu %s", ATTACH_MARK, h->kind, h->id, h->offset,
+             h->bytes, h->total, h->name);
+}
+
+bool attach_parse(const message *msg, attach_header *h) {
+    char text[MSG_LEN_MAX + 1];
+    memcpy(text, msg->msg, MSG_LEN_MAX);
+    text[MSG_LEN_MAX] = '\0';
+
+    int name_at = 0;
+    if (text[0] != ATTACH_MARK ||
+        sscanf(text + 1, "%c %u %lu %lu %lu %n", &(h->kind), &(h->id), &(h->offset), &(h->bytes), &(h->total),
+               &name_at) != 5 || name_at == 0) {
+        return false;
+    }
+    if (h->bytes > ATTACH_CHUNK || h->offset > h->total || h->bytes > h->total - h->offset) {
+        return false;
+    }
+    attach_name(text + 1 + name_at, h->name);
+    return true;
+}
+
+void attach_name(const char *path, char *name) {
+    const char *slash = strrchr(path, '/');
+    const char *base = (slash != NULL) ? slash + 1 : path;
+    if (base[0] == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        base = "attachment";
+    }
+    strncpy(name, base, ATTACH_NAME_MAX);
+    name[ATTACH_NAME_MAX] = '\0';
+}
@@ -0,0 +1,45 @@
+#ifndef MAKEFILE_ATTACH_H
+#define MAKEFILE_ATTACH_H
+
+#include <stdbool.h>
+
+#include "message.h"
+
+/*
+ * Attachments share the connection with chat. A chunk of a file is a message whose text
+ * starts with ATTACH_MARK, followed on the stream by as many raw bytes as the text says:
+ *   ATTACH_MARK kind ' ' id ' ' offset ' ' bytes ' ' total ' ' name
+ * Clients upload with ATTACH_UPLOAD chunks (id is 0, server picks one), everybody is told
+ * "shared <name> ..., /get <id>" once the last one is in. "/get <id>" asks for a download,
+ * which comes as ATTACH_DOWNLOAD chunks. Chunks carry at most ATTACH_CHUNK bytes and are sent
+ * only while less than ATTACH_QUEUED_MAX waits in the socket, so chat messages never wait
+ * behind more than that. Server's notes about transfers come from ATTACH_SENDER.
+ */
+
+#define ATTACH_MARK '\x1f'
+#define ATTACH_UPLOAD 'U'
+#define ATTACH_DOWNLOAD 'D'
+#define ATTACH_REQUEST "/get "
+#define ATTACH_SEND "/send "
+#define ATTACH_SENDER "&"
+
+#define ATTACH_FRAME(m) ((m)->msg[0] == ATTACH_MARK)
+
+typedef struct {
+    char kind;
+    unsigned id;
+    unsigned long offset;
+    unsigned long bytes;
+    unsigned long total;
+    char name[ATTACH_NAME_MAX + 1];
+} attach_header;
+
+void attach_format(message *msg, const char *from, const attach_header *h);
+
+/* false when msg isn't a well formed chunk header */
+bool attach_parse(const message *msg, attach_header *h);
+
+/* last component of path, cut to ATTACH_NAME_MAX; "attachment" when nothing is left */
+void attach_name(const char *path, char *name);
+
+#endif //MAKEFILE_ATTACH_H
@@ -0,0 +1,258 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define CAPTURE_FILE_BUFFER (64*1024)
+
+typedef struct {
+    uint8_t length;
+    unsigned char key[255];
+} capture_source;
+
+bool capture_on = false;
+
+static FILE *capture_file = NULL;
+static long last_us = 0;
+
+static capture_source *sources = NULL; /* by number */
+static int source_count = 0;
+static int source_capacity = 0;
+static int *source_index = NULL;      /* open addressing over sources, -1 - empty */
+static int index_size = 0;
+
+static unsigned long messages = 0;
+static unsigned long bytes = 0;
+static unsigned long write_errors = 0;
+
+/* -------------------------------------- */
+
+static long mono_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+static uint32_t key_hash(const void *key, size_t length) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t k = 0; k < length; k++) {
+        hash = (hash ^ ((const unsigned char *)key)[k])*16777619u;
+    }
+    return hash;
+}
+
+static void put_varint(unsigned long value) {
+    while (value >= 0x80) {
+        fputc((int)(value | 0x80) & 0xff, capture_file);
+        value >>= 7;
+        bytes++;
+    }
+    fputc((int)value, capture_file);
+    bytes++;
+}
+
+static void put_bytes(const void *data, size_t length) {
+    fputc((int)length, capture_file);
+    fwrite(data, 1, length, capture_file);
+    bytes += 1 + length;
+}
+
+/* number of source, new ones are written to the file first */
+static int source_number(const void *key, size_t length) {
+    if (index_size > 0) {
+        int mask = index_size - 1;
+        for (int pos = key_hash(key, length) & mask; source_index[pos] != -1; pos = (pos + 1) & mask) {
+            capture_source *s = &(sources[source_index[pos]]);
+            if (s->length == length && memcmp(s->key, key, length) == 0) {
+                return source_index[pos];
+            }
+        }
+    }
+
+    if (source_count == source_capacity) {
+        source_capacity = (source_capacity == 0) ? 64 : 2*source_capacity;
+        sources = realloc(sources, sizeof(capture_source)*source_capacity);
+    }
+    /* at most half full */
+    if (2*(source_count + 1) > index_size) {
+        free(source_index);
+        index_size = (index_size == 0) ? 128 : 2*index_size;
+        source_index = malloc(sizeof(int)*index_size);
+        memset(source_index, -1, sizeof(int)*index_size);
+        for (int k = 0; k < source_count; k++) {
+            int pos = key_hash(sources[k].key, sources[k].length) & (index_size - 1);
+            while (source_index[pos] != -1) {
+                pos = (pos + 1) & (index_size - 1);
+            }
+            source_index[pos] = k;
+        }
+    }
+
+    capture_source *s = &(sources[source_count]);
+    s->length = (uint8_t)length;
+    memcpy(s->key, key, length);
+    int pos = key_hash(key, length) & (index_size - 1);
+    while (source_index[pos] != -1) {
+        pos = (pos + 1) & (index_size - 1);
+    }
+    source_index[pos] = source_count;
+
+    fputc('S', capture_file);
+    bytes++;
+    put_varint(source_count);
+    put_bytes(key, length);
+    return source_count++;
+}
+
+/* -------------------------------------- */
+
+int capture_open(const char *path, char transport) {
+    capture_file = fopen(path, "w");
+    if (capture_file == NULL) {
+        return -1;
+    }
+    setvbuf(capture_file, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t start = ts.tv_sec*1000000L + ts.tv_nsec/1000;
+    char header[16] = CAPTURE_MAGIC;
+    header[4] = transport;
+    memcpy(header + 8, &start, sizeof(start));
+    fwrite(header, 1, sizeof(header), capture_file);
+    bytes = sizeof(header);
+
+    last_us = mono_us();
+    capture_on = true;
+    return 0;
+}
+
+void capture_message(const void *source, size_t length, const message *msg) {
+    if (length > sizeof(sources[0].key)) {
+        length = sizeof(sources[0].key);
+    }
+    int number = source_number(source, length);
+
+    long now = mono_us();
+    fputc('M', capture_file);
+    bytes++;
+    put_varint((messages == 0) ? 0 : (unsigned long)(now - last_us));
+    put_varint(number);
+    put_bytes(msg->from, strnlen(msg->from, USERNAME_MAX));
+    put_bytes(msg->msg, strnlen(msg->msg, MSG_LEN_MAX));
+    last_us = now;
+    messages++;
+}
+
+void capture_close() {
+    if (capture_file == NULL) {
+        return;
+    }
+    if (fclose(capture_file) != 0) {
+        write_errors++;
+    }
+    capture_file = NULL;
+    capture_on = false;
+}
+
+void capture_report(FILE *out) {
+    if (messages == 0 && !capture_on) {
+        return;
+    }
+    if (capture_file != NULL && ferror(capture_file)) {
+        write_errors++;
+        clearerr(capture_file);
+    }
+    fprintf(out, "Capture: %lu messages from %d sources in %lu bytes (%.1f per message), %lu write errors\n",
+            messages, source_count, bytes, (messages > 0) ? (double)bytes/messages : 0.0, write_errors);
+    fflush(out);
+}
+
+/* -------------------------------------- */
+
+static int get_varint(FILE *in, unsigned long *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(in);
+        if (c == EOF) {
+            return -1;
+        }
+        *value |= (unsigned long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int get_bytes(FILE *in, char *data, size_t max) {
+    int length = fgetc(in);
+    if (length == EOF || (size_t)length > max || fread(data, 1, length, in) != (size_t)length) {
+        return -1;
+    }
+    return length;
+}
+
+int capture_read_open(capture_reader *r, const char *path) {
+    r->in = fopen(path, "r");
+    if (r->in == NULL) {
+        return -1;
+    }
+
+    char header[16];
+    int64_t start;
+    if (fread(header, 1, sizeof(header), r->in) != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 4) != 0 ||
+        (header[4] != CAPTURE_UDP && header[4] != CAPTURE_TCP)) {
+        fclose(r->in);
+        r->in = NULL;
+        return -1;
+    }
+    memcpy(&start, header + 8, sizeof(start));
+    r->transport = header[4];
+    r->start_us = (long)start;
+    r->at_us = 0;
+    r->sources = 0;
+    return 0;
+}
+
+int capture_read(capture_reader *r, long *at_us, int *source, message *msg) {
+    char key[255];
+    unsigned long value;
+    int kind;
+    while ((kind = fgetc(r->in)) == 'S') {
+        /* replay needs only their number */
+        if (get_varint(r->in, &value) == -1 || value != (unsigned long)r->sources ||
+            get_bytes(r->in, key, sizeof(key)) == -1) {
+            return -1;
+        }
+        r->sources++;
+    }
+    if (kind == EOF) {
+        return 0;
+    }
+    if (kind != 'M' || get_varint(r->in, &value) == -1) {
+        return -1;
+    }
+    r->at_us += (long)value;
+
+    memset(msg, 0, sizeof(message));
+    if (get_varint(r->in, &value) == -1 || value >= (unsigned long)r->sources ||
+        get_bytes(r->in, msg->from, USERNAME_MAX) == -1 || get_bytes(r->in, msg->msg, MSG_LEN_MAX) == -1) {
+        return -1;
+    }
+    *at_us = r->at_us;
+    *source = (int)value;
+    return 1;
+}
+
+void capture_read_close(capture_reader *r) {
+    if (r->in != NULL) {
+        fclose(r->in);
+        r->in = NULL;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef MAKEFILE_CAPTURE_H
+#define MAKEFILE_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "message.h"
+
+/*
+ * Traffic capture (server's -C) for replaying real load later (see replay.c). Every chat message
+ * server receives (attachment chunks aren't) is written with time it came and its source -
+ * address recvfrom() gave for UDP, connection for TCP. File is a header followed by records:
+ *   "CAP1", transport ('u' or 't'), 3 zero bytes, wall clock start (int64 us)
+ *   'S' <varint source> <1-byte length> <bytes>          new source, numbered from 0
+ *   'M' <varint us since previous message> <varint source>
+ *       <1-byte length> <sender> <1-byte length> <text>
+ * When capture is off, CAPTURE() costs one branch.
+ */
+
+#define CAPTURE_MAGIC "CAP1"
+#define CAPTURE_UDP 'u'
+#define CAPTURE_TCP 't'
+
+extern bool capture_on;
+
+#define CAPTURE(source, length, msg) do { if (capture_on) capture_message((source), (length), (msg)); } while (0)
+
+/* transport is CAPTURE_UDP or CAPTURE_TCP; -1 when file can't be opened */
+int capture_open(const char *path, char transport);
+
+/* source identifies sender (at most 255 bytes), equal bytes - the same one */
+void capture_message(const void *source, size_t length, const message *msg);
+
+void capture_close();
+
+void capture_report(FILE *out);
+
+/* reading */
+
+typedef struct {
+    FILE *in;
+    char transport;
+    long start_us;                /* wall clock */
+    long at_us;                   /* of the last message, since the first one */
+    int sources;                  /* seen so far */
+} capture_reader;
+
+/* -1 when file can't be opened or isn't a capture */
+int capture_read_open(capture_reader *r, const char *path);
+
+/* next message with its time and source; 1 - read, 0 - end of capture, -1 - malformed */
+int capture_read(capture_reader *r, long *at_us, int *source, message *msg);
+
+void capture_read_close(capture_reader *r);
+
+#endif //MAKEFILE_CAPTURE_H
@@ -1,9 +1,11 @@
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -11,13 +13,25 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <poll.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
+#include <fcntl.h>
 
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <stdarg.h>
 
 #include "message.h"
 #include "queue.h"
+#include "presence.h"
+#include "fragment.h"
+#include "attach.h"
 
 #define EXIT() exit(1);
 
@@ -33,15 +47,96 @@ typedef struct {
 	struct sockaddr *address;
 	size_t address_size;
 	int sock_type;
+	long linger_us;
+	bool headless;
+	char *input_path; /* headless mode reads from it instead of stdin */
+	int overflow; /* OVERFLOW_*, what happens to received messages UI has no room for */
+	char *downloads_dir; /* "/get <id>" saves files here */
 } program_arguments;
 
+enum {
+	OVERFLOW_GROW,
+	OVERFLOW_DROP,
+	OVERFLOW_COALESCE
+};
+
 program_arguments program_args;
 int sd = -1;
 volatile short should_exit = 0;
+volatile short input_finished = 0; /* headless mode reached end of input */
+
+void print_usage() {
+	printf("Usage: client [options] <username> <l|r> <unix_socket_path|ip> [port]\n"
+		   "  -L, --linger-us <us> wait for more messages before sending a batch\n"
+		   "  -b, --headless       no prompts: one message per input line, received ones written as lines\n"
+		   "  -f, --input <file>   headless input (default stdin)\n"
+		   "  -O, --overflow <grow|drop|coalesce>  received messages the display can't keep up with are\n"
+		   "                       kept aside (default), dropped oldest first, or shown as one bulk\n"
+		   "                       of the last %d\n"
+		   "  -D, --downloads <dir> where files asked for with \"/get <id>\" are saved (default .)\n"
+		   "\"/send <path>\" shares a file with everybody, if server keeps them\n", INBOUND_BULK_MAX);
+}
 
 void process_arguments(int argc, char **argv, program_arguments *args) {
+	static struct option long_options[] = {
+		{"linger-us", required_argument, NULL, 'L'},
+		{"headless", no_argument, NULL, 'b'},
+		{"input", required_argument, NULL, 'f'},
+		{"overflow", required_argument, NULL, 'O'},
+		{"downloads", required_argument, NULL, 'D'},
+		{NULL, 0, NULL, 0}
+	};
+
+	args->linger_us = 0;
+	args->headless = false;
+	args->input_path = NULL;
+	args->overflow = OVERFLOW_GROW;
+	args->downloads_dir = ".";
+
+	int opt;
+	while((opt = getopt_long(argc, argv, "+L:bf:O:D:", long_options, NULL)) != -1) {
+		switch(opt) {
+			case 'b':
+				args->headless = true;
+				break;
+			case 'f':
+				args->input_path = optarg;
+				break;
+			case 'O':
+				if(strcmp(optarg, "grow") == 0) {
+					args->overflow = OVERFLOW_GROW;
+				} else if(strcmp(optarg, "drop") == 0) {
+					args->overflow = OVERFLOW_DROP;
+				} else if(strcmp(optarg, "coalesce") == 0) {
+					args->overflow = OVERFLOW_COALESCE;
+				} else {
+					printf("Overflow policy must be grow, drop or coalesce\n");
+					EXIT();
+				}
+				break;
+			case 'D':
+				args->downloads_dir = optarg;
+				break;
+			case 'L':
+				args->linger_us = strtol(optarg, NULL, 10);
+				if(args->linger_us < 0 || args->linger_us >= 1000000) {
+					printf("Linger must be within [0, 1000000) us\n");
+					EXIT();
+				}
+				break;
+			default:
+				print_usage();
+				EXIT();
+		}
+	}
+
+	/* positional arguments keep their indexes */
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if(argc < 3) {
 		printf("Too few arguments\n");
+		print_usage();
 		EXIT();
 	}
 
@@ -83,10 +178,17 @@ void process_arguments(int argc, char **argv, program_arguments *args) {
 			EXIT();
 		}
 
-		struct sockaddr_in *inet_address = calloc(sizeof(struct sockaddr_in), 1);
-		inet_address->sin_family = AF_INET;
-		int ret = inet_pton(AF_INET, argv[3], &(inet_address->sin_addr));
-		if(ret != 1) {
+		/* IPv4 or IPv6 */
+		struct sockaddr_storage *storage = calloc(sizeof(struct sockaddr_storage), 1);
+		struct sockaddr_in *inet_address = (struct sockaddr_in *)storage;
+		struct sockaddr_in6 *inet6_address = (struct sockaddr_in6 *)storage;
+		if(inet_pton(AF_INET, argv[3], &(inet_address->sin_addr)) == 1) {
+			inet_address->sin_family = AF_INET;
+			args->address_size = sizeof(struct sockaddr_in);
+		} else if(inet_pton(AF_INET6, argv[3], &(inet6_address->sin6_addr)) == 1) {
+			inet6_address->sin6_family = AF_INET6;
+			args->address_size = sizeof(struct sockaddr_in6);
+		} else {
 			printf("Wrong IP format\n");
 			EXIT();
 		}
@@ -96,11 +198,11 @@ void process_arguments(int argc, char **argv, program_arguments *args) {
 			printf("Wrong port\n");
 			EXIT();
 		}
+		/* port is at the same place in both */
 		inet_address->sin_port = htons((in_port_t)unvalidated_port);
 
-		args->address = inet_address;
-		args->address_size = sizeof(struct sockaddr_in);
-		args->sock_type = AF_INET;
+		args->address = (struct sockaddr *)storage;
+		args->sock_type = storage->ss_family;
 	}
 }
 
@@ -148,25 +250,72 @@ void print_recipient_query() {
 	fflush(stdout);
 }
 
-void print_all_pending_msgs(queue_t *q_out) {
+/*
+ * Received messages on their way to UI (q_out). Networking thread never waits for UI: whatever
+ * doesn't fit into q_out is handled by overflow policy (see deliver()). Entries are single
+ * messages, or with -O coalesce a bulk of the newest ones - a ring of capacity messages.
+ */
+typedef struct {
+	int count;
+	int capacity;
+	int first;
+	unsigned long skipped; /* older messages bulk had no room for */
+	message msgs[];
+} inbound;
+
+/* set by networking thread while it holds messages back; UI kicks it once it made room */
+volatile short inbound_waiting = 0;
+
+/* long texts put back together; UI thread's, or networking thread's in headless mode */
+fragment_reader incoming;
+
+/* what to show for received msg, NULL while it's a piece of a longer text still coming */
+const char *shown_text(message *msg) {
+	const char *text;
+	switch(fragment_accept(&incoming, msg, &text)) {
+		case FRAGMENT_PLAIN:
+			return msg->msg;
+		case FRAGMENT_DONE:
+			return text;
+		case FRAGMENT_LOST:
+			return "[part of a long message was lost]";
+		default:
+			return NULL;
+	}
+}
+
+void print_all_pending_msgs(queue_t *q_out, pthread_t networking_thread) {
 
 	short at_least_one_printed = 0;
-	message *msg = NULL;
-	while(msg = queue_dequeue(q_out), msg != NULL) {
+	inbound *entry = NULL;
+	while(entry = queue_dequeue(q_out), entry != NULL) {
 		at_least_one_printed = 1;
-		printf("\n! [%s] %s\n", msg->from, msg->msg);
-		free(msg);
+		if(entry->skipped > 0) {
+			printf("\n! ... %lu earlier messages skipped, display was busy\n", entry->skipped);
+		}
+		for(int i = 0; i < entry->count; i++) {
+			message *msg = &(entry->msgs[(entry->first + i) % entry->capacity]);
+			const char *text = shown_text(msg);
+			if(text != NULL) {
+				printf("\n! [%s] %s\n", msg->from, text);
+			}
+		}
+		free(entry);
 	}
 
 	if(at_least_one_printed != 0) {
 		print_command_prompt();
+		if(inbound_waiting) {
+			pthread_kill(networking_thread, SIGUSR2);
+		}
 	}
 }
 
 message *pack_message(char *from, char *content) {
 	message *msg = calloc(sizeof(message), 1);
-	strcpy(msg->from, from);
-	strcpy(msg->msg, content);
+	/* calloc'ed, so cut ones stay terminated */
+	strncpy(msg->from, from, USERNAME_MAX);
+	strncpy(msg->msg, content, MSG_LEN_MAX);
 
 	return msg;
 }
@@ -180,6 +329,18 @@ typedef struct {
 	pthread_t networking_thread;
 } thread_data;
 
+/* text goes as one message, or as several when it doesn't fit */
+void enqueue_text(thread_data *data, const char *text, size_t length) {
+	fragment_writer w;
+	fragment_begin(&w, data->program_args->username, text, length);
+
+	message *msg;
+	while((msg = fragment_next(&w)) != NULL) {
+		queue_enqueue(data->q_in, msg);
+		pthread_kill(data->networking_thread, SIGUSR2);
+	}
+}
+
 void *thread_io(void *_data) {
 	thread_data *data = _data;
 
@@ -193,7 +354,7 @@ void *thread_io(void *_data) {
 			GET_LINE();
 
 			if(strcmp(buffer_for_user_input, USR_CMD_EXIT) == 0) {
-				print_all_pending_msgs(data->q_out);
+				print_all_pending_msgs(data->q_out, data->networking_thread);
 				should_exit = 1;
 				pthread_kill(data->networking_thread, SIGUSR2);
 			} else if(strcmp(buffer_for_user_input, USR_CMD_TYPE) == 0) {
@@ -204,63 +365,591 @@ void *thread_io(void *_data) {
 					buffer_for_user_input[read-1] = '\0';
 				}
 
-				message *packed_msg = pack_message(data->program_args->username, buffer_for_user_input);
-				queue_enqueue(data->q_in, packed_msg);
-				pthread_kill(data->networking_thread, SIGUSR2);
+				enqueue_text(data, buffer_for_user_input, strlen(buffer_for_user_input));
 
 				print_command_prompt();
 			} else {
 				print_command_prompt();
 			}
 		} else {
-			print_all_pending_msgs(data->q_out);
+			print_all_pending_msgs(data->q_out, data->networking_thread);
 		}
 	}
 
 	#undef GET_LINE
 }
 
+/*
+ * Headless input: every line is a message. Blocks on full q_in, which throttles the reader
+ * to what the network can take. At the end of input networking thread finishes sending and exits.
+ */
+void *thread_headless_input(void *_data) {
+	thread_data *data = _data;
+
+	FILE *input = stdin;
+	if(data->program_args->input_path != NULL) {
+		input = fopen(data->program_args->input_path, "r");
+		if(input == NULL) {
+			perror("fopen(...) failed");
+			input_finished = 1;
+			pthread_kill(data->networking_thread, SIGUSR2);
+			return NULL;
+		}
+	}
+
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t read;
+	while(should_exit != 1 && (read = getline(&line, &line_capacity, input)) != -1) {
+		if(read > 0 && line[read-1] == '\n') {
+			line[--read] = '\0';
+		}
+
+		enqueue_text(data, line, read);
+	}
+
+	free(line);
+	if(input != stdin) {
+		fclose(input);
+	}
+
+	input_finished = 1;
+	pthread_kill(data->networking_thread, SIGUSR2);
+	return NULL;
+}
+
+/*
+ * Set by SIGUSR2 handler. Networking thread keeps SIGUSR2 blocked except inside ppoll(),
+ * so the signal can't slip in between checking this and going to sleep.
+ */
+volatile sig_atomic_t data_signalled = 0;
+
+/* outgoing traffic - messages per syscall shows how well batching works */
+unsigned long sent_messages = 0;
+unsigned long send_syscalls = 0;
+
+/* writes whole iovec array, continuing after partial writes */
+void write_all(struct iovec *iov, int count) {
+	while(count > 0) {
+		ssize_t written = writev(sd, iov, count);
+		send_syscalls++;
+		if(written == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+
+		while(count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+}
+
+/* -------------------------------------- */
+
+void deliver(thread_data *data, message *msg);
+
+/* transfers are reported to user as messages from ATTACH_SENDER */
+void notify(thread_data *data, const char *format, ...) {
+	message note;
+	memset(&note, 0, sizeof(message));
+	strcpy(note.from, ATTACH_SENDER);
+	va_list args;
+	va_start(args, format);
+	vsnprintf(note.msg, sizeof(note.msg), format, args);
+	va_end(args);
+	deliver(data, &note);
+}
+
+typedef struct {
+	int fd;
+	char name[ATTACH_NAME_MAX + 1];
+	off_t offset;
+	off_t total;
+} upload;
+
+/* "/send <path>" files, first one is being sent; networking thread's only */
+upload uploads[ATTACH_UPLOADS_MAX];
+int upload_count = 0;
+
+void start_upload(thread_data *data, const char *path) {
+	if(upload_count == ATTACH_UPLOADS_MAX) {
+		notify(data, "%d files are being sent already, %s isn't", ATTACH_UPLOADS_MAX, path);
+		return;
+	}
+
+	upload *u = &(uploads[upload_count]);
+	struct stat st;
+	u->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(u->fd == -1 || fstat(u->fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		notify(data, "cannot send %s: %s", path, (u->fd == -1) ? strerror(errno) : "not a file");
+		if(u->fd != -1) {
+			close(u->fd);
+		}
+		return;
+	}
+	attach_name(path, u->name);
+	u->offset = 0;
+	u->total = st.st_size;
+	upload_count++;
+}
+
+/* whole chunk goes out, zeros stand in for what the file doesn't have anymore; false if it had to */
+bool send_chunk(upload *u, size_t bytes) {
+	while(bytes > 0) {
+		ssize_t sent = sendfile(sd, u->fd, &(u->offset), bytes);
+		if(sent == -1 && errno == EINTR) {
+			continue;
+		}
+		if(sent == -1 && errno != EIO && errno != EINVAL) {
+			/* connection is gone, poll tells */
+			return true;
+		}
+		if(sent <= 0) {
+			char zeros[ATTACH_CHUNK] = {0};
+			struct iovec iov = {zeros, bytes};
+			write_all(&iov, 1);
+			u->offset += bytes;
+			return false;
+		}
+		bytes -= sent;
+	}
+	return true;
+}
+
+/* chunks go while little waits in the socket, so chat messages slip in between them */
+void pump_uploads(thread_data *data) {
+	while(upload_count > 0) {
+		int queued;
+		if(ioctl(sd, SIOCOUTQ, &queued) == 0 && queued >= ATTACH_QUEUED_MAX) {
+			return;
+		}
+
+		upload *u = &(uploads[0]);
+		attach_header h;
+		h.kind = ATTACH_UPLOAD;
+		h.id = 0;
+		h.offset = u->offset;
+		h.bytes = (u->total - u->offset < ATTACH_CHUNK) ? u->total - u->offset : ATTACH_CHUNK;
+		h.total = u->total;
+		strcpy(h.name, u->name);
+
+		message header;
+		attach_format(&header, data->program_args->username, &h);
+		struct iovec iov = {&header, sizeof(message)};
+		write_all(&iov, 1);
+		sent_messages++;
+		if(!send_chunk(u, h.bytes)) {
+			notify(data, "%s changed while being sent, what was left of it went as zeros", u->name);
+			u->offset = u->total;
+		}
+
+		if(u->offset == u->total) {
+			close(u->fd);
+			memmove(uploads, uploads + 1, sizeof(upload)*(--upload_count));
+		}
+	}
+}
+
+void send_outgoing(thread_data *data) {
+	struct iovec iov[SEND_BATCH_MAX];
+	message *batch[SEND_BATCH_MAX];
+
+	/* give producer a moment to add more, unless there is already enough for full batch */
+	if(data->program_args->linger_us > 0 && queue_size(data->q_in) < SEND_BATCH_MAX) {
+		struct timespec linger = {0, data->program_args->linger_us*1000};
+		nanosleep(&linger, NULL);
+	}
+
+	int count;
+	do {
+		message *msg;
+		count = 0;
+		while(count < SEND_BATCH_MAX && (msg = queue_dequeue(data->q_in), msg != NULL)) {
+			if(strncmp(msg->msg, ATTACH_SEND, strlen(ATTACH_SEND)) == 0) {
+				/* file goes in chunks, see pump_uploads() */
+				start_upload(data, msg->msg + strlen(ATTACH_SEND));
+				free(msg);
+				continue;
+			}
+			iov[count].iov_base = msg;
+			iov[count].iov_len = sizeof(message);
+			batch[count++] = msg;
+		}
+
+		if(count > 0) {
+			write_all(iov, count);
+			sent_messages += count;
+		}
+
+		for(int i = 0; i < count; i++) {
+			free(batch[i]);
+		}
+	} while(count == SEND_BATCH_MAX);
+}
+
+/* -------------------------------------- */
+
+/* messages q_out had no room for, oldest first; networking thread's only */
+inbound **inbound_held = NULL;
+int inbound_held_head = 0;
+int inbound_held_count = 0;
+int inbound_held_capacity = 0;
+unsigned long inbound_held_peak = 0;
+unsigned long inbound_dropped = 0;
+
+inbound *new_inbound(int capacity) {
+	inbound *entry = malloc(sizeof(inbound) + sizeof(message)*capacity);
+	entry->count = 0;
+	entry->capacity = capacity;
+	entry->first = 0;
+	entry->skipped = 0;
+	return entry;
+}
+
+void hold_back_inbound(inbound *entry) {
+	if(inbound_held_head + inbound_held_count == inbound_held_capacity) {
+		if(inbound_held_head > 0) {
+			memmove(inbound_held, inbound_held + inbound_held_head, sizeof(inbound*)*inbound_held_count);
+			inbound_held_head = 0;
+		} else {
+			inbound_held_capacity = (inbound_held_capacity > 0) ? 2*inbound_held_capacity : MSG_QUEUES_CAPACITY;
+			inbound_held = realloc(inbound_held, sizeof(inbound*)*inbound_held_capacity);
+		}
+	}
+	inbound_held[inbound_held_head + inbound_held_count++] = entry;
+	if((unsigned long)inbound_held_count > inbound_held_peak) {
+		inbound_held_peak = inbound_held_count;
+	}
+}
+
+/* moves whatever UI made room for to q_out */
+void flush_held_back_inbound(thread_data *data) {
+	while(inbound_held_count > 0 && queue_try_enqueue(data->q_out, inbound_held[inbound_held_head]) == 0) {
+		inbound_held_head++;
+		inbound_held_count--;
+	}
+	if(inbound_held_count == 0) {
+		inbound_held_head = 0;
+		inbound_waiting = 0;
+	}
+}
+
+void presence_update(thread_data *data, message *msg);
+
+/* hands received message to user - UI thread, or straight to (buffered) stdout in headless mode */
+void deliver(thread_data *data, message *msg) {
+	if(presence_record(msg)) {
+		/* headless output carries only messages, it never asks for roster either */
+		if(!data->program_args->headless) {
+			presence_update(data, msg);
+		}
+		return;
+	}
+
+	if(data->program_args->headless) {
+		const char *text = shown_text(msg);
+		if(text != NULL) {
+			printf("%s\t%s\n", msg->from, text);
+		}
+		return;
+	}
+
+	flush_held_back_inbound(data);
+	if(inbound_held_count == 0) {
+		inbound *entry = new_inbound(1);
+		memcpy(&(entry->msgs[0]), msg, sizeof(message));
+		entry->count = 1;
+		if(queue_try_enqueue(data->q_out, entry) == 0) {
+			return;
+		}
+
+		if(data->program_args->overflow == OVERFLOW_DROP) {
+			/* UI may be dequeuing meanwhile - the swap happens under q_out's own lock */
+			inbound *oldest = queue_enqueue_displace(data->q_out, entry);
+			if(oldest != NULL) {
+				inbound_dropped += oldest->count;
+				free(oldest);
+			}
+			return;
+		}
+
+		if(data->program_args->overflow == OVERFLOW_COALESCE) {
+			inbound *bulk = new_inbound(INBOUND_BULK_MAX);
+			memcpy(&(bulk->msgs[0]), msg, sizeof(message));
+			bulk->count = 1;
+			free(entry);
+			entry = bulk;
+		}
+		hold_back_inbound(entry);
+	} else if(data->program_args->overflow == OVERFLOW_COALESCE) {
+		/* the one bulk waiting keeps the newest */
+		inbound *bulk = inbound_held[inbound_held_head];
+		if(bulk->count < bulk->capacity) {
+			memcpy(&(bulk->msgs[bulk->count++]), msg, sizeof(message));
+		} else {
+			memcpy(&(bulk->msgs[bulk->first]), msg, sizeof(message));
+			bulk->first = (bulk->first + 1) % bulk->capacity;
+			bulk->skipped++;
+			inbound_dropped++;
+		}
+	} else {
+		inbound *entry = new_inbound(1);
+		memcpy(&(entry->msgs[0]), msg, sizeof(message));
+		entry->count = 1;
+		hold_back_inbound(entry);
+	}
+	inbound_waiting = 1;
+}
+
+/* roster as server last described it; networking thread's only */
+presence_view roster_view;
+
+/* next send_outgoing() takes it along */
+void request_roster(thread_data *data) {
+	message *request = pack_message(data->program_args->username, PRESENCE_REQUEST);
+	if(queue_try_enqueue(data->q_in, request) == -1) {
+		/* next delta finds view out of date again */
+		free(request);
+		return;
+	}
+	data_signalled = 1;
+}
+
+/* applies roster record, user sees changes as messages from "*" */
+void presence_update(thread_data *data, message *msg) {
+	message shown;
+	memset(&shown, 0, sizeof(message));
+	strcpy(shown.from, "*");
+
+	switch(presence_apply(&roster_view, msg)) {
+		case PRESENCE_RESYNC:
+			request_roster(data);
+			return;
+		case PRESENCE_UPDATED:
+			/* "+bob -carol ~dave" */
+			strcpy(shown.msg, roster_view.changes);
+			break;
+		case PRESENCE_COMPLETE: {
+			const char *names[PRESENCE_SHOWN_MAX];
+			int count = presence_names(&roster_view, names, PRESENCE_SHOWN_MAX);
+			size_t length = snprintf(shown.msg, sizeof(shown.msg), "%u online:", roster_view.roster.used);
+			for(int i = 0; i < count && length < sizeof(shown.msg); i++) {
+				length += snprintf(shown.msg + length, sizeof(shown.msg) - length, " %s", names[i]);
+			}
+			break;
+		}
+		default:
+			return;
+	}
+
+	deliver(data, &shown);
+}
+
+/* download whose chunks are coming in; networking thread's only */
+struct {
+	int fd; /* -1 - bytes are skipped */
+	unsigned id;
+	char path[PATH_MAX];
+	unsigned long received;
+	unsigned long total;
+	unsigned long chunk_left; /* bytes of current chunk still to come */
+} download = {-1, 0, "", 0, 0, 0};
+
+/* chunk header from server, its bytes follow it */
+void download_bytes(thread_data *data, const char *bytes, size_t length);
+
+void download_chunk(thread_data *data, message *msg) {
+	attach_header h;
+	if(!attach_parse(msg, &h) || h.kind != ATTACH_DOWNLOAD) {
+		notify(data, "[broken attachment chunk]");
+		return;
+	}
+
+	if(h.offset == 0) {
+		if(download.fd != -1) {
+			close(download.fd);
+		}
+		download.id = h.id;
+		download.received = 0;
+		download.total = h.total;
+		snprintf(download.path, sizeof(download.path), "%s/%u-%s", data->program_args->downloads_dir, h.id, h.name);
+		download.fd = open(download.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if(download.fd == -1) {
+			notify(data, "cannot save %s: %s", download.path, strerror(errno));
+		}
+	} else if(h.id != download.id || h.offset != download.received) {
+		/* rest of something that already failed */
+		if(download.fd != -1) {
+			close(download.fd);
+			download.fd = -1;
+		}
+	}
+	download.chunk_left = h.bytes;
+	if(h.bytes == 0) {
+		/* empty file, nothing follows */
+		download_bytes(data, NULL, 0);
+	}
+}
+
+/* bytes of the current chunk, download ends with the last one */
+void download_bytes(thread_data *data, const char *bytes, size_t length) {
+	download.chunk_left -= length;
+	download.received += length;
+	if(download.fd == -1) {
+		return;
+	}
+
+	while(length > 0) {
+		ssize_t written = write(download.fd, bytes, length);
+		if(written == -1 && errno == EINTR) {
+			continue;
+		}
+		if(written == -1) {
+			notify(data, "cannot save %s: %s", download.path, strerror(errno));
+			close(download.fd);
+			download.fd = -1;
+			unlink(download.path);
+			return;
+		}
+		bytes += written;
+		length -= written;
+	}
+
+	if(download.chunk_left == 0 && download.received == download.total) {
+		close(download.fd);
+		download.fd = -1;
+		notify(data, "saved %s (%lu bytes)", download.path, download.total);
+	}
+}
+
+/* stream may be split at any byte, partial message waits here for the rest */
+char receive_buffer[SEND_BATCH_MAX*sizeof(message)];
+size_t receive_buffered = 0;
+
+/* returns what recv() did */
+ssize_t receive_messages(thread_data *data) {
+	ssize_t read = recv(sd, receive_buffer + receive_buffered, sizeof(receive_buffer) - receive_buffered, 0);
+	if(read <= 0) {
+		return read;
+	}
+	receive_buffered += read;
+
+	size_t offset = 0;
+	while(offset < receive_buffered) {
+		if(download.chunk_left > 0) {
+			size_t length = receive_buffered - offset;
+			length = (length < download.chunk_left) ? length : download.chunk_left;
+			download_bytes(data, receive_buffer + offset, length);
+			offset += length;
+			continue;
+		}
+		if(receive_buffered - offset < sizeof(message)) {
+			break;
+		}
+
+		message *msg = (message *)(receive_buffer + offset);
+		offset += sizeof(message);
+		if(ATTACH_FRAME(msg)) {
+			download_chunk(data, msg);
+		} else {
+			deliver(data, msg);
+		}
+	}
+
+	memmove(receive_buffer, receive_buffer + offset, receive_buffered - offset);
+	receive_buffered -= offset;
+	return read;
+}
+
 void thread_networking(thread_data *data) {
 	open_socket(&program_args);
 
+	/* snapshot of who is online, deltas follow by themselves */
+	if(!data->program_args->headless) {
+		request_roster(data);
+		data_signalled = 0;
+		send_outgoing(data);
+	}
+
 	struct pollfd poll_receiving[1];
 	poll_receiving[0].fd = sd;
 	poll_receiving[0].events = POLLIN;
 	poll_receiving[0].revents = 0;
 
+	sigset_t wait_mask;
+	pthread_sigmask(SIG_SETMASK, NULL, &wait_mask);
+	sigdelset(&wait_mask, SIGUSR2);
+
+	/* in headless mode stdout carries only messages */
+	FILE *report = data->program_args->headless ? stderr : stdout;
+
+	/* sockets are checked for room this often while files go out */
+	struct timespec upload_tick = {0, ATTACH_POLL_MS*1000000L};
+
 	int ret = 0;
 	while(should_exit != 1) {
-		ret = poll(poll_receiving, 1, -1);
+		ret = ppoll(poll_receiving, 1, (upload_count > 0) ? &upload_tick : NULL, &wait_mask);
 		if(ret > 0 && (poll_receiving[0].revents & POLLHUP) != 0) {
-			printf("Server disconnected\n");
+			fprintf(report, "Server disconnected\n");
 			poll_receiving[0].fd *= -1;
 			should_exit = 1;
 		} else if(ret > 0 && (poll_receiving[0].revents & POLLIN) != 0) {
-			message *incoming_msg = malloc(sizeof(message));
-			ssize_t  read = recv(sd, incoming_msg, sizeof(message), 0);
+			ssize_t read = receive_messages(data);
 
 			if(read == 0) {
-				printf("\n***\nServer disconnected\n");
+				fprintf(report, "\n***\nServer disconnected\n");
 				poll_receiving[0].fd *= -1;
 				should_exit = 1;
-			} else {
-				queue_enqueue(data->q_out, incoming_msg);
+			} else if(data->program_args->headless) {
+				fflush(stdout);
 			}
 
 			poll_receiving[0].revents = 0;
-		} else if (ret == -1 && errno == EINTR) {
-			message *msg;
-			while(msg = queue_dequeue(data->q_in), msg != NULL) {
-				send(sd, msg, sizeof(message), 0);
-				free(msg);
-			}
 		}
+
+		if(data_signalled) {
+			data_signalled = 0;
+			flush_held_back_inbound(data);
+			send_outgoing(data);
+		}
+		pump_uploads(data);
+
+		/* headless session ends once whole input is sent */
+		if(data->program_args->headless && input_finished == 1 && queue_size(data->q_in) == 0 && upload_count == 0) {
+			should_exit = 1;
+		}
+	}
+
+	if(data->program_args->headless && poll_receiving[0].fd >= 0) {
+		/*
+		 * Closing with unread data resets the connection and server could lose our last messages.
+		 * Say we are done and keep reading until server lets go (or goes quiet for a while).
+		 */
+		shutdown(sd, SHUT_WR);
+		while(poll(poll_receiving, 1, HEADLESS_DRAIN_MS) > 0 && receive_messages(data) > 0);
+	}
+
+	fflush(stdout);
+	fprintf(report, "Sent %lu messages in %lu syscalls (%.2f per syscall)\n", sent_messages, send_syscalls,
+		   (send_syscalls > 0) ? (double)sent_messages/send_syscalls : 0.0);
+	if(inbound_held_peak > 0 || inbound_dropped > 0) {
+		fprintf(report, "Display fell behind: %lu entries held back at most, %lu messages dropped\n",
+			   inbound_held_peak, inbound_dropped);
 	}
 }
 
 /* ------------------------------- */
 
 void dummy(int sig) {
+	data_signalled = 1;
 
 }
 
@@ -286,13 +975,14 @@ int main(int argc, char **argv) {
 	data.networking_thread = pthread_self();
 
 	pthread_t io_thread;
-	pthread_create(&io_thread, NULL, &thread_io, &data);
+	if(program_args.headless) {
+		setvbuf(stdout, NULL, _IOFBF, HEADLESS_OUTPUT_BUFFER);
+		pthread_create(&io_thread, NULL, &thread_headless_input, &data);
+	} else {
+		pthread_create(&io_thread, NULL, &thread_io, &data);
+	}
 
-	/* for networking thread we want SIGUSR2 unlocked */
-	sigset_t usr2;
-	sigemptyset(&usr2);
-	sigaddset(&usr2, SIGUSR2);
-	pthread_sigmask(SIG_UNBLOCK, &usr2, NULL);
+	/* networking thread unblocks SIGUSR2 only for the duration of ppoll() */
 	/* I don't want SIGUSR2 to kill my application but to interrupt poll */
 	struct sigaction dummy_sighandler;
 	dummy_sighandler.sa_handler = &dummy;
@@ -302,8 +992,11 @@ int main(int argc, char **argv) {
 
 	thread_networking(&data);
 
+	/* headless reader may still be blocked on input if we are leaving because of server */
 	void *dummy = NULL;
-	pthread_join(io_thread, &dummy);
+	if(!program_args.headless || input_finished == 1) {
+		pthread_join(io_thread, &dummy);
+	}
 
 	close_socket();
 	return 0;
@@ -0,0 +1,387 @@
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "clients.h"
+#include "topics.h"
+#include "presence.h"
+#include "mailbox.h"
+#include "spool.h"
+
+#define INIT_DESC 4 /* must be > CLIENTS_FIRST */
+
+int clientCapacity = CLIENTS_FIRST;
+struct pollfd *ufds = NULL;
+int clientIterator = CLIENTS_FIRST;
+unsigned long *clientConnection = NULL;
+char (*clientName)[USERNAME_MAX + 1] = NULL;
+message **clientInbox = NULL;
+size_t *clientHeld = NULL;
+char **clientOutbox = NULL;
+size_t *clientQueued = NULL;
+rate_bucket *clientBucket = NULL;
+long *clientResumeAt = NULL;
+int deferredClients = 0;
+long nextResume = 0;
+
+/* slots of disconnected clients, the one freed last is reused first */
+static int *freeSlots = NULL;
+static int freeCount = 0;
+static unsigned long connections = 0;
+
+int addClient(int desc) {
+    if(freeCount == 0 && clientIterator >= clientCapacity) {
+        clientCapacity = (clientCapacity > 0) ? 2*clientCapacity : INIT_DESC;
+        ufds = realloc(ufds, sizeof(struct pollfd)*clientCapacity);
+        clientConnection = realloc(clientConnection, sizeof(unsigned long)*clientCapacity);
+        clientBucket = realloc(clientBucket, sizeof(rate_bucket)*clientCapacity);
+        clientResumeAt = realloc(clientResumeAt, sizeof(long)*clientCapacity);
+        clientName = realloc(clientName, sizeof(*clientName)*clientCapacity);
+        clientInbox = realloc(clientInbox, sizeof(message*)*clientCapacity);
+        clientHeld = realloc(clientHeld, sizeof(size_t)*clientCapacity);
+        clientOutbox = realloc(clientOutbox, sizeof(char*)*clientCapacity);
+        clientQueued = realloc(clientQueued, sizeof(size_t)*clientCapacity);
+        freeSlots = realloc(freeSlots, sizeof(int)*clientCapacity);
+    }
+    int i = (freeCount > 0) ? freeSlots[--freeCount] : clientIterator++;
+
+    ufds[i].fd = desc;
+    ufds[i].events = POLLIN;
+    ufds[i].revents = 0;
+    clientConnection[i] = connections++;
+    /* never refilled bucket fills up on first use */
+    clientBucket[i].tokens = 0;
+    clientBucket[i].last_ms = 0;
+    clientResumeAt[i] = 0;
+    clientName[i][0] = '\0';
+    clientInbox[i] = NULL;
+    clientHeld[i] = 0;
+    clientOutbox[i] = NULL;
+    clientQueued[i] = 0;
+    return i;
+}
+
+void removeClient(int i) {
+    if (ufds[i].fd < 0) {
+        /* gone already, e.g. a send to it failed on the way here */
+        return;
+    }
+    printf("Client disconnected\n");
+    close(ufds[i].fd);
+    ufds[i].fd = -1;
+    ufds[i].revents = 0;
+    topics_forget(i);
+    spool_forget(i);
+    free(clientInbox[i]);
+    clientInbox[i] = NULL;
+    clientHeld[i] = 0;
+    free(clientOutbox[i]);
+    clientOutbox[i] = NULL;
+    clientQueued[i] = 0;
+    if (clientName[i][0] != '\0') {
+        if (presence_leave(clientName[i], false)) {
+            mailbox_offline(clientName[i]);
+        }
+        clientName[i][0] = '\0';
+    }
+    if (clientResumeAt[i] != 0) {
+        clientResumeAt[i] = 0;
+        deferredClients--;
+    }
+    freeSlots[freeCount++] = i;
+}
+
+void nameClient(int i, const char *name) {
+    if (clientName[i][0] == '\0' && name[0] != '\0') {
+        size_t length = strnlen(name, USERNAME_MAX);
+        memcpy(clientName[i], name, length);
+        clientName[i][length] = '\0';
+        if (presence_join(clientName[i])) {
+            mailbox_online(clientName[i]);
+        }
+    }
+}
+
+int clientNamed(const char *name) {
+    for (int i = CLIENTS_FIRST; i < clientIterator; i++) {
+        if (ufds[i].fd >= 0 && strncmp(clientName[i], name, USERNAME_MAX) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void deferClient(int i, long until) {
+    ufds[i].events &= ~POLLIN; /* POLLOUT stays, downloads aren't limited */
+    if (clientResumeAt[i] == 0) {
+        deferredClients++;
+    }
+    clientResumeAt[i] = until;
+    if (deferredClients == 1 || until < nextResume) {
+        nextResume = until;
+    }
+}
+
+void resumeClients(long now) {
+    if (deferredClients == 0 || now < nextResume) {
+        return;
+    }
+
+    long next = 0;
+    for (int i = CLIENTS_FIRST; i < clientIterator; i++) {
+        if (clientResumeAt[i] == 0) {
+            continue;
+        }
+        if (clientResumeAt[i] <= now) {
+            ufds[i].events |= POLLIN;
+            clientResumeAt[i] = 0;
+            deferredClients--;
+        } else if (next == 0 || clientResumeAt[i] < next) {
+            next = clientResumeAt[i];
+        }
+    }
+    nextResume = next;
+}
+
+int sendClient(int i, const void *bytes, size_t length) {
+    int chunk = spool_continue(i);
+    if (chunk == -1) {
+        return -1;
+    }
+    if (chunk == 1 && clientQueued[i] == 0) {
+        ssize_t sent = send(ufds[i].fd, bytes, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return -1;
+        }
+        if (sent == (ssize_t)length) {
+            return 0;
+        }
+        if (sent > 0) {
+            bytes = (const char *)bytes + sent;
+            length -= sent;
+        }
+    }
+
+    /* it isn't reading - waiting for it would stop everybody else */
+    if (clientQueued[i] + length > OUTBOX_BYTES_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    clientOutbox[i] = realloc(clientOutbox[i], clientQueued[i] + length);
+    memcpy(clientOutbox[i] + clientQueued[i], bytes, length);
+    clientQueued[i] += length;
+    ufds[i].events |= POLLOUT;
+    return 0;
+}
+
+int flushClient(int i) {
+    int chunk = spool_continue(i);
+    if (chunk != 1) {
+        return chunk;
+    }
+
+    size_t sent = 0;
+    while (sent < clientQueued[i]) {
+        ssize_t result = send(ufds[i].fd, clientOutbox[i] + sent, clientQueued[i] - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        sent += result;
+    }
+    clientQueued[i] -= sent;
+    if (clientQueued[i] > 0) {
+        memmove(clientOutbox[i], clientOutbox[i] + sent, clientQueued[i]);
+        return 0;
+    }
+
+    free(clientOutbox[i]);
+    clientOutbox[i] = NULL;
+    /* next chunk of a download sets it again if it doesn't fit */
+    ufds[i].events &= ~POLLOUT;
+    return 0;
+}
+
+int broadcast(message *msg, size_t length) {
+    int recipients = 0;
+
+    for (int j = CLIENTS_FIRST; j < clientIterator; j++) {
+        if(ufds[j].fd >= 0) {
+            /* one client going away (or not reading) must not take the server down */
+            if (sendClient(j, msg, length) == -1) {
+                perror("send(...) failed");
+                removeClient(j);
+            } else {
+                recipients++;
+            }
+        }
+    }
+
+    return recipients;
+}
+
+int multicast(message *msg, size_t length, const int *ids, int count) {
+    int recipients = 0;
+
+    for (int k = 0; k < count; k++) {
+        int j = ids[k];
+        if (ufds[j].fd >= 0) {
+            if (sendClient(j, msg, length) == -1) {
+                perror("send(...) failed");
+                removeClient(j);
+            } else {
+                recipients++;
+            }
+        }
+    }
+
+    return recipients;
+}
+
+static void put(char **data, size_t *length, const void *bytes, size_t count) {
+    *data = realloc(*data, *length + count);
+    memcpy(*data + *length, bytes, count);
+    *length += count;
+}
+
+void saveClientState(int i, char **data, size_t *length) {
+    uint8_t nameLength = (uint8_t)strlen(clientName[i]);
+    put(data, length, &nameLength, sizeof(nameLength));
+    put(data, length, clientName[i], nameLength);
+
+    uint16_t held = (uint16_t)clientHeld[i];
+    put(data, length, &held, sizeof(held));
+    put(data, length, clientInbox[i], held);
+
+    uint32_t queued = (uint32_t)clientQueued[i];
+    put(data, length, &queued, sizeof(queued));
+    put(data, length, clientOutbox[i], queued);
+
+    uint16_t count = (uint16_t)topics_count(i);
+    put(data, length, &count, sizeof(count));
+    for (int k = 0; k < count; k++) {
+        uint16_t patternLength = (uint16_t)strlen(topics_pattern(i, k));
+        put(data, length, &patternLength, sizeof(patternLength));
+        put(data, length, topics_pattern(i, k), patternLength);
+    }
+
+    spool_save(i, data, length);
+}
+
+int loadClientState(int i, const char *data, size_t length, size_t *offset) {
+    uint8_t nameLength;
+    char name[USERNAME_MAX + 1];
+    if (*offset + sizeof(nameLength) > length) {
+        return -1;
+    }
+    memcpy(&nameLength, data + *offset, sizeof(nameLength));
+    *offset += sizeof(nameLength);
+    if (nameLength > USERNAME_MAX || *offset + nameLength > length) {
+        return -1;
+    }
+    memcpy(name, data + *offset, nameLength);
+    name[nameLength] = '\0';
+    *offset += nameLength;
+    nameClient(i, name);
+
+    uint16_t held;
+    if (*offset + sizeof(held) > length) {
+        return -1;
+    }
+    memcpy(&held, data + *offset, sizeof(held));
+    *offset += sizeof(held);
+    if (held >= sizeof(message) || *offset + held > length) {
+        return -1;
+    }
+    if (held > 0) {
+        clientInbox[i] = malloc(sizeof(message));
+        memcpy(clientInbox[i], data + *offset, held);
+    }
+    clientHeld[i] = held;
+    *offset += held;
+
+    uint32_t queued;
+    if (*offset + sizeof(queued) > length) {
+        return -1;
+    }
+    memcpy(&queued, data + *offset, sizeof(queued));
+    *offset += sizeof(queued);
+    if (queued > OUTBOX_BYTES_MAX || *offset + queued > length) {
+        return -1;
+    }
+    if (queued > 0) {
+        clientOutbox[i] = malloc(queued);
+        memcpy(clientOutbox[i], data + *offset, queued);
+        ufds[i].events |= POLLOUT;
+    }
+    clientQueued[i] = queued;
+    *offset += queued;
+
+    uint16_t count;
+    if (*offset + sizeof(count) > length) {
+        return -1;
+    }
+    memcpy(&count, data + *offset, sizeof(count));
+    *offset += sizeof(count);
+
+    for (int k = 0; k < count; k++) {
+        uint16_t patternLength;
+        char pattern[MSG_LEN_MAX + 1];
+        if (*offset + sizeof(patternLength) > length) {
+            return -1;
+        }
+        memcpy(&patternLength, data + *offset, sizeof(patternLength));
+        *offset += sizeof(patternLength);
+        if (patternLength > MSG_LEN_MAX || *offset + patternLength > length) {
+            return -1;
+        }
+        memcpy(pattern, data + *offset, patternLength);
+        pattern[patternLength] = '\0';
+        *offset += patternLength;
+        topics_subscribe(i, pattern);
+    }
+
+    return spool_load(i, data, length, offset);
+}
+
+/* what every slot costs, whether the client does anything or not */
+static size_t slotBytes() {
+    return sizeof(struct pollfd) + sizeof(unsigned long) + sizeof(*clientName) + sizeof(message *) + sizeof(size_t) +
+           sizeof(char *) + sizeof(size_t) + sizeof(rate_bucket) + sizeof(long) + sizeof(int);
+}
+
+void memoryReport(FILE *out) {
+    int live = 0;
+    int held = 0;
+    size_t owed = 0;
+    for (int i = CLIENTS_FIRST; i < clientIterator; i++) {
+        if (ufds[i].fd >= 0) {
+            live++;
+        }
+        if (clientInbox[i] != NULL) {
+            held++;
+        }
+        owed += clientQueued[i];
+    }
+    /* slots of clients gone (waiting for reuse) and ones never used yet aren't anybody's */
+    int dead = clientCapacity - CLIENTS_FIRST - live;
+    size_t registry = slotBytes()*(CLIENTS_FIRST + live);
+    size_t inboxes = sizeof(message)*held;
+    size_t transfers = spool_memory();
+    fprintf(out, "Memory: registry %zu B (%d clients), dead slots %zu B (%d freed, %d never used), "
+            "%d partial messages %zu B, outboxes %zu B, transfers %zu B, idle client %zu B\n", registry, live,
+            slotBytes()*dead, freeCount, clientCapacity - clientIterator, held, inboxes, owed, transfers,
+            slotBytes());
+    fflush(out);
+}
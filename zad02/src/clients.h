@@ -0,0 +1,81 @@
+#ifndef MAKEFILE_CLIENTS_H
+#define MAKEFILE_CLIENTS_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <poll.h>
+
+#include "config.h"
+#include "message.h"
+#include "ratelimit.h"
+
+/*
+ * Connected clients: their descriptors live in the poll set right after the two listening
+ * sockets and the hot restart one (so client ids start at CLIENTS_FIRST). Disconnected slots
+ * keep fd -1 until addClient() gives them to the next client, so the registry grows with the
+ * most clients connected at once, not with all connections ever made.
+ */
+
+#define CLIENTS_FIRST 3
+
+extern int clientCapacity;
+extern struct pollfd *ufds;
+extern int clientIterator;
+
+/* numbered from 0 as they come - slots are reused, these aren't (captures tell connections apart by them) */
+extern unsigned long *clientConnection;
+extern char (*clientName)[USERNAME_MAX + 1]; /* empty until client sends something */
+/* stream may be split at any byte, start of a message waits in inbox until the rest comes;
+ * inbox is allocated only for that time (NULL while clientHeld is 0) */
+extern message **clientInbox;
+extern size_t *clientHeld;
+/* what client's socket had no room for, sent when it has (POLLOUT); allocated only for that time
+ * (NULL while clientQueued is 0) */
+extern char **clientOutbox;
+extern size_t *clientQueued;
+/* ingress limit (server's -r); deferred clients aren't polled until clientResumeAt (0 - not deferred) */
+extern rate_bucket *clientBucket;
+extern long *clientResumeAt;
+extern int deferredClients;
+extern long nextResume;
+
+/* returns client's slot */
+int addClient(int desc);
+void removeClient(int i);
+
+/* first name client uses is the one it's on the roster (presence.h) with */
+void nameClient(int i, const char *name);
+
+/* some client with that name, -1 - none */
+int clientNamed(const char *name);
+
+/* stops reading client until given time (ms), its data waits in the kernel meanwhile */
+void deferClient(int i, long until);
+void resumeClients(long now);
+
+/*
+ * Sends to i without waiting: whatever its socket doesn't take right away is queued behind what
+ * i is owed already. -1 - connection failed, or client is OUTBOX_BYTES_MAX behind.
+ */
+int sendClient(int i, const void *bytes, size_t length);
+
+/* i's socket has room (POLLOUT): what it's owed goes, chunk in progress first; -1 - connection failed */
+int flushClient(int i);
+
+/* sends to every connected client, drops those which fail; returns number of recipients */
+int broadcast(message *msg, size_t length);
+
+/* the same for given clients only (topic's subscribers) */
+int multicast(message *msg, size_t length, const int *ids, int count);
+
+/*
+ * Name, partly received message, what it's owed and subscriptions of client i for a restarted server (see handoff.h): appended to data
+ * (grown with realloc), read back in the same order from offset. -1 when state is malformed.
+ */
+void saveClientState(int i, char **data, size_t *length);
+int loadClientState(int i, const char *data, size_t length, size_t *offset);
+
+/* bytes held per subsystem: registry, partial messages, transfers */
+void memoryReport(FILE *out);
+
+#endif //MAKEFILE_CLIENTS_H
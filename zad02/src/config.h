@@ -5,6 +5,7 @@
 #ifndef MAKEFILE_CONFIG_H
 #define MAKEFILE_CONFIG_H
 
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE
 
@@ -16,10 +17,73 @@
 #define MIN_PORT 1024
 #define MAX_PORT 65535
 #define MSG_QUEUES_CAPACITY 64
+#define SEND_BATCH_MAX MSG_QUEUES_CAPACITY /* messages sent by client with one syscall */
+
+/* Accepting connections */
+#define SS_BACKLOG_DEFAULT 1024 /* kernel caps it at net.core.somaxconn */
+#define ACCEPT_BATCH_DEFAULT 256 /* connections per listener per tick, keeps clients served during storms */
+
+/* Coalescing fan-out (server's -W) */
+#define COALESCE_MAX 8 /* messages per send() */
+#define COALESCE_WINDOW_MAX_MS 100
+
+/* Sending to clients */
+#define OUTBOX_BYTES_MAX (256*1024) /* what one client may be owed; a client further behind is dropped */
+
+/* Rate limiting (server's -r, -u) */
+#define RATE_USERS_INIT 256
+#define RATE_USERS_MAX (64*1024) /* usernames with own bucket; beyond that idle ones are forgotten */
+
+/* Topics (pub/sub) */
+#define TOPIC_DEPTH_MAX 16 /* levels of a topic or pattern */
+#define TOPICS_CACHE_SIZE 256 /* recipient sets of recently published topics, power of 2 */
+
+/* Long messages, sent in fragments */
+#define FRAGMENT_TEXT_MAX (64*1024) /* longer input is cut */
+#define FRAGMENT_PARTIALS_MAX 16 /* texts receiver puts together at once */
+
+/* Presence */
+#define PRESENCE_BATCH_MS 250 /* deltas go out at most this often */
+#define PRESENCE_SHOWN_MAX 32 /* names client shows with a snapshot */
+
+/* Offline mailboxes (server's -M) */
+#define MAILBOX_CHUNK (64*1024) /* mailbox files grow by doubling from that */
+#define MAILBOX_BYTES_MAX (1024*1024) /* beyond that newer messages for the user are dropped */
+#define MAILBOX_MAPPED_MAX 64 /* mailboxes mapped at once, least recently used is unmapped first */
+#define MAILBOX_QUEUE_CAPACITY 4096 /* jobs for the writer; full - new posts are dropped */
+#define MAILBOX_BATCH_MAX 256 /* posts written in one pass over mailboxes */
+#define MAILBOX_POLL_MS 10 /* how often event loop looks for finished deliveries while some are due */
+
+/* History and search (server's -L) */
+#define SEARCH_TERM_MAX 32 /* longer terms are cut */
+#define SEARCH_RESULTS_MAX 20 /* newest hits sent back for a query */
+#define SEARCH_QUEUE_CAPACITY 4096 /* messages and queries for the search thread; full - messages aren't kept */
+#define SEARCH_POLL_MS 10 /* how often event loop looks for answers while some are due */
+
+/* Attachments (server's -D) */
+#define ATTACH_NAME_MAX 64
+#define ATTACH_CHUNK (16*1024) /* file bytes following one chunk header */
+#define ATTACH_QUEUED_MAX (32*1024) /* next chunk goes only while less than that waits in the socket */
+#define ATTACH_FILE_MAX (64*1024*1024L)
+#define ATTACH_DOWNLOADS_MAX 8 /* asked for by one client at once */
+#define ATTACH_UPLOADS_MAX 8 /* client's files waiting for the one being uploaded */
+#define ATTACH_POLL_MS 1 /* how often sockets are checked for room while transfers go on */
+
+/* Hot restart */
+#define HANDOFF_VERSION 5 /* bump whenever the handed off state changes */
+#define HANDOFF_TIMEOUT_SEC 5
+#define HANDOFF_FDS_PER_MESSAGE 250 /* kernel takes at most 253 per SCM_RIGHTS */
+#define HANDOFF_CHUNK (32*1024)
+
+/* Tracing */
+#define TRACE_SAMPLE_DEFAULT 100 /* every n-th message goes to trace file */
 
 /* Interface */
 #define USR_CMD_EXIT "e\n"
 #define USR_CMD_TYPE "t\n"
+#define HEADLESS_OUTPUT_BUFFER (64*1024)
+#define INBOUND_BULK_MAX 256 /* client's -O coalesce: newest messages one bulk keeps for display */
+#define HEADLESS_DRAIN_MS 200 /* how long to wait for server to finish after end of input */
 
 
 #endif //MAKEFILE_CONFIG_H
@@ -0,0 +1,182 @@
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fragment.h"
+
+#define PARTIAL_BYTES (FRAGMENT_TEXT_MAX + MSG_LEN_MAX + 1)
+
+/* ids of a restarted client shouldn't meet the ones it used before */
+static unsigned next_id = 0;
+static bool id_seeded = false;
+
+void fragment_begin(fragment_writer *w, const char *from, const char *text, size_t length) {
+    if (!id_seeded) {
+        next_id = (unsigned)time(NULL) ^ (unsigned)getpid();
+        id_seeded = true;
+    }
+
+    w->from = from;
+    w->text = text;
+    w->length = (length > FRAGMENT_TEXT_MAX) ? FRAGMENT_TEXT_MAX : length;
+    w->whole = w->length <= MSG_LEN_MAX || text[0] == '/';
+    w->prefix = 0;
+    w->seq = 0;
+    w->id = next_id++ & 0xffff;
+
+    /* topic goes with every piece, unless it leaves hardly any room for text */
+    if (!w->whole && text[0] == '@') {
+        const char *space = memchr(text, ' ', MSG_LEN_MAX/2);
+        if (space != NULL) {
+            w->prefix = space - text + 1;
+        }
+    }
+    w->done = w->prefix;
+}
+
+message *fragment_next(fragment_writer *w) {
+    if (w->seq > 0 && w->done == w->length) {
+        return NULL;
+    }
+
+    message *msg = calloc(sizeof(message), 1);
+    strncpy(msg->from, w->from, USERNAME_MAX);
+    if (w->whole) {
+        memcpy(msg->msg, w->text, (w->length > MSG_LEN_MAX) ? MSG_LEN_MAX : w->length);
+        w->done = w->length;
+        w->seq++;
+        return msg;
+    }
+
+    size_t room = MSG_LEN_MAX - w->prefix - FRAGMENT_HEADER;
+    size_t piece = (w->length - w->done < room) ? w->length - w->done : room;
+    bool last = w->done + piece == w->length;
+
+    memcpy(msg->msg, w->text, w->prefix);
+    char header[FRAGMENT_HEADER + 1];
+    snprintf(header, sizeof(header), "%c%04x%04x%c", FRAGMENT_MARK, w->id, w->seq & 0xffff, last ? '$' : '+');
+    memcpy(msg->msg + w->prefix, header, FRAGMENT_HEADER);
+    memcpy(msg->msg + w->prefix + FRAGMENT_HEADER, w->text + w->done, piece);
+
+    w->done += piece;
+    w->seq++;
+    return msg;
+}
+
+/* -------------------------------------- */
+
+static bool parse_hex(const char *text, unsigned *value) {
+    *value = 0;
+    for (int k = 0; k < 4; k++) {
+        if (!isxdigit((unsigned char)text[k])) {
+            return false;
+        }
+        *value = *value*16 + (isdigit((unsigned char)text[k]) ? text[k] - '0' : tolower((unsigned char)text[k]) - 'a' + 10);
+    }
+    return true;
+}
+
+static void release(fragment_partial *p) {
+    free(p->text);
+    p->text = NULL;
+}
+
+/* partial for sender's text id; a new one (possibly in place of the least recently extended) when there's none */
+static fragment_partial *find_partial(fragment_reader *r, const char *from, unsigned id) {
+    fragment_partial *empty = NULL;
+    fragment_partial *oldest = NULL;
+    for (int k = 0; k < FRAGMENT_PARTIALS_MAX; k++) {
+        fragment_partial *p = &(r->partials[k]);
+        if (p->text == NULL) {
+            empty = p;
+        } else if (p->id == id && strncmp(p->from, from, USERNAME_MAX) == 0) {
+            return p;
+        } else if (oldest == NULL || p->used < oldest->used) {
+            oldest = p;
+        }
+    }
+
+    if (empty == NULL) {
+        r->lost++;
+        release(oldest);
+        empty = oldest;
+    }
+    memset(empty, 0, sizeof(fragment_partial));
+    memcpy(empty->from, from, strnlen(from, USERNAME_MAX)); /* terminated by the memset */
+    empty->id = id;
+    empty->text = malloc(PARTIAL_BYTES);
+    return empty;
+}
+
+int fragment_accept(fragment_reader *r, const message *msg, const char **text) {
+    free(r->finished);
+    r->finished = NULL;
+
+    /* text needn't be terminated, nothing is read past sizeof(msg->msg) */
+    const char *t = msg->msg;
+    size_t prefix = 0;
+    if (t[0] == '@') {
+        const char *space = memchr(t, ' ', strnlen(t, sizeof(msg->msg) - 1));
+        if (space != NULL && space[1] == FRAGMENT_MARK) {
+            prefix = space - t + 1;
+        }
+    }
+    /* writer keeps topics under MSG_LEN_MAX/2, a longer one leaves no room for the header */
+    if (prefix > MSG_LEN_MAX - FRAGMENT_HEADER) {
+        return FRAGMENT_PLAIN;
+    }
+
+    const char *header = t + prefix;
+    unsigned id, seq;
+    if (header[0] != FRAGMENT_MARK || strnlen(header, FRAGMENT_HEADER) < FRAGMENT_HEADER ||
+        !parse_hex(header + 1, &id) || !parse_hex(header + 5, &seq) || (header[9] != '+' && header[9] != '$')) {
+        return FRAGMENT_PLAIN;
+    }
+    bool last = header[9] == '$';
+
+    fragment_partial *p = find_partial(r, msg->from, id);
+    p->used = ++(r->clock);
+    if (p->broken) {
+        if (last) {
+            release(p);
+        }
+        return FRAGMENT_PENDING;
+    }
+    if (seq != p->next_seq) {
+        r->lost++;
+        p->broken = true;
+        if (last) {
+            release(p);
+        }
+        return FRAGMENT_LOST;
+    }
+
+    if (seq == 0) {
+        memcpy(p->text, t, prefix);
+        p->length = prefix;
+    }
+    /* bounded whatever the sender does, the excess is cut */
+    const char *body = header + FRAGMENT_HEADER;
+    size_t piece = strnlen(body, MSG_LEN_MAX - prefix - FRAGMENT_HEADER);
+    if (p->length + piece > PARTIAL_BYTES - 1) {
+        piece = PARTIAL_BYTES - 1 - p->length;
+    }
+    memcpy(p->text + p->length, body, piece);
+    p->length += piece;
+    p->next_seq++;
+
+    if (!last) {
+        return FRAGMENT_PENDING;
+    }
+    p->text[p->length] = '\0';
+    r->finished = p->text;
+    p->text = NULL;
+    r->completed++;
+    *text = r->finished;
+    return FRAGMENT_DONE;
+}
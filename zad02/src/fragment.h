@@ -0,0 +1,82 @@
+#ifndef MAKEFILE_FRAGMENT_H
+#define MAKEFILE_FRAGMENT_H
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "message.h"
+
+/*
+ * Texts longer than a message travel as a run of ordinary messages, so servers relay them
+ * one by one as they come - nothing waits for the whole text. Each one's text starts with
+ * a header:
+ *   FRAGMENT_MARK, 4 hex digits of id (per sender), 4 hex digits of sequence number from 0,
+ *   '+' when more follow or '$' for the last one
+ * followed by the next piece of text. A topic ("@topic ") is repeated in front of every
+ * header, so each piece is routed like the whole text would be. Commands ("/...") and texts
+ * which fit one message are sent as they are.
+ *
+ * Receivers put pieces back together per sender and id, at most FRAGMENT_PARTIALS_MAX texts
+ * at a time (the least recently extended one is given up beyond that) and FRAGMENT_TEXT_MAX
+ * bytes each. A missing piece gives up the whole text.
+ */
+
+#define FRAGMENT_MARK '\x1e'
+#define FRAGMENT_HEADER 10
+
+/* what follows the header of a fragment (search indexes and shows just that), text itself otherwise */
+static inline const char *fragment_body(const char *text) {
+    return (text[0] == FRAGMENT_MARK && strnlen(text, FRAGMENT_HEADER) == FRAGMENT_HEADER) ?
+           text + FRAGMENT_HEADER : text;
+}
+
+/* sending */
+
+typedef struct {
+    const char *from;
+    const char *text;
+    size_t length;
+    size_t prefix;                /* "@topic " repeated in every fragment */
+    size_t done;
+    bool whole;                   /* goes as one message */
+    unsigned id;
+    unsigned seq;
+} fragment_writer;
+
+/* text needn't be terminated, only first FRAGMENT_TEXT_MAX bytes are sent */
+void fragment_begin(fragment_writer *w, const char *from, const char *text, size_t length);
+
+/* next message (calloc'ed, receiver of it frees), NULL once whole text is out */
+message *fragment_next(fragment_writer *w);
+
+/* receiving */
+
+enum {
+    FRAGMENT_PLAIN,               /* not a fragment, show message as it is */
+    FRAGMENT_PENDING,             /* kept, text isn't complete yet */
+    FRAGMENT_DONE,                /* whole text is ready */
+    FRAGMENT_LOST                 /* piece of a text is missing, the rest of it will be ignored */
+};
+
+typedef struct {
+    char from[USERNAME_MAX + 1];
+    unsigned id;
+    unsigned next_seq;
+    bool broken;
+    size_t length;
+    char *text;                   /* FRAGMENT_TEXT_MAX + MSG_LEN_MAX + 1 bytes, NULL - slot is free */
+    unsigned long used;           /* when last extended */
+} fragment_partial;
+
+typedef struct {
+    fragment_partial partials[FRAGMENT_PARTIALS_MAX];
+    char *finished;               /* text last returned, freed by the next call */
+    unsigned long clock;
+    unsigned long completed;
+    unsigned long lost;
+} fragment_reader;
+
+/* reader starts zeroed; for FRAGMENT_DONE *text is the whole text, valid until the next call */
+int fragment_accept(fragment_reader *r, const message *msg, const char **text);
+
+#endif //MAKEFILE_FRAGMENT_H
@@ -0,0 +1,152 @@
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "listener.h"
+#include "clients.h"
+
+static long overflows_base = 0;
+static long drops_base = 0;
+
+static void queue_sample(listener *l) {
+    if (!l->tcp) {
+        return;
+    }
+
+    /* for listening sockets tcpi_unacked is the accept queue length, tcpi_sacked the backlog */
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    if (getsockopt(l->fd, IPPROTO_TCP, TCP_INFO, &info, &size) == 0) {
+        if (info.tcpi_unacked > l->queue_peak) {
+            l->queue_peak = info.tcpi_unacked;
+        }
+        l->backlog = info.tcpi_sacked;
+    }
+}
+
+void listener_init(listener *l, int fd, const char *name, bool tcp) {
+    memset(l, 0, sizeof(listener));
+    l->fd = fd;
+    l->name = name;
+    l->tcp = tcp;
+    queue_sample(l);
+}
+
+int listener_accept(listener *l, int cap) {
+    int batch = 0;
+
+    l->wakeups++;
+    queue_sample(l);
+
+    while (batch < cap) {
+        /* client sockets stay blocking, sends to them don't wait anyway (see sendClient()) */
+        int desc = accept4(l->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (desc == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                /* connection stays queued, maybe somebody disconnects until next tick */
+                l->starved++;
+                break;
+            }
+            return -1;
+        }
+
+        addClient(desc);
+        batch++;
+    }
+
+    if (batch == cap) {
+        l->capped++;
+    }
+    if (batch > l->largest_batch) {
+        l->largest_batch = batch;
+    }
+    l->accepted += batch;
+
+    return batch;
+}
+
+int listener_somaxconn() {
+    FILE *f = fopen("/proc/sys/net/core/somaxconn", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int value = -1;
+    if (fscanf(f, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(f);
+    return value;
+}
+
+/* TcpExt ListenOverflows and ListenDrops, -1 each when unavailable */
+static void overflow_counters(long *overflows, long *drops) {
+    *overflows = -1;
+    *drops = -1;
+
+    FILE *f = fopen("/proc/net/netstat", "r");
+    if (f == NULL) {
+        return;
+    }
+
+    /* pairs of lines: "TcpExt: Name1 Name2 ..." followed by "TcpExt: value1 value2 ..." */
+    char names[8192], values[8192];
+    while (fgets(names, sizeof(names), f) != NULL && fgets(values, sizeof(values), f) != NULL) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+
+        char *name_save, *value_save;
+        char *name = strtok_r(names, " \n", &name_save);
+        char *value = strtok_r(values, " \n", &value_save);
+        while (name != NULL && value != NULL) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                *overflows = strtol(value, NULL, 10);
+            } else if (strcmp(name, "ListenDrops") == 0) {
+                *drops = strtol(value, NULL, 10);
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+    fclose(f);
+}
+
+void listener_overflow_baseline() {
+    overflow_counters(&overflows_base, &drops_base);
+}
+
+void listener_report(FILE *out, const listener *ls, int count) {
+    for (int k = 0; k < count; k++) {
+        const listener *l = &(ls[k]);
+        fprintf(out, "Accept %-4s: %lu accepted in %lu ticks, largest batch %d, capped %lu, out of descriptors %lu",
+                l->name, l->accepted, l->wakeups, l->largest_batch, l->capped, l->starved);
+        if (l->tcp) {
+            fprintf(out, ", queue peak %u of %u", l->queue_peak, l->backlog);
+        }
+        fprintf(out, "\n");
+    }
+
+    long overflows, drops;
+    overflow_counters(&overflows, &drops);
+    if (overflows >= 0 && overflows_base >= 0) {
+        /* host-wide, other listeners count too */
+        fprintf(out, "Accept queue overflows (host): %ld, listen drops: %ld\n",
+                overflows - overflows_base, drops - drops_base);
+    }
+    fflush(out);
+}
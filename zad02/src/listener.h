@@ -0,0 +1,43 @@
+#ifndef MAKEFILE_LISTENER_H
+#define MAKEFILE_LISTENER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Listening sockets drained in batches: every wakeup accept4()s until EAGAIN or the per-tick cap,
+ * so a reconnect storm empties the accept queue in a few ticks instead of one connection per poll().
+ * Counts what it did; for inet listeners also samples the accept queue (TCP_INFO), and the
+ * kernel-wide ListenOverflows/ListenDrops (/proc/net/netstat) tell whether the backlog was too short.
+ */
+
+typedef struct {
+    int fd;
+    const char *name;         /* for reports */
+    bool tcp;                 /* TCP_INFO is available */
+    unsigned long accepted;
+    unsigned long wakeups;    /* ticks with pending connections */
+    unsigned long capped;     /* ticks which hit the cap, rest waited for the next one */
+    unsigned long starved;    /* accept4() failed for lack of descriptors/memory */
+    int largest_batch;
+    unsigned int queue_peak;  /* most connections seen waiting in accept queue */
+    unsigned int backlog;     /* effective backlog, as the kernel reports it (tcp only) */
+} listener;
+
+void listener_init(listener *l, int fd, const char *name, bool tcp);
+
+/*
+ * Accepts up to cap connections (close-on-exec), handing each one to addClient().
+ * Returns number accepted, -1 on error other than running out of connections or resources.
+ */
+int listener_accept(listener *l, int cap);
+
+/* kernel's somaxconn - listen() silently clamps backlog to it; -1 when unknown */
+int listener_somaxconn();
+
+/* remembers kernel-wide overflow counters, report shows what happened since */
+void listener_overflow_baseline();
+
+void listener_report(FILE *out, const listener *ls, int count);
+
+#endif //MAKEFILE_LISTENER_H
@@ -0,0 +1,630 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mailbox.h"
+#include "queue.h"
+
+enum {
+    JOB_ONLINE,
+    JOB_OFFLINE,
+    JOB_POST,
+    JOB_RETURN,
+    JOB_SCAN,
+    JOB_STOP
+};
+
+typedef struct {
+    int kind;
+    char name[USERNAME_MAX+1];    /* ONLINE, OFFLINE, RETURN */
+    message *msgs;                /* RETURN */
+    int count;                    /* RETURN */
+    message msg;                  /* POST */
+} mailbox_job;
+
+typedef struct mailbox_delivery {
+    char name[USERNAME_MAX+1];
+    message *msgs;
+    int count;
+    struct mailbox_delivery *next;
+} mailbox_delivery;
+
+/* what the index of a mailbox file (its header) says */
+typedef struct {
+    char magic[4];
+    uint32_t count;               /* records */
+    uint32_t end;                 /* offset past the last one */
+    uint32_t reserved;
+} mailbox_header;
+
+#define MAILBOX_MAGIC "MBX1"
+
+typedef struct {
+    char name[USERNAME_MAX+1];
+    bool online;
+    bool stored;                  /* has a file */
+    int fd;                       /* -1 - not mapped */
+    char *map;
+    size_t mapped;
+    unsigned long used_at;        /* for eviction of mapped ones */
+} mailbox_user;
+
+bool mailboxRunning = false;
+
+static char *directory = NULL;
+static pthread_t writer;
+static void *job_buffer[MAILBOX_QUEUE_CAPACITY];
+static queue_t jobs = QUEUE_INITIALIZER(job_buffer);
+
+/* owned by the writer */
+static mailbox_user *users = NULL;
+static int user_count = 0;
+static int user_capacity = 0;
+static int *user_index = NULL;    /* open addressing over users, -1 - empty */
+static int index_size = 0;
+static int mapped_count = 0;
+static unsigned long clock_tick = 0;
+
+/* finished deliveries, oldest first */
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static mailbox_delivery *done_head = NULL;
+static mailbox_delivery *done_tail = NULL;
+static unsigned long jobs_done = 0;
+
+/* loop thread's */
+static unsigned long jobs_queued = 0;
+static int waiting = 0;
+static unsigned long dropped = 0;
+
+/* written by the writer, read by reports */
+static unsigned long stored = 0;
+static unsigned long delivered = 0;
+static unsigned long deliveries = 0;
+static unsigned long returned = 0;
+static unsigned long full = 0;
+static unsigned long corrupt = 0;
+static unsigned long failures = 0;
+static unsigned long maps = 0;
+static int mapped_peak = 0;
+
+/* -------------------------------------- */
+
+static uint32_t name_hash(const char *name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int k = 0; k < USERNAME_MAX && name[k] != '\0'; k++) {
+        hash = (hash ^ (unsigned char)name[k])*16777619u;
+    }
+    return hash;
+}
+
+static mailbox_user *find_user(const char *name, bool add) {
+    if (index_size > 0) {
+        unsigned int mask = index_size - 1;
+        for (unsigned int pos = name_hash(name) & mask; user_index[pos] != -1; pos = (pos + 1) & mask) {
+            if (strncmp(users[user_index[pos]].name, name, USERNAME_MAX) == 0) {
+                return &(users[user_index[pos]]);
+            }
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+
+    if (user_count == user_capacity) {
+        user_capacity = (user_capacity == 0) ? 64 : 2*user_capacity;
+        users = realloc(users, sizeof(mailbox_user)*user_capacity);
+    }
+    /* at most half full */
+    if (2*(user_count + 1) > index_size) {
+        free(user_index);
+        index_size = (index_size == 0) ? 128 : 2*index_size;
+        user_index = malloc(sizeof(int)*index_size);
+        memset(user_index, -1, sizeof(int)*index_size);
+        for (int k = 0; k < user_count; k++) {
+            unsigned int pos = name_hash(users[k].name) & (index_size - 1);
+            while (user_index[pos] != -1) {
+                pos = (pos + 1) & (index_size - 1);
+            }
+            user_index[pos] = k;
+        }
+    }
+
+    mailbox_user *u = &(users[user_count]);
+    memset(u, 0, sizeof(mailbox_user));
+    strncpy(u->name, name, USERNAME_MAX);
+    u->fd = -1;
+    unsigned int pos = name_hash(u->name) & (index_size - 1);
+    while (user_index[pos] != -1) {
+        pos = (pos + 1) & (index_size - 1);
+    }
+    user_index[pos] = user_count++;
+    return u;
+}
+
+/* anything but letters, digits, '_' and '-' is %XX, so no name leaves the directory */
+static void mailbox_path(const char *name, char *path) {
+    int length = snprintf(path, PATH_MAX, "%s/", directory);
+    for (int k = 0; k < USERNAME_MAX && name[k] != '\0'; k++) {
+        unsigned char c = (unsigned char)name[k];
+        if (isalnum(c) || c == '_' || c == '-') {
+            path[length++] = (char)c;
+        } else {
+            length += sprintf(path + length, "%%%02X", c);
+        }
+    }
+    strcpy(path + length, MAILBOX_SUFFIX);
+}
+
+/* reverse of mailbox_path() for a file name; -1 - not a mailbox */
+static int mailbox_name(const char *file, char *name) {
+    size_t length = strlen(file);
+    size_t suffix = strlen(MAILBOX_SUFFIX);
+    if (length <= suffix || strcmp(file + length - suffix, MAILBOX_SUFFIX) != 0) {
+        return -1;
+    }
+
+    int used = 0;
+    for (size_t k = 0; k < length - suffix; k++) {
+        unsigned int c = (unsigned char)file[k];
+        if (c == '%' && (k + 2 >= length - suffix || sscanf(file + k + 1, "%2x", &c) != 1)) {
+            return -1;
+        }
+        if (file[k] == '%') {
+            k += 2;
+        }
+        if (used == USERNAME_MAX || c == 0) {
+            return -1;
+        }
+        name[used++] = (char)c;
+    }
+    name[used] = '\0';
+    return 0;
+}
+
+static void unmap_user(mailbox_user *u) {
+    if (u->fd == -1) {
+        return;
+    }
+    if (u->map != NULL) {
+        munmap(u->map, u->mapped);
+    }
+    close(u->fd);
+    u->fd = -1;
+    u->map = NULL;
+    mapped_count--;
+}
+
+static int remap(mailbox_user *u, size_t size) {
+    if (u->map != NULL) {
+        munmap(u->map, u->mapped);
+        u->map = NULL;
+    }
+    if (ftruncate(u->fd, size) == -1) {
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, u->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    u->map = map;
+    u->mapped = size;
+    maps++;
+    return 0;
+}
+
+/* -1 when mailbox can't be used (counted) */
+static int map_user(mailbox_user *u) {
+    u->used_at = ++clock_tick;
+    if (u->fd != -1) {
+        return 0;
+    }
+
+    /* least recently used one makes room */
+    if (mapped_count >= MAILBOX_MAPPED_MAX) {
+        mailbox_user *oldest = NULL;
+        for (int k = 0; k < user_count; k++) {
+            if (users[k].fd != -1 && (oldest == NULL || users[k].used_at < oldest->used_at)) {
+                oldest = &(users[k]);
+            }
+        }
+        unmap_user(oldest);
+    }
+
+    char path[PATH_MAX];
+    mailbox_path(u->name, path);
+    struct stat st;
+    if ((u->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1 || fstat(u->fd, &st) == -1) {
+        failures++;
+        if (u->fd != -1) {
+            close(u->fd);
+            u->fd = -1;
+        }
+        return -1;
+    }
+    u->stored = true;
+    u->map = NULL;
+
+    /* file is kept in whole chunks, only the header counts */
+    size_t size = (size_t)st.st_size;
+    bool fresh = size < sizeof(mailbox_header);
+    if (size < MAILBOX_CHUNK) {
+        size = MAILBOX_CHUNK;
+    }
+    mapped_count++;
+    if (remap(u, size) == -1) {
+        failures++;
+        unmap_user(u);
+        return -1;
+    }
+    if (mapped_count > mapped_peak) {
+        mapped_peak = mapped_count;
+    }
+
+    mailbox_header *header = (mailbox_header *)u->map;
+    if (!fresh && (memcmp(header->magic, MAILBOX_MAGIC, 4) != 0 || header->end < sizeof(mailbox_header) ||
+                   header->end > u->mapped)) {
+        corrupt++;
+        fresh = true;
+    }
+    if (fresh) {
+        memcpy(header->magic, MAILBOX_MAGIC, 4);
+        header->count = 0;
+        header->end = sizeof(mailbox_header);
+        header->reserved = 0;
+    }
+    return 0;
+}
+
+static void append(mailbox_user *u, const message *msg) {
+    if (map_user(u) == -1) {
+        return;
+    }
+
+    size_t from_length = strnlen(msg->from, USERNAME_MAX);
+    size_t msg_length = strnlen(msg->msg, MSG_LEN_MAX);
+    size_t need = 2 + from_length + msg_length;
+    mailbox_header *header = (mailbox_header *)u->map;
+    if (header->end + need > u->mapped) {
+        size_t size = u->mapped;
+        while (header->end + need > size) {
+            size *= 2;
+        }
+        if (size > MAILBOX_BYTES_MAX) {
+            /* the oldest stay - newer ones are easier to get from someone else */
+            full++;
+            return;
+        }
+        if (remap(u, size) == -1) {
+            failures++;
+            unmap_user(u);
+            return;
+        }
+        header = (mailbox_header *)u->map;
+    }
+
+    char *record = u->map + header->end;
+    record[0] = (char)from_length;
+    memcpy(record + 1, msg->from, from_length);
+    record[1 + from_length] = (char)msg_length;
+    memcpy(record + 2 + from_length, msg->msg, msg_length);
+    header->end += need;
+    header->count++;
+    stored++;
+}
+
+/* everything in mailbox, which is truncated; returns number of messages (*msgs NULL if none) */
+static int take_all(mailbox_user *u, message **msgs) {
+    *msgs = NULL;
+    if (!u->stored || map_user(u) == -1) {
+        return 0;
+    }
+
+    mailbox_header *header = (mailbox_header *)u->map;
+    int count = 0;
+    if (header->count > 0) {
+        *msgs = calloc(header->count, sizeof(message));
+    }
+    size_t offset = sizeof(mailbox_header);
+    while (count < (int)header->count && offset < header->end) {
+        size_t from_length = (unsigned char)u->map[offset];
+        size_t msg_length = (offset + 1 + from_length < header->end) ?
+                            (unsigned char)u->map[offset + 1 + from_length] : SIZE_MAX;
+        if (from_length > USERNAME_MAX || msg_length > MSG_LEN_MAX ||
+            offset + 2 + from_length + msg_length > header->end) {
+            corrupt++;
+            break;
+        }
+        memcpy((*msgs)[count].from, u->map + offset + 1, from_length);
+        memcpy((*msgs)[count].msg, u->map + offset + 2 + from_length, msg_length);
+        offset += 2 + from_length + msg_length;
+        count++;
+    }
+
+    header->count = 0;
+    header->end = sizeof(mailbox_header);
+    int fd = u->fd;
+    u->fd = -1;
+    munmap(u->map, u->mapped);
+    u->map = NULL;
+    mapped_count--;
+    /* empty mailbox takes no room on disk */
+    if (ftruncate(fd, sizeof(mailbox_header)) == -1) {
+        failures++;
+    }
+    close(fd);
+    return count;
+}
+
+static void deliver(const char *name, message *msgs, int count) {
+    mailbox_delivery *d = malloc(sizeof(mailbox_delivery));
+    strncpy(d->name, name, USERNAME_MAX);
+    d->name[USERNAME_MAX] = '\0';
+    d->msgs = msgs;
+    d->count = count;
+    d->next = NULL;
+
+    pthread_mutex_lock(&done_mutex);
+    if (done_tail == NULL) {
+        done_head = d;
+    } else {
+        done_tail->next = d;
+    }
+    done_tail = d;
+    pthread_mutex_unlock(&done_mutex);
+}
+
+static void scan() {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        failures++;
+        return;
+    }
+    struct dirent *entry;
+    char name[USERNAME_MAX+1];
+    while ((entry = readdir(dir)) != NULL) {
+        if (mailbox_name(entry->d_name, name) == 0) {
+            find_user(name, true)->stored = true;
+        }
+    }
+    closedir(dir);
+}
+
+/* consecutive posts go in one pass over offline users, so each mailbox is mapped once for all */
+static void post_all(mailbox_job **posts, int count) {
+    for (int k = 0; k < user_count; k++) {
+        if (users[k].online) {
+            continue;
+        }
+        for (int p = 0; p < count; p++) {
+            append(&(users[k]), &(posts[p]->msg));
+        }
+    }
+}
+
+static void *write_mailboxes(void *unused) {
+    (void)unused;
+    mailbox_job *posts[MAILBOX_BATCH_MAX];
+    mailbox_job *next = NULL;
+    bool running = true;
+    while (running) {
+        mailbox_job *job = (next != NULL) ? next : queue_dequeue_wait(&jobs);
+        next = NULL;
+        int finished = 1;
+
+        mailbox_user *u = NULL;
+        message *msgs;
+        int count;
+        switch (job->kind) {
+            case JOB_POST:
+                count = 0;
+                posts[count++] = job;
+                while (count < MAILBOX_BATCH_MAX && (next = queue_dequeue(&jobs)) != NULL && next->kind == JOB_POST) {
+                    posts[count++] = next;
+                    next = NULL;
+                }
+                post_all(posts, count);
+                for (int p = 1; p < count; p++) {
+                    free(posts[p]);
+                }
+                finished = count;
+                break;
+            case JOB_ONLINE:
+                u = find_user(job->name, true);
+                u->online = true;
+                count = take_all(u, &msgs);
+                delivered += count;
+                deliveries++;
+                deliver(u->name, msgs, count);
+                break;
+            case JOB_OFFLINE:
+                find_user(job->name, true)->online = false;
+                break;
+            case JOB_RETURN:
+                /* returned ones are older than whatever came meanwhile */
+                u = find_user(job->name, true);
+                count = take_all(u, &msgs);
+                for (int p = 0; p < job->count; p++) {
+                    append(u, &(job->msgs[p]));
+                }
+                for (int p = 0; p < count; p++) {
+                    append(u, &(msgs[p]));
+                }
+                stored -= job->count + count;
+                returned += job->count;
+                free(msgs);
+                free(job->msgs);
+                break;
+            case JOB_SCAN:
+                scan();
+                break;
+            case JOB_STOP:
+                running = false;
+                break;
+        }
+        free(job);
+
+        pthread_mutex_lock(&done_mutex);
+        jobs_done += finished;
+        pthread_mutex_unlock(&done_mutex);
+        pthread_cond_broadcast(&done_cond);
+    }
+
+    for (int k = 0; k < user_count; k++) {
+        unmap_user(&(users[k]));
+    }
+    return NULL;
+}
+
+static void queue_job(mailbox_job *job) {
+    jobs_queued++;
+    queue_enqueue(&jobs, job);
+}
+
+static mailbox_job *new_job(int kind, const char *name) {
+    mailbox_job *job = malloc(sizeof(mailbox_job));
+    job->kind = kind;
+    if (name != NULL) {
+        strncpy(job->name, name, USERNAME_MAX);
+        job->name[USERNAME_MAX] = '\0';
+    }
+    return job;
+}
+
+/* -------------------------------------- */
+
+int mailbox_start(const char *dir) {
+    /* room for the longest encoded name */
+    if (strlen(dir) + 1 + 3*USERNAME_MAX + strlen(MAILBOX_SUFFIX) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    directory = strdup(dir);
+
+    int err = pthread_create(&writer, NULL, write_mailboxes, NULL);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    mailboxRunning = true;
+    return 0;
+}
+
+void mailbox_scan() {
+    if (mailboxRunning) {
+        queue_job(new_job(JOB_SCAN, NULL));
+    }
+}
+
+void mailbox_drain() {
+    if (!mailboxRunning) {
+        return;
+    }
+    pthread_mutex_lock(&done_mutex);
+    while (jobs_done < jobs_queued) {
+        pthread_cond_wait(&done_cond, &done_mutex);
+    }
+    pthread_mutex_unlock(&done_mutex);
+}
+
+void mailbox_stop() {
+    if (!mailboxRunning) {
+        return;
+    }
+    queue_job(new_job(JOB_STOP, NULL));
+    pthread_join(writer, NULL);
+    mailboxRunning = false;
+}
+
+void mailbox_online(const char *name) {
+    if (mailboxRunning) {
+        waiting++;
+        queue_job(new_job(JOB_ONLINE, name));
+    }
+}
+
+void mailbox_offline(const char *name) {
+    if (mailboxRunning) {
+        queue_job(new_job(JOB_OFFLINE, name));
+    }
+}
+
+bool mailbox_post(const message *msg) {
+    if (!mailboxRunning) {
+        return true;
+    }
+    mailbox_job *job = new_job(JOB_POST, NULL);
+    memcpy(&(job->msg), msg, sizeof(message));
+    if (queue_try_enqueue(&jobs, job) == -1) {
+        dropped++;
+        free(job);
+        return false;
+    }
+    jobs_queued++;
+    return true;
+}
+
+int mailbox_waiting() {
+    return waiting;
+}
+
+int mailbox_collect(char *name, message **msgs) {
+    pthread_mutex_lock(&done_mutex);
+    mailbox_delivery *d = done_head;
+    if (d != NULL) {
+        done_head = d->next;
+        if (done_head == NULL) {
+            done_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&done_mutex);
+    if (d == NULL) {
+        return -1;
+    }
+
+    waiting--;
+    strcpy(name, d->name);
+    *msgs = d->msgs;
+    int count = d->count;
+    free(d);
+    return count;
+}
+
+void mailbox_return(const char *name, message *msgs, int count) {
+    if (count == 0) {
+        free(msgs);
+        return;
+    }
+    mailbox_job *job = new_job(JOB_RETURN, name);
+    job->msgs = msgs;
+    job->count = count;
+    queue_job(job);
+}
+
+void mailbox_report(FILE *out) {
+    if (directory == NULL) {
+        return;
+    }
+    fprintf(out, "Mailboxes: %d users, %lu stored, %lu delivered in %lu deliveries, %lu returned, "
+                 "%lu dropped (writer behind), %lu full, %lu corrupt, %lu failures; "
+                 "%d mapped (peak %d of %d), %lu maps\n",
+            user_count, stored, delivered, deliveries, returned, dropped, full, corrupt, failures,
+            mapped_count, mapped_peak, MAILBOX_MAPPED_MAX, maps);
+    fflush(out);
+}
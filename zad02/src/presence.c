@@ -0,0 +1,351 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "presence.h"
+
+typedef struct {
+    char op;
+    char name[USERNAME_MAX+1];
+} presence_delta;
+
+static presence_set roster = {NULL, 0, 0};
+static unsigned long epoch = 0;
+static unsigned long seq = 0;
+
+static presence_delta *pending = NULL;
+static int pending_count = 0;
+static int pending_capacity = 0;
+
+static unsigned long joins = 0;
+static unsigned long leaves = 0;
+static unsigned long timeouts = 0;
+static unsigned long snapshots = 0;
+static unsigned long batches = 0;
+
+/* -------------------------------------- */
+
+static uint32_t name_hash(const char *name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int k = 0; k < USERNAME_MAX && name[k] != '\0'; k++) {
+        hash = (hash ^ (unsigned char)name[k])*16777619u;
+    }
+    return hash;
+}
+
+static presence_entry *set_find(presence_set *s, const char *name) {
+    if (s->size == 0) {
+        return NULL;
+    }
+
+    unsigned int mask = s->size - 1;
+    unsigned int pos = name_hash(name) & mask;
+    while (s->slots[pos].count > 0) {
+        if (strncmp(s->slots[pos].name, name, USERNAME_MAX) == 0) {
+            return &(s->slots[pos]);
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+static presence_entry *set_add(presence_set *s, const char *name) {
+    /* at most half full */
+    if (2*(s->used + 1) > s->size) {
+        presence_entry *old = s->slots;
+        unsigned int old_size = s->size;
+
+        s->size = (s->size > 0) ? 2*s->size : 64;
+        s->slots = calloc(sizeof(presence_entry), s->size);
+        for (unsigned int k = 0; k < old_size; k++) {
+            if (old[k].count > 0) {
+                unsigned int pos = name_hash(old[k].name) & (s->size - 1);
+                while (s->slots[pos].count > 0) {
+                    pos = (pos + 1) & (s->size - 1);
+                }
+                s->slots[pos] = old[k];
+            }
+        }
+        free(old);
+    }
+
+    unsigned int mask = s->size - 1;
+    unsigned int pos = name_hash(name) & mask;
+    while (s->slots[pos].count > 0) {
+        pos = (pos + 1) & mask;
+    }
+    strncpy(s->slots[pos].name, name, USERNAME_MAX);
+    s->slots[pos].name[USERNAME_MAX] = '\0';
+    s->used++;
+    return &(s->slots[pos]);
+}
+
+/* linear probing: entries behind the removed one move up, so no tombstones are needed */
+static void set_remove(presence_set *s, presence_entry *e) {
+    unsigned int mask = s->size - 1;
+    unsigned int hole = (unsigned int)(e - s->slots);
+    unsigned int pos = hole;
+    while (true) {
+        pos = (pos + 1) & mask;
+        if (s->slots[pos].count == 0) {
+            break;
+        }
+        unsigned int home = name_hash(s->slots[pos].name) & mask;
+        /* entry may fill the hole unless its home lies cyclically in (hole, pos] */
+        bool stays = (hole <= pos) ? (hole < home && home <= pos) : (hole < home || home <= pos);
+        if (!stays) {
+            s->slots[hole] = s->slots[pos];
+            hole = pos;
+        }
+    }
+    s->slots[hole].count = 0;
+    s->used--;
+}
+
+static void set_clear(presence_set *s) {
+    if (s->size > 0) {
+        memset(s->slots, 0, sizeof(presence_entry)*s->size);
+    }
+    s->used = 0;
+}
+
+/* -------------------------------------- */
+
+static void queue_delta(char op, const char *name) {
+    if (pending_count == pending_capacity) {
+        pending_capacity = (pending_capacity > 0) ? 2*pending_capacity : 64;
+        pending = realloc(pending, sizeof(presence_delta)*pending_capacity);
+    }
+    pending[pending_count].op = op;
+    strncpy(pending[pending_count].name, name, USERNAME_MAX);
+    pending[pending_count].name[USERNAME_MAX] = '\0';
+    pending_count++;
+}
+
+bool presence_join(const char *name) {
+    presence_entry *e = set_find(&roster, name);
+    if (e != NULL) {
+        e->count++;
+        return false;
+    }
+
+    set_add(&roster, name)->count = 1;
+    queue_delta(PRESENCE_JOIN, name);
+    joins++;
+    return true;
+}
+
+bool presence_leave(const char *name, bool timed_out) {
+    presence_entry *e = set_find(&roster, name);
+    if (e == NULL || --(e->count) > 0) {
+        return false;
+    }
+
+    set_remove(&roster, e);
+    queue_delta(timed_out ? PRESENCE_TIMEOUT : PRESENCE_LEAVE, name);
+    if (timed_out) {
+        timeouts++;
+    } else {
+        leaves++;
+    }
+    return true;
+}
+
+bool presence_pending() {
+    return pending_count > 0;
+}
+
+static unsigned long current_epoch() {
+    /* differs between a server and its successor, so clients notice the restart */
+    if (epoch == 0) {
+        epoch = ((unsigned long)time(NULL) << 16 ^ (unsigned long)getpid()) & 0xffffffffffUL;
+    }
+    return epoch;
+}
+
+typedef struct {
+    message *records;
+    int count;
+    int capacity;
+    bool deltas;                  /* every delta record applies on its own, so it gets its own seq */
+    unsigned int total;           /* snapshot's */
+    int length;                   /* of the last record's text */
+} record_builder;
+
+static void record_start(record_builder *b) {
+    if (b->count == b->capacity) {
+        b->capacity = (b->capacity > 0) ? 2*b->capacity : 8;
+        b->records = realloc(b->records, sizeof(message)*b->capacity);
+    }
+    message *r = &(b->records[b->count++]);
+    memset(r, 0, sizeof(message));
+    if (b->deltas) {
+        b->length = snprintf(r->msg, MSG_LEN_MAX + 1, "D%lu:%lu", current_epoch(), ++seq);
+    } else {
+        b->length = snprintf(r->msg, MSG_LEN_MAX + 1, "S%lu:%lu %u", current_epoch(), seq, b->total);
+    }
+}
+
+/* appends word to the last record, starting a new one when it doesn't fit */
+static void record_word(record_builder *b, char op, const char *name) {
+    int length = (int)strnlen(name, USERNAME_MAX) + (op != 0) + 1;
+    if (b->count == 0 || b->length + length > MSG_LEN_MAX) {
+        record_start(b);
+    }
+    message *r = &(b->records[b->count - 1]);
+    if (op != 0) {
+        b->length += snprintf(r->msg + b->length, MSG_LEN_MAX + 1 - b->length, " %c%.*s", op, USERNAME_MAX, name);
+    } else {
+        b->length += snprintf(r->msg + b->length, MSG_LEN_MAX + 1 - b->length, " %.*s", USERNAME_MAX, name);
+    }
+}
+
+int presence_snapshot(message **records) {
+    record_builder b = {NULL, 0, 0, false, roster.used, 0};
+
+    record_start(&b);
+    for (unsigned int k = 0; k < roster.size; k++) {
+        if (roster.slots[k].count > 0) {
+            record_word(&b, 0, roster.slots[k].name);
+        }
+    }
+
+    snapshots++;
+    *records = b.records;
+    return b.count;
+}
+
+int presence_deltas(message **records) {
+    if (pending_count == 0) {
+        *records = NULL;
+        return 0;
+    }
+
+    record_builder b = {NULL, 0, 0, true, 0, 0};
+    for (int k = 0; k < pending_count; k++) {
+        record_word(&b, pending[k].op, pending[k].name);
+    }
+    pending_count = 0;
+
+    batches++;
+    *records = b.records;
+    return b.count;
+}
+
+void presence_report(FILE *out) {
+    if (joins == 0) {
+        return;
+    }
+
+    fprintf(out, "Presence: %u online, %lu joins, %lu leaves, %lu timeouts, %lu snapshots, %lu delta batches\n",
+            roster.used, joins, leaves, timeouts, snapshots, batches);
+    fflush(out);
+}
+
+/* -------------------------------------- */
+
+/*
+ * Applies words of a record: names (snapshot) or op+name (deltas). Ops which change the view are
+ * collected in v->changes - a snapshot may already count a join whose delta is numbered after it.
+ */
+static void apply_words(presence_view *v, const char *words, bool snapshot) {
+    char name[USERNAME_MAX+1];
+    size_t changed = 0;
+    v->changes[0] = '\0';
+    const char *w = words;
+    while (*w != '\0') {
+        while (*w == ' ') {
+            w++;
+        }
+        char op = snapshot ? PRESENCE_JOIN : *w;
+        if (!snapshot && *w != '\0') {
+            w++;
+        }
+        int length = 0;
+        while (w[length] != '\0' && w[length] != ' ') {
+            length++;
+        }
+        if (length == 0) {
+            break;
+        }
+        snprintf(name, sizeof(name), "%.*s", length, w);
+        w += length;
+
+        presence_entry *e = set_find(&(v->roster), name);
+        if (op == PRESENCE_JOIN && e == NULL) {
+            set_add(&(v->roster), name)->count = 1;
+        } else if (op != PRESENCE_JOIN && e != NULL) {
+            set_remove(&(v->roster), e);
+        } else {
+            continue;
+        }
+        if (changed < sizeof(v->changes)) {
+            changed += snprintf(v->changes + changed, sizeof(v->changes) - changed, "%s%c%s",
+                                (changed > 0) ? " " : "", op, name);
+        }
+    }
+}
+
+int presence_apply(presence_view *v, const message *msg) {
+    char text[MSG_LEN_MAX + 1];
+    snprintf(text, sizeof(text), "%.*s", MSG_LEN_MAX, msg->msg);
+
+    unsigned long record_epoch, record_seq;
+    int consumed = 0;
+    if (text[0] == 'S') {
+        unsigned int total;
+        if (sscanf(text + 1, "%lu:%lu %u%n", &record_epoch, &record_seq, &total, &consumed) != 3) {
+            return PRESENCE_IGNORED;
+        }
+        if (v->synced || record_epoch != v->snapshot_epoch || record_seq != v->snapshot_seq) {
+            /* a new snapshot, anything collected so far is stale */
+            set_clear(&(v->roster));
+            v->synced = false;
+            v->snapshot_epoch = record_epoch;
+            v->snapshot_seq = record_seq;
+        }
+        apply_words(v, text + 1 + consumed, true);
+        if (v->roster.used < total) {
+            return PRESENCE_IGNORED;
+        }
+        v->synced = true;
+        v->epoch = record_epoch;
+        v->seq = record_seq;
+        return PRESENCE_COMPLETE;
+    }
+
+    if (text[0] != 'D' || sscanf(text + 1, "%lu:%lu%n", &record_epoch, &record_seq, &consumed) != 2) {
+        return PRESENCE_IGNORED;
+    }
+    if (!v->synced) {
+        /* snapshot never completed if deltas past it are coming already */
+        bool lost = record_epoch != v->snapshot_epoch || record_seq > v->snapshot_seq + 1;
+        return lost ? PRESENCE_RESYNC : PRESENCE_IGNORED;
+    }
+    if (record_epoch != v->epoch || record_seq > v->seq + 1) {
+        v->synced = false;
+        return PRESENCE_RESYNC;
+    }
+    if (record_seq <= v->seq) {
+        return PRESENCE_IGNORED;
+    }
+
+    apply_words(v, text + 1 + consumed, false);
+    v->seq = record_seq;
+    return (v->changes[0] != '\0') ? PRESENCE_UPDATED : PRESENCE_IGNORED;
+}
+
+int presence_names(const presence_view *v, const char **names, int max) {
+    int count = 0;
+    for (unsigned int k = 0; k < v->roster.size && count < max; k++) {
+        if (v->roster.slots[k].count > 0) {
+            names[count++] = v->roster.slots[k].name;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,87 @@
+#ifndef MAKEFILE_PRESENCE_H
+#define MAKEFILE_PRESENCE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "message.h"
+
+/*
+ * Who is online. Server keeps a roster of usernames (counted - one user may be connected more
+ * than once) and sends a client which asks (PRESENCE_REQUEST) one snapshot; afterwards everybody
+ * who asked gets join/leave/timeout deltas, batched every PRESENCE_BATCH_MS - churn never makes
+ * server send the whole roster again. Records are ordinary messages with empty sender, so they
+ * fit both servers' framing:
+ *   "S<epoch>:<seq> <total> name name ..."   snapshot as of delta seq, over as many records as needed
+ *   "D<epoch>:<seq> +name -name ~name ..."   joined, left, timed out
+ * Client applies deltas in order; after a gap, or from a new epoch (restarted server), it asks for
+ * a new snapshot.
+ */
+
+#define PRESENCE_REQUEST "/who"
+#define PRESENCE_TOPIC "$presence" /* internal topic (see topics.h) of clients that asked */
+
+enum {
+    PRESENCE_JOIN = '+',
+    PRESENCE_LEAVE = '-',
+    PRESENCE_TIMEOUT = '~'
+};
+
+typedef struct {
+    char name[USERNAME_MAX+1];
+    int count;                    /* 0 - free slot */
+} presence_entry;
+
+/* open addressing set of usernames */
+typedef struct {
+    presence_entry *slots;
+    unsigned int size;            /* power of 2 */
+    unsigned int used;
+} presence_set;
+
+/* server side */
+
+/* true when name just came online (delta is queued) */
+bool presence_join(const char *name);
+/* true when name's last connection went */
+bool presence_leave(const char *name, bool timed_out);
+
+/* deltas wait for the next batch */
+bool presence_pending();
+
+/* both return number of records in *records (malloc'ed, caller frees); deltas are taken */
+int presence_snapshot(message **records);
+int presence_deltas(message **records);
+
+void presence_report(FILE *out);
+
+/* client side */
+
+typedef struct {
+    presence_set roster;
+    unsigned long epoch;
+    unsigned long seq;            /* last applied */
+    bool synced;
+    unsigned long snapshot_epoch; /* snapshot being collected */
+    unsigned long snapshot_seq;
+    char changes[MSG_LEN_MAX + 1]; /* of last PRESENCE_UPDATED, ones the view didn't have yet */
+} presence_view;
+
+enum {
+    PRESENCE_IGNORED,             /* stale, or snapshot is still incomplete */
+    PRESENCE_UPDATED,             /* deltas applied, some of them new to the view */
+    PRESENCE_COMPLETE,            /* last part of snapshot arrived */
+    PRESENCE_RESYNC               /* view is out of date - ask for a snapshot */
+};
+
+static inline bool presence_record(const message *msg) {
+    return msg->from[0] == '\0';
+}
+
+/* one of PRESENCE_IGNORED ... */
+int presence_apply(presence_view *v, const message *msg);
+
+/* names in view, in no particular order; returns their number (at most max) */
+int presence_names(const presence_view *v, const char **names, int max);
+
+#endif //MAKEFILE_PRESENCE_H
@@ -36,7 +36,7 @@ typedef struct queue
     pthread_cond_t cond_empty;
 } queue_t;
 
-void queue_enqueue(queue_t *queue, void *value)
+static inline void queue_enqueue(queue_t *queue, void *value)
 {
       pthread_mutex_lock(&(queue->mutex));
       while (queue->size == queue->capacity)
@@ -49,7 +49,44 @@ void queue_enqueue(queue_t *queue, void *value)
       pthread_cond_broadcast(&(queue->cond_empty));
 }
 
-void *queue_dequeue(queue_t *queue)
+/* like queue_enqueue(), but returns -1 instead of waiting when queue is full */
+static inline int queue_try_enqueue(queue_t *queue, void *value)
+{
+      pthread_mutex_lock(&(queue->mutex));
+      if (queue->size == queue->capacity) {
+          pthread_mutex_unlock(&(queue->mutex));
+          return -1;
+      }
+      queue->buffer[queue->in] = value;
+      ++ queue->size;
+      ++ queue->in;
+      queue->in %= queue->capacity;
+      pthread_mutex_unlock(&(queue->mutex));
+      pthread_cond_broadcast(&(queue->cond_empty));
+      return 0;
+}
+
+/* like queue_try_enqueue(), but a full queue gives up its oldest value - returned, NULL if none */
+static inline void *queue_enqueue_displace(queue_t *queue, void *value)
+{
+      void *oldest = NULL;
+      pthread_mutex_lock(&(queue->mutex));
+      if (queue->size == queue->capacity) {
+          oldest = queue->buffer[queue->out];
+          -- queue->size;
+          ++ queue->out;
+          queue->out %= queue->capacity;
+      }
+      queue->buffer[queue->in] = value;
+      ++ queue->size;
+      ++ queue->in;
+      queue->in %= queue->capacity;
+      pthread_mutex_unlock(&(queue->mutex));
+      pthread_cond_broadcast(&(queue->cond_empty));
+      return oldest;
+}
+
+static inline void *queue_dequeue(queue_t *queue)
 {
       pthread_mutex_lock(&(queue->mutex));
       if(queue->size == 0) {
@@ -65,7 +102,22 @@ void *queue_dequeue(queue_t *queue)
       return value;
 }
 
-int queue_size(queue_t *queue)
+/* like queue_dequeue(), but waits for a value */
+static inline void *queue_dequeue_wait(queue_t *queue)
+{
+      pthread_mutex_lock(&(queue->mutex));
+      while (queue->size == 0)
+        pthread_cond_wait(&(queue->cond_empty), &(queue->mutex));
+      void *value = queue->buffer[queue->out];
+      -- queue->size;
+      ++ queue->out;
+      queue->out %= queue->capacity;
+      pthread_mutex_unlock(&(queue->mutex));
+      pthread_cond_broadcast(&(queue->cond_full));
+      return value;
+}
+
+static inline int queue_size(queue_t *queue)
 {
       pthread_mutex_lock(&(queue->mutex));
       int size = queue->size;
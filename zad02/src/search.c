@@ -0,0 +1,525 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "search.h"
+#include "fragment.h"
+#include "queue.h"
+
+#define HISTORY_FILE "history.log"
+
+enum {
+    JOB_ADD,
+    JOB_QUERY,
+    JOB_STOP
+};
+
+typedef struct {
+    int kind;
+    char name[USERNAME_MAX+1];    /* QUERY */
+    message msg;                  /* ADD; QUERY - query in msg.msg */
+} search_job;
+
+typedef struct search_answer {
+    char name[USERNAME_MAX+1];
+    message *msgs;
+    int count;
+    struct search_answer *next;
+} search_answer;
+
+typedef struct {
+    char term[SEARCH_TERM_MAX+1];
+    uint8_t *postings;            /* varint deltas of message numbers, ascending */
+    uint32_t length;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t last;                /* message number last added */
+} search_term;
+
+/* walks one posting list */
+typedef struct {
+    const search_term *t;
+    uint32_t pos;
+    uint32_t value;               /* 0 - past the end */
+} posting_cursor;
+
+bool searchRunning = false;
+
+static pthread_t searcher;
+static void *job_buffer[SEARCH_QUEUE_CAPACITY];
+static queue_t jobs = QUEUE_INITIALIZER(job_buffer);
+
+static bool opened = false;
+
+/* owned by the search thread */
+static int history_fd = -1;
+static off_t *offsets = NULL;     /* of message n at n - 1 */
+static uint32_t message_count = 0;
+static uint32_t offsets_capacity = 0;
+static search_term *terms = NULL; /* open addressing, empty ones have term[0] == '\0' */
+static uint32_t terms_size = 0;
+static uint32_t terms_used = 0;
+
+/* answered queries, oldest first */
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static search_answer *done_head = NULL;
+static search_answer *done_tail = NULL;
+static unsigned long jobs_done = 0;
+
+/* loop thread's */
+static unsigned long jobs_queued = 0;
+static int waiting = 0;
+static unsigned long dropped = 0;
+
+/* written by the search thread, read by reports */
+static unsigned long posting_bytes = 0;
+static unsigned long posting_count = 0;
+static unsigned long queries = 0;
+static unsigned long hits = 0;
+static unsigned long failures = 0;
+static uint32_t loaded = 0;
+
+/* -------------------------------------- */
+
+static uint32_t term_hash(const char *term) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (int k = 0; term[k] != '\0'; k++) {
+        hash = (hash ^ (unsigned char)term[k])*16777619u;
+    }
+    return hash;
+}
+
+static search_term *find_term(const char *term, bool add) {
+    if (terms_size > 0) {
+        uint32_t mask = terms_size - 1;
+        for (uint32_t pos = term_hash(term) & mask; terms[pos].term[0] != '\0'; pos = (pos + 1) & mask) {
+            if (strcmp(terms[pos].term, term) == 0) {
+                return &(terms[pos]);
+            }
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+
+    /* at most half full */
+    if (2*(terms_used + 1) > terms_size) {
+        search_term *old = terms;
+        uint32_t old_size = terms_size;
+        terms_size = (terms_size == 0) ? 1024 : 2*terms_size;
+        terms = calloc(terms_size, sizeof(search_term));
+        for (uint32_t k = 0; k < old_size; k++) {
+            if (old[k].term[0] != '\0') {
+                uint32_t pos = term_hash(old[k].term) & (terms_size - 1);
+                while (terms[pos].term[0] != '\0') {
+                    pos = (pos + 1) & (terms_size - 1);
+                }
+                terms[pos] = old[k];
+            }
+        }
+        free(old);
+    }
+
+    uint32_t pos = term_hash(term) & (terms_size - 1);
+    while (terms[pos].term[0] != '\0') {
+        pos = (pos + 1) & (terms_size - 1);
+    }
+    strcpy(terms[pos].term, term);
+    terms_used++;
+    return &(terms[pos]);
+}
+
+static void add_posting(search_term *t, uint32_t number) {
+    /* a word twice in one message */
+    if (t->last == number) {
+        return;
+    }
+    if (t->length + 5 > t->capacity) {
+        t->capacity = (t->capacity == 0) ? 8 : 2*t->capacity;
+        t->postings = realloc(t->postings, t->capacity);
+    }
+    uint32_t delta = number - t->last;
+    uint32_t before = t->length;
+    while (delta >= 0x80) {
+        t->postings[t->length++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    t->postings[t->length++] = (uint8_t)delta;
+    t->last = number;
+    t->count++;
+    posting_bytes += t->length - before;
+    posting_count++;
+}
+
+static void cursor_next(posting_cursor *c) {
+    if (c->pos >= c->t->length) {
+        c->value = 0;
+        return;
+    }
+    uint32_t delta = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = c->t->postings[c->pos++];
+        delta |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    c->value += delta;
+}
+
+/*
+ * Next term of text starting at *text, lowercased into term (SEARCH_TERM_MAX + 1 bytes);
+ * false when there are no more.
+ */
+static bool next_term(const char **text, const char *end, char *term) {
+    const char *p = *text;
+    while (p < end && *p != '\0' && !isalnum((unsigned char)*p)) {
+        p++;
+    }
+    if (p == end || *p == '\0') {
+        *text = p;
+        return false;
+    }
+    int length = 0;
+    while (p < end && isalnum((unsigned char)*p)) {
+        if (length < SEARCH_TERM_MAX) {
+            term[length++] = (char)tolower((unsigned char)*p);
+        }
+        p++;
+    }
+    term[length] = '\0';
+    *text = p;
+    return true;
+}
+
+static void index_message(const message *msg, uint32_t number) {
+    char term[SEARCH_TERM_MAX+1];
+    /* words split between fragments of a long text aren't found */
+    const char *text = fragment_body(msg->msg);
+    while (next_term(&text, msg->msg + MSG_LEN_MAX, term)) {
+        add_posting(find_term(term, true), number);
+    }
+}
+
+static void remember_offset(off_t offset) {
+    if (message_count == offsets_capacity) {
+        offsets_capacity = (offsets_capacity == 0) ? 1024 : 2*offsets_capacity;
+        offsets = realloc(offsets, sizeof(off_t)*offsets_capacity);
+    }
+    offsets[message_count++] = offset;
+}
+
+static void append(const message *msg) {
+    char record[2 + USERNAME_MAX + MSG_LEN_MAX];
+    size_t from_length = strnlen(msg->from, USERNAME_MAX);
+    size_t msg_length = strnlen(msg->msg, MSG_LEN_MAX);
+    record[0] = (char)from_length;
+    memcpy(record + 1, msg->from, from_length);
+    record[1 + from_length] = (char)msg_length;
+    memcpy(record + 2 + from_length, msg->msg, msg_length);
+
+    off_t offset = lseek(history_fd, 0, SEEK_END);
+    size_t length = 2 + from_length + msg_length;
+    if (offset == -1 || write(history_fd, record, length) != (ssize_t)length) {
+        failures++;
+        return;
+    }
+    remember_offset(offset);
+    index_message(msg, message_count);
+}
+
+/* message n from history; -1 when it can't be read */
+static int read_message(uint32_t number, message *msg) {
+    unsigned char record[2 + USERNAME_MAX + MSG_LEN_MAX];
+    ssize_t got = pread(history_fd, record, sizeof(record), offsets[number - 1]);
+    memset(msg, 0, sizeof(message));
+    if (got < 2 || record[0] > USERNAME_MAX || 1 + record[0] >= got ||
+        record[1 + record[0]] > MSG_LEN_MAX || 2 + record[0] + record[1 + record[0]] > got) {
+        return -1;
+    }
+    memcpy(msg->from, record + 1, record[0]);
+    memcpy(msg->msg, record + 2 + record[0], record[1 + record[0]]);
+    return 0;
+}
+
+/* whole history into the index; a record cut short (crash while writing) is dropped */
+static void load() {
+    FILE *in = fdopen(dup(history_fd), "r");
+    if (in == NULL) {
+        failures++;
+        return;
+    }
+    off_t offset = 0;
+    message msg;
+    int from_length, msg_length;
+    while ((from_length = fgetc(in)) != EOF) {
+        memset(&msg, 0, sizeof(message));
+        if (from_length > USERNAME_MAX || fread(msg.from, 1, from_length, in) != (size_t)from_length ||
+            (msg_length = fgetc(in)) == EOF || msg_length > MSG_LEN_MAX ||
+            fread(msg.msg, 1, msg_length, in) != (size_t)msg_length) {
+            break;
+        }
+        remember_offset(offset);
+        index_message(&msg, message_count);
+        offset += 2 + from_length + msg_length;
+    }
+    fclose(in);
+    if (ftruncate(history_fd, offset) == -1) {
+        failures++;
+    }
+    loaded = message_count;
+}
+
+static int by_count(const void *a, const void *b) {
+    const search_term *x = *(search_term * const *)a;
+    const search_term *y = *(search_term * const *)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+/* newest matches of all the terms in query, walking the shortest posting list first */
+static void answer(const char *name, const char *query) {
+    const search_term *found[MSG_LEN_MAX/2 + 1];
+    int count = 0;
+    bool missing = false;
+    char term[SEARCH_TERM_MAX+1];
+    const char *text = query;
+    while (next_term(&text, query + MSG_LEN_MAX, term)) {
+        search_term *t = find_term(term, false);
+        if (t == NULL) {
+            missing = true;
+            break;
+        }
+        bool repeated = false;
+        for (int k = 0; k < count; k++) {
+            repeated = repeated || found[k] == t;
+        }
+        if (!repeated) {
+            found[count++] = t;
+        }
+    }
+    qsort(found, count, sizeof(found[0]), by_count);
+
+    uint32_t newest[SEARCH_RESULTS_MAX];
+    unsigned long matched = 0;
+    if (!missing && count > 0) {
+        posting_cursor cursors[MSG_LEN_MAX/2 + 1];
+        for (int k = 0; k < count; k++) {
+            cursors[k].t = found[k];
+            cursors[k].pos = 0;
+            cursors[k].value = 0;
+            cursor_next(&cursors[k]);
+        }
+        while (cursors[0].value != 0) {
+            uint32_t candidate = cursors[0].value;
+            bool all = true;
+            for (int k = 1; k < count && all; k++) {
+                while (cursors[k].value != 0 && cursors[k].value < candidate) {
+                    cursor_next(&cursors[k]);
+                }
+                all = cursors[k].value == candidate;
+                if (cursors[k].value == 0) {
+                    cursors[0].pos = cursors[0].t->length;
+                }
+            }
+            if (all) {
+                newest[matched++ % SEARCH_RESULTS_MAX] = candidate;
+            }
+            cursor_next(&cursors[0]);
+        }
+    }
+
+    int shown = (matched < SEARCH_RESULTS_MAX) ? (int)matched : SEARCH_RESULTS_MAX;
+    search_answer *a = malloc(sizeof(search_answer));
+    strcpy(a->name, name);
+    a->msgs = calloc(shown + 1, sizeof(message));
+    a->count = 1;
+    a->next = NULL;
+    strcpy(a->msgs[0].from, SEARCH_SENDER);
+    snprintf(a->msgs[0].msg, MSG_LEN_MAX + 1, "%lu hits for: %s", matched, query);
+    for (unsigned long k = matched - shown; k < matched; k++) {
+        uint32_t number = newest[k % SEARCH_RESULTS_MAX];
+        message *hit = &(a->msgs[a->count]);
+        if (read_message(number, hit) == -1) {
+            failures++;
+            continue;
+        }
+        /* number goes in front, end of a long text is cut */
+        char text[MSG_LEN_MAX + 1];
+        strcpy(text, fragment_body(hit->msg));
+        size_t prefix = snprintf(hit->msg, MSG_LEN_MAX + 1, "#%u ", number);
+        size_t length = strlen(text);
+        memcpy(hit->msg + prefix, text, (prefix + length > MSG_LEN_MAX) ? MSG_LEN_MAX - prefix : length);
+        hit->msg[(prefix + length > MSG_LEN_MAX) ? MSG_LEN_MAX : prefix + length] = '\0';
+        a->count++;
+    }
+    queries++;
+    hits += matched;
+
+    pthread_mutex_lock(&done_mutex);
+    if (done_tail == NULL) {
+        done_head = a;
+    } else {
+        done_tail->next = a;
+    }
+    done_tail = a;
+    pthread_mutex_unlock(&done_mutex);
+}
+
+static void *run_search(void *unused) {
+    (void)unused;
+    load();
+    bool running = true;
+    while (running) {
+        search_job *job = queue_dequeue_wait(&jobs);
+        switch (job->kind) {
+            case JOB_ADD:
+                append(&(job->msg));
+                break;
+            case JOB_QUERY:
+                answer(job->name, job->msg.msg);
+                break;
+            case JOB_STOP:
+                running = false;
+                break;
+        }
+        free(job);
+
+        pthread_mutex_lock(&done_mutex);
+        jobs_done++;
+        pthread_mutex_unlock(&done_mutex);
+        pthread_cond_broadcast(&done_cond);
+    }
+    return NULL;
+}
+
+static void queue_job(search_job *job) {
+    jobs_queued++;
+    queue_enqueue(&jobs, job);
+}
+
+/* -------------------------------------- */
+
+int search_start(const char *dir) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, HISTORY_FILE) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    if ((history_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+        return -1;
+    }
+
+    int err = pthread_create(&searcher, NULL, run_search, NULL);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    opened = true;
+    searchRunning = true;
+    return 0;
+}
+
+void search_drain() {
+    if (!searchRunning) {
+        return;
+    }
+    pthread_mutex_lock(&done_mutex);
+    while (jobs_done < jobs_queued) {
+        pthread_cond_wait(&done_cond, &done_mutex);
+    }
+    pthread_mutex_unlock(&done_mutex);
+}
+
+void search_stop() {
+    if (!searchRunning) {
+        return;
+    }
+    search_job *job = malloc(sizeof(search_job));
+    job->kind = JOB_STOP;
+    queue_job(job);
+    pthread_join(searcher, NULL);
+    close(history_fd);
+    searchRunning = false;
+}
+
+bool search_add(const message *msg) {
+    if (!searchRunning) {
+        return true;
+    }
+    search_job *job = malloc(sizeof(search_job));
+    job->kind = JOB_ADD;
+    memcpy(&(job->msg), msg, sizeof(message));
+    if (queue_try_enqueue(&jobs, job) == -1) {
+        dropped++;
+        free(job);
+        return false;
+    }
+    jobs_queued++;
+    return true;
+}
+
+void search_query(const char *name, const char *query) {
+    if (!searchRunning) {
+        return;
+    }
+    search_job *job = malloc(sizeof(search_job));
+    job->kind = JOB_QUERY;
+    strncpy(job->name, name, USERNAME_MAX);
+    job->name[USERNAME_MAX] = '\0';
+    memset(&(job->msg), 0, sizeof(message));
+    strncpy(job->msg.msg, query, MSG_LEN_MAX);
+    waiting++;
+    queue_job(job);
+}
+
+int search_waiting() {
+    return waiting;
+}
+
+int search_collect(char *name, message **msgs) {
+    pthread_mutex_lock(&done_mutex);
+    search_answer *a = done_head;
+    if (a != NULL) {
+        done_head = a->next;
+        if (done_head == NULL) {
+            done_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&done_mutex);
+    if (a == NULL) {
+        return -1;
+    }
+
+    waiting--;
+    strcpy(name, a->name);
+    *msgs = a->msgs;
+    int count = a->count;
+    free(a);
+    return count;
+}
+
+void search_report(FILE *out) {
+    if (!opened) {
+        return;
+    }
+    fprintf(out, "Search: %u messages in history (%u loaded), %u terms, %lu postings in %lu bytes "
+                 "(%.2f per posting), %lu dropped (behind); %lu queries, %lu hits, %lu failures\n",
+            message_count, loaded, terms_used, posting_count, posting_bytes,
+            (posting_count > 0) ? (double)posting_bytes/posting_count : 0.0, dropped, queries, hits, failures);
+    fflush(out);
+}
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
 
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -17,36 +18,220 @@
 #include <poll.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
 
 #include "message.h"
-#include "sockaddr_cmp.h"
+#include "tuning.h"
+#include "clients.h"
+#include "trace.h"
+#include "listener.h"
+#include "handoff.h"
+#include "ratelimit.h"
+#include "topics.h"
+#include "presence.h"
+#include "mailbox.h"
+#include "search.h"
+#include "capture.h"
+#include "attach.h"
+#include "spool.h"
 
 //#define IP_ADDR htonl(INADDR_ANY)
 //#define PORT 2507
 
-#define SS_BACKLOG 16
 #define UNIX_ADDR "./unix_socket"
-#define INIT_DESC 4 /* must be > 2 */
 
 typedef struct {
     struct sockaddr_un unix_socket_addr;
-    struct sockaddr_in inet_socket_addr;
+    struct sockaddr_storage inet_socket_addr;   /* IPv4 or IPv6 */
+    socklen_t inet_socket_size;
     char *hr_up;
     char *hr_ip;
     char *hr_p;
+    tuning_options tuning;
+    bool trace;
+    char *trace_path;
+    int trace_sample;
+    int backlog;
+    int accept_batch;
+    char *handoff_path;
+    int coalesce_ms;
+    rate_limit conn_limit;
+    rate_limit user_limit;
+    char *mailbox_dir;
+    char *history_dir;
+    char *capture_path;
+    char *spool_dir;
 } application_arguments;
 
 application_arguments prog_args;
 
+void print_usage() {
+    printf("Usage: server [options] <unix_socket_path> <ip> <port>\n"
+           "  -c, --cpus <list>        pin event loop to cpus, e.g. 2 or 0,2-3\n"
+           "  -B, --busy-poll-us <us>  SO_BUSY_POLL on inet sockets\n"
+           "  -S, --spin-us <us>       spin that long before sleeping in poll()\n"
+           "  -T, --trace              per-stage latency histograms (printed on SIGUSR1 and at exit)\n"
+           "  -F, --trace-file <path>  also write sampled message traces (Chrome trace format), implies -T\n"
+           "  -N, --trace-sample <n>   trace every n-th message to the file (default %d)\n"
+           "  -b, --backlog <n>        listen backlog (default %d, kernel caps it at somaxconn)\n"
+           "  -A, --accept-batch <n>   most connections accepted per listener per tick (default %d)\n"
+           "  -X, --handoff <path>     hot restart: take over from server listening at path, if any,\n"
+           "                           then listen there for a successor\n"
+           "  -W, --coalesce-ms <ms>   hold messages up to that long and send them to each client\n"
+           "                           with one send() (up to %d at once, default 0 - off)\n"
+           "  -r, --rate <n>[:burst]   messages a second one connection may send (burst defaults to n);\n"
+           "                           beyond that it isn't read until a token is back\n"
+           "  -u, --user-rate <n>[:burst]  the same per username, over all its connections\n"
+           "  -M, --mailbox <dir>      keep messages for users who are offline in dir, deliver them\n"
+           "                           when user is back\n"
+           "  -L, --history <dir>      keep history of messages in dir, searchable with\n"
+           "                           \"/search <words>\"\n"
+           "  -C, --capture <path>     record every received message with its time and connection to path,\n"
+           "                           for replay (see replay)\n"
+           "  -D, --spool <dir>        keep files sent with \"/send <path>\" in dir, for \"/get <id>\"\n"
+           "<ip> may be IPv4 or IPv6; an IPv6 one (:: for any) takes IPv4 clients as well.\n"
+           "Messages \"@<topic> <text>\" go only to clients which sent \"/sub <pattern>\" with a matching\n"
+           "pattern (levels split by dots, * - one level, # at the end - any number of them).\n",
+           TRACE_SAMPLE_DEFAULT, SS_BACKLOG_DEFAULT, ACCEPT_BATCH_DEFAULT, COALESCE_MAX);
+}
+
 /*
- * Order of arguments:
+ * Options go first, then in order:
  * - unix port name
  * - ip
  * - port
  */
 void process_application_arguments(int argc, char **argv, application_arguments *args) {
-    if(argc < 3) {
+    static struct option long_options[] = {
+        {"cpus", required_argument, NULL, 'c'},
+        {"busy-poll-us", required_argument, NULL, 'B'},
+        {"spin-us", required_argument, NULL, 'S'},
+        {"trace", no_argument, NULL, 'T'},
+        {"trace-file", required_argument, NULL, 'F'},
+        {"trace-sample", required_argument, NULL, 'N'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"accept-batch", required_argument, NULL, 'A'},
+        {"handoff", required_argument, NULL, 'X'},
+        {"coalesce-ms", required_argument, NULL, 'W'},
+        {"rate", required_argument, NULL, 'r'},
+        {"user-rate", required_argument, NULL, 'u'},
+        {"mailbox", required_argument, NULL, 'M'},
+        {"history", required_argument, NULL, 'L'},
+        {"capture", required_argument, NULL, 'C'},
+        {"spool", required_argument, NULL, 'D'},
+        {NULL, 0, NULL, 0}
+    };
+
+    tuning_defaults(&(args->tuning));
+    args->trace = false;
+    args->trace_path = NULL;
+    args->trace_sample = TRACE_SAMPLE_DEFAULT;
+    args->backlog = SS_BACKLOG_DEFAULT;
+    args->accept_batch = ACCEPT_BATCH_DEFAULT;
+    args->handoff_path = NULL;
+    args->coalesce_ms = 0;
+    args->conn_limit.rate = 0;
+    args->user_limit.rate = 0;
+    args->mailbox_dir = NULL;
+    args->history_dir = NULL;
+    args->capture_path = NULL;
+    args->spool_dir = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+c:B:S:TF:N:b:A:X:W:r:u:M:L:C:D:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                if (tuning_parse_cpus(optarg, &(args->tuning.cpus)) == -1) {
+                    printf("Wrong cpu list\n");
+                    exit(1);
+                }
+                args->tuning.pin = true;
+                break;
+            case 'B':
+                args->tuning.busy_poll_us = (int)strtol(optarg, NULL, 10);
+                if (args->tuning.busy_poll_us < 0) {
+                    printf("Busy poll time must not be negative\n");
+                    exit(1);
+                }
+                break;
+            case 'S':
+                args->tuning.spin_us = strtol(optarg, NULL, 10);
+                if (args->tuning.spin_us < 0 || args->tuning.spin_us >= 1000000) {
+                    printf("Spin time must be within [0, 1000000) us\n");
+                    exit(1);
+                }
+                break;
+            case 'T':
+                args->trace = true;
+                break;
+            case 'F':
+                args->trace = true;
+                args->trace_path = optarg;
+                break;
+            case 'N':
+                args->trace_sample = (int)strtol(optarg, NULL, 10);
+                if (args->trace_sample <= 0) {
+                    printf("Trace sampling must be positive\n");
+                    exit(1);
+                }
+                break;
+            case 'b':
+                args->backlog = (int)strtol(optarg, NULL, 10);
+                if (args->backlog <= 0) {
+                    printf("Backlog must be positive\n");
+                    exit(1);
+                }
+                break;
+            case 'A':
+                args->accept_batch = (int)strtol(optarg, NULL, 10);
+                if (args->accept_batch <= 0) {
+                    printf("Accept batch must be positive\n");
+                    exit(1);
+                }
+                break;
+            case 'X':
+                args->handoff_path = optarg;
+                break;
+            case 'W':
+                args->coalesce_ms = (int)strtol(optarg, NULL, 10);
+                if (args->coalesce_ms < 0 || args->coalesce_ms > COALESCE_WINDOW_MAX_MS) {
+                    printf("Coalescing window must be within [0, %d] ms\n", COALESCE_WINDOW_MAX_MS);
+                    exit(1);
+                }
+                break;
+            case 'r':
+            case 'u':
+                if (rate_parse(optarg, (opt == 'r') ? &(args->conn_limit) : &(args->user_limit)) == -1) {
+                    printf("Rate must be <n>[:burst], both positive\n");
+                    exit(1);
+                }
+                break;
+            case 'M':
+                args->mailbox_dir = optarg;
+                break;
+            case 'L':
+                args->history_dir = optarg;
+                break;
+            case 'C':
+                args->capture_path = optarg;
+                break;
+            case 'D':
+                args->spool_dir = optarg;
+                break;
+            default:
+                print_usage();
+                exit(1);
+        }
+    }
+
+    /* positional arguments keep their indexes */
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if(argc < 4) {
         printf("Too few argument, 3 required: <unix_socket_path> <ip> <port>\n");
+        print_usage();
         exit(1);
     }
 
@@ -68,9 +253,15 @@ void process_application_arguments(int argc, char **argv, application_arguments
     strcpy(args->unix_socket_addr.sun_path, unix_socket_path);
 
     /* internet domain socket */
-    args->inet_socket_addr.sin_family = AF_INET;
-    int ret = inet_pton(AF_INET, argv[2], &(args->inet_socket_addr.sin_addr));
-    if(ret != 1) {
+    struct sockaddr_in *inet_addr = (struct sockaddr_in *)&(args->inet_socket_addr);
+    struct sockaddr_in6 *inet6_addr = (struct sockaddr_in6 *)&(args->inet_socket_addr);
+    if(inet_pton(AF_INET, argv[2], &(inet_addr->sin_addr)) == 1) {
+        inet_addr->sin_family = AF_INET;
+        args->inet_socket_size = sizeof(struct sockaddr_in);
+    } else if(inet_pton(AF_INET6, argv[2], &(inet6_addr->sin6_addr)) == 1) {
+        inet6_addr->sin6_family = AF_INET6;
+        args->inet_socket_size = sizeof(struct sockaddr_in6);
+    } else {
         printf("Wrong IP format\n");
         exit(1);
     }
@@ -80,12 +271,14 @@ void process_application_arguments(int argc, char **argv, application_arguments
         printf("Wrong port\n");
         exit(1);
     }
-    args->inet_socket_addr.sin_port = htons((in_port_t)unvalidated_port);
+    /* port is at the same place in both */
+    inet_addr->sin_port = htons((in_port_t)unvalidated_port);
 }
 
 /* -------------------------------------- */
 
 volatile bool loop = true;
+volatile sig_atomic_t reportRequested = 0;
 
 void sigint_handler(int signo) {
     char msg[] = "\nSIGINT received...\n";
@@ -93,55 +286,285 @@ void sigint_handler(int signo) {
     loop = false;
 }
 
+void sigusr1_handler(int signo) {
+    (void)signo;
+    reportRequested = 1;
+}
+
 /* -------------------------------------- */
 
-int clientCapacity = 2;
-struct pollfd *ufds = NULL;
-int clientIterator = 2;
+/*
+ * Coalescing window: first message opens it, it closes after coalesce_ms or when it's full, and
+ * then every client gets everything with one send(). Messages' trace "log" stage includes the wait.
+ */
+char pendingBytes[COALESCE_MAX*sizeof(message)];
+size_t pendingLength = 0;
+int pendingCount = 0;
+trace_record pendingTrace[COALESCE_MAX];
+char pendingFrom[COALESCE_MAX][USERNAME_MAX + 1];
+long pendingDeadline = 0;
+unsigned long coalescedMessages = 0;
+unsigned long coalescedSends = 0;
+
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+void flushPending() {
+    if (pendingCount == 0) {
+        return;
+    }
 
-void addClient(int desc) {
-    if(clientIterator >= clientCapacity) {
-        clientCapacity = (clientCapacity > 0) ? 2*clientCapacity : INIT_DESC;
-        ufds = realloc(ufds, sizeof(struct pollfd)*clientCapacity);
+    for (int k = 0; k < pendingCount; k++) {
+        TRACE_STAMP(&pendingTrace[k], TRACE_FANOUT);
+    }
+    int recipients = broadcast((message *)pendingBytes, pendingLength);
+    for (int k = 0; k < pendingCount; k++) {
+        pendingTrace[k].recipients = recipients;
+        TRACE_STAMP(&pendingTrace[k], TRACE_SENT);
+        TRACE_END(&pendingTrace[k], pendingFrom[k]);
     }
 
-    ufds[clientIterator].fd = desc;
-    ufds[clientIterator].events = POLLIN;
-    ufds[clientIterator].revents = 0;
-    clientIterator++;
+    coalescedMessages += pendingCount;
+    coalescedSends++;
+    pendingCount = 0;
+    pendingLength = 0;
 }
 
-/* -------------------------------------- */
+/* sends what was received to everybody right away, or parks it in the coalescing window */
+void fanOut(message *msg, size_t length, trace_record *trace) {
+    if (prog_args.coalesce_ms == 0) {
+        TRACE_STAMP(trace, TRACE_FANOUT);
+        trace->recipients = broadcast(msg, length);
+        TRACE_STAMP(trace, TRACE_SENT);
+        TRACE_END(trace, msg->from);
+        return;
+    }
 
+    if (pendingLength + length > sizeof(pendingBytes)) {
+        flushPending();
+    }
+    if (pendingCount == 0) {
+        pendingDeadline = now_ms() + prog_args.coalesce_ms;
+    }
+    memcpy(pendingBytes + pendingLength, msg, length);
+    pendingLength += length;
+    memcpy(&pendingTrace[pendingCount], trace, sizeof(trace_record));
+    memcpy(pendingFrom[pendingCount], msg->from, USERNAME_MAX);
+    pendingFrom[pendingCount][USERNAME_MAX] = '\0';
+    pendingCount++;
+
+    if (pendingCount == COALESCE_MAX) {
+        flushPending();
+    }
+}
 
-int main(int argc, char **argv) {
-    process_application_arguments(argc, argv, &prog_args);
+/* snapshot to client which asked, from now on it gets deltas too */
+void sendRoster(int i) {
+    topics_subscribe(i, PRESENCE_TOPIC);
 
-    int recv_len, i, events, optval;
+    message *records;
+    int count = presence_snapshot(&records);
+    for (int k = 0; k < count; k++) {
+        multicast(&records[k], sizeof(message), &i, 1);
+    }
+    free(records);
+}
+
+/* joins and leaves since the last batch, to everybody who asked for roster */
+void flushPresence() {
+    message *records;
+    int count = presence_deltas(&records);
+    int watchers;
+    const int *ids = topics_match(PRESENCE_TOPIC, &watchers);
+    for (int k = 0; k < count; k++) {
+        multicast(&records[k], sizeof(message), ids, watchers);
+    }
+    free(records);
+}
 
-    socklen_t how_much_for_address = 0;
-    {
-        socklen_t inet_sizeof = sizeof(struct sockaddr_in);
-        socklen_t un_sizeof = sizeof(struct sockaddr_un);
-        if (inet_sizeof > un_sizeof) {
-            how_much_for_address = inet_sizeof;
+/* mailboxes read for users who came back go to them, or back if they're gone again */
+void collectMail() {
+    char name[USERNAME_MAX + 1];
+    message *msgs;
+    int count;
+    while ((count = mailbox_collect(name, &msgs)) != -1) {
+        int i = clientNamed(name);
+        if (i == -1) {
+            mailbox_return(name, msgs, count);
+            continue;
+        }
+        for (int k = 0; k < count; k++) {
+            multicast(&msgs[k], sizeof(message), &i, 1);
+        }
+        if (count > 0) {
+            printf("Delivered %d messages kept for %s\n", count, name);
+        }
+        free(msgs);
+    }
+}
+
+/* answers to searches, for whoever asked (if still there) */
+void collectAnswers() {
+    char name[USERNAME_MAX + 1];
+    message *msgs;
+    int count;
+    while ((count = search_collect(name, &msgs)) != -1) {
+        int i = clientNamed(name);
+        for (int k = 0; k < count && i != -1; k++) {
+            multicast(&msgs[k], sizeof(message), &i, 1);
+        }
+        free(msgs);
+    }
+}
+
+/* roster requests, searches, downloads, topic commands are handled here (see topics.h), everything else fans out */
+void route(int i, message *msg, size_t length, trace_record *trace) {
+    if (presence_record(msg)) {
+        /* only server sends with empty name */
+        printf("Message without sender, dropping\n");
+        return;
+    }
+    nameClient(i, msg->from);
+
+    if (strncmp(msg->msg, PRESENCE_REQUEST, sizeof(PRESENCE_REQUEST)) == 0) {
+        sendRoster(i);
+        return;
+    }
+
+    if (strncmp(msg->msg, ATTACH_REQUEST, strlen(ATTACH_REQUEST)) == 0) {
+        spool_request(i, msg->msg + strlen(ATTACH_REQUEST));
+        return;
+    }
+
+    if (strncmp(msg->msg, SEARCH_REQUEST, strlen(SEARCH_REQUEST)) == 0) {
+        if (searchRunning) {
+            search_query(msg->from, msg->msg + strlen(SEARCH_REQUEST));
         } else {
-            how_much_for_address = un_sizeof;
+            printf("No history to search for: %s\n", msg->from);
         }
+        return;
     }
 
+    char name[MSG_LEN_MAX + 1];
+    switch (topics_command(msg->msg, name)) {
+        case TOPIC_NONE:
+            mailbox_post(msg);
+            search_add(msg);
+            fanOut(msg, length, trace);
+            break;
+        case TOPIC_PUBLISH: {
+            /* whatever waits in the window was sent earlier */
+            flushPending();
+            int count;
+            const int *ids = topics_match(name, &count);
+            TRACE_STAMP(trace, TRACE_FANOUT);
+            trace->recipients = multicast(msg, length, ids, count);
+            TRACE_STAMP(trace, TRACE_SENT);
+            TRACE_END(trace, msg->from);
+            break;
+        }
+        case TOPIC_SUBSCRIBE:
+            if (topics_subscribe(i, name) == 0) {
+                printf("%s subscribed to %s\n", msg->from, name);
+            }
+            break;
+        case TOPIC_UNSUBSCRIBE:
+            if (topics_unsubscribe(i, name) == 0) {
+                printf("%s unsubscribed from %s\n", msg->from, name);
+            }
+            break;
+        default:
+            printf("Malformed topic from: %s\n", msg->from);
+    }
+}
 
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = sigint_handler;
-    sigaction(SIGINT, &act, NULL);
+void coalesceReport() {
+    if (prog_args.coalesce_ms > 0) {
+        printf("Coalesced %lu messages into %lu sends per client\n", coalescedMessages, coalescedSends);
+    }
+}
+
+/*
+ * Ingress limits, checked before anything is read off the connection. Excess isn't dropped -
+ * client is deferred instead, its data waits in socket buffers and TCP slows the sender down.
+ * Username is peeked, so the message stays where it is too. False - client got deferred.
+ */
+bool admit(int i) {
+    /* rest of a message which was let in already */
+    if (clientHeld[i] > 0) {
+        return true;
+    }
+
+    long now = now_ms();
+    rate_bucket *conn = &(clientBucket[i]);
+    if (prog_args.conn_limit.rate > 0 && !rate_take(conn, &(prog_args.conn_limit), now)) {
+        rate_decisions[RATE_CONNECTION]++;
+        deferClient(i, now + rate_wait_ms(conn, &(prog_args.conn_limit)));
+        return false;
+    }
+
+    if (prog_args.user_limit.rate > 0) {
+        message peeked;
+        ssize_t got = recv(ufds[i].fd, peeked.from, sizeof(peeked.from), MSG_PEEK);
+        /* EOF and errors are for the ordinary path to handle */
+        if (got > 0) {
+            peeked.from[(got < USERNAME_MAX) ? got : USERNAME_MAX] = '\0';
+            rate_bucket *user = rate_user(peeked.from, &(prog_args.user_limit), now);
+            if (!rate_take(user, &(prog_args.user_limit), now)) {
+                if (prog_args.conn_limit.rate > 0) {
+                    rate_give_back(conn);
+                }
+                rate_decisions[RATE_USER]++;
+                deferClient(i, now + rate_wait_ms(user, &(prog_args.user_limit)));
+                return false;
+            }
+        }
+    }
+
+    rate_decisions[RATE_PASSED]++;
+    return true;
+}
 
-    ufds = calloc(sizeof(struct pollfd), 2);
+void rateReport() {
+    if (prog_args.conn_limit.rate > 0 || prog_args.user_limit.rate > 0) {
+        rate_report(stdout, "deferred");
+    }
+}
+
+/* every client needs a descriptor - a reconnect storm shouldn't hit the default 1024 */
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
 
-    /* create UNIX and INET listen sockets */
-    int inet_listen = socket(AF_INET, SOCK_STREAM, 0);
+/* creates UNIX and INET listen sockets: sockets[0] - inet, sockets[1] - unix */
+void openListeners(int *sockets) {
+    int optval;
+    int inet_listen = socket(prog_args.inet_socket_addr.ss_family, SOCK_STREAM, 0);
 
-    if (bind(inet_listen, (struct sockaddr *) &(prog_args.inet_socket_addr), sizeof(prog_args.inet_socket_addr)) == -1) {
+    /* after a restart with many clients the port is full of TIME_WAIT connections */
+    optval = 1;
+    if (setsockopt(inet_listen, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) == -1) {
+        perror("setsockopt(..., SO_REUSEADDR, ...) failed");
+        exit(1);
+    }
+
+    /* dual stack: IPv4 clients connect to the IPv6 socket too */
+    optval = 0;
+    if (prog_args.inet_socket_addr.ss_family == AF_INET6 &&
+        setsockopt(inet_listen, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(optval)) == -1) {
+        perror("setsockopt(..., IPV6_V6ONLY, ...) failed");
+        exit(1);
+    }
+
+    if (bind(inet_listen, (struct sockaddr *) &(prog_args.inet_socket_addr), prog_args.inet_socket_size) == -1) {
         perror("bind(...) failed");
         exit(1);
     }
@@ -156,7 +579,7 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (bind(unix_listen, (struct sockaddr *) &(prog_args.unix_socket_addr), sizeof(prog_args.inet_socket_addr)) == -1) {
+    if (bind(unix_listen, (struct sockaddr *) &(prog_args.unix_socket_addr), sizeof(prog_args.unix_socket_addr)) == -1) {
         perror("bind2(...) failed");
         exit(1);
     }
@@ -165,9 +588,163 @@ int main(int argc, char **argv) {
     fcntl(inet_listen, F_SETFL, O_NONBLOCK);
     fcntl(unix_listen, F_SETFL, O_NONBLOCK);
 
+    sockets[0] = inet_listen;
+    sockets[1] = unix_listen;
+}
+
+/* hot restart, new process: listening sockets and connections of the previous one */
+void takeOver(int conn, int *sockets) {
+    handoff_state st;
+    if (handoff_receive(conn, &st) == -1) {
+        perror("handoff_receive(...) failed");
+        exit(1);
+    }
+    if (st.fd_count < 2) {
+        printf("Previous server handed over %d sockets, at least 2 expected\n", st.fd_count);
+        exit(1);
+    }
+
+    sockets[0] = st.fds[0];
+    sockets[1] = st.fds[1];
+    size_t offset = 0;
+    for (int k = 2; k < st.fd_count; k++) {
+        if (loadClientState(addClient(st.fds[k]), st.state, st.state_length, &offset) == -1) {
+            printf("Malformed client state from previous server\n");
+            exit(1);
+        }
+    }
+    printf("Took over %d clients from previous server\n", st.fd_count - 2);
+    handoff_free(&st);
+}
+
+/* hot restart, old process: true when successor has everything and we should quit */
+bool handOver(int handoffListen) {
+    int conn = accept4(handoffListen, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+        perror("accept4(...) failed");
+        return false;
+    }
+
+    /* nothing may stay behind in the window, successor reads mailboxes as they are now */
+    flushPending();
+    mailbox_drain();
+    search_drain();
+
+    /* listening sockets first, then every connected client */
+    int *fds = malloc(sizeof(int)*clientIterator);
+    int count = 0;
+    char *state = NULL;
+    size_t length = 0;
+    fds[count++] = ufds[0].fd;
+    fds[count++] = ufds[1].fd;
+    for (int i = CLIENTS_FIRST; i < clientIterator; i++) {
+        if (ufds[i].fd >= 0) {
+            fds[count++] = ufds[i].fd;
+            saveClientState(i, &state, &length);
+        }
+    }
+
+    bool done = handoff_send(conn, fds, count, state, length) == 0 && handoff_wait_confirm(conn) == 0;
+    if (done) {
+        printf("Handed %d clients over to successor\n", count - 2);
+    } else {
+        printf("Successor went away, carrying on\n");
+    }
+
+    free(fds);
+    free(state);
+    close(conn);
+    return done;
+}
+
+int main(int argc, char **argv) {
+    process_application_arguments(argc, argv, &prog_args);
+
+    int recv_len, i, events;
+
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sigint_handler;
+    sigaction(SIGINT, &act, NULL);
+    act.sa_handler = sigusr1_handler;
+    sigaction(SIGUSR1, &act, NULL);
+
+    if (prog_args.trace && trace_init(prog_args.trace_path, prog_args.trace_sample) == -1) {
+        perror("trace_init(...) failed");
+        exit(1);
+    }
+    if (prog_args.capture_path != NULL && capture_open(prog_args.capture_path, CAPTURE_TCP) == -1) {
+        perror("capture_open(...) failed");
+        exit(1);
+    }
+
+    raise_fd_limit();
+
+    ufds = calloc(sizeof(struct pollfd), CLIENTS_FIRST);
+
+    /* listening sockets and connections come either from the previous server, or we start from scratch */
+    int sockets[2];
+    int handoffConn = -1;
+    if (prog_args.handoff_path != NULL) {
+        handoffConn = handoff_connect(prog_args.handoff_path);
+        if (handoffConn == -1 && errno != ENOENT && errno != ECONNREFUSED) {
+            perror("handoff_connect(...) failed");
+            exit(1);
+        }
+    }
+
+    if (prog_args.mailbox_dir != NULL && mailbox_start(prog_args.mailbox_dir) == -1) {
+        perror("mailbox_start(...) failed");
+        exit(1);
+    }
+    /* before taking over, transfers in progress come with the clients */
+    if (prog_args.spool_dir != NULL && spool_start(prog_args.spool_dir) == -1) {
+        perror("spool_start(...) failed");
+        exit(1);
+    }
+
+    if (handoffConn != -1) {
+        takeOver(handoffConn, sockets);
+    } else {
+        openListeners(sockets);
+    }
+    /* predecessor, if any, has written all its mail and history by now */
+    mailbox_scan();
+    if (prog_args.history_dir != NULL && search_start(prog_args.history_dir) == -1) {
+        perror("search_start(...) failed");
+        exit(1);
+    }
+    int inet_listen = sockets[0];
+    int unix_listen = sockets[1];
+
+    /* again for taken over ones - it only updates backlog */
     /* mark sockets using listen */
-    listen(inet_listen, SS_BACKLOG);
-    listen(unix_listen, SS_BACKLOG);
+    if (listen(inet_listen, prog_args.backlog) == -1 || listen(unix_listen, prog_args.backlog) == -1) {
+        perror("listen(...) failed");
+        exit(1);
+    }
+
+    int somaxconn = listener_somaxconn();
+    if (somaxconn > 0 && prog_args.backlog > somaxconn) {
+        printf("Backlog %d capped by net.core.somaxconn to %d\n", prog_args.backlog, somaxconn);
+    }
+
+    listener listeners[2];
+    listener_init(&listeners[0], inet_listen, "inet", true);
+    listener_init(&listeners[1], unix_listen, "unix", false);
+    listener_overflow_baseline();
+
+    if (tuning_apply_affinity(&(prog_args.tuning)) == -1) {
+        perror("tuning_apply_affinity(...) failed");
+        exit(1);
+    }
+
+    /* accepted connections inherit it from the listening socket */
+    if (tuning_apply_busy_poll(&(prog_args.tuning), inet_listen) == -1) {
+        perror("tuning_apply_busy_poll(...) failed");
+        exit(1);
+    }
 
     /* add sockets to polling queue */
     ufds[0].fd = inet_listen;
@@ -178,13 +755,95 @@ int main(int argc, char **argv) {
     ufds[1].events = POLLIN;
     ufds[1].revents = 0;
 
+    /* successor connects here; -1 (ignored by poll) without hot restart */
+    ufds[2].fd = -1;
+    ufds[2].events = POLLIN;
+    ufds[2].revents = 0;
+    if (prog_args.handoff_path != NULL && (ufds[2].fd = handoff_listen(prog_args.handoff_path)) == -1) {
+        perror("handoff_listen(...) failed");
+        exit(1);
+    }
+
+    /* only now the previous server may go */
+    if (handoffConn != -1) {
+        if (handoff_confirm(handoffConn) == -1) {
+            perror("handoff_confirm(...) failed");
+            exit(1);
+        }
+        close(handoffConn);
+    }
+
     printf("Waiting for connections at %s:[%s] and %s\n", prog_args.hr_ip, prog_args.hr_p, prog_args.hr_up);
 
-    struct sockaddr *cli_addr = NULL;
     message buf;
+    trace_record trace;
+    bool handedOver = false;
+    long nextPresence = 0;
     while (loop) {
-        if ((events = poll(ufds, clientIterator, 2500)) == 0) {
-            printf("Timeout, but no events!\n");
+        int timeout = 2500;
+        if (pendingCount > 0) {
+            long left = pendingDeadline - now_ms();
+            timeout = (left < 0) ? 0 : ((left < timeout) ? (int)left : timeout);
+        }
+        if (deferredClients > 0) {
+            long left = nextResume - now_ms();
+            timeout = (left < 0) ? 0 : ((left < timeout) ? (int)left : timeout);
+        }
+        if (presence_pending()) {
+            long left = nextPresence - now_ms();
+            timeout = (left < 0) ? 0 : ((left < timeout) ? (int)left : timeout);
+        }
+        bool mailDue = mailbox_waiting() > 0;
+        if (mailDue && timeout > MAILBOX_POLL_MS) {
+            timeout = MAILBOX_POLL_MS;
+        }
+        bool answerDue = search_waiting() > 0;
+        if (answerDue && timeout > SEARCH_POLL_MS) {
+            timeout = SEARCH_POLL_MS;
+        }
+        bool transferDue = spool_pending() > 0;
+        if (transferDue && timeout > ATTACH_POLL_MS) {
+            timeout = ATTACH_POLL_MS;
+        }
+        events = tuning_poll(&(prog_args.tuning), ufds, clientIterator, timeout);
+
+        if (reportRequested) {
+            reportRequested = 0;
+            trace_report(stdout);
+            listener_report(stdout, listeners, 2);
+            coalesceReport();
+            rateReport();
+            topics_report(stdout);
+            presence_report(stdout);
+            mailbox_report(stdout);
+            search_report(stdout);
+            spool_report(stdout);
+            memoryReport(stdout);
+            capture_report(stdout);
+        }
+
+        int deferredBefore = deferredClients;
+        resumeClients(now_ms());
+
+        bool windowClosed = pendingCount > 0 && now_ms() >= pendingDeadline;
+        if (windowClosed) {
+            flushPending();
+        }
+
+        /* first change goes out right away, the ones following it in batches */
+        bool presenceSent = presence_pending() && now_ms() >= nextPresence;
+        if (presenceSent) {
+            flushPresence();
+            nextPresence = now_ms() + PRESENCE_BATCH_MS;
+        }
+        collectMail();
+        collectAnswers();
+        spool_pump();
+
+        if (events == 0) {
+            if (!windowClosed && deferredBefore == 0 && !presenceSent && !mailDue && !answerDue && !transferDue) {
+                printf("Timeout, but no events!\n");
+            }
             continue;
         }
         else if (events == -1) {
@@ -195,17 +854,22 @@ int main(int argc, char **argv) {
             exit(1);
         }
         else {
+            /* successor takes it from here - nothing more may be read */
+            if (ufds[2].revents & POLLIN) {
+                events--;
+                if (handOver(ufds[2].fd)) {
+                    handedOver = true;
+                    break;
+                }
+            }
+
             /* first, check listening ports if somebody does not want to connect */
-            int res = -1;
+            int polled = clientIterator; /* clients accepted now weren't polled yet */
             i = 0;
             for(; i < 2 && events > 0; i++) {
                 if(ufds[i].revents & POLLIN) {
-                    res = accept(ufds[i].fd, NULL, NULL);
-                    if (res > 0) {
-                        /* new client connected! */
-                        addClient(res);
-                    } else if (res == -1 && errno != EWOULDBLOCK && errno != EAGAIN) {
-                        perror("accept(...) failed");
+                    if (listener_accept(&listeners[i], prog_args.accept_batch) == -1) {
+                        perror("accept4(...) failed");
                         exit(1);
                     }
 
@@ -215,47 +879,129 @@ int main(int argc, char **argv) {
 
             /* now check the rest for ordinary transmission requests */
 
-            for (; i < clientIterator && events > 0; i++) {
-                if(ufds[i].revents & POLLHUP) {
-                    printf("Client disconnected\n");
-                    ufds[i].fd *= -1;
+            for (i = CLIENTS_FIRST; i < polled && events > 0; i++) {
+                if (ufds[i].revents & POLLOUT) {
+                    /* socket has room for what it's owed */
+                    if (flushClient(i) == -1) {
+                        perror("send(...) failed");
+                        removeClient(i);
+                        events--;
+                        continue;
+                    }
+                    if (!(ufds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                        events--;
+                        continue;
+                    }
+                }
+                if ((ufds[i].revents & POLLIN) && spool_receiving(i)) {
+                    /* chunk bytes aren't messages, the rate limit doesn't count them */
+                    TRACE_STAMP(&trace, TRACE_RECEIVED);
+                    int received = spool_receive(i, &buf);
+                    if (received == -2) {
+                        /* closed in the middle of an upload, as for recv() returning 0 */
+                        flushPending();
+                        removeClient(i);
+                    } else if (received == -1) {
+                        perror("splice(...) failed");
+                        removeClient(i);
+                    } else if (received == 1) {
+                        TRACE_STAMP(&trace, TRACE_DECODED);
+                        route(i, &buf, sizeof(message), &trace);
+                    }
+                    events--;
                 } else if (ufds[i].revents & POLLIN) {
-                    if ((recv_len = recv(ufds[i].fd, &buf, sizeof(buf), 0)) == -1) {
+                    if (!admit(i)) {
+                        events--;
+                        continue;
+                    }
+                    /* straight into buf unless a partial message waits in the inbox */
+                    message *into = (clientHeld[i] > 0) ? clientInbox[i] : &buf;
+                    recv_len = recv(ufds[i].fd, (char *)into + clientHeld[i], sizeof(message) - clientHeld[i], 0);
+                    TRACE_STAMP(&trace, TRACE_RECEIVED);
+                    if (recv_len == -1) {
                         if (errno == EINTR) {
                             continue;
                         }
-                        perror("recvfrom(...) failed");
-                        exit(1);
+                        perror("recv(...) failed");
+                        removeClient(i);
+                        events--;
+                        continue;
                     }
 
                     if(recv_len == 0) {
-                        /* socket was ready and yet no data read - it has be closed remotely */
-                        printf("Client disconnected\n");
-                        ufds[i].fd *= -1;
-                    } else {
-                        printf("Received: %s from: %s\n", buf.msg, buf.from);
-                        //      ELSE SEND TO ALL1
-
-                        for (int j = 2; j < clientIterator; j++) {
-                            if(ufds[j].fd >= 0) {
-                                if (send(ufds[j].fd, &buf, recv_len, 0) == -1) {
-                                    perror("sendto(...) failed");
-                                    exit(1);
-                                }
+                        /* socket was ready and yet no data read - it has be closed remotely;
+                         * it may still be reading, let it have what it sent */
+                        flushPending();
+                        removeClient(i);
+                    } else if ((clientHeld[i] += recv_len) == sizeof(message)) {
+                        /* only whole messages are routed, the stream may have been split anywhere */
+                        clientHeld[i] = 0;
+                        if (into != &buf) {
+                            memcpy(&buf, into, sizeof(message));
+                            free(clientInbox[i]);
+                            clientInbox[i] = NULL;
+                        }
+                        TRACE_STAMP(&trace, TRACE_DECODED);
+                        if (ATTACH_FRAME(&buf)) {
+                            /* raw bytes follow, announcement replaces the header once they're all in */
+                            int received = spool_chunk(i, &buf, &buf);
+                            if (received == -1) {
+                                printf("Malformed attachment chunk from: %s, dropping client\n", buf.from);
+                                removeClient(i);
+                            } else if (received == 1) {
+                                route(i, &buf, sizeof(message), &trace);
                             }
+                        } else {
+                            /* only chat is recorded - chunk framing is useless without its bytes;
+                             * slots are reused, connection numbers aren't */
+                            CAPTURE(&clientConnection[i], sizeof(clientConnection[i]), &buf);
+                            printf("Received: %s from: %s\n", buf.msg, buf.from);
+                            //      ELSE SEND TO ALL1
+
+                            route(i, &buf, sizeof(message), &trace);
                         }
+                    } else if (into == &buf) {
+                        /* first part of a split message, keep it until the rest comes */
+                        clientInbox[i] = malloc(sizeof(message));
+                        memcpy(clientInbox[i], &buf, clientHeld[i]);
                     }
 
+                    events--;
+                } else if (ufds[i].revents & (POLLHUP | POLLERR)) {
+                    /* read whatever is left first, only then drop the client */
+                    removeClient(i);
                     events--;
                 }
             }
         }
     }
 
+    flushPending();
+
     printf("Shutting down...\n");
+    trace_report(stdout);
+    listener_report(stdout, listeners, 2);
+    coalesceReport();
+    rateReport();
+    topics_report(stdout);
+    presence_report(stdout);
+    mailbox_stop();
+    mailbox_report(stdout);
+    search_stop();
+    search_report(stdout);
+    spool_report(stdout);
+    memoryReport(stdout);
+    capture_report(stdout);
+    trace_close();
+    capture_close();
+
+    /* path belongs to the successor now */
+    if (ufds[2].fd >= 0 && !handedOver) {
+        unlink(prog_args.handoff_path);
+    }
 
     for (int i = clientIterator - 1; i >= 0; i--) {
-        if (close(ufds[i].fd) == -1) {
+        if (ufds[i].fd >= 0 && close(ufds[i].fd) == -1) {
             perror("close(...) failed");
             exit(1);
         }
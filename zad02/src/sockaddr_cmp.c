@@ -1,55 +0,0 @@
-
-/*
- * Copyright (c) 2014 Kazuho Oku
- *
- * Redistribution and use in source and binary forms, with or without modification,
- * are permitted.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
- * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
- * IN THE SOFTWARE.
- */
-
-#include <stdlib.h>
-#include <assert.h>
-#include <string.h>
-#include <arpa/inet.h>
-#include <sys/un.h>
-#include <netinet/in.h>
-
-#include "sockaddr_cmp.h"
-
-int sockaddr_cmp(struct sockaddr *x, struct sockaddr *y)
-{
-#define CMP(a, b) if (a != b) return a < b ? -1 : 1
-
-    CMP(x->sa_family, y->sa_family);
-
-    if (x->sa_family == AF_UNIX) {
-        struct sockaddr_un *xun = (void*)x, *yun = (void*)y;
-        int r = strcmp(xun->sun_path, yun->sun_path);
-        if (r != 0)
-            return r;
-    } else if (x->sa_family == AF_INET) {
-        struct sockaddr_in *xin = (void*)x, *yin = (void*)y;
-        CMP(ntohl(xin->sin_addr.s_addr), ntohl(yin->sin_addr.s_addr));
-        CMP(ntohs(xin->sin_port), ntohs(yin->sin_port));
-    } else if (x->sa_family == AF_INET6) {
-        struct sockaddr_in6 *xin6 = (void*)x, *yin6 = (void*)y;
-        int r = memcmp(xin6->sin6_addr.s6_addr, yin6->sin6_addr.s6_addr, sizeof(xin6->sin6_addr.s6_addr));
-        if (r != 0)
-            return r;
-        CMP(ntohs(xin6->sin6_port), ntohs(yin6->sin6_port));
-        CMP(xin6->sin6_flowinfo, yin6->sin6_flowinfo);
-        CMP(xin6->sin6_scope_id, yin6->sin6_scope_id);
-    } else {
-        assert(!"unknown sa_family");
-    }
-
-#undef CMP
-    return 0;
-}
\ No newline at end of file
@@ -1,13 +0,0 @@
-//
-// Created by blueeyedhush on 6/12/15.
-//
-
-#ifndef MAKEFILE_SOCKADDR_CMP_H
-#define MAKEFILE_SOCKADDR_CMP_H
-
-#include <sys/types.h>
-#include <sys/socket.h>
-
-int sockaddr_cmp(struct sockaddr *x, struct sockaddr *y);
-
-#endif //MAKEFILE_SOCKADDR_CMP_H
@@ -0,0 +1,705 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
+
+#include "spool.h"
+#include "attach.h"
+#include "clients.h"
+
+#define ATTACHMENT_SUFFIX ".att"
+#define PART_SUFFIX ".part"
+
+typedef struct {
+    int fd;
+    unsigned id;
+    char name[ATTACH_NAME_MAX + 1];
+    off_t start;                  /* file bytes start after the name */
+    off_t offset;                 /* next one to send */
+    off_t end;
+} spool_download;
+
+typedef struct {
+    bool uploading;
+    bool discarding;              /* upload goes nowhere: no spool, too big or it failed */
+    int upload_fd;                /* -1 - none */
+    unsigned upload_id;
+    char name[ATTACH_NAME_MAX + 1];
+    char uploader[USERNAME_MAX + 1];
+    unsigned long received;
+    unsigned long total;
+    unsigned long chunk_left;     /* bytes of the current chunk still on the stream */
+    spool_download downloads[ATTACH_DOWNLOADS_MAX]; /* first one is being sent */
+    int download_count;
+    message out_header;           /* chunk of downloads[0] partly sent, see spool_continue() */
+    size_t out_header_left;
+    size_t out_bytes_left;
+} spool_client;
+
+#define CHUNK_GOING(s) ((s)->out_header_left > 0 || (s)->out_bytes_left > 0)
+
+bool spoolRunning = false;
+
+static char *directory = NULL;
+static unsigned next_id = 1;
+static int pipe_fds[2] = {-1, -1};   /* uploads pass through it on their way to files */
+static int devnull = -1;             /* and discarded ones to here */
+
+static spool_client **clients = NULL; /* by slot, NULL - no transfers ever */
+static int clients_size = 0;
+static int active = 0;                /* clients with downloads */
+
+static unsigned long uploads = 0;
+static unsigned long bytes_in = 0;
+static unsigned long downloads = 0;
+static unsigned long chunks = 0;
+static unsigned long bytes_out = 0;
+static unsigned long held_back = 0;
+static unsigned long rejected = 0;
+static unsigned long failures = 0;
+
+/* -------------------------------------- */
+
+static spool_client *client_state(int i) {
+    if (i >= clients_size) {
+        int size = (clients_size == 0) ? 64 : clients_size;
+        while (size <= i) {
+            size *= 2;
+        }
+        clients = realloc(clients, sizeof(spool_client *)*size);
+        memset(clients + clients_size, 0, sizeof(spool_client *)*(size - clients_size));
+        clients_size = size;
+    }
+    if (clients[i] == NULL) {
+        clients[i] = calloc(1, sizeof(spool_client));
+        clients[i]->upload_fd = -1;
+    }
+    return clients[i];
+}
+
+static int open_plumbing() {
+    if (devnull != -1) {
+        return 0;
+    }
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    return (devnull == -1) ? -1 : 0;
+}
+
+static void file_path(char *path, unsigned id, const char *suffix) {
+    snprintf(path, PATH_MAX, "%s/%u%s", directory, id, suffix);
+}
+
+/* server's note to i, queued behind what i is still owed; a failed send shows up on the next read */
+static void note(int i, const char *format, ...) {
+    message msg;
+    memset(&msg, 0, sizeof(message));
+    strcpy(msg.from, ATTACH_SENDER);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(msg.msg, sizeof(msg.msg), format, args);
+    va_end(args);
+    sendClient(i, &msg, sizeof(message));
+}
+
+/* throws away upload in progress, if any */
+static void abandon(spool_client *s) {
+    if (s->upload_fd != -1) {
+        char path[PATH_MAX];
+        close(s->upload_fd);
+        file_path(path, s->upload_id, PART_SUFFIX);
+        unlink(path);
+        s->upload_fd = -1;
+    }
+    s->uploading = false;
+    s->discarding = false;
+}
+
+/* new upload goes to "<id>.part", name first */
+static int open_part(spool_client *s) {
+    char path[PATH_MAX];
+    s->upload_id = next_id++;
+    file_path(path, s->upload_id, PART_SUFFIX);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    char header[1 + ATTACH_NAME_MAX];
+    header[0] = (char)strlen(s->name);
+    memcpy(header + 1, s->name, header[0]);
+    if (write(fd, header, 1 + header[0]) != 1 + header[0]) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+/* offset counts file bytes only, as chunk headers do */
+static int open_download(spool_download *d, unsigned id, off_t offset) {
+    char path[PATH_MAX];
+    file_path(path, id, ATTACHMENT_SUFFIX);
+    d->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (d->fd == -1) {
+        return -1;
+    }
+
+    unsigned char length;
+    struct stat st;
+    if (read(d->fd, &length, 1) != 1 || length > ATTACH_NAME_MAX || read(d->fd, d->name, length) != length ||
+        fstat(d->fd, &st) == -1 || st.st_size < 1 + length) {
+        close(d->fd);
+        return -1;
+    }
+    d->name[length] = '\0';
+    d->id = id;
+    d->start = 1 + length;
+    d->end = st.st_size;
+    d->offset = (d->start + offset < d->end) ? d->start + offset : d->end;
+    return 0;
+}
+
+static void download_done(spool_client *s) {
+    close(s->downloads[0].fd);
+    memmove(s->downloads, s->downloads + 1, sizeof(spool_download)*(s->download_count - 1));
+    s->download_count--;
+    if (s->download_count == 0) {
+        active--;
+    }
+    downloads++;
+}
+
+/* upload ends with the last byte of its last chunk */
+static int chunk_done(int i, spool_client *s, message *announcement) {
+    if (!s->uploading || s->received < s->total) {
+        return 0;
+    }
+    s->uploading = false;
+    if (s->discarding) {
+        s->discarding = false;
+        return 0;
+    }
+
+    char part[PATH_MAX];
+    char path[PATH_MAX];
+    close(s->upload_fd);
+    s->upload_fd = -1;
+    file_path(part, s->upload_id, PART_SUFFIX);
+    file_path(path, s->upload_id, ATTACHMENT_SUFFIX);
+    if (rename(part, path) == -1) {
+        failures++;
+        unlink(part);
+        note(i, "cannot store %s", s->name);
+        return 0;
+    }
+
+    uploads++;
+    memset(announcement, 0, sizeof(message));
+    strcpy(announcement->from, s->uploader);
+    snprintf(announcement->msg, sizeof(announcement->msg), "shared %s (%lu bytes), " ATTACH_REQUEST "%u", s->name,
+             s->total, s->upload_id);
+    return 1;
+}
+
+/* next chunk of downloads[0] */
+static void start_chunk(spool_client *s) {
+    spool_download *d = &(s->downloads[0]);
+    attach_header h;
+    h.kind = ATTACH_DOWNLOAD;
+    h.id = d->id;
+    h.offset = d->offset - d->start;
+    h.bytes = (d->end - d->offset < ATTACH_CHUNK) ? d->end - d->offset : ATTACH_CHUNK;
+    h.total = d->end - d->start;
+    strcpy(h.name, d->name);
+
+    attach_format(&(s->out_header), ATTACH_SENDER, &h);
+    s->out_header_left = sizeof(message);
+    s->out_bytes_left = h.bytes;
+}
+
+/*
+ * Sends what the socket (non-blocking by then) takes of the chunk: 1 - it's all out, 0 - socket
+ * is full, -1 - connection failed. Receiver counts on whole chunks, so nothing else may go to the
+ * socket until it's all out.
+ */
+static int push_chunk(int fd, spool_client *s) {
+    if (s->download_count == 0) {
+        /* file of the chunk was gone after a hot restart, see spool_load() */
+        errno = ENOENT;
+        return -1;
+    }
+    while (s->out_header_left > 0) {
+        const char *from = (const char *)&(s->out_header) + sizeof(message) - s->out_header_left;
+        ssize_t result = send(fd, from, s->out_header_left, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        s->out_header_left -= result;
+    }
+
+    spool_download *d = &(s->downloads[0]);
+    while (s->out_bytes_left > 0) {
+        ssize_t result = sendfile(fd, d->fd, &(d->offset), s->out_bytes_left);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        s->out_bytes_left -= result;
+        bytes_out += result;
+    }
+    return 1;
+}
+
+static void chunk_sent(spool_client *s) {
+    chunks++;
+    if (s->downloads[0].offset == s->downloads[0].end) {
+        download_done(s);
+    }
+}
+
+/* -------------------------------------- */
+
+int spool_start(const char *dir) {
+    if (strlen(dir) + 16 >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return -1;
+    }
+
+    /* ids go on from the highest one there, finished or not */
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        char *end;
+        unsigned long id = strtoul(entry->d_name, &end, 10);
+        if (end != entry->d_name && (strcmp(end, ATTACHMENT_SUFFIX) == 0 || strcmp(end, PART_SUFFIX) == 0) &&
+            id >= next_id && id < UINT_MAX) {
+            next_id = (unsigned)id + 1;
+        }
+    }
+    closedir(d);
+
+    if (open_plumbing() == -1) {
+        return -1;
+    }
+    directory = strdup(dir);
+    spoolRunning = true;
+    return 0;
+}
+
+bool spool_receiving(int i) {
+    return i < clients_size && clients[i] != NULL && clients[i]->chunk_left > 0;
+}
+
+int spool_chunk(int i, const message *header, message *announcement) {
+    attach_header h;
+    if (!attach_parse(header, &h) || h.kind != ATTACH_UPLOAD || open_plumbing() == -1) {
+        return -1;
+    }
+
+    spool_client *s = client_state(i);
+    if (h.offset == 0) {
+        abandon(s);
+        s->uploading = true;
+        s->discarding = true;
+        s->received = 0;
+        s->total = h.total;
+        strcpy(s->name, h.name);
+        strncpy(s->uploader, header->from, USERNAME_MAX);
+        s->uploader[USERNAME_MAX] = '\0';
+
+        if (!spoolRunning) {
+            rejected++;
+            note(i, "attachments are off here, %s isn't kept", s->name);
+        } else if (h.total > ATTACH_FILE_MAX) {
+            rejected++;
+            note(i, "%s is over %ld bytes, it isn't kept", s->name, ATTACH_FILE_MAX);
+        } else if ((s->upload_fd = open_part(s)) == -1) {
+            failures++;
+            note(i, "cannot store %s", s->name);
+        } else {
+            s->discarding = false;
+        }
+    } else if (!s->uploading || h.offset != s->received || h.total != s->total) {
+        /* whatever it continues is broken, its bytes are only skipped */
+        abandon(s);
+        rejected++;
+    }
+
+    s->chunk_left = h.bytes;
+    return (s->chunk_left == 0) ? chunk_done(i, s, announcement) : 0;
+}
+
+int spool_receive(int i, message *announcement) {
+    spool_client *s = clients[i];
+    ssize_t count = splice(ufds[i].fd, NULL, pipe_fds[1], NULL, s->chunk_left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (count == 0) {
+        /* peer is gone in the middle of a chunk */
+        abandon(s);
+        return -2;
+    }
+    if (count == -1) {
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+
+    int target = (s->uploading && !s->discarding) ? s->upload_fd : devnull;
+    for (ssize_t moved = 0; moved < count; ) {
+        ssize_t result = splice(pipe_fds[0], NULL, target, NULL, count - moved, SPLICE_F_MOVE);
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            if (target == devnull) {
+                return -1;
+            }
+            /* disk full or such: upload is lost, the pipe still has to be emptied */
+            failures++;
+            note(i, "cannot store %s", s->name);
+            close(s->upload_fd);
+            s->upload_fd = -1;
+            char path[PATH_MAX];
+            file_path(path, s->upload_id, PART_SUFFIX);
+            unlink(path);
+            s->discarding = true;
+            target = devnull;
+            continue;
+        }
+        moved += result;
+    }
+
+    s->chunk_left -= count;
+    if (s->uploading) {
+        s->received += count;
+    }
+    bytes_in += count;
+    return (s->chunk_left == 0) ? chunk_done(i, s, announcement) : 0;
+}
+
+void spool_request(int i, const char *id) {
+    if (!spoolRunning) {
+        note(i, "attachments are off here");
+        return;
+    }
+
+    spool_client *s = client_state(i);
+    if (s->download_count == ATTACH_DOWNLOADS_MAX) {
+        note(i, "%d downloads are going on already", ATTACH_DOWNLOADS_MAX);
+        return;
+    }
+    char *end;
+    unsigned long number = strtoul(id, &end, 10);
+    if (end == id || number >= UINT_MAX || open_download(&(s->downloads[s->download_count]), (unsigned)number, 0) == -1) {
+        note(i, "no attachment %.16s", id);
+        return;
+    }
+    if (s->download_count++ == 0) {
+        active++;
+    }
+}
+
+int spool_pending() {
+    return active;
+}
+
+void spool_pump() {
+    for (int i = 0; i < clients_size && active > 0; i++) {
+        spool_client *s = clients[i];
+        if (s == NULL || s->download_count == 0 || ufds[i].fd < 0) {
+            continue;
+        }
+
+        /* sendfile() has no MSG_DONTWAIT, the socket is non-blocking only for the pump */
+        int fd = ufds[i].fd;
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int result = 1;
+        int queued;
+        while (s->download_count > 0) {
+            if (!CHUNK_GOING(s)) {
+                /* messages the client is owed go first, and they'd wait behind whatever is in there */
+                if (clientQueued[i] > 0 || (ioctl(fd, SIOCOUTQ, &queued) == 0 && queued >= ATTACH_QUEUED_MAX)) {
+                    break;
+                }
+                start_chunk(s);
+            }
+            if ((result = push_chunk(fd, s)) != 1) {
+                break;
+            }
+            chunk_sent(s);
+        }
+        fcntl(fd, F_SETFL, flags);
+
+        if (result == -1) {
+            perror("sendfile(...) failed");
+            removeClient(i);
+            continue;
+        }
+        if (result == 0) {
+            /* rest of the chunk goes when the socket has room */
+            ufds[i].events |= POLLOUT;
+        }
+        if (s->download_count > 0) {
+            held_back++;
+        }
+    }
+}
+
+int spool_continue(int i) {
+    if (i >= clients_size || clients[i] == NULL || !CHUNK_GOING(clients[i])) {
+        return 1;
+    }
+    spool_client *s = clients[i];
+    int fd = ufds[i].fd;
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int result = push_chunk(fd, s);
+    fcntl(fd, F_SETFL, flags);
+    if (result == 1) {
+        chunk_sent(s);
+    }
+    return result;
+}
+
+size_t spool_memory() {
+    size_t bytes = sizeof(spool_client *)*clients_size;
+    for (int i = 0; i < clients_size; i++) {
+        if (clients[i] != NULL) {
+            bytes += sizeof(spool_client);
+        }
+    }
+    return bytes;
+}
+
+void spool_forget(int i) {
+    if (i >= clients_size || clients[i] == NULL) {
+        return;
+    }
+    spool_client *s = clients[i];
+    abandon(s);
+    for (int k = 0; k < s->download_count; k++) {
+        close(s->downloads[k].fd);
+    }
+    if (s->download_count > 0) {
+        active--;
+    }
+    free(s);
+    clients[i] = NULL;
+}
+
+/* -------------------------------------- */
+
+static void put(char **data, size_t *length, const void *bytes, size_t count) {
+    *data = realloc(*data, *length + count);
+    memcpy(*data + *length, bytes, count);
+    *length += count;
+}
+
+static int get(const char *data, size_t length, size_t *offset, void *bytes, size_t count) {
+    if (*offset + count > length) {
+        return -1;
+    }
+    memcpy(bytes, data + *offset, count);
+    *offset += count;
+    return 0;
+}
+
+static void put_string(char **data, size_t *length, const char *text) {
+    uint8_t size = (uint8_t)strlen(text);
+    put(data, length, &size, sizeof(size));
+    put(data, length, text, size);
+}
+
+static int get_string(const char *data, size_t length, size_t *offset, char *text, size_t max) {
+    uint8_t size;
+    if (get(data, length, offset, &size, sizeof(size)) == -1 || size > max ||
+        get(data, length, offset, text, size) == -1) {
+        return -1;
+    }
+    text[size] = '\0';
+    return 0;
+}
+
+/*
+ * flags (1 - uploading, 2 - discarding), with an upload: id, name, uploader, received, total;
+ * then bytes of the chunk still on the stream, downloads (id and how far each got) and what's
+ * left of the chunk being sent (its header and how much of it and of the file bytes is still due)
+ */
+void spool_save(int i, char **data, size_t *length) {
+    spool_client empty;
+    memset(&empty, 0, sizeof(spool_client));
+    spool_client *s = (i < clients_size && clients[i] != NULL) ? clients[i] : &empty;
+
+    uint8_t flags = (s->uploading ? 1 : 0) | (s->discarding ? 2 : 0);
+    put(data, length, &flags, sizeof(flags));
+    if (s->uploading) {
+        uint32_t id = s->upload_id;
+        uint64_t received = s->received;
+        uint64_t total = s->total;
+        put(data, length, &id, sizeof(id));
+        put_string(data, length, s->name);
+        put_string(data, length, s->uploader);
+        put(data, length, &received, sizeof(received));
+        put(data, length, &total, sizeof(total));
+    }
+    uint32_t chunk_left = (uint32_t)s->chunk_left;
+    put(data, length, &chunk_left, sizeof(chunk_left));
+
+    uint8_t count = (uint8_t)s->download_count;
+    put(data, length, &count, sizeof(count));
+    for (int k = 0; k < count; k++) {
+        uint32_t id = s->downloads[k].id;
+        uint64_t sent = s->downloads[k].offset - s->downloads[k].start;
+        put(data, length, &id, sizeof(id));
+        put(data, length, &sent, sizeof(sent));
+    }
+
+    uint32_t header_left = (uint32_t)s->out_header_left;
+    uint32_t bytes_left = (uint32_t)s->out_bytes_left;
+    put(data, length, &header_left, sizeof(header_left));
+    put(data, length, &bytes_left, sizeof(bytes_left));
+    if (CHUNK_GOING(s)) {
+        put(data, length, &(s->out_header), sizeof(message));
+    }
+}
+
+int spool_load(int i, const char *data, size_t length, size_t *offset) {
+    uint8_t flags;
+    if (get(data, length, offset, &flags, sizeof(flags)) == -1) {
+        return -1;
+    }
+
+    spool_client loaded;
+    memset(&loaded, 0, sizeof(spool_client));
+    loaded.upload_fd = -1;
+    if (flags & 1) {
+        uint32_t id;
+        uint64_t received, total;
+        if (get(data, length, offset, &id, sizeof(id)) == -1 ||
+            get_string(data, length, offset, loaded.name, ATTACH_NAME_MAX) == -1 ||
+            get_string(data, length, offset, loaded.uploader, USERNAME_MAX) == -1 ||
+            get(data, length, offset, &received, sizeof(received)) == -1 ||
+            get(data, length, offset, &total, sizeof(total)) == -1) {
+            return -1;
+        }
+        loaded.uploading = true;
+        loaded.discarding = (flags & 2) != 0;
+        loaded.upload_id = id;
+        loaded.received = received;
+        loaded.total = total;
+    }
+    uint32_t chunk_left;
+    uint8_t count;
+    if (get(data, length, offset, &chunk_left, sizeof(chunk_left)) == -1 ||
+        get(data, length, offset, &count, sizeof(count)) == -1 || count > ATTACH_DOWNLOADS_MAX) {
+        return -1;
+    }
+    loaded.chunk_left = chunk_left;
+
+    bool lost_first = false;
+    for (int k = 0; k < count; k++) {
+        uint32_t id;
+        uint64_t sent;
+        if (get(data, length, offset, &id, sizeof(id)) == -1 || get(data, length, offset, &sent, sizeof(sent)) == -1) {
+            return -1;
+        }
+        /* gone meanwhile (or no spool here) - the client just doesn't get it */
+        if (spoolRunning && open_download(&(loaded.downloads[loaded.download_count]), id, (off_t)sent) == 0) {
+            loaded.download_count++;
+        } else if (k == 0) {
+            lost_first = true;
+        }
+    }
+
+    uint32_t header_left, bytes_left;
+    if (get(data, length, offset, &header_left, sizeof(header_left)) == -1 ||
+        get(data, length, offset, &bytes_left, sizeof(bytes_left)) == -1 || header_left > sizeof(message) ||
+        bytes_left > ATTACH_CHUNK) {
+        return -1;
+    }
+    if (header_left > 0 || bytes_left > 0) {
+        if (get(data, length, offset, &(loaded.out_header), sizeof(message)) == -1) {
+            return -1;
+        }
+        loaded.out_header_left = header_left;
+        loaded.out_bytes_left = bytes_left;
+        if (lost_first) {
+            /* its chunk can't be finished, nothing else may follow - connection fails on next send */
+            for (int k = 0; k < loaded.download_count; k++) {
+                close(loaded.downloads[k].fd);
+            }
+            loaded.download_count = 0;
+        }
+    }
+
+    if (!loaded.uploading && loaded.chunk_left == 0 && loaded.download_count == 0 && !CHUNK_GOING(&loaded)) {
+        return 0;
+    }
+    if (open_plumbing() == -1) {
+        return -1;
+    }
+    /* the rest of the upload goes where the first part went */
+    if (loaded.uploading && !loaded.discarding) {
+        char path[PATH_MAX];
+        if (spoolRunning) {
+            file_path(path, loaded.upload_id, PART_SUFFIX);
+            /* not O_APPEND, splice() won't write to such files */
+            loaded.upload_fd = open(path, O_WRONLY | O_CLOEXEC);
+            if (loaded.upload_fd != -1 && lseek(loaded.upload_fd, 0, SEEK_END) == -1) {
+                close(loaded.upload_fd);
+                loaded.upload_fd = -1;
+            }
+        }
+        loaded.discarding = loaded.upload_fd == -1;
+    }
+
+    spool_client *s = client_state(i);
+    memcpy(s, &loaded, sizeof(spool_client));
+    if (s->download_count > 0) {
+        active++;
+    }
+    if (CHUNK_GOING(s)) {
+        ufds[i].events |= POLLOUT;
+    }
+    return 0;
+}
+
+void spool_report(FILE *out) {
+    if (!spoolRunning && rejected == 0) {
+        return;
+    }
+    fprintf(out, "Attachments: %lu uploads (%lu bytes in), %lu downloads (%lu chunks, %lu bytes out), "
+            "%lu times held back for a busy socket, %lu rejected, %lu failures\n", uploads, bytes_in, downloads,
+            chunks, bytes_out, held_back, rejected, failures);
+    fflush(out);
+}
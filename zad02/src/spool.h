@@ -0,0 +1,69 @@
+#ifndef MAKEFILE_SPOOL_H
+#define MAKEFILE_SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "message.h"
+
+/*
+ * Attachment store (server's -D), see attach.h for how transfers look on the connection.
+ * Attachment n is "<dir>/<n>.att": a 1-byte length and the name, then the file. Uploads go to
+ * "<n>.part" and are renamed when complete. File bytes never come to user space: uploads are
+ * spliced from the socket through a pipe into the file, downloads go out with sendfile().
+ * Clients are the server's slots; transfers of a client are part of its handed over state.
+ */
+
+extern bool spoolRunning;
+
+/* opens (creating if needed) dir; -1 (errno set) on failure */
+int spool_start(const char *dir);
+
+/* raw bytes of an upload chunk are next on i's connection */
+bool spool_receiving(int i);
+
+/*
+ * Chunk header came from i (without a spool the chunk is just skipped). -1 - malformed, nobody
+ * knows where the next message starts; 1 - upload is complete and announcement filled.
+ */
+int spool_chunk(int i, const message *header, message *announcement);
+
+/*
+ * Moves what's there of the chunk into the file; -1 - connection failed, -2 - peer closed it
+ * (upload is thrown away), 0/1 as for spool_chunk().
+ */
+int spool_receive(int i, message *announcement);
+
+/* "/get <id>", what follows ATTACH_REQUEST is in id */
+void spool_request(int i, const char *id);
+
+/* clients with downloads in progress */
+int spool_pending();
+
+/*
+ * Next chunks of each download whose socket has room for them. Sockets aren't waited for: a
+ * chunk that doesn't fit is finished later, the client's poll entry gets POLLOUT meanwhile. No
+ * chunk starts while messages the client is owed wait (see sendClient()).
+ */
+void spool_pump();
+
+/*
+ * Sends what the socket takes of i's chunk in progress, anything else sent to i has to go after
+ * it: 1 - none is left (or none was going), 0 - socket is full, -1 - connection failed
+ */
+int spool_continue(int i);
+
+/* i's connection is gone, unfinished upload is thrown away */
+void spool_forget(int i);
+
+/* transfers of client i for a restarted server, see saveClientState() */
+void spool_save(int i, char **data, size_t *length);
+int spool_load(int i, const char *data, size_t length, size_t *offset);
+
+/* bytes of transfer state, allocated only for clients that have transfers */
+size_t spool_memory();
+
+void spool_report(FILE *out);
+
+#endif //MAKEFILE_SPOOL_H
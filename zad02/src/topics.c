@@ -0,0 +1,483 @@
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "topics.h"
+
+typedef struct topic_node {
+    char *segment;                /* NULL at the root */
+    struct topic_node *parent;
+    struct topic_node *star;      /* "*" child */
+    struct topic_node *rest;      /* "#" child */
+    int children;                 /* literal ones, they are in child table */
+    int *subscribers;
+    int subscriber_count;
+    int subscriber_capacity;
+} topic_node;
+
+typedef struct {
+    topic_node *node;
+    char *pattern;
+} topic_subscription;
+
+typedef struct {
+    topic_subscription *subs;
+    int count;
+    int capacity;
+} topic_subscriber;
+
+typedef struct {
+    char *topic;
+    int *ids;
+    int count;
+    int capacity;
+    unsigned long generation;     /* valid while it's the current one */
+} topic_cache_entry;
+
+#define CHILD_TOMBSTONE ((topic_node *)1)
+
+static topic_node root = {NULL, NULL, NULL, NULL, 0, NULL, 0, 0};
+
+/* literal children of all nodes, open addressing keyed by (parent, segment) */
+static topic_node **child_table = NULL;
+static unsigned int child_size = 0; /* power of 2 */
+static unsigned int child_used = 0; /* including tombstones */
+static unsigned int child_live = 0;
+
+static topic_subscriber *by_id = NULL;
+static unsigned int *seen = NULL; /* match stamp per id, each id goes to result once */
+static int id_capacity = 0;
+static unsigned int match_stamp = 0;
+
+static topic_cache_entry cache[TOPICS_CACHE_SIZE];
+static unsigned long generation = 1; /* bumped on every subscription change */
+
+static unsigned long nodes = 0;
+static unsigned long subscriptions = 0;
+static unsigned long published = 0;
+static unsigned long cache_hits = 0;
+
+/* -------------------------------------- */
+
+static uint32_t segment_hash(const topic_node *parent, const char *segment, int length) {
+    /* FNV-1a over parent's address, then segment */
+    uint32_t hash = 2166136261u;
+    uintptr_t p = (uintptr_t)parent;
+    for (unsigned int k = 0; k < sizeof(p); k++, p >>= 8) {
+        hash = (hash ^ (p & 0xff))*16777619u;
+    }
+    for (int k = 0; k < length; k++) {
+        hash = (hash ^ (unsigned char)segment[k])*16777619u;
+    }
+    return hash;
+}
+
+static uint32_t topic_hash(const char *topic) {
+    return segment_hash(NULL, topic, (int)strlen(topic));
+}
+
+static bool same_segment(const topic_node *n, const char *segment, int length) {
+    return strncmp(n->segment, segment, length) == 0 && n->segment[length] == '\0';
+}
+
+static topic_node *child_find(const topic_node *parent, const char *segment, int length) {
+    if (child_size == 0) {
+        return NULL;
+    }
+
+    unsigned int mask = child_size - 1;
+    unsigned int pos = segment_hash(parent, segment, length) & mask;
+    while (child_table[pos] != NULL) {
+        topic_node *n = child_table[pos];
+        if (n != CHILD_TOMBSTONE && n->parent == parent && same_segment(n, segment, length)) {
+            return n;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+
+static void child_place(topic_node *n) {
+    unsigned int mask = child_size - 1;
+    unsigned int pos = segment_hash(n->parent, n->segment, (int)strlen(n->segment)) & mask;
+    while (child_table[pos] != NULL && child_table[pos] != CHILD_TOMBSTONE) {
+        pos = (pos + 1) & mask;
+    }
+    if (child_table[pos] == NULL) {
+        child_used++;
+    }
+    child_table[pos] = n;
+    child_live++;
+}
+
+static void child_insert(topic_node *n) {
+    /* at most half full, tombstones included */
+    if (2*(child_used + 1) > child_size) {
+        topic_node **old = child_table;
+        unsigned int old_size = child_size;
+
+        child_size = 64;
+        while (child_size < 4*(child_live + 1)) {
+            child_size *= 2;
+        }
+        child_table = calloc(sizeof(topic_node*), child_size);
+        child_used = 0;
+        child_live = 0;
+        for (unsigned int k = 0; k < old_size; k++) {
+            if (old[k] != NULL && old[k] != CHILD_TOMBSTONE) {
+                child_place(old[k]);
+            }
+        }
+        free(old);
+    }
+
+    child_place(n);
+}
+
+static void child_remove(topic_node *n) {
+    unsigned int mask = child_size - 1;
+    unsigned int pos = segment_hash(n->parent, n->segment, (int)strlen(n->segment)) & mask;
+    while (child_table[pos] != n) {
+        pos = (pos + 1) & mask;
+    }
+    child_table[pos] = CHILD_TOMBSTONE;
+    child_live--;
+}
+
+/* -------------------------------------- */
+
+/* topics (pattern false) and patterns: non-empty levels split by dots, at most TOPIC_DEPTH_MAX of them */
+static bool valid(const char *name, bool pattern) {
+    int depth = 0;
+    const char *segment = name;
+    while (true) {
+        const char *end = strchr(segment, '.');
+        int length = (end != NULL) ? (int)(end - segment) : (int)strlen(segment);
+        if (length == 0 || ++depth > TOPIC_DEPTH_MAX) {
+            return false;
+        }
+
+        bool wildcard = memchr(segment, '*', length) != NULL || memchr(segment, '#', length) != NULL;
+        if (wildcard) {
+            /* wildcards take whole level, "#" only the last one */
+            if (!pattern || length != 1 || (segment[0] == '#' && end != NULL)) {
+                return false;
+            }
+        }
+
+        if (end == NULL) {
+            return true;
+        }
+        segment = end + 1;
+    }
+}
+
+int topics_command(const char *text, char *name) {
+    const char *arg;
+    int kind;
+    if (text[0] == '@') {
+        arg = text + 1;
+        kind = TOPIC_PUBLISH;
+    } else if (strncmp(text, "/sub ", 5) == 0) {
+        arg = text + 5;
+        kind = TOPIC_SUBSCRIBE;
+    } else if (strncmp(text, "/unsub ", 7) == 0) {
+        arg = text + 7;
+        kind = TOPIC_UNSUBSCRIBE;
+    } else {
+        return TOPIC_NONE;
+    }
+
+    int length = 0;
+    while (arg + length < text + MSG_LEN_MAX && arg[length] != '\0' && !isspace((unsigned char)arg[length])) {
+        length++;
+    }
+    memcpy(name, arg, length);
+    name[length] = '\0';
+
+    /* "$..." topics are the servers' own (presence.h) */
+    return (name[0] != '$' && valid(name, kind != TOPIC_PUBLISH)) ? kind : TOPIC_MALFORMED;
+}
+
+/* -------------------------------------- */
+
+static void ensure_id(int id) {
+    if (id < id_capacity) {
+        return;
+    }
+
+    int capacity = (id_capacity > 0) ? 2*id_capacity : 64;
+    while (capacity <= id) {
+        capacity *= 2;
+    }
+    by_id = realloc(by_id, sizeof(topic_subscriber)*capacity);
+    memset(by_id + id_capacity, 0, sizeof(topic_subscriber)*(capacity - id_capacity));
+    seen = realloc(seen, sizeof(unsigned int)*capacity);
+    memset(seen + id_capacity, 0, sizeof(unsigned int)*(capacity - id_capacity));
+    id_capacity = capacity;
+}
+
+/* node pattern leads to, created on the way if asked to; NULL when it doesn't exist */
+static topic_node *walk(const char *pattern, bool create) {
+    topic_node *n = &root;
+    const char *segment = pattern;
+    while (true) {
+        const char *end = strchr(segment, '.');
+        int length = (end != NULL) ? (int)(end - segment) : (int)strlen(segment);
+
+        topic_node *next;
+        if (length == 1 && segment[0] == '*') {
+            next = n->star;
+        } else if (length == 1 && segment[0] == '#') {
+            next = n->rest;
+        } else {
+            next = child_find(n, segment, length);
+        }
+
+        if (next == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            next = calloc(sizeof(topic_node), 1);
+            next->segment = strndup(segment, length);
+            next->parent = n;
+            if (length == 1 && segment[0] == '*') {
+                n->star = next;
+            } else if (length == 1 && segment[0] == '#') {
+                n->rest = next;
+            } else {
+                child_insert(next);
+                n->children++;
+            }
+            nodes++;
+        }
+
+        n = next;
+        if (end == NULL) {
+            return n;
+        }
+        segment = end + 1;
+    }
+}
+
+/* frees nodes nothing hangs on any more, bottom up */
+static void prune(topic_node *n) {
+    while (n != &root && n->subscriber_count == 0 && n->children == 0 && n->star == NULL && n->rest == NULL) {
+        topic_node *parent = n->parent;
+        if (parent->star == n) {
+            parent->star = NULL;
+        } else if (parent->rest == n) {
+            parent->rest = NULL;
+        } else {
+            child_remove(n);
+            parent->children--;
+        }
+        free(n->segment);
+        free(n->subscribers);
+        free(n);
+        nodes--;
+        n = parent;
+    }
+}
+
+static void node_remove_subscriber(topic_node *n, int id) {
+    for (int k = 0; k < n->subscriber_count; k++) {
+        if (n->subscribers[k] == id) {
+            n->subscribers[k] = n->subscribers[--(n->subscriber_count)];
+            return;
+        }
+    }
+}
+
+int topics_subscribe(int id, const char *pattern) {
+    if (!valid(pattern, true)) {
+        return -1;
+    }
+
+    ensure_id(id);
+    topic_node *n = walk(pattern, true);
+    topic_subscriber *s = &(by_id[id]);
+    for (int k = 0; k < s->count; k++) {
+        if (s->subs[k].node == n) {
+            return 1;
+        }
+    }
+
+    if (n->subscriber_count == n->subscriber_capacity) {
+        n->subscriber_capacity = (n->subscriber_capacity > 0) ? 2*n->subscriber_capacity : 4;
+        n->subscribers = realloc(n->subscribers, sizeof(int)*n->subscriber_capacity);
+    }
+    n->subscribers[n->subscriber_count++] = id;
+
+    if (s->count == s->capacity) {
+        s->capacity = (s->capacity > 0) ? 2*s->capacity : 4;
+        s->subs = realloc(s->subs, sizeof(topic_subscription)*s->capacity);
+    }
+    s->subs[s->count].node = n;
+    s->subs[s->count].pattern = strdup(pattern);
+    s->count++;
+
+    subscriptions++;
+    generation++;
+    return 0;
+}
+
+int topics_unsubscribe(int id, const char *pattern) {
+    if (id >= id_capacity || !valid(pattern, true)) {
+        return -1;
+    }
+
+    topic_node *n = walk(pattern, false);
+    topic_subscriber *s = &(by_id[id]);
+    for (int k = 0; n != NULL && k < s->count; k++) {
+        if (s->subs[k].node == n) {
+            free(s->subs[k].pattern);
+            s->subs[k] = s->subs[--(s->count)];
+            node_remove_subscriber(n, id);
+            prune(n);
+            subscriptions--;
+            generation++;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+void topics_forget(int id) {
+    if (id >= id_capacity || by_id[id].count == 0) {
+        return;
+    }
+
+    topic_subscriber *s = &(by_id[id]);
+    for (int k = 0; k < s->count; k++) {
+        node_remove_subscriber(s->subs[k].node, id);
+        prune(s->subs[k].node);
+        free(s->subs[k].pattern);
+    }
+    subscriptions -= s->count;
+    s->count = 0;
+    generation++;
+}
+
+void topics_renumber(int from, int to) {
+    if (from >= id_capacity || by_id[from].count == 0) {
+        return;
+    }
+
+    ensure_id(to);
+    topic_subscriber *s = &(by_id[from]);
+    for (int k = 0; k < s->count; k++) {
+        topic_node *n = s->subs[k].node;
+        for (int j = 0; j < n->subscriber_count; j++) {
+            if (n->subscribers[j] == from) {
+                n->subscribers[j] = to;
+            }
+        }
+    }
+
+    /* swapping keeps to's (empty) list allocated for reuse */
+    topic_subscriber empty = by_id[to];
+    by_id[to] = by_id[from];
+    by_id[from] = empty;
+    generation++;
+}
+
+/* -------------------------------------- */
+
+static void add_subscribers(const topic_node *n, topic_cache_entry *e) {
+    for (int k = 0; k < n->subscriber_count; k++) {
+        int id = n->subscribers[k];
+        if (seen[id] == match_stamp) {
+            continue;
+        }
+        seen[id] = match_stamp;
+
+        if (e->count == e->capacity) {
+            e->capacity = (e->capacity > 0) ? 2*e->capacity : 16;
+            e->ids = realloc(e->ids, sizeof(int)*e->capacity);
+        }
+        e->ids[e->count++] = id;
+    }
+}
+
+static void collect(const topic_node *n, const char **segments, const int *lengths, int depth, int level,
+                    topic_cache_entry *e) {
+    if (n->rest != NULL) {
+        add_subscribers(n->rest, e);
+    }
+    if (level == depth) {
+        add_subscribers(n, e);
+        return;
+    }
+
+    const topic_node *child = child_find(n, segments[level], lengths[level]);
+    if (child != NULL) {
+        collect(child, segments, lengths, depth, level + 1, e);
+    }
+    if (n->star != NULL) {
+        collect(n->star, segments, lengths, depth, level + 1, e);
+    }
+}
+
+const int *topics_match(const char *topic, int *count) {
+    published++;
+
+    topic_cache_entry *e = &(cache[topic_hash(topic) & (TOPICS_CACHE_SIZE - 1)]);
+    if (e->generation == generation && strcmp(e->topic, topic) == 0) {
+        cache_hits++;
+        *count = e->count;
+        return e->ids;
+    }
+
+    free(e->topic);
+    e->topic = strdup(topic);
+    e->count = 0;
+    e->generation = generation;
+
+    const char *segments[TOPIC_DEPTH_MAX];
+    int lengths[TOPIC_DEPTH_MAX];
+    int depth = 0;
+    const char *segment = topic;
+    while (depth < TOPIC_DEPTH_MAX) {
+        const char *end = strchr(segment, '.');
+        segments[depth] = segment;
+        lengths[depth] = (end != NULL) ? (int)(end - segment) : (int)strlen(segment);
+        depth++;
+        if (end == NULL) {
+            break;
+        }
+        segment = end + 1;
+    }
+
+    if (++match_stamp == 0) {
+        /* wrapped around, old stamps could match again */
+        memset(seen, 0, sizeof(unsigned int)*id_capacity);
+        match_stamp = 1;
+    }
+    collect(&root, segments, lengths, depth, 0, e);
+
+    *count = e->count;
+    return e->ids;
+}
+
+int topics_count(int id) {
+    return (id < id_capacity) ? by_id[id].count : 0;
+}
+
+const char *topics_pattern(int id, int k) {
+    return by_id[id].subs[k].pattern;
+}
+
+void topics_report(FILE *out) {
+    if (subscriptions == 0 && published == 0) {
+        return;
+    }
+
+    fprintf(out, "Topics: %lu subscriptions on %lu trie nodes, %lu published, %lu recipient sets from cache\n",
+            subscriptions, nodes, published, cache_hits);
+    fflush(out);
+}
@@ -0,0 +1,52 @@
+#ifndef MAKEFILE_TOPICS_H
+#define MAKEFILE_TOPICS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Hierarchical topics for the servers' fan-out. Message text "@ops.alerts.db <text>" publishes to
+ * a topic - it goes only to clients subscribed to a matching pattern; "/sub <pattern>" and
+ * "/unsub <pattern>" manage subscriptions. In patterns "*" stands for exactly one level and "#"
+ * (last level only) for any number of them, none included. Other messages go to everybody.
+ * Topics starting with "$" are reserved for the servers themselves.
+ *
+ * Subscribers are ids server picks (client slots). Patterns live in a trie, publishing walks it
+ * level by level (literal child, "*" and "#" branches), so it costs topic depth, not the number
+ * of clients. Recipient sets of recently published topics are cached until any subscription
+ * changes.
+ */
+
+enum {
+    TOPIC_NONE,                   /* ordinary message */
+    TOPIC_PUBLISH,
+    TOPIC_SUBSCRIBE,
+    TOPIC_UNSUBSCRIBE,
+    TOPIC_MALFORMED
+};
+
+/* what message text is; topic (or pattern) is copied to name, which has room for MSG_LEN_MAX + 1 */
+int topics_command(const char *text, char *name);
+
+/* 0 - subscribed, 1 - already was, -1 - malformed pattern */
+int topics_subscribe(int id, const char *pattern);
+
+/* 0 - unsubscribed, -1 - wasn't */
+int topics_unsubscribe(int id, const char *pattern);
+
+/* drops every subscription of id (client left) */
+void topics_forget(int id);
+
+/* id moved to another slot which has no subscriptions */
+void topics_renumber(int from, int to);
+
+/* ids subscribed to topic, each once; array stays valid until the next topics_match() */
+const int *topics_match(const char *topic, int *count);
+
+/* subscriptions of id, for handing them over to a restarted server */
+int topics_count(int id);
+const char *topics_pattern(int id, int k);
+
+void topics_report(FILE *out);
+
+#endif //MAKEFILE_TOPICS_H
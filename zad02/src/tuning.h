@@ -0,0 +1,38 @@
+#ifndef MAKEFILE_TUNING_H
+#define MAKEFILE_TUNING_H
+
+#include <stdbool.h>
+#include <sched.h>
+#include <poll.h>
+
+/*
+ * Low-latency knobs for the server loop. All of them are off by default:
+ * - CPU affinity keeps the loop on chosen cores (warm caches, no migrations),
+ * - busy polling lets the kernel spin on the NIC queue instead of waiting for an interrupt
+ *   (only sockets backed by a real device benefit - loopback and unix sockets don't),
+ * - spinning keeps the loop itself awake for a while before it sleeps in poll().
+ * Each one trades CPU time for wakeup latency.
+ */
+
+typedef struct {
+    bool pin;
+    cpu_set_t cpus;
+    int busy_poll_us;   /* 0 - off */
+    long spin_us;       /* 0 - off */
+} tuning_options;
+
+void tuning_defaults(tuning_options *t);
+
+/* parses "2", "0,2" or "0-3,6"; -1 when list is malformed or names no cpu */
+int tuning_parse_cpus(const char *list, cpu_set_t *set);
+
+/* pins calling thread (nothing to do when !t->pin); -1 on failure */
+int tuning_apply_affinity(const tuning_options *t);
+
+/* SO_BUSY_POLL (+ SO_PREFER_BUSY_POLL where kernel headers know it); -1 on failure */
+int tuning_apply_busy_poll(const tuning_options *t, int fd);
+
+/* poll() which first spins for up to spin_us with zero timeouts, then blocks for the rest of timeout_ms */
+int tuning_poll(const tuning_options *t, struct pollfd *fds, nfds_t nfds, int timeout_ms);
+
+#endif //MAKEFILE_TUNING_H
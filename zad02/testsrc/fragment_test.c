@@ -0,0 +1,102 @@
+#include "../src/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/message.h"
+#include "../src/fragment.h"
+
+/*
+ * fragment_accept() on whatever a peer may send: messages come off the wire as they are, the
+ * text needn't be terminated. Built with sanitizers (make test), so reading past it fails too.
+ */
+
+int failures = 0;
+
+void check(int condition, const char *what) {
+    printf("%s: %s\n", condition ? "ok" : "FAIL", what);
+    if (!condition) {
+        failures++;
+    }
+}
+
+/* all of msg->msg taken, no terminator: "@<topic of topic_length> " + FRAGMENT_MARK + filler */
+message *unterminated(size_t topic_length) {
+    message *msg = malloc(sizeof(message));
+    memset(msg->from, 0, sizeof(msg->from));
+    strcpy(msg->from, "mallory");
+    memset(msg->msg, 'x', sizeof(msg->msg));
+    msg->msg[0] = '@';
+    msg->msg[1 + topic_length] = ' ';
+    msg->msg[2 + topic_length] = FRAGMENT_MARK;
+    return msg;
+}
+
+/* header right after the topic, pieces of text up to the last byte */
+message *unterminated_fragment(size_t topic_length) {
+    message *msg = unterminated(topic_length);
+    char header[FRAGMENT_HEADER + 1];
+    snprintf(header, sizeof(header), "%c%04x%04x%c", FRAGMENT_MARK, 1, 0, '$');
+    memcpy(msg->msg + 2 + topic_length, header, FRAGMENT_HEADER);
+    return msg;
+}
+
+void test_long_topic() {
+    fragment_reader r;
+    memset(&r, 0, sizeof(r));
+    const char *text = NULL;
+    message *msg = unterminated(MSG_LEN_MAX - 2);
+    check(fragment_accept(&r, msg, &text) == FRAGMENT_PLAIN, "topic filling whole message is no fragment");
+    free(msg);
+
+    msg = unterminated(MSG_LEN_MAX - FRAGMENT_HEADER);
+    check(fragment_accept(&r, msg, &text) == FRAGMENT_PLAIN, "topic leaving no room for header is no fragment");
+    free(msg);
+    free(r.finished);
+}
+
+void test_unterminated_fragment() {
+    fragment_reader r;
+    memset(&r, 0, sizeof(r));
+    const char *text = NULL;
+    size_t topic_length = MSG_LEN_MAX - FRAGMENT_HEADER - 2;
+    message *msg = unterminated_fragment(topic_length);
+    check(fragment_accept(&r, msg, &text) == FRAGMENT_DONE && strlen(text) == MSG_LEN_MAX - FRAGMENT_HEADER,
+          "header ending at the last byte leaves just the topic");
+    free(msg);
+
+    msg = unterminated_fragment(10);
+    check(fragment_accept(&r, msg, &text) == FRAGMENT_DONE && strlen(text) == MSG_LEN_MAX - FRAGMENT_HEADER,
+          "body stops at the end of message");
+    free(msg);
+    free(r.finished);
+}
+
+void test_round_trip() {
+    char text[3*MSG_LEN_MAX];
+    memset(text, 'a', sizeof(text));
+    memcpy(text, "@news ", 6);
+    text[sizeof(text) - 1] = '\0';
+
+    fragment_writer w;
+    fragment_reader r;
+    memset(&r, 0, sizeof(r));
+    fragment_begin(&w, "alice", text, strlen(text));
+    const char *whole = NULL;
+    int result = FRAGMENT_PLAIN;
+    message *msg;
+    while ((msg = fragment_next(&w)) != NULL) {
+        result = fragment_accept(&r, msg, &whole);
+        free(msg);
+    }
+    check(result == FRAGMENT_DONE && strcmp(whole, text) == 0, "long text comes back as it was sent");
+    free(r.finished);
+}
+
+int main() {
+    test_long_topic();
+    test_unterminated_fragment();
+    test_round_trip();
+    return (failures == 0) ? 0 : 1;
+}